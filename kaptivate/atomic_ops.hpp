@@ -0,0 +1,93 @@
+/*
+ * atomic_ops.hpp
+ * This file is a part of Kaptivate
+ * https://github.com/FunkyTownEnterprises/Kaptivate
+ *
+ * Copyright (c) 2011 Ben Cable, Chris Eberle
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+// Acquire loads and release stores of the indices the lock-free structures hand back and forth. VS2010 has
+// no <atomic>, so this is a small shim over whatever the compiler gives us:
+//
+//  - GCC and Clang: the __atomic builtins, which do the right thing on any architecture.
+//  - MSVC on x86 / x64: ordinary loads already have acquire semantics and ordinary stores already have
+//    release semantics, so all we have to stop is the compiler reordering things around them.
+//  - Anything else with C++11: std::atomic_thread_fence around the plain access.
+//
+// Anything that needs a full barrier (store followed by a load of a different variable) must use one of
+// the Interlocked* functions instead.
+
+#if defined(__GNUC__) || defined(__clang__)
+#define KAPTIVATE_ATOMICS_GCC
+#elif defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64))
+#include <intrin.h>
+#pragma intrinsic(_ReadWriteBarrier)
+#define KAPTIVATE_ATOMICS_MSVC_X86
+#elif __cplusplus >= 201103L
+#include <atomic>
+#define KAPTIVATE_ATOMICS_FENCE
+#else
+#error "atomic_ops.hpp doesn't know how to do acquire / release on this compiler"
+#endif
+
+// Most x86 parts have 64 byte cache lines. Data written by different threads should be at least this far
+// apart, otherwise the threads spend their time fighting over the line.
+#define KAPTIVATE_CACHE_LINE 64
+
+namespace Kaptivate
+{
+    inline unsigned int loadAcquire(const volatile unsigned int* src)
+    {
+#if defined(KAPTIVATE_ATOMICS_GCC)
+        return __atomic_load_n(src, __ATOMIC_ACQUIRE);
+#elif defined(KAPTIVATE_ATOMICS_MSVC_X86)
+        unsigned int value = *src;
+        _ReadWriteBarrier();
+        return value;
+#else
+        unsigned int value = *src;
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return value;
+#endif
+    }
+
+    inline void storeRelease(volatile unsigned int* dst, unsigned int value)
+    {
+#if defined(KAPTIVATE_ATOMICS_GCC)
+        __atomic_store_n(dst, value, __ATOMIC_RELEASE);
+#elif defined(KAPTIVATE_ATOMICS_MSVC_X86)
+        _ReadWriteBarrier();
+        *dst = value;
+#else
+        std::atomic_thread_fence(std::memory_order_release);
+        *dst = value;
+#endif
+    }
+}
@@ -0,0 +1,122 @@
+/*
+ * capture_log.hpp
+ * This file is a part of Kaptivate
+ * https://github.com/FunkyTownEnterprises/Kaptivate
+ *
+ * Copyright (c) 2011 Ben Cable, Chris Eberle
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include "kaptivate.hpp"
+
+// The binary log written by CaptureRecorder and read by ReplayBackend.
+//
+// A LogFileHeader, followed by entries back to back. Every entry starts with its kind, and each kind has a
+// fixed size except for devices, whose name follows. Timestamps are QueryPerformanceCounter ticks at the
+// frequency given in the header. Everything is little endian, as written by an x86 build.
+
+#define CAPTURE_LOG_MAGIC   "KAPLOG\r\n"
+#define CAPTURE_LOG_VERSION 2
+
+// Sequence number for a decision that was made without a raw event
+#define CAPTURE_LOG_NO_SEQUENCE 0xffffffff
+
+namespace Kaptivate
+{
+    enum LogEntryKind
+    {
+        LOG_DEVICE = 1,
+        LOG_RAW = 2,
+        LOG_KEY_DECISION = 3,
+        LOG_MOUSE_DECISION = 4
+    };
+
+#pragma pack(push, 1)
+
+    struct LogFileHeader
+    {
+        char magic[8];
+        unsigned int version;
+        LONGLONG ticksPerSecond;
+        LONGLONG startTicks;
+    };
+
+    // A device known when capture started, or announced by the backend. nameLength bytes of name follow.
+    struct LogDevice
+    {
+        unsigned char kind;
+        unsigned char type;               // KEYBOARD_EVENT or MOUSE_BUTTON_EVENT
+        ULONGLONG device;
+        unsigned short nameLength;
+    };
+
+    // A decoded raw event, as the backend pushed it
+    struct LogRaw
+    {
+        unsigned char kind;
+        LONGLONG timestamp;
+        unsigned int sequence;
+        ULONGLONG device;
+        unsigned char type;
+        unsigned short samples;
+        unsigned char data[sizeof(((EventRecord*)0)->data)];
+    };
+
+    // A keyboard decision: what was asked, when, and what the answer was
+    struct LogKeyDecision
+    {
+        unsigned char kind;
+        LONGLONG asked;
+        LONGLONG decided;
+        unsigned int sequence;            // Of the raw event it was paired with
+        unsigned short vkey;
+        unsigned short scanCode;
+        unsigned char keyUp;
+        unsigned char decision;
+    };
+
+    struct LogMouseDecision
+    {
+        unsigned char kind;
+        LONGLONG asked;
+        LONGLONG decided;
+        unsigned int sequence;
+        unsigned int message;             // The mouse message the hook was called with
+        unsigned char decision;
+    };
+
+#pragma pack(pop)
+
+    // Any fixed-size entry, for passing around in memory
+    union LogEntry
+    {
+        unsigned char kind;
+        LogRaw raw;
+        LogKeyDecision key;
+        LogMouseDecision mouse;
+    };
+}
@@ -0,0 +1,309 @@
+/*
+ * capture_recorder.cpp
+ * This file is a part of Kaptivate
+ * https://github.com/FunkyTownEnterprises/Kaptivate
+ *
+ * Copyright (c) 2011 Ben Cable, Chris Eberle
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "stdafx.hpp"
+#include "capture_recorder.hpp"
+#include "scoped_mutex.hpp"
+#include "kaptivate_exceptions.hpp"
+
+#include <string.h>
+
+using namespace std;
+using namespace Kaptivate;
+
+// Room for this many entries per thread between two writes
+#define RECORDER_RING_SIZE 16384
+
+// How often the writer thread wakes up
+#define RECORDER_FLUSH_MS 10
+
+static LONGLONG now()
+{
+    LARGE_INTEGER li;
+    QueryPerformanceCounter(&li);
+    return li.QuadPart;
+}
+
+// How many bytes of an entry actually go into the log
+static size_t entrySize(const LogEntry& entry)
+{
+    switch(entry.kind)
+    {
+    case LOG_RAW:
+        return sizeof(LogRaw);
+    case LOG_KEY_DECISION:
+        return sizeof(LogKeyDecision);
+    case LOG_MOUSE_DECISION:
+        return sizeof(LogMouseDecision);
+    }
+    return 0;
+}
+
+CaptureRecorder::CaptureRecorder()
+{
+    file = INVALID_HANDLE_VALUE;
+    writerThread = 0;
+    stopping = 0;
+    dropped = 0;
+    failed = 0;
+    buffered = 0;
+    rawRing = new SpscRing<LogEntry>(RECORDER_RING_SIZE);
+    hookRing = new SpscRing<LogEntry>(RECORDER_RING_SIZE);
+    InitializeCriticalSection(&fileLock);
+}
+
+CaptureRecorder::~CaptureRecorder()
+{
+    close();
+
+    delete rawRing;
+    rawRing = NULL;
+    delete hookRing;
+    hookRing = NULL;
+
+    DeleteCriticalSection(&fileLock);
+}
+
+static DWORD WINAPI RecorderLoop(LPVOID iValue)
+{
+    ((CaptureRecorder*)iValue)->_RunWriter();
+    return 0;
+}
+
+void CaptureRecorder::setPath(const string& path)
+{
+    this->path = path;
+}
+
+const string& CaptureRecorder::getPath() const
+{
+    return path;
+}
+
+void CaptureRecorder::open()
+{
+    if(isOpen())
+        throw KaptivateException("The capture log is already open");
+
+    file = CreateFileA(path.c_str(), GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS,
+                       FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if(file == INVALID_HANDLE_VALUE)
+        throw KaptivateException("Unable to create the capture log");
+
+    // Anything left from last time belongs to a log that's already closed
+    LogEntry entry;
+    while(rawRing->pop(entry))
+        ;
+    while(hookRing->pop(entry))
+        ;
+    dropped = 0;
+    failed = 0;
+    buffer.clear();
+    buffered = 0;
+
+    LARGE_INTEGER freq;
+    QueryPerformanceFrequency(&freq);
+
+    LogFileHeader header;
+    memcpy(header.magic, CAPTURE_LOG_MAGIC, sizeof(header.magic));
+    header.version = CAPTURE_LOG_VERSION;
+    header.ticksPerSecond = freq.QuadPart;
+    header.startTicks = now();
+
+    DWORD written = 0;
+    if(!WriteFile(file, &header, sizeof(header), &written, NULL) || written != sizeof(header))
+    {
+        CloseHandle(file);
+        file = INVALID_HANDLE_VALUE;
+        throw KaptivateException("Unable to write the capture log");
+    }
+
+    stopping = 0;
+    DWORD threadId = 0;
+    if(NULL == (writerThread = CreateThread(NULL, 0, RecorderLoop, this, 0, &threadId)))
+    {
+        writerThread = 0;
+        CloseHandle(file);
+        file = INVALID_HANDLE_VALUE;
+        throw KaptivateException("Failed to create the capture log writer thread");
+    }
+}
+
+void CaptureRecorder::close()
+{
+    if(!isOpen())
+        return;
+
+    InterlockedExchange(&stopping, 1);
+    if(writerThread != 0)
+    {
+        WaitForSingleObject(writerThread, INFINITE);
+        CloseHandle(writerThread);
+        writerThread = 0;
+    }
+
+    CloseHandle(file);
+    file = INVALID_HANDLE_VALUE;
+}
+
+bool CaptureRecorder::isOpen() const
+{
+    return file != INVALID_HANDLE_VALUE;
+}
+
+unsigned int CaptureRecorder::getDropped() const
+{
+    return (unsigned int)dropped;
+}
+
+bool CaptureRecorder::hasFailed() const
+{
+    return failed != 0;
+}
+
+// Wake up every so often and write out whatever has piled up. One last time on the way out.
+void CaptureRecorder::_RunWriter()
+{
+    while(true)
+    {
+        bool last = (stopping != 0);
+
+        ScopedCriticalSection fMutex(&fileLock);
+        drain(rawRing);
+        drain(hookRing);
+        flush();
+
+        if(last)
+            break;
+
+        ScopedNonCriticalSection unlock(&fileLock);
+        Sleep(RECORDER_FLUSH_MS);
+    }
+}
+
+// Append everything waiting in a ring to the buffer. Must hold fileLock.
+void CaptureRecorder::drain(SpscRing<LogEntry>* ring)
+{
+    LogEntry entry;
+    while(ring->pop(entry))
+    {
+        size_t size = entrySize(entry);
+        const char* bytes = (const char*)&entry;
+        buffer.insert(buffer.end(), bytes, bytes + size);
+        buffered++;
+    }
+}
+
+// Write out the buffer. Must hold fileLock.
+void CaptureRecorder::flush()
+{
+    if(buffer.empty())
+        return;
+
+    if(failed == 0)
+    {
+        DWORD written = 0;
+        if(!WriteFile(file, &buffer[0], (DWORD)buffer.size(), &written, NULL) || written != buffer.size())
+            InterlockedExchange(&failed, 1);
+    }
+
+    // Some of this may have made it out, but a log that stops partway through an entry can't be read past it
+    if(failed != 0)
+        InterlockedExchangeAdd(&dropped, buffered);
+
+    buffer.clear();
+    buffered = 0;
+}
+
+void CaptureRecorder::device(unsigned char type, HANDLE device, const string& name)
+{
+    if(!isOpen())
+        return;
+
+    LogDevice entry;
+    entry.kind = LOG_DEVICE;
+    entry.type = type;
+    entry.device = (ULONGLONG)(UINT_PTR)device;
+    entry.nameLength = (unsigned short)(name.size() > 0xffff ? 0xffff : name.size());
+
+    ScopedCriticalSection fMutex(&fileLock);
+    const char* bytes = (const char*)&entry;
+    buffer.insert(buffer.end(), bytes, bytes + sizeof(entry));
+    buffer.insert(buffer.end(), name.begin(), name.begin() + entry.nameLength);
+    buffered++;
+    flush();
+}
+
+void CaptureRecorder::raw(const EventRecord& rec)
+{
+    LogEntry entry;
+    entry.raw.kind = LOG_RAW;
+    entry.raw.timestamp = rec.timestamp;
+    entry.raw.sequence = rec.sequence;
+    entry.raw.device = (ULONGLONG)(UINT_PTR)rec.device;
+    entry.raw.type = rec.type;
+    entry.raw.samples = rec.samples;
+    memcpy(entry.raw.data, &rec.data, sizeof(entry.raw.data));
+
+    if(!rawRing->push(entry))
+        InterlockedIncrement(&dropped);
+}
+
+void CaptureRecorder::keyboardDecision(LONGLONG asked, unsigned int sequence, unsigned int vkey,
+                                       unsigned int scanCode, bool keyUp, Decision decision)
+{
+    LogEntry entry;
+    entry.key.kind = LOG_KEY_DECISION;
+    entry.key.asked = asked;
+    entry.key.decided = now();
+    entry.key.sequence = sequence;
+    entry.key.vkey = (unsigned short)vkey;
+    entry.key.scanCode = (unsigned short)scanCode;
+    entry.key.keyUp = keyUp ? 1 : 0;
+    entry.key.decision = (unsigned char)decision;
+
+    if(!hookRing->push(entry))
+        InterlockedIncrement(&dropped);
+}
+
+void CaptureRecorder::mouseDecision(LONGLONG asked, unsigned int sequence, unsigned int message, Decision decision)
+{
+    LogEntry entry;
+    entry.mouse.kind = LOG_MOUSE_DECISION;
+    entry.mouse.asked = asked;
+    entry.mouse.decided = now();
+    entry.mouse.sequence = sequence;
+    entry.mouse.message = message;
+    entry.mouse.decision = (unsigned char)decision;
+
+    if(!hookRing->push(entry))
+        InterlockedIncrement(&dropped);
+}
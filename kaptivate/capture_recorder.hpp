@@ -0,0 +1,109 @@
+/*
+ * capture_recorder.hpp
+ * This file is a part of Kaptivate
+ * https://github.com/FunkyTownEnterprises/Kaptivate
+ *
+ * Copyright (c) 2011 Ben Cable, Chris Eberle
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include "kaptivate.hpp"
+#include "capture_log.hpp"
+#include "spsc_ring.hpp"
+#include <string>
+#include <vector>
+
+namespace Kaptivate
+{
+    // Writes everything that goes through the pipeline to a capture log (see capture_log.hpp), so it can
+    // be replayed later.
+    //
+    // The raw and hook threads each get a ring of their own, so recording never takes a lock or touches
+    // the disk on their time. A writer thread empties both every few milliseconds. If it can't keep up,
+    // entries are dropped and counted rather than holding up input.
+    class CaptureRecorder
+    {
+    private:
+        HANDLE file;
+        CRITICAL_SECTION fileLock;
+        HANDLE writerThread;
+        volatile LONG stopping;
+
+        SpscRing<LogEntry>* rawRing;
+        SpscRing<LogEntry>* hookRing;
+        volatile LONG dropped;
+        volatile LONG failed;
+        std::string path;
+
+        // Only touched by the writer thread (or under fileLock)
+        std::vector<char> buffer;
+        LONG buffered;                // Entries in the buffer
+
+        void drain(SpscRing<LogEntry>* ring);
+        void flush();
+
+        // Not copyable
+        CaptureRecorder(const CaptureRecorder&);
+        CaptureRecorder& operator=(const CaptureRecorder&);
+
+    public:
+        CaptureRecorder();
+        ~CaptureRecorder();
+
+        // Where the log goes. Empty means don't record.
+        void setPath(const std::string& path);
+        const std::string& getPath() const;
+
+        // Create the log and start the writer thread. Throws if the file can't be created.
+        void open();
+
+        // Write out whatever is still waiting and close the log
+        void close();
+        bool isOpen() const;
+
+        // Any thread, but only before the raw and hook threads are running, or rarely
+        void device(unsigned char type, HANDLE device, const std::string& name);
+
+        // Raw thread only
+        void raw(const EventRecord& rec);
+
+        // Hook thread only
+        void keyboardDecision(LONGLONG asked, unsigned int sequence, unsigned int vkey, unsigned int scanCode,
+                              bool keyUp, Decision decision);
+        void mouseDecision(LONGLONG asked, unsigned int sequence, unsigned int message, Decision decision);
+
+        // Entries thrown away because the writer fell behind, or couldn't write them
+        unsigned int getDropped() const;
+
+        // Has a write to the log failed? Nothing more is written once one has, since the log may end
+        // halfway through an entry, and everything after it counts as dropped.
+        bool hasFailed() const;
+
+        // Writer thread
+        void _RunWriter();
+    };
+}
@@ -0,0 +1,275 @@
+/*
+ * device_cache.cpp
+ * This file is a part of Kaptivate
+ * https://github.com/FunkyTownEnterprises/Kaptivate
+ *
+ * Copyright (c) 2011 Ben Cable, Chris Eberle
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "stdafx.hpp"
+#include "device_cache.hpp"
+
+#include <string.h>
+
+using namespace std;
+using namespace Kaptivate;
+
+DeviceCache::DeviceCache()
+{
+    file = INVALID_HANDLE_VALUE;
+    mapping = NULL;
+    view = NULL;
+    header = NULL;
+    devices = NULL;
+    patterns = NULL;
+    matches = NULL;
+}
+
+DeviceCache::~DeviceCache()
+{
+    close();
+}
+
+bool DeviceCache::open(const string& path)
+{
+    close();
+
+    file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if(file == INVALID_HANDLE_VALUE)
+        return false;
+
+    DWORD size = GetFileSize(file, NULL);
+    if(size == INVALID_FILE_SIZE || size < sizeof(DeviceCacheHeader)
+       || NULL == (mapping = CreateFileMapping(file, NULL, PAGE_READONLY, 0, 0, NULL))
+       || NULL == (view = (const char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0)))
+    {
+        close();
+        return false;
+    }
+
+    // Make sure everything's where it says it is before believing any of it
+    const DeviceCacheHeader* h = (const DeviceCacheHeader*)view;
+    ULONGLONG tables = sizeof(DeviceCacheHeader)
+                     + (ULONGLONG)h->deviceCount * sizeof(DeviceCacheDevice)
+                     + (ULONGLONG)h->patternCount * sizeof(DeviceCachePattern)
+                     + (ULONGLONG)h->patternCount * h->matchWords * sizeof(unsigned int);
+    if(memcmp(h->magic, DEVICE_CACHE_MAGIC, sizeof(h->magic)) != 0 || h->version != DEVICE_CACHE_VERSION
+       || h->fingerprint != fingerprint() || h->fileSize != size || tables > size
+       || (ULONGLONG)h->matchWords * 32 < h->deviceCount)
+    {
+        close();
+        return false;
+    }
+
+    const DeviceCacheDevice* d = (const DeviceCacheDevice*)(view + sizeof(DeviceCacheHeader));
+    const DeviceCachePattern* p = (const DeviceCachePattern*)(d + h->deviceCount);
+    for(unsigned int i = 0; i < h->deviceCount; i++)
+    {
+        if((ULONGLONG)d[i].nameOffset + d[i].nameLength > size)
+        {
+            close();
+            return false;
+        }
+    }
+    for(unsigned int i = 0; i < h->patternCount; i++)
+    {
+        if((ULONGLONG)p[i].textOffset + p[i].textLength > size)
+        {
+            close();
+            return false;
+        }
+    }
+
+    header = h;
+    devices = d;
+    patterns = p;
+    matches = (const unsigned int*)(p + h->patternCount);
+    return true;
+}
+
+void DeviceCache::close()
+{
+    if(view != NULL)
+        UnmapViewOfFile(view);
+    if(mapping != NULL)
+        CloseHandle(mapping);
+    if(file != INVALID_HANDLE_VALUE)
+        CloseHandle(file);
+
+    file = INVALID_HANDLE_VALUE;
+    mapping = NULL;
+    view = NULL;
+    header = NULL;
+    devices = NULL;
+    patterns = NULL;
+    matches = NULL;
+}
+
+bool DeviceCache::isOpen() const
+{
+    return header != NULL;
+}
+
+bool DeviceCache::sameText(unsigned int offset, unsigned int length, const string& text) const
+{
+    return length == text.size() && memcmp(view + offset, text.data(), length) == 0;
+}
+
+int DeviceCache::findDevice(const string& name) const
+{
+    if(!isOpen())
+        return -1;
+
+    for(unsigned int i = 0; i < header->deviceCount; i++)
+    {
+        if(sameText(devices[i].nameOffset, devices[i].nameLength, name))
+            return (int)i;
+    }
+    return -1;
+}
+
+bool DeviceCache::findName(HANDLE device, bool mouse, string& name) const
+{
+    if(!isOpen())
+        return false;
+
+    for(unsigned int i = 0; i < header->deviceCount; i++)
+    {
+        const DeviceCacheDevice& d = devices[i];
+        if(d.device == (ULONGLONG)(UINT_PTR)device && (d.mouse != 0) == mouse)
+        {
+            name.assign(view + d.nameOffset, d.nameLength);
+            return true;
+        }
+    }
+    return false;
+}
+
+int DeviceCache::findMatch(const string& pattern, const string& name) const
+{
+    return findMatch(pattern, findDevice(name));
+}
+
+int DeviceCache::findMatch(const string& pattern, int d) const
+{
+    if(!isOpen() || d < 0)
+        return -1;
+
+    for(unsigned int i = 0; i < header->patternCount; i++)
+    {
+        if(sameText(patterns[i].textOffset, patterns[i].textLength, pattern))
+        {
+            unsigned int word = matches[i * header->matchWords + d / 32];
+            return (word >> (d % 32)) & 1;
+        }
+    }
+    return -1;
+}
+
+// When Windows started, to the minute. Rounded so that two processes in the same boot agree even though
+// their clocks are read a moment apart.
+ULONGLONG DeviceCache::fingerprint()
+{
+    FILETIME ft;
+    GetSystemTimeAsFileTime(&ft);
+    ULONGLONG nowMs = (((ULONGLONG)ft.dwHighDateTime << 32) | ft.dwLowDateTime) / 10000;
+    ULONGLONG bootMinute = (nowMs - GetTickCount64() + 30000) / 60000;
+
+    // FNV-1a, so a stray file full of small numbers doesn't look like a match
+    ULONGLONG hash = 14695981039346656037ULL;
+    for(int i = 0; i < 8; i++)
+    {
+        hash ^= (bootMinute >> (i * 8)) & 0xff;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+static bool writeAll(HANDLE file, const void* data, DWORD size)
+{
+    DWORD written = 0;
+    return size == 0 || (WriteFile(file, data, size, &written, NULL) && written == size);
+}
+
+bool DeviceCache::write(const string& path, const vector<CachedDevice>& devices, const vector<string>& patterns,
+                        const vector<unsigned int>& matches)
+{
+    DeviceCacheHeader header;
+    memcpy(header.magic, DEVICE_CACHE_MAGIC, sizeof(header.magic));
+    header.version = DEVICE_CACHE_VERSION;
+    header.fingerprint = fingerprint();
+    header.deviceCount = (unsigned int)devices.size();
+    header.patternCount = (unsigned int)patterns.size();
+    header.matchWords = (header.deviceCount + 31) / 32;
+    if(matches.size() != (size_t)header.patternCount * header.matchWords)
+        return false;
+
+    // Lay the tables out, with the strings after them
+    unsigned int offset = sizeof(header)
+                        + header.deviceCount * sizeof(DeviceCacheDevice)
+                        + header.patternCount * sizeof(DeviceCachePattern)
+                        + (unsigned int)matches.size() * sizeof(unsigned int);
+
+    vector<DeviceCacheDevice> deviceRecords(devices.size());
+    string strings;
+    for(size_t i = 0; i < devices.size(); i++)
+    {
+        deviceRecords[i].device = (ULONGLONG)(UINT_PTR)devices[i].device;
+        deviceRecords[i].mouse = devices[i].mouse ? 1 : 0;
+        deviceRecords[i].nameOffset = offset + (unsigned int)strings.size();
+        deviceRecords[i].nameLength = (unsigned short)devices[i].name.size();
+        strings.append(devices[i].name, 0, deviceRecords[i].nameLength);
+    }
+
+    vector<DeviceCachePattern> patternRecords(patterns.size());
+    for(size_t i = 0; i < patterns.size(); i++)
+    {
+        patternRecords[i].textOffset = offset + (unsigned int)strings.size();
+        patternRecords[i].textLength = (unsigned short)patterns[i].size();
+        strings.append(patterns[i], 0, patternRecords[i].textLength);
+    }
+    header.fileSize = offset + (unsigned int)strings.size();
+
+    // Write it next door, then swap it in, so nobody ever maps half a file
+    string temp = path + ".tmp";
+    HANDLE file = CreateFileA(temp.c_str(), GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if(file == INVALID_HANDLE_VALUE)
+        return false;
+
+    bool ok = writeAll(file, &header, sizeof(header))
+           && (deviceRecords.empty() || writeAll(file, &deviceRecords[0], (DWORD)(deviceRecords.size() * sizeof(DeviceCacheDevice))))
+           && (patternRecords.empty() || writeAll(file, &patternRecords[0], (DWORD)(patternRecords.size() * sizeof(DeviceCachePattern))))
+           && (matches.empty() || writeAll(file, &matches[0], (DWORD)(matches.size() * sizeof(unsigned int))))
+           && writeAll(file, strings.data(), (DWORD)strings.size());
+    CloseHandle(file);
+
+    if(!ok || !MoveFileExA(temp.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING))
+    {
+        DeleteFileA(temp.c_str());
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,136 @@
+/*
+ * device_cache.hpp
+ * This file is a part of Kaptivate
+ * https://github.com/FunkyTownEnterprises/Kaptivate
+ *
+ * Copyright (c) 2011 Ben Cable, Chris Eberle
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include "kaptivate.hpp"
+#include <string>
+#include <vector>
+
+// The device cache file: what every device was called and which handler patterns matched it, the last time
+// we looked. Raw device handles only mean something until Windows restarts, so the whole file is only good
+// for the boot it was written in; its fingerprint says which one that was.
+//
+// A DeviceCacheHeader, then deviceCount DeviceCacheDevices, then patternCount DeviceCachePatterns, then
+// patternCount * matchWords words of match bits (bit d of a pattern's words is set if it matched device d),
+// then the strings. Offsets are from the start of the file.
+
+#define DEVICE_CACHE_MAGIC   "KAPDEV\r\n"
+#define DEVICE_CACHE_VERSION 1
+
+namespace Kaptivate
+{
+#pragma pack(push, 1)
+
+    struct DeviceCacheHeader
+    {
+        char magic[8];
+        unsigned int version;
+        ULONGLONG fingerprint;
+        unsigned int deviceCount;
+        unsigned int patternCount;
+        unsigned int matchWords;
+        unsigned int fileSize;
+    };
+
+    struct DeviceCacheDevice
+    {
+        ULONGLONG device;
+        unsigned char mouse;
+        unsigned int nameOffset;
+        unsigned short nameLength;
+    };
+
+    struct DeviceCachePattern
+    {
+        unsigned int textOffset;
+        unsigned short textLength;
+    };
+
+#pragma pack(pop)
+
+    // A device, as it goes into the cache
+    struct CachedDevice
+    {
+        HANDLE device;
+        bool mouse;
+        std::string name;
+    };
+
+    // A cache file, mapped into memory and read in place. Lookups are a walk over a handful of records, with
+    // nothing to parse or allocate beforehand. Not thread safe; EventDispatcher only uses it under its lock.
+    class DeviceCache
+    {
+    private:
+        HANDLE file;
+        HANDLE mapping;
+        const char* view;
+
+        const DeviceCacheHeader* header;
+        const DeviceCacheDevice* devices;
+        const DeviceCachePattern* patterns;
+        const unsigned int* matches;
+
+        bool sameText(unsigned int offset, unsigned int length, const std::string& text) const;
+
+        // Not copyable
+        DeviceCache(const DeviceCache&);
+        DeviceCache& operator=(const DeviceCache&);
+
+    public:
+        DeviceCache();
+        ~DeviceCache();
+
+        // Map a cache file. False if there isn't one, it's damaged, or it's from another boot, in which case
+        // there's nothing cached.
+        bool open(const std::string& path);
+        void close();
+        bool isOpen() const;
+
+        // What a device was called
+        bool findName(HANDLE device, bool mouse, std::string& name) const;
+
+        // Which device in the file goes by a name, -1 if none does
+        int findDevice(const std::string& name) const;
+
+        // 1 if the pattern matched the named device, 0 if it didn't, -1 if the cache doesn't know
+        int findMatch(const std::string& pattern, const std::string& name) const;
+        int findMatch(const std::string& pattern, int device) const;
+
+        // Identifies this boot. Cheap.
+        static ULONGLONG fingerprint();
+
+        // Replace a cache file. matches holds patterns.size() * ((devices.size() + 31) / 32) words, laid out
+        // as in the file. Nothing is replaced unless the whole file could be written.
+        static bool write(const std::string& path, const std::vector<CachedDevice>& devices,
+                          const std::vector<std::string>& patterns, const std::vector<unsigned int>& matches);
+    };
+}
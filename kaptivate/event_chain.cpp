@@ -31,10 +31,124 @@
 
 #include "stdafx.hpp"
 #include "event_chain.hpp"
+#include "latency_tracer.hpp"
+#include "handler_profiler.hpp"
 
 using namespace std;
 using namespace Kaptivate;
 
+////////////////////////////////////////////////////////////////////////////////
+// Timing
+
+static ULONGLONG threadCycles()
+{
+    ULONGLONG cycles = 0;
+    QueryThreadCycleTime(GetCurrentThread(), &cycles);
+    return cycles;
+}
+
+// Times one trip down a chain, for latency tracing and handler profiling. Only ever created when one of
+// them is on.
+class ChainTimer
+{
+private:
+    LatencyHistogram* latency;
+    HandlerProfiler* profiler;
+    HANDLE device;
+    bool keyboard;
+    LONGLONG last;
+    ULONGLONG lastCycles;
+
+public:
+    ChainTimer(const ChainTiming& timing, HANDLE device, bool keyboard)
+    {
+        this->latency = timing.handlerLatency;
+        this->profiler = timing.profiler;
+        this->device = device;
+        this->keyboard = keyboard;
+        restart();
+    }
+
+    void restart()
+    {
+        last = LatencyTracer::stamp();
+        lastCycles = profiler ? threadCycles() : 0;
+    }
+
+    // A handler has just returned. Its profile is looked up by the device the event came from, so a chain
+    // that's shared by several devices (the default one) still charges each of them separately.
+    void handled(void* handler)
+    {
+        LONGLONG now = LatencyTracer::stamp();
+        LONGLONG ticks = now - last;
+        last = now;
+
+        if(latency)
+            latency->recordShared(ticks);
+
+        if(profiler)
+        {
+            ULONGLONG cycles = threadCycles();
+            HandlerProfile* profile = profiler->find(handler, device);
+            bool lookedUp = (profile == NULL);
+            if(lookedUp)
+                profile = profiler->profile(handler, device, keyboard);
+
+            // There might have been too many to make another
+            if(profile != NULL)
+            {
+                ScopedProfile busy(profile);
+                profile->calls++;
+                profile->totalTicks += ticks;
+                if(ticks > profile->maxTicks)
+                    profile->maxTicks = ticks;
+                profile->cycles += cycles - lastCycles;
+                profile->latency.record(ticks);
+            }
+            lastCycles = cycles;
+
+            // Don't charge making the profile to the next handler
+            if(lookedUp)
+                restart();
+        }
+    }
+};
+
+static bool timed(const ChainTiming* timing)
+{
+    return timing != NULL && (timing->handlerLatency != NULL || timing->profiler != NULL);
+}
+
+// The same loop as the chains below, with every handler call timed. Kept apart so that the usual loop
+// doesn't pay anything for it.
+template <typename Handler, typename Event>
+static void runTimedChain(const vector<Handler*>& handlers, Event& evt, const ChainTiming& timing, bool keyboard,
+                          void (Handler::*handle)(Event&))
+{
+    ChainTimer timer(timing, evt.getDeviceHandle(), keyboard);
+    for(size_t i = 0; i < handlers.size(); i++)
+    {
+        try
+        {
+            (handlers[i]->*handle)(evt);
+            timer.handled(handlers[i]);
+            Decision dec = evt.getDecision();
+            if(dec == PERMIT || dec == CONSUME)
+                break;
+            else if(dec == PASS)
+                evt.setDecision(UNDECIDED);
+        }
+        catch(...)
+        {
+            evt.setDecision(UNDECIDED);
+            timer.restart();
+        }
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Keyboard
+
 KeyboardEventChain::KeyboardEventChain()
 {
 }
@@ -56,21 +170,38 @@ void KeyboardEventChain::addHandler(KeyboardHandler* handler)
 
 void KeyboardEventChain::removeHandler(KeyboardHandler* handler)
 {
-    vector<KeyboardHandler*>::iterator it;
-    for(it = handlers.begin(); it != handlers.end(); it++)
+    for(size_t i = 0; i < handlers.size(); )
     {
-        if(*it == handler)
-            handlers.erase(it);
+        if(handlers[i] == handler)
+            handlers.erase(handlers.begin() + i);
+        else
+            i++;
     }
 }
 
+bool KeyboardEventChain::hasHandler(KeyboardHandler* handler) const
+{
+    for(size_t i = 0; i < handlers.size(); i++)
+    {
+        if(handlers[i] == handler)
+            return true;
+    }
+    return false;
+}
+
 unsigned int KeyboardEventChain::chainSize()
 {
     return (unsigned int)handlers.size();
 }
 
-void KeyboardEventChain::runKeyboardEventChain(KeyboardEvent& evt)
+void KeyboardEventChain::runKeyboardEventChain(KeyboardEvent& evt, const ChainTiming* timing)
 {
+    if(timed(timing))
+    {
+        runTimedChain(handlers, evt, *timing, true, &KeyboardHandler::HandleKeyEvent);
+        return;
+    }
+
     vector<KeyboardHandler*>::iterator it;
     for(it = handlers.begin(); it != handlers.end(); it++)
     {
@@ -93,6 +224,22 @@ void KeyboardEventChain::runKeyboardEventChain(KeyboardEvent& evt)
     }
 }
 
+void KeyboardEventChain::runKeyboardObserverBatch(KeyboardEvent* events, unsigned int count)
+{
+    vector<KeyboardHandler*>::iterator it;
+    for(it = handlers.begin(); it != handlers.end(); it++)
+    {
+        try
+        {
+            (*it)->HandleKeyEvents(events, count);
+        }
+        catch(...)
+        {
+            // One misbehaving observer shouldn't keep the rest from seeing the batch
+        }
+    }
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 
 MouseEventChain::MouseEventChain()
@@ -116,21 +263,38 @@ void MouseEventChain::addHandler(MouseHandler* handler)
 
 void MouseEventChain::removeHandler(MouseHandler* handler)
 {
-    vector<MouseHandler*>::iterator it;
-    for(it = handlers.begin(); it != handlers.end(); it++)
+    for(size_t i = 0; i < handlers.size(); )
     {
-        if(*it == handler)
-            handlers.erase(it);
+        if(handlers[i] == handler)
+            handlers.erase(handlers.begin() + i);
+        else
+            i++;
     }
 }
 
+bool MouseEventChain::hasHandler(MouseHandler* handler) const
+{
+    for(size_t i = 0; i < handlers.size(); i++)
+    {
+        if(handlers[i] == handler)
+            return true;
+    }
+    return false;
+}
+
 unsigned int MouseEventChain::chainSize()
 {
     return (unsigned int)handlers.size();
 }
 
-void MouseEventChain::runMouseButtonEventChain(MouseButtonEvent& evt)
+void MouseEventChain::runMouseButtonEventChain(MouseButtonEvent& evt, const ChainTiming* timing)
 {
+    if(timed(timing))
+    {
+        runTimedChain(handlers, evt, *timing, false, &MouseHandler::HandleButtonEvent);
+        return;
+    }
+
     vector<MouseHandler*>::iterator it;
     for(it = handlers.begin(); it != handlers.end(); it++)
     {
@@ -153,8 +317,14 @@ void MouseEventChain::runMouseButtonEventChain(MouseButtonEvent& evt)
     }
 }
 
-void MouseEventChain::runMouseWheelEventChain(MouseWheelEvent& evt)
+void MouseEventChain::runMouseWheelEventChain(MouseWheelEvent& evt, const ChainTiming* timing)
 {
+    if(timed(timing))
+    {
+        runTimedChain(handlers, evt, *timing, false, &MouseHandler::HandleWheelEvent);
+        return;
+    }
+
     vector<MouseHandler*>::iterator it;
     for(it = handlers.begin(); it != handlers.end(); it++)
     {
@@ -177,8 +347,14 @@ void MouseEventChain::runMouseWheelEventChain(MouseWheelEvent& evt)
     }
 }
 
-void MouseEventChain::runMouseMoveEventChain(MouseMoveEvent& evt)
+void MouseEventChain::runMouseMoveEventChain(MouseMoveEvent& evt, const ChainTiming* timing)
 {
+    if(timed(timing))
+    {
+        runTimedChain(handlers, evt, *timing, false, &MouseHandler::HandleMoveEvent);
+        return;
+    }
+
     vector<MouseHandler*>::iterator it;
     for(it = handlers.begin(); it != handlers.end(); it++)
     {
@@ -200,3 +376,51 @@ void MouseEventChain::runMouseMoveEventChain(MouseMoveEvent& evt)
         }
     }
 }
+
+void MouseEventChain::runMouseButtonObserverBatch(MouseButtonEvent* events, unsigned int count)
+{
+    vector<MouseHandler*>::iterator it;
+    for(it = handlers.begin(); it != handlers.end(); it++)
+    {
+        try
+        {
+            (*it)->HandleButtonEvents(events, count);
+        }
+        catch(...)
+        {
+            // One misbehaving observer shouldn't keep the rest from seeing the batch
+        }
+    }
+}
+
+void MouseEventChain::runMouseWheelObserverBatch(MouseWheelEvent* events, unsigned int count)
+{
+    vector<MouseHandler*>::iterator it;
+    for(it = handlers.begin(); it != handlers.end(); it++)
+    {
+        try
+        {
+            (*it)->HandleWheelEvents(events, count);
+        }
+        catch(...)
+        {
+            // One misbehaving observer shouldn't keep the rest from seeing the batch
+        }
+    }
+}
+
+void MouseEventChain::runMouseMoveObserverBatch(MouseMoveEvent* events, unsigned int count)
+{
+    vector<MouseHandler*>::iterator it;
+    for(it = handlers.begin(); it != handlers.end(); it++)
+    {
+        try
+        {
+            (*it)->HandleMoveEvents(events, count);
+        }
+        catch(...)
+        {
+            // One misbehaving observer shouldn't keep the rest from seeing the batch
+        }
+    }
+}
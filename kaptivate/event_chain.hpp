@@ -39,6 +39,17 @@
 
 namespace Kaptivate
 {
+    class LatencyHistogram;
+    class HandlerProfiler;
+    struct HandlerProfile;
+
+    // Where a chain's handler calls are timed. Either may be NULL.
+    struct ChainTiming
+    {
+        LatencyHistogram* handlerLatency;
+        HandlerProfiler* profiler;
+    };
+
     class KeyboardEventChain
     {
     public:
@@ -48,9 +59,14 @@ namespace Kaptivate
         void clearHandlers();
         void addHandler(KeyboardHandler* handler);
         void removeHandler(KeyboardHandler* handler);
+        bool hasHandler(KeyboardHandler* handler) const;
         unsigned int chainSize();
 
-        void runKeyboardEventChain(KeyboardEvent& evt);
+        // If timing is given, every handler call is timed into it
+        void runKeyboardEventChain(KeyboardEvent& evt, const ChainTiming* timing = NULL);
+
+        // Observers only: every handler sees the whole batch, nobody gets to decide anything
+        void runKeyboardObserverBatch(KeyboardEvent* events, unsigned int count);
 
     private:
         std::vector<KeyboardHandler*> handlers;
@@ -65,11 +81,17 @@ namespace Kaptivate
         void clearHandlers();
         void addHandler(MouseHandler* handler);
         void removeHandler(MouseHandler* handler);
+        bool hasHandler(MouseHandler* handler) const;
         unsigned int chainSize();
 
-        void runMouseButtonEventChain(MouseButtonEvent& evt);
-        void runMouseWheelEventChain(MouseWheelEvent& evt);
-        void runMouseMoveEventChain(MouseMoveEvent& evt);
+        void runMouseButtonEventChain(MouseButtonEvent& evt, const ChainTiming* timing = NULL);
+        void runMouseWheelEventChain(MouseWheelEvent& evt, const ChainTiming* timing = NULL);
+        void runMouseMoveEventChain(MouseMoveEvent& evt, const ChainTiming* timing = NULL);
+
+        // Observers only: every handler sees the whole batch, nobody gets to decide anything
+        void runMouseButtonObserverBatch(MouseButtonEvent* events, unsigned int count);
+        void runMouseWheelObserverBatch(MouseWheelEvent* events, unsigned int count);
+        void runMouseMoveObserverBatch(MouseMoveEvent* events, unsigned int count);
 
     private:
         std::vector<MouseHandler*> handlers;
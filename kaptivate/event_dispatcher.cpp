@@ -35,120 +35,507 @@
 #include "kaptivate_exceptions.hpp"
 #include "scoped_mutex.hpp"
 #include "event_chain.hpp"
+#include "device_cache.hpp"
+#include "capture_recorder.hpp"
+#include "handler_profiler.hpp"
 
 #include "trex/trex.hpp"
 #include "trex/TRexpp.hpp"
 
 #include <iostream>
+#include <algorithm>
+#include <string.h>
 using namespace std;
 using namespace Kaptivate;
 
+// Says it's reading the routing table for as long as it's around. Never waits for anything.
+//
+// The thread's local slot remembers which reader count it bumped and how many times, so that a thread that
+// changes the routes from inside a handler doesn't end up waiting for itself.
+namespace Kaptivate
+{
+    class RoutingReader
+    {
+    private:
+        EventDispatcher* dispatcher;
+        LONG phase;
+        UINT_PTR outer;
+
+    public:
+        const RoutingTable* table;
+
+        RoutingReader(EventDispatcher* dispatcher)
+        {
+            this->dispatcher = dispatcher;
+            outer = (UINT_PTR)TlsGetValue(dispatcher->readerTls);
+            phase = (outer != 0) ? (LONG)(outer & 1) : dispatcher->readPhase;
+
+            // The count has to go up before the table is looked at, or a writer could miss us
+            InterlockedIncrement(&dispatcher->readers[phase]);
+            TlsSetValue(dispatcher->readerTls, (LPVOID)((outer != 0) ? outer + 2 : 2 + phase));
+            table = dispatcher->routes;
+        }
+
+        ~RoutingReader()
+        {
+            TlsSetValue(dispatcher->readerTls, (LPVOID)outer);
+            InterlockedDecrement(&dispatcher->readers[phase]);
+        }
+    };
+}
+
 // Constructor
 EventDispatcher::EventDispatcher()
 {
-    InitializeCriticalSection(&kdLock);
-    InitializeCriticalSection(&mdLock);
-    InitializeCriticalSection(&kbHRMLock);
-    InitializeCriticalSection(&mdHRMLock);
-    InitializeCriticalSection(&kecLock);
-    InitializeCriticalSection(&mecLock);
+    InitializeCriticalSection(&indexLock);
+    InitializeCriticalSection(&writeLock);
+
+    keyboardObservers = 0;
+    mouseObservers = 0;
+    handlerLatency = NULL;
+    profiler = NULL;
+    profileOwner = NULL;
+    recorder = NULL;
+
+    deviceCount = 1;
+    memset(deviceSlots, 0, sizeof(deviceSlots));
+    memset((void*)indexDevices, 0, sizeof(indexDevices));
+    memset(announced, 0, sizeof(announced));
+    memset(forgotten, 0, sizeof(forgotten));
+    memset((void*)lookupState, 0, sizeof(lookupState));
+    memset(lookupFailures, 0, sizeof(lookupFailures));
+    memset(lookupRetryAt, 0, sizeof(lookupRetryAt));
+    pendingWork = 0;
+    deviceCache = NULL;
+    memset(fromCache, 0, sizeof(fromCache));
+    cacheRefreshPending = 0;
+    devicePatterns = new TRexSetpp();
+    nextPatternId = 0;
+
+    routes = new RoutingTable();
+    memset(routes, 0, sizeof(RoutingTable));
+    readers[0] = 0;
+    readers[1] = 0;
+    readPhase = 0;
+    parked[0] = 0;
+    parked[1] = 0;
+    next = NULL;
+    garbage = NULL;
+    generation = 0;
+
+    if(TLS_OUT_OF_INDEXES == (readerTls = TlsAlloc()))
+    {
+        delete devicePatterns;
+        delete routes;
+        DeleteCriticalSection(&writeLock);
+        DeleteCriticalSection(&indexLock);
+        throw KaptivateException("Out of thread local storage");
+    }
 }
 
-// Destructor
+// Destructor. Nobody can be dispatching any more, but there may still be lookups or cache refreshes on their way.
 EventDispatcher::~EventDispatcher()
 {
+    while(pendingWork > 0)
+        Sleep(1);
+
     cleanupMouseHandlerMap();
     cleanupKeyboardHandlerMap();
-    cleanupMouseEventChainMap();
-    cleanupKeyboardEventChainMap();
-    cleanupMouseDeviceMap();
-    cleanupKeyboardDeviceMap();
+    delete devicePatterns;
+    devicePatterns = NULL;
 
-    DeleteCriticalSection(&kdLock);
-    DeleteCriticalSection(&mdLock);
-    DeleteCriticalSection(&kbHRMLock);
-    DeleteCriticalSection(&mdHRMLock);
-    DeleteCriticalSection(&kecLock);
-    DeleteCriticalSection(&mecLock);
+    for(size_t i = 0; i < retired.size(); i++)
+        freeRetired(retired[i]);
+    retired.clear();
+
+    for(unsigned int i = 0; i < deviceCount; i++)
+    {
+        delete routes->keyboards[i];
+        delete routes->mice[i];
+        delete routes->kbdChains[i];
+        delete routes->mouseChains[i];
+        delete routes->kbdObserverChains[i];
+        delete routes->mouseObserverChains[i];
+    }
+    delete routes;
+    routes = NULL;
+
+    delete deviceCache;
+    deviceCache = NULL;
+
+    TlsFree(readerTls);
+    DeleteCriticalSection(&writeLock);
+    DeleteCriticalSection(&indexLock);
 }
 
-// Dispatch a keyboard event to any registered handlers
-void EventDispatcher::handleKeyboard(KeyboardEvent& evt)
+// Where a handle's search through the index table starts
+static inline unsigned int deviceHash(HANDLE device)
 {
-    HANDLE dev = evt.getDeviceHandle();
+    return ((unsigned int)(UINT_PTR)device * 2654435761u) >> 21;
+}
+
+// Look a device up without taking any lock. The index is written last, so a slot with an index has its
+// handle too. Slots are never emptied; a forgotten device's is marked freed instead, so that whatever is
+// past it can still be found. Its number may have been given to someone else since we read the slot, so
+// that's checked too.
+unsigned int EventDispatcher::findDeviceIndex(HANDLE device) const
+{
+    unsigned int slot = deviceHash(device);
+    for(unsigned int probes = 0; probes < DEVICE_HASH_SIZE; probes++, slot++)
+    {
+        const DeviceSlot& ds = deviceSlots[slot & (DEVICE_HASH_SIZE - 1)];
+        unsigned int index = ds.index;
+        if(index == 0)
+            return 0;
+        if(index != DEVICE_SLOT_FREED && ds.device == device)
+            return (indexDevices[index] == device) ? index : 0;
+    }
+    return 0;
+}
+
+// The number for a device, handing out a new one if need be
+unsigned int EventDispatcher::deviceIndex(HANDLE device)
+{
+    unsigned int index = findDeviceIndex(device);
+    if(index != 0)
+        return index;
+
+    ScopedCriticalSection iMutex(&indexLock);
 
+    // Somebody might have just beaten us to it. If not, the first freed slot along the way will do.
+    DeviceSlot* found = NULL;
+    unsigned int slot = deviceHash(device);
+    for(unsigned int probes = 0; probes < DEVICE_HASH_SIZE; probes++, slot++)
     {
-        // Set the device info if it's available
-        ScopedCriticalSection kMutex(&kdLock);
-        if(keyboardDevices.count(dev) > 0)
+        DeviceSlot& ds = deviceSlots[slot & (DEVICE_HASH_SIZE - 1)];
+        if(ds.index == 0 || ds.index == DEVICE_SLOT_FREED)
         {
-            evt.setDeviceInfo(keyboardDevices[dev]);
+            if(found == NULL)
+                found = &ds;
+            if(ds.index == 0)
+                break;
         }
-        else
+        else if(ds.device == device)
+            return ds.index;
+    }
+
+    if(found == NULL)
+        return 0;
+
+    if(!freeIndices.empty())
+    {
+        index = freeIndices.back();
+        freeIndices.pop_back();
+    }
+    else if(deviceCount < DEVICE_INDEX_LIMIT)
+    {
+        index = deviceCount;
+        deviceCount = index + 1;
+    }
+    else
+        return 0;
+
+    indexDevices[index] = device;
+    found->device = device;
+    MemoryBarrier();
+    found->index = index;
+    return index;
+}
+
+// The number of the device an event came from. Events that came in through KaptivateAPI already have it,
+// unless the device has gone and its number been handed out again since; anything else gets it looked up.
+unsigned int EventDispatcher::recordIndex(const EventRecord& rec)
+{
+    if(rec.deviceIndex != 0 && indexDevices[rec.deviceIndex] == rec.device)
+        return rec.deviceIndex;
+    return deviceIndex(rec.device);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Routing table changes
+
+// Start on a new table, a copy of the current one
+void EventDispatcher::beginRoutes()
+{
+    next = new RoutingTable();
+    garbage = new RetiredRoutes();
+    memcpy(next, routes, sizeof(RoutingTable));
+}
+
+// Never mind. Nothing in the new table has been published, so nothing it's replaced has to go either.
+void EventDispatcher::abandonRoutes()
+{
+    for(unsigned int i = 0; i < deviceCount; i++)
+    {
+        if(next->kbdChains[i] != routes->kbdChains[i])
+            delete next->kbdChains[i];
+        if(next->mouseChains[i] != routes->mouseChains[i])
+            delete next->mouseChains[i];
+        if(next->kbdObserverChains[i] != routes->kbdObserverChains[i])
+            delete next->kbdObserverChains[i];
+        if(next->mouseObserverChains[i] != routes->mouseObserverChains[i])
+            delete next->mouseObserverChains[i];
+    }
+
+    delete next;
+    delete garbage;
+    next = NULL;
+    garbage = NULL;
+}
+
+// Take a device out of the new table. It's still in the current one, so it goes with that.
+void EventDispatcher::detachDevice(unsigned int index)
+{
+    if(next->keyboards[index] != NULL)
+        garbage->keyboards.push_back(next->keyboards[index]);
+    if(next->mice[index] != NULL)
+        garbage->mice.push_back(next->mice[index]);
+    if(next->kbdChains[index] != NULL)
+        garbage->kbdChains.push_back(next->kbdChains[index]);
+    if(next->mouseChains[index] != NULL)
+        garbage->mouseChains.push_back(next->mouseChains[index]);
+    if(next->kbdObserverChains[index] != NULL)
+        garbage->kbdChains.push_back(next->kbdObserverChains[index]);
+    if(next->mouseObserverChains[index] != NULL)
+        garbage->mouseChains.push_back(next->mouseObserverChains[index]);
+
+    next->keyboards[index] = NULL;
+    next->mice[index] = NULL;
+    next->kbdChains[index] = NULL;
+    next->mouseChains[index] = NULL;
+    next->kbdObserverChains[index] = NULL;
+    next->mouseObserverChains[index] = NULL;
+    fromCache[index] = false;
+}
+
+// A device has gone for good. Its number goes back once nobody can be reading a table that had it.
+void EventDispatcher::forgetDevice(unsigned int index)
+{
+    detachDevice(index);
+    forgotten[index] = true;
+    garbage->indices.push_back(index);
+}
+
+// Give a device's number back, now that dispatch is done with it. Not if the device has turned up again in
+// the meantime, or is still being looked up; the next scan can have another go at that one.
+void EventDispatcher::releaseIndex(unsigned int index)
+{
+    forgotten[index] = false;
+    if(routes->keyboards[index] != NULL || routes->mice[index] != NULL)
+        return;
+    if(InterlockedCompareExchange(&lookupState[index], LOOKUP_QUEUED, LOOKUP_IDLE) != LOOKUP_IDLE)
+        return;
+
+    if(profileOwner != NULL)
+        profileOwner->forgetDevice(indexDevices[index]);
+
+    {
+        ScopedCriticalSection iMutex(&indexLock);
+        unsigned int slot = deviceHash(indexDevices[index]);
+        for(unsigned int probes = 0; probes < DEVICE_HASH_SIZE; probes++, slot++)
         {
-            // It's an unknown device, let's see what we can find out about it.
-            ScopedNonCriticalSection unlock(&kdLock);
-            KeyboardInfo *kbd = unknownKeyboardDevice(dev);
-            if(kbd)
+            DeviceSlot& ds = deviceSlots[slot & (DEVICE_HASH_SIZE - 1)];
+            if(ds.index == 0)
+                break;
+            if(ds.index == index)
             {
-                evt.setDeviceInfo(kbd);
+                ds.index = DEVICE_SLOT_FREED;
+                break;
             }
         }
+
+        indexDevices[index] = NULL;
+        announced[index] = false;
+        fromCache[index] = false;
+        lookupFailures[index] = 0;
+        lookupRetryAt[index] = 0;
+        freeIndices.push_back(index);
     }
 
+    InterlockedExchange(&lookupState[index], LOOKUP_IDLE);
+}
+
+// A chain in the new table that can be changed. One still shared with the current table is copied first.
+KeyboardEventChain* EventDispatcher::writableChain(KeyboardEventChain** chains, KeyboardEventChain** published,
+                                                   unsigned int index)
+{
+    if(chains[index] == NULL)
+        chains[index] = new KeyboardEventChain();
+    else if(chains[index] == published[index])
     {
-        // Run the chain, let someone make a decision about this event
-        ScopedCriticalSection kecMutex(&kecLock);
-        if(kbdEventChains.count(dev) > 0 && kbdEventChains[dev]->chainSize() > 0)
-        {
-            // We've got a real handler, give it to them (and hard)
-            kbdEventChains[dev]->runKeyboardEventChain(evt);
-        }
+        garbage->kbdChains.push_back(published[index]);
+        chains[index] = new KeyboardEventChain(*published[index]);
+    }
+    return chains[index];
+}
+
+MouseEventChain* EventDispatcher::writableChain(MouseEventChain** chains, MouseEventChain** published,
+                                                unsigned int index)
+{
+    if(chains[index] == NULL)
+        chains[index] = new MouseEventChain();
+    else if(chains[index] == published[index])
+    {
+        garbage->mouseChains.push_back(published[index]);
+        chains[index] = new MouseEventChain(*published[index]);
+    }
+    return chains[index];
+}
+
+// Swap the new table in. The old one is freed straight away if nobody's reading; otherwise it waits for
+// whoever comes along next. Returns the old table's generation.
+unsigned int EventDispatcher::publishRoutes()
+{
+    garbage->table = routes;
+    garbage->generation = ++generation;
+    retired.push_back(garbage);
+
+    // A full barrier, so the reader counts below can't be read before the new table is out there
+    InterlockedExchangePointer((void* volatile*)&routes, next);
+    next = NULL;
+    garbage = NULL;
+
+    if(readers[0] == 0 && readers[1] == 0)
+        reclaimRoutes(generation);
+    return generation;
+}
+
+// Free every table up to a generation. Whoever calls this knows nobody can be reading them.
+void EventDispatcher::reclaimRoutes(unsigned int upTo)
+{
+    size_t kept = 0;
+    for(size_t i = 0; i < retired.size(); i++)
+    {
+        if(retired[i]->generation <= upTo)
+            freeRetired(retired[i]);
         else
+            retired[kept++] = retired[i];
+    }
+    retired.resize(kept);
+}
+
+// The table itself, and whatever its replacement didn't take over
+void EventDispatcher::freeRetired(RetiredRoutes* old)
+{
+    for(size_t i = 0; i < old->keyboards.size(); i++)
+        delete old->keyboards[i];
+    for(size_t i = 0; i < old->mice.size(); i++)
+        delete old->mice[i];
+    for(size_t i = 0; i < old->kbdChains.size(); i++)
+        delete old->kbdChains[i];
+    for(size_t i = 0; i < old->mouseChains.size(); i++)
+        delete old->mouseChains[i];
+    for(size_t i = 0; i < old->indices.size(); i++)
+        releaseIndex(old->indices[i]);
+    for(size_t i = 0; i < old->handlers.size() && profileOwner != NULL; i++)
+        profileOwner->forgetHandler(old->handlers[i]);
+    delete old->table;
+    delete old;
+}
+
+// Wait until every reader that might have an older table has finished with it, other than this thread.
+// Each count is emptied in turn, with new readers sent to the other one meanwhile, so it can't go on forever.
+//
+// A reader that gets here (a handler unregistering something) parks its own count while it waits. Other
+// readers doing the same don't wait for parked ones, otherwise two of them would each wait for the other.
+// Nobody that isn't a reader skips them, so the tables they still hold are never freed under them.
+void EventDispatcher::waitForReaders()
+{
+    UINT_PTR mine = (UINT_PTR)TlsGetValue(readerTls);
+    LONG myPhase = (LONG)(mine & 1);
+    LONG myCount = (LONG)(mine >> 1);
+    if(mine != 0)
+        InterlockedExchangeAdd(&parked[myPhase], myCount);
+
+    for(LONG phase = 0; phase < 2; phase++)
+    {
+        InterlockedExchange(&readPhase, 1 - phase);
+
+        // Parked counts only go up while the reader is already counted, so read the reader count first
+        for(unsigned int spins = 0; ; spins++)
         {
-            // Ain't nobody here. Do something?
+            LONG busy = readers[phase];
+            if(mine != 0)
+                busy -= parked[phase];
+            if(busy <= 0)
+                break;
+
+            if(spins < 64)
+                SwitchToThread();
+            else
+                Sleep(1);
         }
     }
 
+    if(mine != 0)
+        InterlockedExchangeAdd(&parked[myPhase], -myCount);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Dispatch. No locks from here on.
+
+// Dispatch a keyboard event to any registered handlers
+void EventDispatcher::handleKeyboard(KeyboardEvent& evt)
+{
+    HANDLE dev = evt.getDeviceHandle();
+    unsigned int index = recordIndex(evt.getRecord());
+    RoutingReader reader(this);
+
+    // Set the device info if it's available
+    KeyboardInfo* kbd = reader.table->keyboards[index];
+    if(kbd)
+        evt.setDeviceInfo(kbd);
+    else
+    {
+        // It's an unknown device, let's see what we can find out about it. Meanwhile it's the default chain's.
+        unknownDevice(index, dev, false);
+        index = 0;
+    }
+
+    // Run the chain, let someone make a decision about this event
+    KeyboardEventChain* chain = reader.table->kbdChains[index];
+    if(chain != NULL && chain->chainSize() > 0)
+    {
+        // We've got a real handler, give it to them (and hard)
+        ChainTiming timing = { handlerLatency, profiler };
+        chain->runKeyboardEventChain(evt, &timing);
+    }
+    else
+    {
+        // Ain't nobody here. Do something?
+    }
 }
 
 // Dispatch a mouse button event to any registered handlers
 void EventDispatcher::handleMouseButton(MouseButtonEvent& evt)
 {
     HANDLE dev = evt.getDeviceHandle();
-
+    unsigned int index = recordIndex(evt.getRecord());
+    RoutingReader reader(this);
+
+    // Set the device info if it's available
+    MouseInfo* mi = reader.table->mice[index];
+    if(mi)
+        evt.setDeviceInfo(mi);
+    else
     {
-        // Set the device info if it's available
-        ScopedCriticalSection mMutex(&mdLock);
-        if(mouseDevices.count(dev) > 0)
-        {
-            evt.setDeviceInfo(mouseDevices[dev]);
-        }
-        else
-        {
-            // It's an unknown device, let's see what we can find out about it.
-            ScopedNonCriticalSection unlock(&mdLock);
-            MouseInfo *mi = unknownMouseDevice(dev);
-            if(mi)
-            {
-                evt.setDeviceInfo(mi);
-            }
-        }
+        // It's an unknown device, let's see what we can find out about it. Meanwhile it's the default chain's.
+        unknownDevice(index, dev, true);
+        index = 0;
     }
 
+    // Run the chain, let someone make a decision about this event
+    MouseEventChain* chain = reader.table->mouseChains[index];
+    if(chain != NULL && chain->chainSize() > 0)
     {
-        // Run the chain, let someone make a decision about this event
-        ScopedCriticalSection mecMutex(&mecLock);
-        if(mouseEventChains.count(dev) > 0 && mouseEventChains[dev]->chainSize() > 0)
-        {
-            // You like me! You really, really like me!
-            mouseEventChains[dev]->runMouseButtonEventChain(evt);
-        }
-        else
-        {
-            // Zero is the REAL lonliest number. It's the lonliest number
-            // since the number one.
-        }
+        // You like me! You really, really like me!
+        ChainTiming timing = { handlerLatency, profiler };
+        chain->runMouseButtonEventChain(evt, &timing);
+    }
+    else
+    {
+        // Zero is the REAL lonliest number. It's the lonliest number
+        // since the number one.
     }
 }
 
@@ -156,39 +543,32 @@ void EventDispatcher::handleMouseButton(MouseButtonEvent& evt)
 void EventDispatcher::handleMouseWheel(MouseWheelEvent& evt)
 {
     HANDLE dev = evt.getDeviceHandle();
-
+    unsigned int index = recordIndex(evt.getRecord());
+    RoutingReader reader(this);
+
+    // Set the device name if it's available
+    MouseInfo* mi = reader.table->mice[index];
+    if(mi)
+        evt.setDeviceInfo(mi);
+    else
     {
-        // Set the device name if it's available
-        ScopedCriticalSection mMutex(&mdLock);
-        if(mouseDevices.count(dev) > 0)
-        {
-            evt.setDeviceInfo(mouseDevices[dev]);
-        }
-        else
-        {
-            // It's an unknown device, let's see what we can find out about it.
-            ScopedNonCriticalSection unlock(&mdLock);
-            MouseInfo *mi = unknownMouseDevice(dev);
-            if(mi)
-            {
-                evt.setDeviceInfo(mi);
-            }
-        }
+        // It's an unknown device, let's see what we can find out about it. Meanwhile it's the default chain's.
+        unknownDevice(index, dev, true);
+        index = 0;
     }
 
+    // Run the chain, let someone make a decision about this event
+    MouseEventChain* chain = reader.table->mouseChains[index];
+    if(chain != NULL && chain->chainSize() > 0)
     {
-        // Run the chain, let someone make a decision about this event
-        ScopedCriticalSection mecMutex(&mecLock);
-        if(mouseEventChains.count(dev) > 0 && mouseEventChains[dev]->chainSize() > 0)
-        {
-            // You like me! You really, really like me!
-            mouseEventChains[dev]->runMouseWheelEventChain(evt);
-        }
-        else
-        {
-            // Zero is the REAL lonliest number. It's the lonliest number
-            // since the number one.
-        }
+        // You like me! You really, really like me!
+        ChainTiming timing = { handlerLatency, profiler };
+        chain->runMouseWheelEventChain(evt, &timing);
+    }
+    else
+    {
+        // Zero is the REAL lonliest number. It's the lonliest number
+        // since the number one.
     }
 }
 
@@ -196,59 +576,239 @@ void EventDispatcher::handleMouseWheel(MouseWheelEvent& evt)
 void EventDispatcher::handleMouseMove(MouseMoveEvent& evt)
 {
     HANDLE dev = evt.getDeviceHandle();
+    unsigned int index = recordIndex(evt.getRecord());
+    RoutingReader reader(this);
+
+    // Set the device name if it's available
+    MouseInfo* mi = reader.table->mice[index];
+    if(mi)
+        evt.setDeviceInfo(mi);
+    else
+    {
+        // It's an unknown device, let's see what we can find out about it. Meanwhile it's the default chain's.
+        unknownDevice(index, dev, true);
+        index = 0;
+    }
 
+    // Run the chain, let someone make a decision about this event
+    MouseEventChain* chain = reader.table->mouseChains[index];
+    if(chain != NULL && chain->chainSize() > 0)
     {
-        // Set the device name if it's available
-        ScopedCriticalSection mMutex(&mdLock);
-        if(mouseDevices.count(dev) > 0)
-        {
-            evt.setDeviceInfo(mouseDevices[dev]);
-        }
+        // You like me! You really, really like me!
+        ChainTiming timing = { handlerLatency, profiler };
+        chain->runMouseMoveEventChain(evt, &timing);
+    }
+    else
+    {
+        // Zero is the REAL lonliest number. It's the lonliest number
+        // since the number one.
+    }
+}
+
+// Hand a batch of decided events to the observers. The batch is split into runs of events of the same kind
+// from the same device, and each run goes to that device's observers in one call. The whole batch sees the
+// same table, and the observers run straight from it; nothing's copied.
+void EventDispatcher::observeBatch(EventRecord* records, unsigned int count, ObserverScratch& scratch)
+{
+    // Held for the whole batch, so unregistering an observer waits for every batch that might still call it
+    RoutingReader reader(this);
+
+    unsigned int start = 0;
+    while(start < count)
+    {
+        unsigned int end = start + 1;
+        while(end < count && records[end].device == records[start].device && records[end].type == records[start].type)
+            end++;
+
+        if(records[start].type == KEYBOARD_EVENT)
+            observeKeyboardRun(reader.table, records + start, end - start, scratch);
         else
+            observeMouseRun(reader.table, records + start, end - start, scratch);
+
+        start = end;
+    }
+}
+
+// Feed a run of keyboard events from a single device to its observers
+void EventDispatcher::observeKeyboardRun(const RoutingTable* table, EventRecord* records, unsigned int count,
+                                         ObserverScratch& scratch)
+{
+    unsigned int index = recordIndex(records[0]);
+    KeyboardInfo* info = table->keyboards[index];
+    if(info == NULL)
+    {
+        unknownDevice(index, records[0].device, false);
+        index = 0;
+    }
+
+    KeyboardEventChain* chain = table->kbdObserverChains[index];
+    if(chain == NULL || chain->chainSize() == 0)
+        return;
+
+    scratch.kbdViews.clear();
+    for(unsigned int i = 0; i < count; i++)
+    {
+        scratch.kbdViews.push_back(KeyboardEvent(records[i]));
+        scratch.kbdViews.back().setDeviceInfo(info);
+    }
+
+    chain->runKeyboardObserverBatch(&scratch.kbdViews[0], count);
+}
+
+// Feed a run of mouse events of a single kind from a single device to its observers
+void EventDispatcher::observeMouseRun(const RoutingTable* table, EventRecord* records, unsigned int count,
+                                      ObserverScratch& scratch)
+{
+    unsigned int index = recordIndex(records[0]);
+    MouseInfo* info = table->mice[index];
+    if(info == NULL)
+    {
+        unknownDevice(index, records[0].device, true);
+        index = 0;
+    }
+
+    MouseEventChain* chain = table->mouseObserverChains[index];
+    if(chain == NULL || chain->chainSize() == 0)
+        return;
+
+    if(records[0].type == MOUSE_BUTTON_EVENT)
+    {
+        scratch.buttonViews.clear();
+        for(unsigned int i = 0; i < count; i++)
         {
-            // It's an unknown device, let's see what we can find out about it.
-            ScopedNonCriticalSection unlock(&mdLock);
-            MouseInfo *mi = unknownMouseDevice(dev);
-            if(mi)
-            {
-                evt.setDeviceInfo(mi);
-            }
+            scratch.buttonViews.push_back(MouseButtonEvent(records[i]));
+            scratch.buttonViews.back().setDeviceInfo(info);
         }
+        chain->runMouseButtonObserverBatch(&scratch.buttonViews[0], count);
     }
-
+    else if(records[0].type == MOUSE_WHEEL_EVENT)
     {
-        // Run the chain, let someone make a decision about this event
-        ScopedCriticalSection mecMutex(&mecLock);
-        if(mouseEventChains.count(dev) > 0 && mouseEventChains[dev]->chainSize() > 0)
+        scratch.wheelViews.clear();
+        for(unsigned int i = 0; i < count; i++)
         {
-            // You like me! You really, really like me!
-            mouseEventChains[dev]->runMouseMoveEventChain(evt);
+            scratch.wheelViews.push_back(MouseWheelEvent(records[i]));
+            scratch.wheelViews.back().setDeviceInfo(info);
         }
-        else
+        chain->runMouseWheelObserverBatch(&scratch.wheelViews[0], count);
+    }
+    else if(records[0].type == MOUSE_MOVE_EVENT)
+    {
+        scratch.moveViews.clear();
+        for(unsigned int i = 0; i < count; i++)
         {
-            // Zero is the REAL lonliest number. It's the lonliest number
-            // since the number one.
+            scratch.moveViews.push_back(MouseMoveEvent(records[i]));
+            scratch.moveViews.back().setDeviceInfo(info);
         }
+        chain->runMouseMoveObserverBatch(&scratch.moveViews[0], count);
     }
 }
 
+// Has anyone ever asked to observe keyboard events? Cheap enough to check on every event.
+bool EventDispatcher::hasKeyboardObservers() const
+{
+    return keyboardObservers > 0;
+}
+
+// Has anyone ever asked to observe mouse events?
+bool EventDispatcher::hasMouseObservers() const
+{
+    return mouseObservers > 0;
+}
+
+// Start or stop timing the handlers. The hook and raw threads pick it up with their next event.
+void EventDispatcher::setHandlerLatency(LatencyHistogram* histogram)
+{
+    handlerLatency = histogram;
+}
+
+// Handler calls are only timed while it's enabled, but the profiles of handlers and devices that go away are
+// dropped from it either way
+void EventDispatcher::setHandlerProfiler(HandlerProfiler* profiler, bool enabled)
+{
+    ScopedCriticalSection wMutex(&writeLock);
+    profileOwner = profiler;
+    this->profiler = enabled ? profiler : NULL;
+}
+
+// Every device is attached under writeLock, so taking it here means nobody's halfway through writing one
+void EventDispatcher::setRecorder(CaptureRecorder* recorder)
+{
+    ScopedCriticalSection wMutex(&writeLock);
+    this->recorder = recorder;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Devices and handlers
+
+// Add a keyboard that isn't in the raw device list, and hook it up to any handlers that want it
+void EventDispatcher::addKeyboardDevice(HANDLE device, const string& name)
+{
+    unsigned int index = deviceIndex(device);
+    if(index == 0)
+        return;
+
+    ScopedCriticalSection wMutex(&writeLock);
+    announced[index] = true;
+    if(routes->keyboards[index] != NULL)
+        return;
+
+    beginRoutes();
+
+    KeyboardInfo* kbi = new KeyboardInfo();
+    kbi->device = device;
+    kbi->name = name;
+    next->keyboards[index] = kbi;
+
+    newKeyboardDevice(index, kbi);
+    publishRoutes();
+}
+
+// Add a mouse that isn't in the raw device list, and hook it up to any handlers that want it
+void EventDispatcher::addMouseDevice(HANDLE device, const string& name)
+{
+    unsigned int index = deviceIndex(device);
+    if(index == 0)
+        return;
+
+    ScopedCriticalSection wMutex(&writeLock);
+    announced[index] = true;
+    if(routes->mice[index] != NULL)
+        return;
+
+    beginRoutes();
+
+    MouseInfo* mi = new MouseInfo();
+    mi->device = device;
+    mi->name = name;
+    next->mice[index] = mi;
+
+    newMouseDevice(index, mi);
+    publishRoutes();
+}
+
 // Get a list of attached keyboards
 vector<KeyboardInfo> EventDispatcher::enumerateKeyboards()
 {
-    vector<KeyboardInfo> ret;
     scanDevices();
+    return knownKeyboards();
+}
 
-    {
-        ScopedCriticalSection kMutex(&kdLock);
+// Get a list of the keyboards we already know about
+vector<KeyboardInfo> EventDispatcher::knownKeyboards()
+{
+    vector<KeyboardInfo> ret;
+    RoutingReader reader(this);
 
-        map<HANDLE, KeyboardInfo*>::iterator it;
-        for(it = keyboardDevices.begin() ; it != keyboardDevices.end(); it++)
-        {
-            KeyboardInfo inf;
-            inf.device = (*it).second->device;
-            inf.name = (*it).second->name;
-            ret.push_back(inf);
-        }
+    for(unsigned int i = 1; i < deviceCount; i++)
+    {
+        const KeyboardInfo* kbd = reader.table->keyboards[i];
+        if(kbd == NULL)
+            continue;
+        KeyboardInfo inf;
+        inf.device = kbd->device;
+        inf.name = kbd->name;
+        ret.push_back(inf);
     }
 
     return ret;
@@ -257,61 +817,236 @@ vector<KeyboardInfo> EventDispatcher::enumerateKeyboards()
 // Get a list of attached mice
 vector<MouseInfo> EventDispatcher::enumerateMice()
 {
-    vector<MouseInfo> ret;
     scanDevices();
+    return knownMice();
+}
 
-    {
-        ScopedCriticalSection mMutex(&mdLock);
+// Get a list of the mice we already know about
+vector<MouseInfo> EventDispatcher::knownMice()
+{
+    vector<MouseInfo> ret;
+    RoutingReader reader(this);
 
-        map<HANDLE, MouseInfo*>::iterator it;
-        for(it = mouseDevices.begin() ; it != mouseDevices.end(); it++)
-        {
-            MouseInfo inf;
-            inf.device = (*it).second->device;
-            inf.name = (*it).second->name;
-            ret.push_back(inf);
-        }
+    for(unsigned int i = 1; i < deviceCount; i++)
+    {
+        const MouseInfo* mi = reader.table->mice[i];
+        if(mi == NULL)
+            continue;
+        MouseInfo inf;
+        inf.device = mi->device;
+        inf.name = mi->name;
+        ret.push_back(inf);
     }
 
     return ret;
 }
 
 // Register a handler for keyboard events
-void EventDispatcher::registerKeyboardHandler(string idRegex, KeyboardHandler* handler)
+void EventDispatcher::registerKeyboardHandler(string idRegex, KeyboardHandler* handler, bool observeOnly)
 {
-    RexHandler* rex = getKeyboardHandler(idRegex, handler);
+    ScopedCriticalSection wMutex(&writeLock);
+    size_t known = kHandlerRexMap.size();
+    RexHandler* rex = getKeyboardHandler(idRegex, handler, observeOnly);
+    if(observeOnly && kHandlerRexMap.size() != known)
+        InterlockedIncrement(&keyboardObservers);
+
+    beginRoutes();
     newKeyboardHandler(rex);
+    publishRoutes();
 }
 
 // Register a handler for mouse events
-void EventDispatcher::resgisterMouseHandler(string idRegex, MouseHandler* handler)
+void EventDispatcher::resgisterMouseHandler(string idRegex, MouseHandler* handler, bool observeOnly)
 {
-    RexHandler* rex = getMouseHandler(idRegex, handler);
+    ScopedCriticalSection wMutex(&writeLock);
+    size_t known = mHandlerRexMap.size();
+    RexHandler* rex = getMouseHandler(idRegex, handler, observeOnly);
+    if(observeOnly && mHandlerRexMap.size() != known)
+        InterlockedIncrement(&mouseObservers);
+
+    beginRoutes();
     newMouseHandler(rex);
+    publishRoutes();
 }
 
-// Unregister a handler for keyboard events
+// Register a handler for the events of devices we don't know yet
+void EventDispatcher::registerDefaultKeyboardHandler(KeyboardHandler* handler, bool observeOnly)
+{
+    ScopedCriticalSection wMutex(&writeLock);
+    for(size_t i = 0; i < kDefaultHandlers.size(); i++)
+    {
+        if(kDefaultHandlers[i]->khandler == handler && kDefaultHandlers[i]->observer == observeOnly)
+            return;
+    }
+
+    RexHandler* rh = new RexHandler();
+    rh->khandler = handler;
+    rh->observer = observeOnly;
+    rh->patternId = -1;
+    kDefaultHandlers.push_back(rh);
+    if(observeOnly)
+        InterlockedIncrement(&keyboardObservers);
+
+    beginRoutes();
+    addToKeyboardChain(0, rh);
+    publishRoutes();
+}
+
+// Same for mice
+void EventDispatcher::registerDefaultMouseHandler(MouseHandler* handler, bool observeOnly)
+{
+    ScopedCriticalSection wMutex(&writeLock);
+    for(size_t i = 0; i < mDefaultHandlers.size(); i++)
+    {
+        if(mDefaultHandlers[i]->mhandler == handler && mDefaultHandlers[i]->observer == observeOnly)
+            return;
+    }
+
+    RexHandler* rh = new RexHandler();
+    rh->mhandler = handler;
+    rh->observer = observeOnly;
+    rh->patternId = -1;
+    mDefaultHandlers.push_back(rh);
+    if(observeOnly)
+        InterlockedIncrement(&mouseObservers);
+
+    beginRoutes();
+    addToMouseChain(0, rh);
+    publishRoutes();
+}
+
+// Unregister a handler for keyboard events. Anyone still calling it from an older table gets to finish
+// before this returns, unless it's this thread (a handler unregistering itself, say).
 void EventDispatcher::unregisterKeyboardHandler(KeyboardHandler* handler)
 {
-    ScopedCriticalSection kecMutex(&kecLock);
-    map<HANDLE, KeyboardEventChain*>::iterator it;
-    for(it = kbdEventChains.begin(); it != kbdEventChains.end(); it++)
-        (*it).second->removeHandler(handler);
+    unsigned int old;
+
+    {
+        ScopedCriticalSection wMutex(&writeLock);
+
+        // Devices that turn up later shouldn't get it either
+        multimap<string, RexHandler*>::iterator it = kHandlerRexMap.begin();
+        while(it != kHandlerRexMap.end())
+        {
+            RexHandler* rh = (*it).second;
+            if(rh->khandler != handler)
+            {
+                it++;
+                continue;
+            }
+
+            string pattern = (*it).first;
+            if(rh->observer)
+                InterlockedDecrement(&keyboardObservers);
+            delete rh;
+            kHandlerRexMap.erase(it++);
+            releasePattern(pattern);
+        }
+
+        for(size_t i = 0; i < kDefaultHandlers.size(); )
+        {
+            RexHandler* rh = kDefaultHandlers[i];
+            if(rh->khandler != handler)
+            {
+                i++;
+                continue;
+            }
+
+            if(rh->observer)
+                InterlockedDecrement(&keyboardObservers);
+            delete rh;
+            kDefaultHandlers.erase(kDefaultHandlers.begin() + i);
+        }
+
+        beginRoutes();
+        garbage->handlers.push_back(handler);
+        for(unsigned int i = 0; i < deviceCount; i++)
+        {
+            if(next->kbdChains[i] != NULL && next->kbdChains[i]->hasHandler(handler))
+                writableChain(next->kbdChains, routes->kbdChains, i)->removeHandler(handler);
+            if(next->kbdObserverChains[i] != NULL && next->kbdObserverChains[i]->hasHandler(handler))
+                writableChain(next->kbdObserverChains, routes->kbdObserverChains, i)->removeHandler(handler);
+        }
+        old = publishRoutes();
+    }
+
+    waitForReaders();
+
+    // If this thread is in the middle of dispatching, it may still be using one of them
+    if(TlsGetValue(readerTls) == NULL)
+    {
+        ScopedCriticalSection wMutex(&writeLock);
+        reclaimRoutes(old);
+    }
 }
 
 // Unregister a handler for mouse events
 void EventDispatcher::unregisterMouseHandler(MouseHandler* handler)
 {
-    ScopedCriticalSection mecMutex(&mecLock);
-    map<HANDLE, MouseEventChain*>::iterator it;
-    for(it = mouseEventChains.begin(); it != mouseEventChains.end(); it++)
-        (*it).second->removeHandler(handler);
+    unsigned int old;
+
+    {
+        ScopedCriticalSection wMutex(&writeLock);
+
+        // Devices that turn up later shouldn't get it either
+        multimap<string, RexHandler*>::iterator it = mHandlerRexMap.begin();
+        while(it != mHandlerRexMap.end())
+        {
+            RexHandler* rh = (*it).second;
+            if(rh->mhandler != handler)
+            {
+                it++;
+                continue;
+            }
+
+            string pattern = (*it).first;
+            if(rh->observer)
+                InterlockedDecrement(&mouseObservers);
+            delete rh;
+            mHandlerRexMap.erase(it++);
+            releasePattern(pattern);
+        }
+
+        for(size_t i = 0; i < mDefaultHandlers.size(); )
+        {
+            RexHandler* rh = mDefaultHandlers[i];
+            if(rh->mhandler != handler)
+            {
+                i++;
+                continue;
+            }
+
+            if(rh->observer)
+                InterlockedDecrement(&mouseObservers);
+            delete rh;
+            mDefaultHandlers.erase(mDefaultHandlers.begin() + i);
+        }
+
+        beginRoutes();
+        garbage->handlers.push_back(handler);
+        for(unsigned int i = 0; i < deviceCount; i++)
+        {
+            if(next->mouseChains[i] != NULL && next->mouseChains[i]->hasHandler(handler))
+                writableChain(next->mouseChains, routes->mouseChains, i)->removeHandler(handler);
+            if(next->mouseObserverChains[i] != NULL && next->mouseObserverChains[i]->hasHandler(handler))
+                writableChain(next->mouseObserverChains, routes->mouseObserverChains, i)->removeHandler(handler);
+        }
+        old = publishRoutes();
+    }
+
+    // Same as above
+    waitForReaders();
+    if(TlsGetValue(readerTls) == NULL)
+    {
+        ScopedCriticalSection wMutex(&writeLock);
+        reclaimRoutes(old);
+    }
 }
 
 // Add or get a mouse handler for a given regular expression and handler pair
-RexHandler* EventDispatcher::getMouseHandler(std::string regex, MouseHandler* handler)
+RexHandler* EventDispatcher::getMouseHandler(std::string regex, MouseHandler* handler, bool observer)
 {
-    ScopedCriticalSection mMutex(&mdHRMLock);
+    ScopedCriticalSection wMutex(&writeLock);
 
     multimap<string, RexHandler*>::iterator it;
     pair<multimap<string, RexHandler*>::iterator, multimap<string, RexHandler*>::iterator> ret;
@@ -320,24 +1055,26 @@ RexHandler* EventDispatcher::getMouseHandler(std::string regex, MouseHandler* ha
     // Check to see if we've already registered this handler for this regex
     for (it = ret.first; it != ret.second; ++it)
     {
-        if((*it).second->mhandler == handler)
+        if((*it).second->mhandler == handler && (*it).second->observer == observer)
             return (*it).second;
     }
 
     // No? Alright then register everything
+    int id = usePattern(regex);
     RexHandler* rh = new RexHandler();
     rh->mhandler = handler;
-    rh->rex = new TRexpp();
-    rh->rex->Compile(regex.c_str());
+    rh->observer = observer;
+    rh->pattern = regex;
+    rh->patternId = id;
 
     mHandlerRexMap.insert(pair<string, RexHandler*>(regex, rh));
     return rh;
 }
 
 // Add or get a keyboard handler for a given regular expression and handler pair
-RexHandler* EventDispatcher::getKeyboardHandler(string regex, KeyboardHandler* handler)
+RexHandler* EventDispatcher::getKeyboardHandler(string regex, KeyboardHandler* handler, bool observer)
 {
-    ScopedCriticalSection kMutex(&kbHRMLock);
+    ScopedCriticalSection wMutex(&writeLock);
 
     multimap<string, RexHandler*>::iterator it;
     pair<multimap<string, RexHandler*>::iterator, multimap<string, RexHandler*>::iterator> ret;
@@ -346,132 +1083,158 @@ RexHandler* EventDispatcher::getKeyboardHandler(string regex, KeyboardHandler* h
     // Check to see if we've already registered this handler for this regex
     for (it = ret.first; it != ret.second; ++it)
     {
-        if((*it).second->khandler == handler)
+        if((*it).second->khandler == handler && (*it).second->observer == observer)
             return (*it).second;
     }
 
     // No? Alright then register everything
+    int id = usePattern(regex);
     RexHandler* rh = new RexHandler();
     rh->khandler = handler;
-    rh->rex = new TRexpp();
-    rh->rex->Compile(regex.c_str());
+    rh->observer = observer;
+    rh->pattern = regex;
+    rh->patternId = id;
 
     kHandlerRexMap.insert(pair<string, RexHandler*>(regex, rh));
     return rh;
 }
 
+// The id of a pattern in the automaton, adding it if nobody's using it yet. Throws a TRexParseException if
+// it doesn't compile.
+int EventDispatcher::usePattern(const string& regex)
+{
+    map<string, int>::iterator it = patternIds.find(regex);
+    if(it != patternIds.end())
+        return (*it).second;
+
+    int id = nextPatternId;
+    devicePatterns->Add(id, regex.c_str());
+    patternIds[regex] = id;
+    nextPatternId++;
+    return id;
+}
+
+// Take a pattern out of the automaton once no handler is using it
+void EventDispatcher::releasePattern(const string& regex)
+{
+    if(kHandlerRexMap.count(regex) > 0 || mHandlerRexMap.count(regex) > 0)
+        return;
+
+    map<string, int>::iterator it = patternIds.find(regex);
+    if(it == patternIds.end())
+        return;
+
+    devicePatterns->Remove((*it).second);
+    patternIds.erase(it);
+}
+
+// Every pattern against a device name, in one pass. The answer is left in patternMatched, by pattern id.
+// A device that was in the cache usually has all of its answers in there already.
+void EventDispatcher::matchPatterns(const string& name)
+{
+    patternMatched.assign(nextPatternId, 0);
+    if(patternIds.empty() || cachedMatches(name))
+        return;
+
+    matchedIds.resize(patternIds.size());
+    int count = devicePatterns->Match(name.c_str(), &matchedIds[0], (int)matchedIds.size());
+    for(int i = 0; i < count && i < (int)matchedIds.size(); i++)
+        patternMatched[matchedIds[i]] = 1;
+}
+
+// Fill in patternMatched from the cache. False if it doesn't have an answer for every pattern; the ones it
+// did have are right, so the automaton can just go over the top.
+bool EventDispatcher::cachedMatches(const string& name)
+{
+    int d = (deviceCache != NULL) ? deviceCache->findDevice(name) : -1;
+    if(d < 0)
+        return false;
+
+    map<string, int>::iterator it;
+    for(it = patternIds.begin(); it != patternIds.end(); it++)
+    {
+        int cached = deviceCache->findMatch((*it).first, d);
+        if(cached < 0)
+            return false;
+        patternMatched[(*it).second] = (char)cached;
+    }
+    return true;
+}
+
 // Clean up the mouse handler map
 void EventDispatcher::cleanupMouseHandlerMap()
 {
-    ScopedCriticalSection mMutex(&mdHRMLock);
+    ScopedCriticalSection wMutex(&writeLock);
     multimap<string, RexHandler*>::iterator it;
 
     for(it = mHandlerRexMap.begin(); it != mHandlerRexMap.end(); it++)
     {
         RexHandler* rex = (*it).second;
-        delete rex->rex;
         delete rex;
     }
 
     mHandlerRexMap.clear();
+
+    for(size_t i = 0; i < mDefaultHandlers.size(); i++)
+        delete mDefaultHandlers[i];
+    mDefaultHandlers.clear();
 }
 
 // Clean up the mouse handler map
 void EventDispatcher::cleanupKeyboardHandlerMap()
 {
-    ScopedCriticalSection kMutex(&kbHRMLock);
+    ScopedCriticalSection wMutex(&writeLock);
     multimap<string, RexHandler*>::iterator it;
 
     for(it = kHandlerRexMap.begin(); it != kHandlerRexMap.end(); it++)
     {
         RexHandler* rex = (*it).second;
-        delete rex->rex;
         delete rex;
     }
 
     kHandlerRexMap.clear();
-}
 
-// Clean up the mouse event chain map
-void EventDispatcher::cleanupMouseEventChainMap()
-{
-    ScopedCriticalSection mMutex(&mecLock);
-
-    map<HANDLE, MouseEventChain*>::iterator it;
-    for(it = mouseEventChains.begin(); it != mouseEventChains.end(); it++)
-        delete (*it).second;
-    mouseEventChains.clear();
+    for(size_t i = 0; i < kDefaultHandlers.size(); i++)
+        delete kDefaultHandlers[i];
+    kDefaultHandlers.clear();
 }
 
-// Clean up the keyboard event chain map
-void EventDispatcher::cleanupKeyboardEventChainMap()
+// A new mouse device has been added to the new table
+void EventDispatcher::newMouseDevice(unsigned int index, MouseInfo* info)
 {
-    ScopedCriticalSection kMutex(&kecLock);
+    if(recorder != NULL)
+        recorder->device(MOUSE_BUTTON_EVENT, info->device, info->name);
 
-    map<HANDLE, KeyboardEventChain*>::iterator it;
-    for(it = kbdEventChains.begin(); it != kbdEventChains.end(); it++)
-        delete (*it).second;
-    kbdEventChains.clear();
-}
-
-// Clear out the mouse device info map
-void EventDispatcher::cleanupMouseDeviceMap()
-{
-    ScopedCriticalSection mMutex(&mdLock);
-
-    map<HANDLE, MouseInfo*>::iterator it;
-    for(it = mouseDevices.begin(); it != mouseDevices.end(); it++)
-        delete (*it).second;
-    mouseDevices.clear();
-}
-
-// Clear out the keyboard device info map
-void EventDispatcher::cleanupKeyboardDeviceMap()
-{
-    ScopedCriticalSection kMutex(&kdLock);
-
-    map<HANDLE, KeyboardInfo*>::iterator it;
-    for(it = keyboardDevices.begin() ; it != keyboardDevices.end(); it++)
-        delete (*it).second;
-    keyboardDevices.clear();
-}
-
-// A new mouse device has been added
-void EventDispatcher::newMouseDevice(MouseInfo* info)
-{
-    ScopedCriticalSection mMutex(&mdHRMLock);
     multimap<string, RexHandler*>::iterator it;
+    matchPatterns(info->name);
 
     for(it = mHandlerRexMap.begin(); it != mHandlerRexMap.end(); it++)
     {
         RexHandler* rh = (*it).second;
-        if(rh->rex->Match(info->name.c_str()))
+        if(patternMatched[rh->patternId])
         {
             // OK, we've got a registered handler for this device.
-            ScopedCriticalSection mecMutex(&mecLock);
-            if(mouseEventChains.count(info->device) == 0)
-                mouseEventChains[info->device] = new MouseEventChain();
-            mouseEventChains[info->device]->addHandler(rh->mhandler);
+            addToMouseChain(index, rh);
         }
     }
 }
 
-// A new keyboard device has been added
-void EventDispatcher::newKeyboardDevice(KeyboardInfo* info)
+// A new keyboard device has been added to the new table
+void EventDispatcher::newKeyboardDevice(unsigned int index, KeyboardInfo* info)
 {
-    ScopedCriticalSection kMutex(&kbHRMLock);
+    if(recorder != NULL)
+        recorder->device(KEYBOARD_EVENT, info->device, info->name);
+
     multimap<string, RexHandler*>::iterator it;
+    matchPatterns(info->name);
 
     for(it = kHandlerRexMap.begin(); it != kHandlerRexMap.end(); it++)
     {
         RexHandler* rh = (*it).second;
-        if(rh->rex->Match(info->name.c_str()))
+        if(patternMatched[rh->patternId])
         {
             // OK, we've got a registered handler for this device.
-            ScopedCriticalSection kecMutex(&kecLock);
-            if(kbdEventChains.count(info->device) == 0)
-                kbdEventChains[info->device] = new KeyboardEventChain();
-            kbdEventChains[info->device]->addHandler(rh->khandler);
+            addToKeyboardChain(index, rh);
         }
     }
 }
@@ -479,19 +1242,13 @@ void EventDispatcher::newKeyboardDevice(KeyboardInfo* info)
 // A new keyboard event handler has been added
 void EventDispatcher::newKeyboardHandler(RexHandler* keHandler)
 {
-    ScopedCriticalSection kMutex(&kdLock);
-
-    map<HANDLE, KeyboardInfo*>::iterator it;
-    for(it = keyboardDevices.begin(); it != keyboardDevices.end(); it++)
+    for(unsigned int i = 1; i < deviceCount; i++)
     {
-        KeyboardInfo* info = (*it).second;
-        if(keHandler->rex->Match(info->name.c_str()))
+        KeyboardInfo* info = next->keyboards[i];
+        if(info != NULL && matchDevice(keHandler, info->name))
         {
             // OK, our new handler can handle this device
-            ScopedCriticalSection kecMutex(&kecLock);
-            if(kbdEventChains.count(info->device) == 0)
-                kbdEventChains[info->device] = new KeyboardEventChain();
-            kbdEventChains[info->device]->addHandler(keHandler->khandler);
+            addToKeyboardChain(i, keHandler);
         }
     }
 }
@@ -499,42 +1256,164 @@ void EventDispatcher::newKeyboardHandler(RexHandler* keHandler)
 // A new mouse event handler has been added
 void EventDispatcher::newMouseHandler(RexHandler* meHandler)
 {
-    ScopedCriticalSection mMutex(&mdHRMLock);
-
-    map<HANDLE, MouseInfo*>::iterator it;
-    for(it = mouseDevices.begin(); it != mouseDevices.end(); it++)
+    for(unsigned int i = 1; i < deviceCount; i++)
     {
-        MouseInfo* info = (*it).second;
-        if(meHandler->rex->Match(info->name.c_str()))
+        MouseInfo* info = next->mice[i];
+        if(info != NULL && matchDevice(meHandler, info->name))
         {
             // OK, our new handler can handle this device
-            ScopedCriticalSection mecMutex(&mecLock);
-            if(mouseEventChains.count(info->device) == 0)
-                mouseEventChains[info->device] = new MouseEventChain();
-            mouseEventChains[info->device]->addHandler(meHandler->mhandler);
+            addToMouseChain(i, meHandler);
         }
     }
 }
 
-// An unknown keyboard device has been encountered. Find out more about it.
-KeyboardInfo* EventDispatcher::unknownKeyboardDevice(HANDLE device)
+// Add a handler to a keyboard's deciding chain or its observer chain, in the new table
+void EventDispatcher::addToKeyboardChain(unsigned int index, RexHandler* keHandler)
 {
-    // TODO: Find out more about this new device
+    if(keHandler->observer)
+        writableChain(next->kbdObserverChains, routes->kbdObserverChains, index)->addHandler(keHandler->khandler);
+    else
+        writableChain(next->kbdChains, routes->kbdChains, index)->addHandler(keHandler->khandler);
+}
+
+// Add a handler to a mouse's deciding chain or its observer chain, in the new table
+void EventDispatcher::addToMouseChain(unsigned int index, RexHandler* meHandler)
+{
+    if(meHandler->observer)
+        writableChain(next->mouseObserverChains, routes->mouseObserverChains, index)->addHandler(meHandler->mhandler);
+    else
+        writableChain(next->mouseChains, routes->mouseChains, index)->addHandler(meHandler->mhandler);
+}
+
+// Ask Windows what a raw device is called
+static bool rawDeviceName(HANDLE device, string& name)
+{
+    // Get the length of the device name
+    UINT pcbSize = 0;
+    if(0 != GetRawInputDeviceInfo(device, RIDI_DEVICENAME, NULL, &pcbSize) || pcbSize == 0)
+        return false;
+
+    TCHAR* cDevName = (TCHAR*)malloc(sizeof(TCHAR) * pcbSize);
+    if(cDevName == NULL)
+        return false;
+
+    // Get the device name
+    bool found = false;
+    if(GetRawInputDeviceInfo(device, RIDI_DEVICENAME, (LPVOID)cDevName, &pcbSize) > 0)
+    {
+#ifdef UNICODE
+        wstring wdevName(cDevName);
+        name.assign(wdevName.begin(), wdevName.end());
+#else
+        name.assign(cDevName);
+#endif
+        found = true;
+    }
 
-    return NULL;
+    free(cDevName);
+    return found;
+}
+
+// Runs on a pool thread
+static DWORD WINAPI DeviceLookupWork(LPVOID param)
+{
+    DeviceLookup* lookup = (DeviceLookup*)param;
+    lookup->dispatcher->_LookupDevice(lookup);
+    return 0;
 }
 
-// An unknown mouse device has been encountered. Find out more about it.
-MouseInfo* EventDispatcher::unknownMouseDevice(HANDLE device)
+// An event has turned up from a device nobody's told us about. Asking Windows what it is takes far too long to
+// do here, so it's done on a pool thread, at most one at a time per device. Until then the device's events go
+// to the default chain. If Windows doesn't know either, don't ask again for a while.
+void EventDispatcher::unknownDevice(unsigned int index, HANDLE device, bool mouse)
 {
-    // TODO: Find out more about this new device
+    if(index == 0 || lookupState[index] != LOOKUP_IDLE)
+        return;
+    if(lookupFailures[index] > 0 && (LONG)(GetTickCount() - lookupRetryAt[index]) < 0)
+        return;
+    if(InterlockedCompareExchange(&lookupState[index], LOOKUP_QUEUED, LOOKUP_IDLE) != LOOKUP_IDLE)
+        return;
+
+    DeviceLookup* lookup = new DeviceLookup();
+    lookup->dispatcher = this;
+    lookup->index = index;
+    lookup->device = device;
+    lookup->mouse = mouse;
+
+    InterlockedIncrement(&pendingWork);
+    if(!QueueUserWorkItem(DeviceLookupWork, lookup, WT_EXECUTEDEFAULT))
+    {
+        delete lookup;
+        InterlockedDecrement(&pendingWork);
+        InterlockedExchange(&lookupState[index], LOOKUP_IDLE);
+    }
+}
+
+// Find out what an unknown device is called, and hook it up to its handlers in one go
+void EventDispatcher::_LookupDevice(DeviceLookup* lookup)
+{
+    unsigned int index = lookup->index;
+    string name;
+
+    if(rawDeviceName(lookup->device, name))
+    {
+        ScopedCriticalSection wMutex(&writeLock);
+
+        // Enumerating might have got there first
+        if(routes->keyboards[index] == NULL && routes->mice[index] == NULL)
+        {
+            beginRoutes();
+            if(lookup->mouse)
+            {
+                MouseInfo* mi = new MouseInfo();
+                mi->device = lookup->device;
+                mi->name = name;
+                next->mice[index] = mi;
+                newMouseDevice(index, mi);
+            }
+            else
+            {
+                KeyboardInfo* kbi = new KeyboardInfo();
+                kbi->device = lookup->device;
+                kbi->name = name;
+                next->keyboards[index] = kbi;
+                newKeyboardDevice(index, kbi);
+            }
+            publishRoutes();
+        }
+        lookupFailures[index] = 0;
+    }
+    else
+    {
+        // Back off: a quarter of a second, doubling every time, up to a minute
+        unsigned int failures = lookupFailures[index];
+        DWORD delay = (failures < 8) ? (250u << failures) : 60000u;
+        lookupRetryAt[index] = GetTickCount() + delay;
+        lookupFailures[index] = failures + 1;
+    }
 
-    return NULL;
+    InterlockedExchange(&lookupState[index], LOOKUP_IDLE);
+    delete lookup;
+    InterlockedDecrement(&pendingWork);
 }
 
-// Scan the raw devices and fill in the device info structures
+// Bring the device info up to date, and if there's a cache file, see that it catches up later
 void EventDispatcher::scanDevices()
 {
+    if(rescanDevices(true))
+        queueCacheRefresh();
+}
+
+// Scan the raw devices and bring the device info up to date. Only devices that have come or gone since last
+// time are touched; everything else, and everything dispatch can see, carries on as it was.
+//
+// Trusting the cache, devices it knows are named from it without asking Windows. Otherwise, devices that
+// were named that way are asked about after all, and start over if the cache was wrong. Returns true if
+// the cache file could do with rewriting.
+bool EventDispatcher::rescanDevices(bool trustCache)
+{
+    bool refresh = false;
+
     UINT nDevices = 0;
     PRAWINPUTDEVICELIST pRawInputDeviceList = NULL;
 
@@ -554,17 +1433,16 @@ void EventDispatcher::scanDevices()
         }
     }
 
-    // We'll be rebuilding these
-    cleanupKeyboardEventChainMap();
-    cleanupMouseEventChainMap();
-    cleanupKeyboardDeviceMap();
-    cleanupMouseDeviceMap();
-
     {
-        // Begin lock
+        // Begin lock. Any changes go in a new table.
 
-        ScopedCriticalSection kMutex(&kdLock);
-        ScopedCriticalSection mMutex(&mdLock);
+        ScopedCriticalSection wMutex(&writeLock);
+        beginRoutes();
+
+        bool changed = false;
+        bool usedCache = false;
+        bool present[DEVICE_INDEX_LIMIT];
+        memset(present, 0, sizeof(present));
 
         // Iterate over the raw devices
         for(UINT i = 0; i < nDevices; i++)
@@ -572,66 +1450,211 @@ void EventDispatcher::scanDevices()
             RAWINPUTDEVICELIST& rid = pRawInputDeviceList[i];
             if(rid.dwType != RIM_TYPEKEYBOARD && rid.dwType != RIM_TYPEMOUSE)
                 continue;
-            if(keyboardDevices.count(rid.hDevice) > 0 || mouseDevices.count(rid.hDevice) > 0)
+            unsigned int index = deviceIndex(rid.hDevice);
+            if(index == 0)
                 continue;
 
-            // Get the length of the device name
-            UINT pcbSize = 0;
-            if(0 != GetRawInputDeviceInfo(rid.hDevice, RIDI_DEVICENAME, NULL, &pcbSize))
+            // Already know this one? Leave it be, unless it's time to check what the cache said about it.
+            present[index] = true;
+            bool known = (next->keyboards[index] != NULL || next->mice[index] != NULL);
+            if(known && (trustCache || !fromCache[index]))
                 continue;
 
-            if (pcbSize > 0)
+            bool mouse = (rid.dwType == RIM_TYPEMOUSE);
+            string devName;
+            bool cached = trustCache && deviceCache != NULL && deviceCache->findName(rid.hDevice, mouse, devName);
+            if(!cached && !rawDeviceName(rid.hDevice, devName))
+                continue;
+
+            if(known)
             {
-                TCHAR* cDevName = (TCHAR*)malloc(sizeof(TCHAR) * pcbSize);
-                if(cDevName != NULL)
+                bool wasMouse = (next->mice[index] != NULL);
+                const string& oldName = wasMouse ? next->mice[index]->name : next->keyboards[index]->name;
+                if(wasMouse == mouse && oldName == devName)
                 {
-                    // Get the device name
-                    if(GetRawInputDeviceInfo(rid.hDevice, RIDI_DEVICENAME, (LPVOID)cDevName, &pcbSize) > 0)
-                    {
-#ifdef UNICODE
-                        wstring wdevName(cDevName);
-                        string devName(wdevName.begin(), wdevName.end());
-                        devName.assign(wdevName.begin(), wdevName.end());
-#else
-                        string devName(cDevName); 
-#endif
-                        
-                        if(rid.dwType == RIM_TYPEKEYBOARD)
-                        {
-                            if(keyboardDevices.count(rid.hDevice) == 0)
-                            {
-                                // Process the new keyboard device
-                                KeyboardInfo* kbi = new KeyboardInfo();
-                                kbi->device = rid.hDevice;
-                                kbi->name = devName;
-                                keyboardDevices[rid.hDevice] = kbi;
-
-                                newKeyboardDevice(kbi);
-                            }
-                        }
-                        else if(rid.dwType == RIM_TYPEMOUSE)
-                        {
-                            if(mouseDevices.count(rid.hDevice))
-                            {
-                                // Process the new mouse device
-                                MouseInfo* mi = new MouseInfo();
-                                mi->device = rid.hDevice;
-                                mi->name = devName;
-                                mouseDevices[rid.hDevice] = mi;
-
-                                newMouseDevice(mi);
-                            }
-                        }
-                    }
-
-                    free(cDevName);
+                    fromCache[index] = false;
+                    continue;
                 }
+
+                // The cache was wrong. Start over with the real thing.
+                detachDevice(index);
             }
+
+            fromCache[index] = cached;
+            usedCache = usedCache || cached;
+
+            if(!mouse)
+            {
+                // Process the new keyboard device
+                KeyboardInfo* kbi = new KeyboardInfo();
+                kbi->device = rid.hDevice;
+                kbi->name = devName;
+                next->keyboards[index] = kbi;
+
+                newKeyboardDevice(index, kbi);
+                changed = true;
+            }
+            else
+            {
+                // Process the new mouse device
+                MouseInfo* mi = new MouseInfo();
+                mi->device = rid.hDevice;
+                mi->name = devName;
+                next->mice[index] = mi;
+
+                newMouseDevice(index, mi);
+                changed = true;
+            }
+        }
+
+        // Anything that's gone from the list has been unplugged, and its number can go to the next one.
+        // That includes handles we only ever saw events from. Devices a backend told us about were never on
+        // it in the first place.
+        for(unsigned int i = 1; i < deviceCount; i++)
+        {
+            if(present[i] || announced[i] || forgotten[i] || indexDevices[i] == NULL)
+                continue;
+            forgetDevice(i);
+            changed = true;
         }
 
+        if(changed)
+            publishRoutes();
+        else
+            abandonRoutes();
+
+        refresh = !deviceCachePath.empty() && (changed || usedCache);
+
         // End lock
     }
 
     if(pRawInputDeviceList)
         free(pRawInputDeviceList);
+
+    return refresh;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Device cache
+
+// Remember device names and handler matches in a file, so that next time (in the same boot) enumerating
+// doesn't have to ask Windows about every device before anything can be routed
+void EventDispatcher::setDeviceCache(const string& path)
+{
+    ScopedCriticalSection wMutex(&writeLock);
+
+    delete deviceCache;
+    deviceCache = NULL;
+    deviceCachePath = path;
+
+    if(!path.empty())
+    {
+        deviceCache = new DeviceCache();
+        deviceCache->open(path);
+    }
+}
+
+// Runs on a pool thread
+static DWORD WINAPI CacheRefreshWork(LPVOID param)
+{
+    ((EventDispatcher*)param)->_RefreshDeviceCache();
+    return 0;
+}
+
+// Check on the cache, and write a new one, in the background. Several scans in a row only need one.
+void EventDispatcher::queueCacheRefresh()
+{
+    if(InterlockedExchange(&cacheRefreshPending, 1) != 0)
+        return;
+
+    InterlockedIncrement(&pendingWork);
+    if(!QueueUserWorkItem(CacheRefreshWork, this, WT_EXECUTEDEFAULT))
+    {
+        InterlockedDecrement(&pendingWork);
+        InterlockedExchange(&cacheRefreshPending, 0);
+    }
+}
+
+// The full scan that trusting the cache skipped, then a new cache file with the results
+void EventDispatcher::_RefreshDeviceCache()
+{
+    // Anything that changes from here on gets a refresh of its own
+    InterlockedExchange(&cacheRefreshPending, 0);
+
+    try
+    {
+        rescanDevices(false);
+        saveDeviceCache();
+    }
+    catch(...)
+    {
+        // Never mind, the cache is only a head start
+    }
+
+    InterlockedDecrement(&pendingWork);
+}
+
+// Write down every Windows device we know about and which patterns match it
+void EventDispatcher::saveDeviceCache()
+{
+    string path;
+    vector<CachedDevice> devices;
+    vector<string> patterns;
+    vector<unsigned int> matches;
+
+    {
+        ScopedCriticalSection wMutex(&writeLock);
+        if(deviceCachePath.empty())
+            return;
+        path = deviceCachePath;
+
+        // Everything in it has been checked by now. It has to be let go of before it can be replaced.
+        if(deviceCache != NULL)
+            deviceCache->close();
+
+        for(unsigned int i = 1; i < deviceCount; i++)
+        {
+            if(announced[i] || (routes->keyboards[i] == NULL && routes->mice[i] == NULL))
+                continue;
+
+            CachedDevice cd;
+            cd.mouse = (routes->mice[i] != NULL);
+            cd.device = cd.mouse ? routes->mice[i]->device : routes->keyboards[i]->device;
+            cd.name = cd.mouse ? routes->mice[i]->name : routes->keyboards[i]->name;
+            devices.push_back(cd);
+        }
+
+        // One row of bits per pattern, however many handlers use it
+        unsigned int words = ((unsigned int)devices.size() + 31) / 32;
+        multimap<string, RexHandler*>* maps[2] = { &kHandlerRexMap, &mHandlerRexMap };
+        for(int m = 0; m < 2; m++)
+        {
+            multimap<string, RexHandler*>::iterator it;
+            for(it = maps[m]->begin(); it != maps[m]->end(); it = maps[m]->upper_bound(it->first))
+            {
+                if(find(patterns.begin(), patterns.end(), it->first) != patterns.end())
+                    continue;
+
+                patterns.push_back(it->first);
+                matches.resize(matches.size() + words, 0);
+                unsigned int* row = &matches[matches.size() - words];
+                for(size_t d = 0; d < devices.size(); d++)
+                {
+                    if(devicePatterns->MatchOne(it->second->patternId, devices[d].name.c_str()))
+                        row[d / 32] |= 1u << (d % 32);
+                }
+            }
+        }
+    }
+
+    DeviceCache::write(path, devices, patterns, matches);
+}
+
+// Does a handler want a device? The cache may already know.
+bool EventDispatcher::matchDevice(RexHandler* rh, const string& name) const
+{
+    int cached = (deviceCache != NULL) ? deviceCache->findMatch(rh->pattern, name) : -1;
+    if(cached >= 0)
+        return cached != 0;
+    return devicePatterns->MatchOne(rh->patternId, name.c_str());
 }
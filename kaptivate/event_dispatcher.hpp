@@ -35,7 +35,20 @@
 #include <vector>
 #include <iostream>
 
-class TRexpp;
+#include "kaptivate.hpp"
+#include "event_chain.hpp"
+
+class TRexSetpp;
+
+// How many devices can be numbered at once, counting the unused 0. Past that, new devices go without
+// handlers. Numbers of devices that have gone are handed out again.
+#define DEVICE_INDEX_LIMIT 1024
+
+// Slots in the handle -> index table. A power of two, at least twice the limit.
+#define DEVICE_HASH_SIZE 2048
+
+// The index of a slot whose device has been forgotten. Lookups carry on past it; a new device can have it.
+#define DEVICE_SLOT_FREED 0xFFFFFFFF
 
 namespace Kaptivate
 {
@@ -49,10 +62,27 @@ namespace Kaptivate
     class MouseEventChain;
     struct KeyboardInfo;
     struct MouseInfo;
+    struct EventRecord;
+    class LatencyHistogram;
+    class HandlerProfiler;
+    class DeviceCache;
+    class CaptureRecorder;
+
+    // Working space for feeding observers. Each observer thread has its own, so that several of them can
+    // run at once without sharing anything.
+    struct ObserverScratch
+    {
+        std::vector<KeyboardEvent> kbdViews;
+        std::vector<MouseButtonEvent> buttonViews;
+        std::vector<MouseWheelEvent> wheelViews;
+        std::vector<MouseMoveEvent> moveViews;
+    };
 
     struct RexHandler
     {
-        TRexpp* rex;
+        std::string pattern;
+        int patternId;                // In EventDispatcher::devicePatterns
+        bool observer;
         union
         {
             KeyboardHandler* khandler;
@@ -60,59 +90,248 @@ namespace Kaptivate
         };
     };
 
+    // One entry in the handle -> index table. An index of 0 means the slot has never been used, and
+    // DEVICE_SLOT_FREED that its device has been forgotten.
+    struct DeviceSlot
+    {
+        HANDLE device;
+        volatile unsigned int index;
+    };
+
+    class EventDispatcher;
+
+    // A device being looked up in the background
+    struct DeviceLookup
+    {
+        EventDispatcher* dispatcher;
+        unsigned int index;
+        HANDLE device;
+        bool mouse;
+    };
+
+    // Where a device's lookup is at
+    enum LookupState
+    {
+        LOOKUP_IDLE = 0,
+        LOOKUP_QUEUED
+    };
+
+    // Everything dispatch needs to know, indexed by device number. Entry 0 never has any info; its chains are
+    // the default ones, for devices we don't know (yet).
+    // Once a table has been published it's never changed; changes are made to a copy which replaces it.
+    // Tables share whatever info and chains they have in common.
+    struct RoutingTable
+    {
+        KeyboardInfo* keyboards[DEVICE_INDEX_LIMIT];
+        MouseInfo* mice[DEVICE_INDEX_LIMIT];
+        KeyboardEventChain* kbdChains[DEVICE_INDEX_LIMIT];
+        MouseEventChain* mouseChains[DEVICE_INDEX_LIMIT];
+
+        // Observers get chains of their own, so that feeding them never holds up the hook thread
+        KeyboardEventChain* kbdObserverChains[DEVICE_INDEX_LIMIT];
+        MouseEventChain* mouseObserverChains[DEVICE_INDEX_LIMIT];
+    };
+
+    // A table that's been replaced, along with whatever it had that its replacement doesn't. Freed once
+    // nobody can still be reading it.
+    struct RetiredRoutes
+    {
+        RoutingTable* table;
+        unsigned int generation;
+        std::vector<KeyboardInfo*> keyboards;
+        std::vector<MouseInfo*> mice;
+        std::vector<KeyboardEventChain*> kbdChains;
+        std::vector<MouseEventChain*> mouseChains;
+        std::vector<unsigned int> indices;    // Of devices that have gone, to be handed out again
+        std::vector<void*> handlers;          // Unregistered, whose profiles can go
+    };
+
     class EventDispatcher
     {
     private:
-        CRITICAL_SECTION kdLock;
-        CRITICAL_SECTION mdLock;
-        std::map<HANDLE, KeyboardInfo*> keyboardDevices;
-        std::map<HANDLE, MouseInfo*> mouseDevices;
-
-        CRITICAL_SECTION kecLock;
-        CRITICAL_SECTION mecLock;
-        std::map<HANDLE, KeyboardEventChain*> kbdEventChains;
-        std::map<HANDLE, MouseEventChain*> mouseEventChains;
-
-        CRITICAL_SECTION kbHRMLock;
-        CRITICAL_SECTION mdHRMLock;
+        friend class RoutingReader;
+
+        // Every device handle we come across gets a small number until it goes away, which events carry
+        // around (EventRecord::deviceIndex), so that everything about a device is an array lookup away.
+        // Numbers are handed out and given back under indexLock and looked up without any lock.
+        CRITICAL_SECTION indexLock;
+        DeviceSlot deviceSlots[DEVICE_HASH_SIZE];
+        volatile unsigned int deviceCount;
+        HANDLE volatile indexDevices[DEVICE_INDEX_LIMIT];   // Whose each number is, NULL if nobody's
+        std::vector<unsigned int> freeIndices;
+
+        // The routing table. Dispatch reads it without taking any lock: it says it's reading by bumping
+        // one of the two reader counts (whichever readPhase says), and a table that's been replaced is only
+        // freed once both counts have been seen at zero. Everything that changes it does so under writeLock.
+        RoutingTable* volatile routes;
+        volatile LONG readers[2];
+        volatile LONG readPhase;
+        volatile LONG parked[2];      // How much of each reader count belongs to handlers sat in waitForReaders
+        DWORD readerTls;              // 0 if this thread isn't reading, or twice how deep it is plus the count it bumped
+
+        CRITICAL_SECTION writeLock;
+        RoutingTable* next;           // The copy being changed, while writeLock is held
+        RetiredRoutes* garbage;       // What it's replacing
+        std::vector<RetiredRoutes*> retired;
+        unsigned int generation;
+
+        // Devices a backend told us about, which scanning leaves alone. Under writeLock.
+        bool announced[DEVICE_INDEX_LIMIT];
+
+        // Devices that have gone, whose numbers are waiting for the tables that had them to be let go of.
+        // Under writeLock.
+        bool forgotten[DEVICE_INDEX_LIMIT];
+
+        // Looking up devices we've never heard of. Only one lookup per device at a time, which owns its
+        // failure count and retry time until it's done.
+        volatile LONG lookupState[DEVICE_INDEX_LIMIT];
+        unsigned int lookupFailures[DEVICE_INDEX_LIMIT];
+        DWORD lookupRetryAt[DEVICE_INDEX_LIMIT];
+
+        // Names and handler matches from the last run, if there's a cache file. Under writeLock.
+        DeviceCache* deviceCache;
+        std::string deviceCachePath;
+        bool fromCache[DEVICE_INDEX_LIMIT];   // Named from the cache, and not checked yet
+        volatile LONG cacheRefreshPending;
+
+        // Lookups and cache refreshes still running on pool threads
+        volatile LONG pendingWork;
+
+        volatile LONG keyboardObservers;
+        volatile LONG mouseObservers;
+
+        // Where handler calls are timed, if anywhere
+        LatencyHistogram* volatile handlerLatency;
+        HandlerProfiler* volatile profiler;
+        HandlerProfiler* profileOwner;        // Where gone handlers and devices are dropped from, on or off
+
+        // Where devices are written down as they're attached, if anywhere. Only touched under writeLock.
+        CaptureRecorder* recorder;
+
         std::multimap<std::string, RexHandler*> kHandlerRexMap;
         std::multimap<std::string, RexHandler*> mHandlerRexMap;
 
-        RexHandler* getKeyboardHandler(std::string regex, KeyboardHandler* handler);
-        RexHandler* getMouseHandler(std::string regex, MouseHandler* handler);
+        // Handlers that asked for the events of devices we don't know (yet), on the chains of entry 0.
+        // They have no pattern. Under writeLock.
+        std::vector<RexHandler*> kDefaultHandlers;
+        std::vector<RexHandler*> mDefaultHandlers;
+
+        // Every pattern a handler is registered with, keyboard or mouse, in one automaton, so that a new
+        // device is matched against all of them in a single pass over its name. Under writeLock.
+        TRexSetpp* devicePatterns;
+        std::map<std::string, int> patternIds;
+        int nextPatternId;
+        std::vector<int> matchedIds;
+        std::vector<char> patternMatched;
+
+        RexHandler* getKeyboardHandler(std::string regex, KeyboardHandler* handler, bool observer);
+        RexHandler* getMouseHandler(std::string regex, MouseHandler* handler, bool observer);
+
+        unsigned int findDeviceIndex(HANDLE device) const;
+        unsigned int recordIndex(const EventRecord& rec);
+
+        // Writing a new table. All with writeLock held.
+        void beginRoutes();
+        void abandonRoutes();
+        void detachDevice(unsigned int index);
+        void forgetDevice(unsigned int index);
+        void releaseIndex(unsigned int index);
+        unsigned int publishRoutes();
+        KeyboardEventChain* writableChain(KeyboardEventChain** chains, KeyboardEventChain** published, unsigned int index);
+        MouseEventChain* writableChain(MouseEventChain** chains, MouseEventChain** published, unsigned int index);
+        void reclaimRoutes(unsigned int upTo);
+        void freeRetired(RetiredRoutes* old);
+
+        // Wait until nobody else can be reading a table older than the current one. A handler that calls
+        // this (by unregistering something) doesn't wait for other handlers doing the same thing.
+        void waitForReaders();
 
-        KeyboardInfo* unknownKeyboardDevice(HANDLE device);
-        MouseInfo* unknownMouseDevice(HANDLE device);
+        // Start finding out about a device, if that's not already happening. Cheap, and never waits.
+        void unknownDevice(unsigned int index, HANDLE device, bool mouse);
 
-        void newKeyboardDevice(KeyboardInfo* info);
-        void newMouseDevice(MouseInfo* info);
+        bool rescanDevices(bool trustCache);
+        void queueCacheRefresh();
+        void saveDeviceCache();
+        bool matchDevice(RexHandler* rh, const std::string& name) const;
+        int usePattern(const std::string& regex);
+        void releasePattern(const std::string& regex);
+        void matchPatterns(const std::string& name);
+        bool cachedMatches(const std::string& name);
+
+        void newKeyboardDevice(unsigned int index, KeyboardInfo* info);
+        void newMouseDevice(unsigned int index, MouseInfo* info);
         void newKeyboardHandler(RexHandler* keHandler);
         void newMouseHandler(RexHandler* meHandler);
+        void addToKeyboardChain(unsigned int index, RexHandler* keHandler);
+        void addToMouseChain(unsigned int index, RexHandler* meHandler);
+
+        void observeKeyboardRun(const RoutingTable* table, EventRecord* records, unsigned int count, ObserverScratch& scratch);
+        void observeMouseRun(const RoutingTable* table, EventRecord* records, unsigned int count, ObserverScratch& scratch);
 
         void cleanupMouseHandlerMap();
         void cleanupKeyboardHandlerMap();
-        void cleanupMouseEventChainMap();
-        void cleanupKeyboardEventChainMap();
-        void cleanupMouseDeviceMap();
-        void cleanupKeyboardDeviceMap();
 
-        void scanDevices();
+        // Not copyable
+        EventDispatcher(const EventDispatcher&);
+        EventDispatcher& operator=(const EventDispatcher&);
 
     public:
         EventDispatcher();
         ~EventDispatcher();
 
+        // The number for a device, handing out a new one if it hasn't got one. 0 if they've run out.
+        // Cheap, and safe from any thread.
+        unsigned int deviceIndex(HANDLE device);
+
         void handleKeyboard(KeyboardEvent& evt);
         void handleMouseButton(MouseButtonEvent& evt);
         void handleMouseWheel(MouseWheelEvent& evt);
         void handleMouseMove(MouseMoveEvent& evt);
 
+        // Hand a batch of decided events to the observers. Safe from several observer threads at once, as
+        // long as each brings its own scratch space.
+        void observeBatch(EventRecord* records, unsigned int count, ObserverScratch& scratch);
+        bool hasKeyboardObservers() const;
+        bool hasMouseObservers() const;
+
+        // Time every handler call (but not observers) into these, or stop if they're NULL
+        void setHandlerLatency(LatencyHistogram* histogram);
+        void setHandlerProfiler(HandlerProfiler* profiler, bool enabled);
+
+        // Write every device down in this capture log as it's attached (plugged in, looked up or found by a
+        // scan), or stop if it's NULL. Once this returns the old one isn't being written to.
+        void setRecorder(CaptureRecorder* recorder);
+
         std::vector<KeyboardInfo> enumerateKeyboards();
         std::vector<MouseInfo> enumerateMice();
 
-        void registerKeyboardHandler(std::string idRegex, KeyboardHandler* handler);
-        void resgisterMouseHandler(std::string idRegex, MouseHandler* handler);
+        // What we know about right now, without looking again
+        std::vector<KeyboardInfo> knownKeyboards();
+        std::vector<MouseInfo> knownMice();
+
+        // Look at the Windows device list again: new devices are hooked up to any handlers that want them,
+        // and devices that have gone are dropped. Events being dispatched meanwhile aren't held up.
+        void scanDevices();
+
+        // Where to remember devices between runs; empty for nowhere. With a cache from earlier in this boot,
+        // scanning names the devices it knows from there straight away, and checks with Windows afterwards
+        // in the background.
+        void setDeviceCache(const std::string& path);
+
+        // Devices that only a backend knows about. Scanning leaves these alone.
+        void addKeyboardDevice(HANDLE device, const std::string& name);
+        void addMouseDevice(HANDLE device, const std::string& name);
+
+        void registerKeyboardHandler(std::string idRegex, KeyboardHandler* handler, bool observeOnly = false);
+        void resgisterMouseHandler(std::string idRegex, MouseHandler* handler, bool observeOnly = false);
+        void registerDefaultKeyboardHandler(KeyboardHandler* handler, bool observeOnly = false);
+        void registerDefaultMouseHandler(MouseHandler* handler, bool observeOnly = false);
+        // Once these return, the handler won't be called again from any other thread
         void unregisterKeyboardHandler(KeyboardHandler* handler);
         void unregisterMouseHandler(MouseHandler* handler);
+
+        // Internal use only
+        void _LookupDevice(DeviceLookup* lookup);
+        void _RefreshDeviceCache();
     };
 }
@@ -31,152 +31,480 @@
 
 #include "stdafx.hpp"
 #include "event_queue.hpp"
-#include "scoped_mutex.hpp"
+#include "kaptivate_exceptions.hpp"
 
 using namespace Kaptivate;
 
-// http://www.tidytutorials.com/2009/10/windows-c-producer-consumer-threaded.html
-// http://msdn.microsoft.com/en-us/library/ms687025(v=VS.85).aspx
-// http://dev-faqs.blogspot.com/2011/03/revisiting-producer-and-consumer.html
+// Each queue has exactly one producer and one consumer, so each lane is a single-producer /
+// single-consumer ring. The producer only signals the consumer when it has actually gone to sleep; a burst
+// of keystrokes costs one wakeup, not one per key.
 
-EventQueue::EventQueue()
+// Records are copied in and out of the rings, so keep them small enough that a handful share a cache line
+static_assert(sizeof(EventRecord) <= 64, "EventRecord should fit in a single cache line");
+
+// How many times a blocked producer yields before it starts sleeping
+#define BLOCK_YIELD_COUNT 64
+
+// How many times the consumer looks at an empty lane before parking. The raw event usually trails the
+// hook by a few microseconds, so this is enough to catch most of them without a trip through the kernel.
+#define DEFAULT_SPIN_COUNT 2000
+
+EventQueue::EventQueue(unsigned int capacity)
 {
-    this->kbdEventSignal = CreateEvent(NULL, TRUE, FALSE, NULL);
-    this->kbdStopSignal = CreateEvent(NULL, TRUE, FALSE, NULL);
-    this->kbdHandles[0] = this->kbdEventSignal;
-    this->kbdHandles[1] = this->kbdStopSignal;
+    this->stopped = 1;
+    if(NULL == (this->stopSignal = CreateEvent(NULL, TRUE, FALSE, NULL)))
+        throw KaptivateException("Unable to create the event queue stop signal");
 
-    this->mouseEventSignal = CreateEvent(NULL, TRUE, FALSE, NULL);
-    this->mouseStopSignal = CreateEvent(NULL, TRUE, FALSE, NULL);
-    this->mouseHandles[0] = this->mouseEventSignal;
-    this->mouseHandles[1] = this->mouseStopSignal;
+    kbdLane.ring = NULL;
+    mouseLane.ring = NULL;
+    initLane(kbdLane, capacity, OVERFLOW_DROP_NEWEST);
+    initLane(mouseLane, capacity, OVERFLOW_COALESCE);
 
-    this->stopped = true;
+    // Spinning is pointless if the producer can't run at the same time
+    SYSTEM_INFO sysInfo;
+    GetSystemInfo(&sysInfo);
+    this->spinCount = (sysInfo.dwNumberOfProcessors > 1) ? DEFAULT_SPIN_COUNT : 0;
 
-    InitializeCriticalSection(&mouseQueueLock);
-    InitializeCriticalSection(&kbdQueueLock);
+    LARGE_INTEGER freq;
+    QueryPerformanceFrequency(&freq);
+    this->ticksPerMs = freq.QuadPart / 1000;
+    if(this->ticksPerMs == 0)
+        this->ticksPerMs = 1;
 }
 
 EventQueue::~EventQueue()
 {
     stop();
 
-    CloseHandle(this->kbdEventSignal);
-    CloseHandle(this->kbdStopSignal);
-    CloseHandle(this->mouseEventSignal);
-    CloseHandle(this->mouseStopSignal);
+    delete kbdLane.ring;
+    kbdLane.ring = NULL;
+    delete mouseLane.ring;
+    mouseLane.ring = NULL;
 
-    this->kbdHandles[0] = 0;
-    this->kbdHandles[1] = 0;
-    this->mouseHandles[0] = 0;
-    this->mouseHandles[1] = 0;
+    CloseHandle(this->stopSignal);
+    this->stopSignal = 0;
+}
 
-    DeleteCriticalSection(&mouseQueueLock);
-    DeleteCriticalSection(&kbdQueueLock);
+// (Re)build a lane's ring. The policies that let the consumer trim need room past the limit to work with.
+void EventQueue::initLane(EventLane& lane, unsigned int capacity, OverflowPolicy policy)
+{
+    if(capacity == 0)
+        throw KaptivateException("An event queue needs room for at least one event");
+
+    unsigned int ringSize = capacity;
+    if(policy == OVERFLOW_DROP_OLDEST || policy == OVERFLOW_COALESCE)
+        ringSize = capacity * 2;
+
+    SpscRing<EventRecord>* ring = new SpscRing<EventRecord>(ringSize);
+    delete lane.ring;
+    lane.ring = ring;
+    lane.limit = capacity;
+    lane.policy = policy;
+    resetLane(lane);
 }
 
+// Throw away anything left in a lane and zero its counters
+void EventQueue::resetLane(EventLane& lane)
+{
+    EventRecord rec;
+    while(lane.ring->pop(rec))
+        ;
+
+    lane.droppedNewest = 0;
+    lane.blocked = 0;
+    lane.highWater = 0;
+    lane.droppedOldest = 0;
+    lane.coalesced = 0;
+}
+
+QueueStats EventQueue::laneStats(const EventLane& lane) const
+{
+    QueueStats stats;
+    stats.capacity = lane.limit;
+    stats.policy = lane.policy;
+    stats.depth = lane.ring->size();
+    if(stats.depth > lane.limit)
+        stats.depth = lane.limit; // The rest is about to be trimmed
+    stats.highWater = lane.highWater;
+    stats.dropped = lane.droppedNewest + lane.droppedOldest;
+    stats.coalesced = lane.coalesced;
+    stats.blocked = lane.blocked;
+    return stats;
+}
+
+// Must not be called while the producer or consumer threads are running
 void EventQueue::start()
 {
-    ScopedCriticalSection crit1(&mouseQueueLock);
-    ScopedCriticalSection crit2(&kbdQueueLock);
-    stopped = false;
+    // Throw away anything left over from the last run
+    resetLane(kbdLane);
+    resetLane(mouseLane);
+
+    ResetEvent(stopSignal);
+    InterlockedExchange(&stopped, 0);
 }
 
 void EventQueue::stop()
 {
-    ScopedCriticalSection crit1(&mouseQueueLock);
-    ScopedCriticalSection crit2(&kbdQueueLock);
-
-    if(stopped)
+    if(1 == InterlockedExchange(&stopped, 1))
         return;
 
-    stopped = true;
-
-    SetEvent(mouseStopSignal);
-    SetEvent(kbdStopSignal);
+    SetEvent(stopSignal);
 }
 
 bool EventQueue::running()
 {
-    ScopedCriticalSection crit1(&mouseQueueLock);
-    ScopedCriticalSection crit2(&kbdQueueLock);
-    return !stopped;
+    return stopped == 0;
 }
 
-void EventQueue::EnqueueKeyboardEvent(KeyboardEvent* kbdEvent)
+void EventQueue::setKeyboardLimit(unsigned int capacity, OverflowPolicy policy)
 {
-    ScopedCriticalSection crit(&kbdQueueLock);
-    if(stopped)
-        return;
-    kbEventQueue.push(kbdEvent);
-    SetEvent(kbdEventSignal);
+    if(running())
+        throw KaptivateException("Queue limits can't be changed while the queue is running");
+    initLane(kbdLane, capacity, policy);
+}
+
+void EventQueue::setMouseLimit(unsigned int capacity, OverflowPolicy policy)
+{
+    if(running())
+        throw KaptivateException("Queue limits can't be changed while the queue is running");
+    initLane(mouseLane, capacity, policy);
+}
+
+void EventQueue::setSpinCount(unsigned int spins)
+{
+    spinCount = spins;
+}
+
+QueueStats EventQueue::getKeyboardStats() const
+{
+    return laneStats(kbdLane);
 }
 
-KeyboardEvent* EventQueue::DequeueKeyboardEvent()
+QueueStats EventQueue::getMouseStats() const
+{
+    return laneStats(mouseLane);
+}
+
+// Copy a record into a lane without waking anyone
+bool EventQueue::store(EventLane& lane, const EventRecord& rec)
 {
-    ScopedCriticalSection crit(&kbdQueueLock);
     if(stopped)
-        return NULL;
+        return false;
 
-    while(kbEventQueue.empty() && !stopped)
+    if(lane.policy == OVERFLOW_BLOCK)
     {
+        // Wait for the consumer to make room, yielding at first and then sleeping
+        if(!lane.ring->push(rec, lane.limit))
         {
-            ScopedNonCriticalSection uncrit(&kbdQueueLock);
-            if((DWORD)kbdEventSignal != WaitForMultipleObjects(2, kbdHandles, FALSE, INFINITE))
-                return NULL;
+            lane.blocked++;
+
+            // The consumer may not have been told about what's already in there yet
+            parker.unpark();
+
+            unsigned int tries = 0;
+            while(!lane.ring->push(rec, lane.limit))
+            {
+                if(stopped)
+                    return false;
+                if(tries++ < BLOCK_YIELD_COUNT)
+                    SwitchToThread();
+                else
+                    Sleep(1);
+            }
+        }
+    }
+    else if(lane.policy == OVERFLOW_DROP_NEWEST)
+    {
+        if(!lane.ring->push(rec, lane.limit))
+        {
+            lane.droppedNewest++;
+            return false;
+        }
+    }
+    else
+    {
+        // The consumer trims anything past the limit. If even the spare room is gone, this one has to go.
+        if(!lane.ring->push(rec))
+        {
+            lane.droppedNewest++;
+            return false;
         }
     }
 
-    KeyboardEvent* evt = kbEventQueue.front();
-    kbEventQueue.pop();
-    return evt;
+    return true;
 }
 
-void EventQueue::EnqueueMouseButtonEvent(MouseButtonEvent* mbEvent)
+// Copy a record into a lane and wake the consumer if it's asleep
+bool EventQueue::enqueue(EventLane& lane, const EventRecord& rec)
 {
-    ScopedCriticalSection crit(&mouseQueueLock);
-    if(stopped)
+    if(!store(lane, rec))
+        return false;
+
+    parker.unpark();
+    return true;
+}
+
+// Copy several records into a lane, and only then wake the consumer
+unsigned int EventQueue::enqueueBatch(EventLane& lane, const EventRecord* records, unsigned int count)
+{
+    unsigned int stored = 0;
+    for(unsigned int i = 0; i < count; i++)
+    {
+        if(store(lane, records[i]))
+            stored++;
+    }
+
+    if(stored > 0)
+        parker.unpark();
+    return stored;
+}
+
+// Can next be folded into rec? Only relative moves and wheel turns in the same direction from the same
+// device can, and only while the sample count has room.
+static bool canMerge(const EventRecord& rec, const EventRecord& next)
+{
+    if(next.device != rec.device || next.type != rec.type || next.decision != rec.decision ||
+       next.flags != rec.flags || rec.samples >= 0xFFFF - next.samples)
+        return false;
+
+    if(rec.type == MOUSE_MOVE_EVENT)
+        return !rec.data.move.absolute && !next.data.move.absolute;
+    if(rec.type == MOUSE_WHEEL_EVENT)
+        return rec.data.wheel.horizontal == next.data.wheel.horizontal;
+    return false;
+}
+
+// Add the deltas from rec into later. The merged record keeps the later one's sequence number and timestamp
+// (and enqueue stamp) as a pair, since it isn't complete until its last sample arrives.
+static void mergeInto(EventRecord& later, const EventRecord& rec)
+{
+    if(rec.type == MOUSE_MOVE_EVENT)
+    {
+        later.data.move.dx += rec.data.move.dx;
+        later.data.move.dy += rec.data.move.dy;
+    }
+    else
+    {
+        later.data.wheel.delta += rec.data.wheel.delta;
+    }
+
+    later.samples = (unsigned short)(later.samples + rec.samples);
+}
+
+// Consumer side. Keep track of the high water mark, and if the producer has gone past the limit, get rid
+// of the oldest records until we're back under it.
+void EventQueue::trim(EventLane& lane)
+{
+    unsigned int waiting = lane.ring->available();
+    if(waiting > lane.highWater)
+        lane.highWater = (waiting > lane.limit) ? lane.limit : waiting;
+    if(waiting <= lane.limit)
         return;
-    mbEventQueue.push(mbEvent);
-    SetEvent(mouseEventSignal);
+
+    for(unsigned int excess = waiting - lane.limit; excess > 0; excess--)
+    {
+        EventRecord* oldest = lane.ring->peek(0);
+        EventRecord* next = lane.ring->peek(1);
+
+        if(lane.policy == OVERFLOW_COALESCE && next != NULL && canMerge(*oldest, *next))
+        {
+            // Nothing is lost, the movement just shows up a little later
+            mergeInto(*next, *oldest);
+            lane.coalesced++;
+        }
+        else
+        {
+            lane.droppedOldest++;
+        }
+
+        lane.ring->dropFront();
+    }
 }
 
-MouseButtonEvent* EventQueue::DequeueMouseButtonEvent()
+// Turn a timeout into an absolute QueryPerformanceCounter deadline. 0 means no deadline.
+LONGLONG EventQueue::deadlineFor(DWORD timeoutMs) const
 {
-    ScopedCriticalSection crit(&mouseQueueLock);
+    if(timeoutMs == INFINITE)
+        return 0;
 
-    if(stopped)
-        return NULL;
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    return now.QuadPart + (LONGLONG)timeoutMs * ticksPerMs;
+}
+
+// How long until the deadline, rounded up so that we never wake early and have to go around again
+DWORD EventQueue::remainingMs(LONGLONG deadline) const
+{
+    if(deadline == 0)
+        return INFINITE;
 
-    while(mbEventQueue.empty() && !stopped)
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    if(now.QuadPart >= deadline)
+        return 0;
+    return (DWORD)((deadline - now.QuadPart + ticksPerMs - 1) / ticksPerMs);
+}
+
+// Is there anything waiting in a lane (in either lane if lane is NULL)?
+bool EventQueue::hasRecords(EventLane* lane)
+{
+    if(lane != NULL)
+        return lane->ring->available() > 0;
+    return kbdLane.ring->available() > 0 || mouseLane.ring->available() > 0;
+}
+
+// Wait until there's something in a lane (either lane if lane is NULL). Spin for a little while first, then
+// park. Returns false if the deadline passed or the queue was stopped with nothing there.
+bool EventQueue::waitForRecords(EventLane* lane, LONGLONG deadline)
+{
+    for(unsigned int i = 0; i < spinCount && !stopped; i++)
+    {
+        if(hasRecords(lane))
+            return true;
+        YieldProcessor();
+    }
+
+    while(!stopped)
     {
+        // Tell the producer we're going to sleep, then look one more time in case something slipped in
+        // before it could see that.
+        parker.prepare();
+        if(hasRecords(lane))
         {
-            ScopedNonCriticalSection uncrit(&mouseQueueLock);
-            if((DWORD)mouseEventSignal != WaitForMultipleObjects(2, mouseHandles, FALSE, INFINITE))
-                return NULL;
+            parker.cancel();
+            return true;
         }
+
+        // A wakeup may have been for the other lane, so go around again until the time is up
+        DWORD res = parker.park(stopSignal, remainingMs(deadline));
+        if(res == WAIT_TIMEOUT)
+            return hasRecords(lane);
+        if(res != WAIT_OBJECT_0)
+            return false;
+        if(hasRecords(lane))
+            return true;
     }
 
-    MouseButtonEvent* evt = mbEventQueue.front();
-    mbEventQueue.pop();
+    return false;
+}
+
+// Pop the next record from a lane, waiting up to timeoutMs if there isn't one yet. Returns false if the
+// time ran out or the queue has been stopped.
+bool EventQueue::dequeue(EventLane& lane, EventRecord& rec, DWORD timeoutMs)
+{
+    LONGLONG deadline = 0;
+    while(!stopped)
+    {
+        trim(lane);
+        if(lane.ring->pop(rec))
+            return true;
+
+        // Only look at the clock once we know we'll have to wait
+        if(deadline == 0)
+            deadline = deadlineFor(timeoutMs);
+
+        if(!waitForRecords(&lane, deadline))
+            return false;
+    }
 
-    return evt;
+    return false;
 }
 
-void EventQueue::EnqueueMouseWheelEvent(MouseWheelEvent* mwEvent)
+// Fold any mergeable records waiting right behind rec into it. This only ever happens when the consumer
+// is behind, so it costs nothing when it's keeping up.
+void EventQueue::coalesce(EventLane& lane, EventRecord& rec)
 {
+    if(rec.type != MOUSE_MOVE_EVENT && rec.type != MOUSE_WHEEL_EVENT)
+        return;
+
+    EventRecord* next;
+    while(NULL != (next = lane.ring->peek(0)) && canMerge(rec, *next))
+    {
+        // The merged event is the newest one, see mergeInto
+        EventRecord merged = *next;
+        mergeInto(merged, rec);
+        rec = merged;
+        lane.ring->dropFront();
+    }
+}
+
+// Pop whatever is waiting in one lane, or in both if lane is NULL
+unsigned int EventQueue::popAvailable(EventLane* lane, EventRecord* out, unsigned int maxCount)
+{
+    if(lane != NULL)
+    {
+        trim(*lane);
+        return lane->ring->popBatch(out, maxCount);
+    }
+
+    trim(kbdLane);
+    trim(mouseLane);
+    unsigned int count = kbdLane.ring->popBatch(out, maxCount);
+    return count + mouseLane.ring->popBatch(out + count, maxCount - count);
+}
+
+// Pop everything that's waiting, sleeping until the timeout runs out if nothing is
+unsigned int EventQueue::dequeueBatch(EventLane* lane, EventRecord* out, unsigned int maxCount, DWORD timeoutMs)
+{
+    if(maxCount == 0)
+        return 0;
+
+    unsigned int count = popAvailable(lane, out, maxCount);
+    if(count > 0 || stopped || timeoutMs == 0)
+        return count;
+
+    // Waiting for a batch isn't a timeout worth counting, batch consumers just go idle
+    if(!waitForRecords(lane, deadlineFor(timeoutMs)))
+        return 0;
+
+    return popAvailable(lane, out, maxCount);
+}
+
+bool EventQueue::EnqueueKeyboardEvent(const EventRecord& rec)
+{
+    return enqueue(kbdLane, rec);
+}
+
+bool EventQueue::EnqueueMouseEvent(const EventRecord& rec)
+{
+    return enqueue(mouseLane, rec);
+}
+
+unsigned int EventQueue::EnqueueKeyboardBatch(const EventRecord* records, unsigned int count)
+{
+    return enqueueBatch(kbdLane, records, count);
+}
+
+unsigned int EventQueue::EnqueueMouseBatch(const EventRecord* records, unsigned int count)
+{
+    return enqueueBatch(mouseLane, records, count);
+}
+
+bool EventQueue::DequeueKeyboardEvent(EventRecord& rec, DWORD timeoutMs)
+{
+    return dequeue(kbdLane, rec, timeoutMs);
+}
+
+bool EventQueue::DequeueMouseEvent(EventRecord& rec, DWORD timeoutMs)
+{
+    if(!dequeue(mouseLane, rec, timeoutMs))
+        return false;
+
+    coalesce(mouseLane, rec);
+    return true;
 }
 
-MouseWheelEvent* EventQueue::DequeueMouseWheelEvent()
+unsigned int EventQueue::DequeueKeyboardBatch(EventRecord* out, unsigned int maxCount, DWORD timeoutMs)
 {
-    return NULL;
+    return dequeueBatch(&kbdLane, out, maxCount, timeoutMs);
 }
 
-void EventQueue::EnqueueMouseMoveEvent(MouseMoveEvent* mmEvent)
+unsigned int EventQueue::DequeueMouseBatch(EventRecord* out, unsigned int maxCount, DWORD timeoutMs)
 {
+    return dequeueBatch(&mouseLane, out, maxCount, timeoutMs);
 }
 
-MouseMoveEvent* EventQueue::DequeueMouseMoveEvent()
+unsigned int EventQueue::DequeueBatch(EventRecord* out, unsigned int maxCount, DWORD timeoutMs)
 {
-    return NULL;
+    return dequeueBatch(NULL, out, maxCount, timeoutMs);
 }
@@ -31,57 +31,132 @@
 
 #pragma once
 
-#include <queue>
+#include "kaptivate.hpp"
+#include "spsc_ring.hpp"
+#include "parker.hpp"
 
 namespace Kaptivate
 {
-    class KeyboardEvent;
-    class MouseButtonEvent;
-    class MouseWheelEvent;
-    class MouseMoveEvent;
+    // One lane of an EventQueue: a ring, the limit it's held to, and what happens past that limit
+    struct EventLane
+    {
+        SpscRing<EventRecord>* ring;
+        unsigned int limit;
+        OverflowPolicy policy;
+
+        // Written by the producer
+        volatile unsigned int droppedNewest;
+        volatile unsigned int blocked;
+
+        // Written by the consumer
+        volatile unsigned int highWater;
+        volatile unsigned int droppedOldest;
+        volatile unsigned int coalesced;
+    };
 
+    // Hands events from one producer thread to one consumer thread. Enqueueing and dequeueing never take
+    // a lock; the consumer only touches the kernel when it has run out of events and has to wait for more.
+    //
+    // Events are stored by value as EventRecords, so nothing is allocated per event. There is one lane for
+    // keyboard events and one for mouse events; button, wheel and move events share the mouse lane in the
+    // order they arrived, which is the order the mouse hook will ask about them. Both lanes belong to the
+    // same consumer thread, so they share one parker: a consumer waiting on either lane is woken by both.
+    //
+    // Each lane holds at most a fixed number of events. What happens beyond that is up to the lane's
+    // OverflowPolicy. Dropping the oldest events and coalescing can't be done by the producer without
+    // stepping on the consumer, so for those the ring has room for twice the limit and the consumer trims
+    // the excess before it takes anything.
+    //
+    // KaptivateAPI uses one queue to hand raw events to the hook thread, and a second to hand decided
+    // events from the hook thread to each of the observer threads.
     class EventQueue
     {
     private:
         // Start / stop
-        bool stopped;
-
-        // Queues
-        std::queue<KeyboardEvent*> kbEventQueue;
-        std::queue<MouseButtonEvent*> mbEventQueue;
-        std::queue<MouseWheelEvent*> mwEventQueue;
-        std::queue<MouseMoveEvent*> mmEventQueue;
-
-        // Events
-        HANDLE mouseStopSignal;
-        HANDLE mouseEventSignal;
-        HANDLE kbdStopSignal;
-        HANDLE kbdEventSignal;
-        HANDLE mouseHandles[2];
-        HANDLE kbdHandles[2];
-
-        // Locks
-        CRITICAL_SECTION mouseQueueLock;
-        CRITICAL_SECTION kbdQueueLock;
+        volatile LONG stopped;
+        HANDLE stopSignal;
+
+        // Lanes
+        EventLane kbdLane;
+        EventLane mouseLane;
+
+        // Sleeping consumer
+        ConsumerParker parker;
+        unsigned int spinCount;
+
+        // For turning timeouts into QueryPerformanceCounter deadlines
+        LONGLONG ticksPerMs;
+
+        void initLane(EventLane& lane, unsigned int capacity, OverflowPolicy policy);
+        void resetLane(EventLane& lane);
+        QueueStats laneStats(const EventLane& lane) const;
+
+        LONGLONG deadlineFor(DWORD timeoutMs) const;
+        DWORD remainingMs(LONGLONG deadline) const;
+        bool hasRecords(EventLane* lane);
+        bool waitForRecords(EventLane* lane, LONGLONG deadline);
+
+        bool store(EventLane& lane, const EventRecord& rec);
+        bool enqueue(EventLane& lane, const EventRecord& rec);
+        unsigned int enqueueBatch(EventLane& lane, const EventRecord* records, unsigned int count);
+        bool dequeue(EventLane& lane, EventRecord& rec, DWORD timeoutMs);
+        unsigned int dequeueBatch(EventLane* lane, EventRecord* out, unsigned int maxCount, DWORD timeoutMs);
+        unsigned int popAvailable(EventLane* lane, EventRecord* out, unsigned int maxCount);
+        void trim(EventLane& lane);
+        void coalesce(EventLane& lane, EventRecord& rec);
+
+        // Not copyable
+        EventQueue(const EventQueue&);
+        EventQueue& operator=(const EventQueue&);
 
     public:
-        EventQueue();
+        EventQueue(unsigned int capacity = 1024);
         ~EventQueue();
 
         void start();
         void stop();
         bool running();
 
-        void EnqueueKeyboardEvent(KeyboardEvent* kbdEvent);
-        KeyboardEvent* DequeueKeyboardEvent();
+        // Change a lane's limit and overflow policy. Throws if the queue is running.
+        void setKeyboardLimit(unsigned int capacity, OverflowPolicy policy);
+        void setMouseLimit(unsigned int capacity, OverflowPolicy policy);
+
+        // Safe from any thread, but only a snapshot
+        QueueStats getKeyboardStats() const;
+        QueueStats getMouseStats() const;
+
+        // How many times an empty-handed consumer checks again before going to sleep. Defaults to 0 on
+        // single processor machines, where spinning only keeps the producer from running.
+        void setSpinCount(unsigned int spins);
+
+        // The record is copied into the queue as is. Returns false if it was thrown away instead
+        // (stopped, or full and the policy says to drop it).
+        bool EnqueueKeyboardEvent(const EventRecord& rec);
+        bool EnqueueMouseEvent(const EventRecord& rec);
+
+        // Same, for several records at once. The consumer is only woken once, after all of them are in.
+        // Returns how many were kept.
+        unsigned int EnqueueKeyboardBatch(const EventRecord* records, unsigned int count);
+        unsigned int EnqueueMouseBatch(const EventRecord* records, unsigned int count);
+
+        // Wait up to timeoutMs for the next record, spinning briefly before going to sleep. Returns false
+        // if the time ran out (which is counted in the lane's stats) or the queue has been stopped.
+        bool DequeueKeyboardEvent(EventRecord& rec, DWORD timeoutMs = INFINITE);
 
-        void EnqueueMouseButtonEvent(MouseButtonEvent* mbEvent);
-        MouseButtonEvent* DequeueMouseButtonEvent();
+        // Same, except that if the consumer has fallen behind, relative moves (or wheel turns) from the same
+        // device that are queued back to back come out as a single record. The deltas are added up and
+        // the record's sample count says how many raw events went into it. It keeps the sequence number
+        // and timestamp of the newest of them.
+        bool DequeueMouseEvent(EventRecord& rec, DWORD timeoutMs = INFINITE);
 
-        void EnqueueMouseWheelEvent(MouseWheelEvent* mwEvent);
-        MouseWheelEvent* DequeueMouseWheelEvent();
+        // Copy out everything that is already waiting, up to maxCount records, in one go. Only waits (up
+        // to timeoutMs, which may be 0 or INFINITE) if nothing is waiting at all. Returns the number of
+        // records copied, which is 0 on timeout or once the queue has been stopped.
+        unsigned int DequeueKeyboardBatch(EventRecord* out, unsigned int maxCount, DWORD timeoutMs);
+        unsigned int DequeueMouseBatch(EventRecord* out, unsigned int maxCount, DWORD timeoutMs);
 
-        void EnqueueMouseMoveEvent(MouseMoveEvent* mmEvent);
-        MouseMoveEvent* DequeueMouseMoveEvent();
+        // Same, but from both lanes: keyboard records first, then mouse records. Records from different
+        // lanes can be put back in arrival order with their sequence numbers.
+        unsigned int DequeueBatch(EventRecord* out, unsigned int maxCount, DWORD timeoutMs);
     };
 }
@@ -0,0 +1,106 @@
+/*
+ * flight_log.hpp
+ * This file is a part of Kaptivate
+ * https://github.com/FunkyTownEnterprises/Kaptivate
+ *
+ * Copyright (c) 2011 Ben Cable, Chris Eberle
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include "kaptivate.hpp"
+
+// What the flight recorder dumps, and what kaptivate_flight reads.
+//
+// A FlightDumpHeader, then for each ring a FlightRingHeader followed by its entries, oldest first.
+// Timestamps are QueryPerformanceCounter ticks at the frequency given in the header.
+
+#define FLIGHT_DUMP_MAGIC   "KAPFLT\r\n"
+#define FLIGHT_DUMP_VERSION 1
+
+namespace Kaptivate
+{
+    // One ring per thread that records. The control ring is shared by everything else.
+    enum FlightRingId
+    {
+        FLIGHT_RING_RAW = 0,
+        FLIGHT_RING_HOOK = 1,
+        FLIGHT_RING_CONTROL = 2,
+        FLIGHT_RINGS = 3
+    };
+
+    enum FlightKind
+    {
+        FLIGHT_RAW = 1,               // Raw event queued. value = vkey | scanCode << 16, or the button flags
+        FLIGHT_ASKED = 2,             // Hook called. value = vkey | scanCode << 16 for keys; flags = key up
+        FLIGHT_DECIDED = 3,           // Hook answered. value = microseconds since it was called
+        FLIGHT_TIMEOUT = 4,           // Hook gave up on its raw event. value = microseconds waited
+        FLIGHT_SLOW = 5,              // A decision took longer than the threshold. value = microseconds
+        FLIGHT_HOOK_DEAD = 6,         // The backend stopped answering (the hooks time out and go quiet)
+        FLIGHT_DUMP = 7               // A dump was asked for. value = FlightDumpReason
+    };
+
+    enum FlightDumpReason
+    {
+        FLIGHT_DUMP_REQUESTED = 1,
+        FLIGHT_DUMP_TIMEOUT = 2,
+        FLIGHT_DUMP_SLOW = 3,
+        FLIGHT_DUMP_HOOK_DEAD = 4
+    };
+
+#pragma pack(push, 1)
+
+    struct FlightEntry
+    {
+        LONGLONG timestamp;
+        ULONGLONG device;
+        unsigned int sequence;
+        unsigned int value;
+        unsigned char kind;           // FlightKind
+        unsigned char type;           // EventType, or 0
+        unsigned char decision;       // Decision, or 0
+        unsigned char flags;
+        unsigned int thread;          // Id of the thread that wrote it
+    };
+
+    struct FlightDumpHeader
+    {
+        char magic[8];
+        unsigned int version;
+        unsigned int reason;          // FlightDumpReason
+        LONGLONG ticksPerSecond;
+        LONGLONG dumpTicks;
+        unsigned int rings;
+    };
+
+    struct FlightRingHeader
+    {
+        unsigned int ring;            // FlightRingId
+        unsigned int count;
+    };
+
+#pragma pack(pop)
+}
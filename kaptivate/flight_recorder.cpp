@@ -0,0 +1,386 @@
+/*
+ * flight_recorder.cpp
+ * This file is a part of Kaptivate
+ * https://github.com/FunkyTownEnterprises/Kaptivate
+ *
+ * Copyright (c) 2011 Ben Cable, Chris Eberle
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "stdafx.hpp"
+#include "flight_recorder.hpp"
+#include "scoped_mutex.hpp"
+#include "kaptivate_exceptions.hpp"
+
+#include <stdio.h>
+#include <string.h>
+
+using namespace std;
+using namespace Kaptivate;
+
+// How long an automatic dump waits before copying the rings, so that what happened next makes it in too
+#define FLIGHT_DUMP_DELAY_MS 100
+
+// At most one automatic dump this often, so a stuck handler doesn't fill the disk
+#define FLIGHT_DUMP_INTERVAL_MS 5000
+
+// How often the backend is checked on
+#define FLIGHT_WATCH_MS 250
+
+static LONGLONG now()
+{
+    LARGE_INTEGER li;
+    QueryPerformanceCounter(&li);
+    return li.QuadPart;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// FlightRing
+
+void FlightRing::copy(vector<FlightEntry>& out) const
+{
+    unsigned int n = loadAcquire(&written);
+    unsigned int count = (n < FLIGHT_RING_SIZE) ? n : FLIGHT_RING_SIZE;
+
+    out.clear();
+    out.reserve(count);
+    for(unsigned int i = n - count; i != n; i++)
+    {
+        unsigned int slot = i & (FLIGHT_RING_SIZE - 1);
+        if(loadAcquire(&stamps[slot]) != i + 1)
+            continue;
+
+        FlightEntry entry = entries[slot];
+
+        // The copy has to be finished before the stamp is looked at again
+        MemoryBarrier();
+        if(stamps[slot] == i + 1)
+            out.push_back(entry);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Creation / destruction
+
+FlightRecorder::FlightRecorder()
+{
+    rings = new FlightRing[FLIGHT_RINGS];
+    enabled = 0;
+    slowTicks = 0;
+    dumpCount = 0;
+    lastDump = 0;
+    pendingReason = 0;
+    watched = NULL;
+    watchedAlive = true;
+    thread = 0;
+    stopping = 0;
+    wake = CreateEvent(NULL, FALSE, FALSE, NULL);
+    InitializeCriticalSection(&dumpLock);
+    InitializeCriticalSection(&watchLock);
+
+    LARGE_INTEGER freq;
+    QueryPerformanceFrequency(&freq);
+    ticksPerUs = (double)freq.QuadPart / 1000000.0;
+}
+
+FlightRecorder::~FlightRecorder()
+{
+    stopThread();
+    CloseHandle(wake);
+    DeleteCriticalSection(&watchLock);
+    DeleteCriticalSection(&dumpLock);
+    delete [] rings;
+    rings = NULL;
+}
+
+static DWORD WINAPI FlightWatcherLoop(LPVOID iValue)
+{
+    ((FlightRecorder*)iValue)->_RunWatcher();
+    return 0;
+}
+
+void FlightRecorder::stopThread()
+{
+    if(thread == 0)
+        return;
+
+    InterlockedExchange(&stopping, 1);
+    SetEvent(wake);
+    WaitForSingleObject(thread, INFINITE);
+    CloseHandle(thread);
+    thread = 0;
+}
+
+void FlightRecorder::configure(bool enabled, const string& dumpPrefix, DWORD slowMs)
+{
+    stopThread();
+
+    {
+        ScopedCriticalSection dMutex(&dumpLock);
+        this->dumpPrefix = dumpPrefix;
+        this->slowTicks = (LONGLONG)(slowMs * 1000.0 * ticksPerUs);
+        this->pendingReason = 0;
+    }
+    InterlockedExchange(&this->enabled, enabled ? 1 : 0);
+
+    if(!enabled)
+        return;
+
+    stopping = 0;
+    DWORD threadId = 0;
+    if(NULL == (thread = CreateThread(NULL, 0, FlightWatcherLoop, this, 0, &threadId)))
+    {
+        thread = 0;
+        InterlockedExchange(&this->enabled, 0);
+        throw KaptivateException("Failed to create the flight recorder thread");
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Recording
+
+void FlightRecorder::note(FlightRingId ring, FlightKind kind, LONGLONG timestamp, unsigned int value)
+{
+    FlightEntry entry;
+    memset(&entry, 0, sizeof(FlightEntry));
+    entry.timestamp = timestamp;
+    entry.sequence = 0xffffffff;
+    entry.value = value;
+    entry.kind = (unsigned char)kind;
+    entry.thread = GetCurrentThreadId();
+
+    if(ring == FLIGHT_RING_CONTROL)
+        rings[ring].recordShared(entry);
+    else
+        rings[ring].record(entry);
+}
+
+void FlightRecorder::raw(const EventRecord& rec)
+{
+    FlightEntry entry;
+    memset(&entry, 0, sizeof(FlightEntry));
+    entry.timestamp = rec.timestamp;
+    entry.device = (ULONGLONG)(UINT_PTR)rec.device;
+    entry.sequence = rec.sequence;
+    entry.kind = FLIGHT_RAW;
+    entry.type = rec.type;
+    entry.decision = rec.decision;
+    entry.thread = GetCurrentThreadId();
+
+    if(rec.type == KEYBOARD_EVENT)
+    {
+        entry.value = rec.data.keyboard.vkey | (rec.data.keyboard.scanCode << 16);
+        entry.flags = rec.data.keyboard.keyUp ? 1 : 0;
+    }
+    else if(rec.type == MOUSE_BUTTON_EVENT)
+    {
+        entry.value = rec.data.button.buttonFlags;
+    }
+
+    rings[FLIGHT_RING_RAW].record(entry);
+}
+
+void FlightRecorder::asked(LONGLONG when, unsigned char type, unsigned int value, bool keyUp)
+{
+    FlightEntry entry;
+    memset(&entry, 0, sizeof(FlightEntry));
+    entry.timestamp = when;
+    entry.sequence = 0xffffffff;
+    entry.value = value;
+    entry.kind = FLIGHT_ASKED;
+    entry.type = type;
+    entry.flags = keyUp ? 1 : 0;
+    entry.thread = GetCurrentThreadId();
+    rings[FLIGHT_RING_HOOK].record(entry);
+}
+
+void FlightRecorder::decided(LONGLONG asked, const EventRecord& rec, Decision decision)
+{
+    LONGLONG t = now();
+
+    FlightEntry entry;
+    memset(&entry, 0, sizeof(FlightEntry));
+    entry.timestamp = t;
+    entry.device = (ULONGLONG)(UINT_PTR)rec.device;
+    entry.sequence = rec.sequence;
+    entry.value = (unsigned int)((t - asked) / ticksPerUs);
+    entry.kind = FLIGHT_DECIDED;
+    entry.type = rec.type;
+    entry.decision = (unsigned char)decision;
+    entry.thread = GetCurrentThreadId();
+    rings[FLIGHT_RING_HOOK].record(entry);
+
+    if(slowTicks > 0 && t - asked > slowTicks)
+    {
+        note(FLIGHT_RING_HOOK, FLIGHT_SLOW, t, entry.value);
+        trigger(FLIGHT_DUMP_SLOW);
+    }
+}
+
+void FlightRecorder::timedOut(LONGLONG asked, unsigned char type, Decision decision)
+{
+    LONGLONG t = now();
+
+    FlightEntry entry;
+    memset(&entry, 0, sizeof(FlightEntry));
+    entry.timestamp = t;
+    entry.sequence = 0xffffffff;
+    entry.value = (unsigned int)((t - asked) / ticksPerUs);
+    entry.kind = FLIGHT_TIMEOUT;
+    entry.type = type;
+    entry.decision = (unsigned char)decision;
+    entry.thread = GetCurrentThreadId();
+    rings[FLIGHT_RING_HOOK].record(entry);
+
+    // Plenty of mouse messages have no raw event behind them, so only a keyboard one is worth a dump
+    if(type == KEYBOARD_EVENT)
+        trigger(FLIGHT_DUMP_TIMEOUT);
+}
+
+// The first reason wins until the dump has been written
+void FlightRecorder::trigger(FlightDumpReason reason)
+{
+    if(0 == InterlockedCompareExchange(&pendingReason, reason, 0))
+        SetEvent(wake);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Dumping
+
+static void writeAll(HANDLE file, const void* data, DWORD size)
+{
+    DWORD written = 0;
+    if(size > 0 && (!WriteFile(file, data, size, &written, NULL) || written != size))
+        throw KaptivateException("Unable to write the flight recorder dump");
+}
+
+void FlightRecorder::dump(const string& path, FlightDumpReason reason)
+{
+    ScopedCriticalSection dMutex(&dumpLock);
+
+    note(FLIGHT_RING_CONTROL, FLIGHT_DUMP, now(), reason);
+
+    // Copy everything first, so the rings are written over as little as possible while we're at it
+    vector<FlightEntry> copies[FLIGHT_RINGS];
+    for(int i = 0; i < FLIGHT_RINGS; i++)
+        rings[i].copy(copies[i]);
+
+    HANDLE file = CreateFileA(path.c_str(), GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS,
+                              FILE_ATTRIBUTE_NORMAL, NULL);
+    if(file == INVALID_HANDLE_VALUE)
+        throw KaptivateException("Unable to create the flight recorder dump");
+
+    try
+    {
+        LARGE_INTEGER freq;
+        QueryPerformanceFrequency(&freq);
+
+        FlightDumpHeader header;
+        memcpy(header.magic, FLIGHT_DUMP_MAGIC, sizeof(header.magic));
+        header.version = FLIGHT_DUMP_VERSION;
+        header.reason = reason;
+        header.ticksPerSecond = freq.QuadPart;
+        header.dumpTicks = now();
+        header.rings = FLIGHT_RINGS;
+        writeAll(file, &header, sizeof(header));
+
+        for(int i = 0; i < FLIGHT_RINGS; i++)
+        {
+            FlightRingHeader ring;
+            ring.ring = i;
+            ring.count = (unsigned int)copies[i].size();
+            writeAll(file, &ring, sizeof(ring));
+            if(ring.count > 0)
+                writeAll(file, &copies[i][0], ring.count * sizeof(FlightEntry));
+        }
+    }
+    catch(...)
+    {
+        CloseHandle(file);
+        throw;
+    }
+
+    CloseHandle(file);
+}
+
+void FlightRecorder::watch(InputBackend* backend)
+{
+    ScopedCriticalSection wMutex(&watchLock);
+    watched = backend;
+    watchedAlive = true;
+}
+
+// Wake up every so often to check on the backend, or when someone wants a dump
+void FlightRecorder::_RunWatcher()
+{
+    while(true)
+    {
+        WaitForSingleObject(wake, FLIGHT_WATCH_MS);
+        if(stopping)
+            break;
+
+        {
+            ScopedCriticalSection wMutex(&watchLock);
+            if(watched != NULL && watchedAlive && !watched->isAlive())
+            {
+                watchedAlive = false;
+                note(FLIGHT_RING_CONTROL, FLIGHT_HOOK_DEAD, now(), 0);
+                trigger(FLIGHT_DUMP_HOOK_DEAD);
+            }
+        }
+
+        LONG reason = pendingReason;
+        if(reason == 0)
+            continue;
+
+        string path;
+        {
+            ScopedCriticalSection dMutex(&dumpLock);
+            DWORD tick = GetTickCount();
+            if(!dumpPrefix.empty() && (dumpCount == 0 || tick - lastDump >= FLIGHT_DUMP_INTERVAL_MS))
+            {
+                char suffix[32];
+                sprintf_s(suffix, sizeof(suffix), "-%03u.kfr", ++dumpCount);
+                path = dumpPrefix + suffix;
+                lastDump = tick;
+            }
+        }
+
+        if(!path.empty())
+        {
+            Sleep(FLIGHT_DUMP_DELAY_MS);
+            try
+            {
+                dump(path, (FlightDumpReason)reason);
+            }
+            catch(...)
+            {
+                // Nowhere to report it from here; the next one may have better luck
+            }
+        }
+
+        InterlockedExchange(&pendingReason, 0);
+    }
+}
@@ -0,0 +1,157 @@
+/*
+ * flight_recorder.hpp
+ * This file is a part of Kaptivate
+ * https://github.com/FunkyTownEnterprises/Kaptivate
+ *
+ * Copyright (c) 2011 Ben Cable, Chris Eberle
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include "kaptivate.hpp"
+#include "flight_log.hpp"
+#include "atomic_ops.hpp"
+
+#include <string>
+#include <vector>
+
+// Entries kept per ring. A power of two.
+#define FLIGHT_RING_SIZE 8192
+
+namespace Kaptivate
+{
+    // A fixed-size ring that's written over and over and only read when dumped. Writing takes no locks and
+    // never waits for anything.
+    //
+    // Each slot has a stamp: 0 while it's being written, then one more than the number of the entry in it.
+    // A reader only keeps an entry whose stamp is right both before and after copying it, so it never sees
+    // one that's half written or being written over.
+    class FlightRing
+    {
+    private:
+        FlightEntry entries[FLIGHT_RING_SIZE];
+        volatile unsigned int stamps[FLIGHT_RING_SIZE];
+        volatile unsigned int written;
+
+        void put(unsigned int n, const FlightEntry& entry)
+        {
+            unsigned int slot = n & (FLIGHT_RING_SIZE - 1);
+            InterlockedExchange((volatile LONG*)&stamps[slot], 0);
+            entries[slot] = entry;
+            storeRelease(&stamps[slot], n + 1);
+        }
+
+    public:
+        FlightRing() : written(0)
+        {
+            for(unsigned int i = 0; i < FLIGHT_RING_SIZE; i++)
+                stamps[i] = 0;
+        }
+
+        // Only one thread may write this way
+        void record(const FlightEntry& entry)
+        {
+            unsigned int n = written;
+            put(n, entry);
+            storeRelease(&written, n + 1);
+        }
+
+        // Any number of threads
+        void recordShared(const FlightEntry& entry)
+        {
+            unsigned int n = (unsigned int)InterlockedIncrement((volatile LONG*)&written) - 1;
+            put(n, entry);
+        }
+
+        // Oldest first. The writers carry on meanwhile, so entries that are still being written, or that
+        // have already been written over by newer ones, are left out.
+        void copy(std::vector<FlightEntry>& out) const;
+    };
+
+    // Keeps the recent history of every event in memory, and writes it out when asked, or when something
+    // looks wrong. A thread of its own does the writing (and watches the backend), so nothing on the raw
+    // or hook threads ever waits for the disk.
+    class FlightRecorder
+    {
+    private:
+        FlightRing* rings;
+        volatile LONG enabled;
+        double ticksPerUs;
+        LONGLONG slowTicks;
+
+        // Automatic dumps
+        CRITICAL_SECTION dumpLock;
+        std::string dumpPrefix;
+        unsigned int dumpCount;
+        DWORD lastDump;
+        volatile LONG pendingReason;
+
+        // The backend being watched, if any
+        CRITICAL_SECTION watchLock;
+        InputBackend* watched;
+        bool watchedAlive;
+
+        HANDLE thread;
+        HANDLE wake;
+        volatile LONG stopping;
+
+        void stopThread();
+        void note(FlightRingId ring, FlightKind kind, LONGLONG timestamp, unsigned int value);
+
+        // Not copyable
+        FlightRecorder(const FlightRecorder&);
+        FlightRecorder& operator=(const FlightRecorder&);
+
+    public:
+        FlightRecorder();
+        ~FlightRecorder();
+
+        bool isEnabled() const { return enabled != 0; }
+
+        // An empty prefix means no automatic dumps. slowMs of 0 means no threshold.
+        void configure(bool enabled, const std::string& dumpPrefix, DWORD slowMs);
+
+        // Raw thread
+        void raw(const EventRecord& rec);
+
+        // Hook thread
+        void asked(LONGLONG when, unsigned char type, unsigned int value, bool keyUp);
+        void decided(LONGLONG asked, const EventRecord& rec, Decision decision);
+        void timedOut(LONGLONG asked, unsigned char type, Decision decision);
+
+        // Ask for an automatic dump. Cheap, any thread.
+        void trigger(FlightDumpReason reason);
+
+        // Write everything out now. Throws if the file can't be written.
+        void dump(const std::string& path, FlightDumpReason reason);
+
+        // Keep an eye on a backend (or stop, with NULL), and dump if it stops answering
+        void watch(InputBackend* backend);
+
+        // Dump / watch thread
+        void _RunWatcher();
+    };
+}
@@ -0,0 +1,317 @@
+/*
+ * handler_profiler.cpp
+ * This file is a part of Kaptivate
+ * https://github.com/FunkyTownEnterprises/Kaptivate
+ *
+ * Copyright (c) 2011 Ben Cable, Chris Eberle
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "stdafx.hpp"
+#include "handler_profiler.hpp"
+#include "scoped_mutex.hpp"
+#include "kaptivate_exceptions.hpp"
+
+#include <string.h>
+
+using namespace std;
+using namespace Kaptivate;
+
+// Where a (handler, device) pair's search through the slots starts
+static inline unsigned int profileHash(void* handler, HANDLE device)
+{
+    UINT_PTR h = (UINT_PTR)handler ^ ((UINT_PTR)device * 31);
+    return ((unsigned int)h * 2654435761u) >> 20;
+}
+
+HandlerProfiler::HandlerProfiler()
+{
+    InitializeCriticalSection(&lock);
+    enabled = 0;
+    listener = NULL;
+    intervalMs = 1000;
+    listenerThread = 0;
+    listenerStop = CreateEvent(NULL, TRUE, FALSE, NULL);
+    memset(slots, 0, sizeof(slots));
+    slotCount = 0;
+    unprofiled = 0;
+
+    LARGE_INTEGER freq;
+    QueryPerformanceFrequency(&freq);
+    ticksPerUs = (double)freq.QuadPart / 1000000.0;
+}
+
+HandlerProfiler::~HandlerProfiler()
+{
+    stopListener();
+    CloseHandle(listenerStop);
+
+    map<pair<void*, HANDLE>, HandlerProfile*>::iterator it;
+    for(it = profiles.begin(); it != profiles.end(); it++)
+        delete (*it).second;
+    profiles.clear();
+
+    for(size_t i = 0; i < spare.size(); i++)
+        delete spare[i];
+    spare.clear();
+
+    DeleteCriticalSection(&lock);
+}
+
+HandlerProfile* HandlerProfiler::find(void* handler, HANDLE device) const
+{
+    unsigned int slot = profileHash(handler, device);
+    for(unsigned int probes = 0; probes < PROFILE_HASH_SIZE; probes++, slot++)
+    {
+        const ProfileSlot& ps = slots[slot & (PROFILE_HASH_SIZE - 1)];
+        HandlerProfile* p = ps.profile;
+        if(p == NULL)
+            return NULL;
+        if(p != PROFILE_SLOT_FREED && ps.handler == handler && ps.device == device)
+            return p;
+    }
+    return NULL;
+}
+
+// Only the first call for a handler on a device takes the lock. Once there are too many profiles, the rest
+// don't take it at all.
+HandlerProfile* HandlerProfiler::profile(void* handler, HANDLE device, bool keyboard)
+{
+    HandlerProfile* found = find(handler, device);
+    if(found != NULL)
+        return found;
+
+    if(slotCount >= PROFILE_SLOT_LIMIT)
+    {
+        InterlockedIncrement(&unprofiled);
+        return NULL;
+    }
+
+    ScopedCriticalSection mutex(&lock);
+
+    // Somebody might have just beaten us to it. If not, the first freed slot along the way will do.
+    ProfileSlot* free = NULL;
+    unsigned int slot = profileHash(handler, device);
+    for(unsigned int probes = 0; probes < PROFILE_HASH_SIZE; probes++, slot++)
+    {
+        ProfileSlot& ps = slots[slot & (PROFILE_HASH_SIZE - 1)];
+        if(ps.profile == NULL || ps.profile == PROFILE_SLOT_FREED)
+        {
+            if(free == NULL)
+                free = &ps;
+            if(ps.profile == NULL)
+                break;
+        }
+        else if(ps.handler == handler && ps.device == device)
+            return ps.profile;
+    }
+
+    if(free == NULL || slotCount >= PROFILE_SLOT_LIMIT)
+    {
+        InterlockedIncrement(&unprofiled);
+        return NULL;
+    }
+
+    HandlerProfile* p;
+    if(!spare.empty())
+    {
+        p = spare.back();
+        spare.pop_back();
+    }
+    else
+    {
+        p = new HandlerProfile();
+        p->busy = 0;
+    }
+
+    {
+        ScopedProfile busy(p);
+        p->handler = handler;
+        p->device = device;
+        p->keyboard = keyboard;
+        p->calls = 0;
+        p->totalTicks = 0;
+        p->maxTicks = 0;
+        p->cycles = 0;
+        p->latency.reset();
+    }
+    profiles[pair<void*, HANDLE>(handler, device)] = p;
+
+    free->handler = handler;
+    free->device = device;
+    MemoryBarrier();
+    free->profile = p;
+    slotCount++;
+
+    return p;
+}
+
+// Take a profile out of the slots and keep it for the next one. With the lock held.
+void HandlerProfiler::drop(HandlerProfile* p)
+{
+    unsigned int slot = profileHash(p->handler, p->device);
+    for(unsigned int probes = 0; probes < PROFILE_HASH_SIZE; probes++, slot++)
+    {
+        ProfileSlot& ps = slots[slot & (PROFILE_HASH_SIZE - 1)];
+        if(ps.profile == NULL)
+            break;
+        if(ps.profile == p)
+        {
+            ps.profile = PROFILE_SLOT_FREED;
+            slotCount--;
+            break;
+        }
+    }
+    spare.push_back(p);
+}
+
+void HandlerProfiler::forgetHandler(void* handler)
+{
+    ScopedCriticalSection mutex(&lock);
+
+    map<pair<void*, HANDLE>, HandlerProfile*>::iterator it = profiles.lower_bound(pair<void*, HANDLE>(handler, (HANDLE)0));
+    while(it != profiles.end() && (*it).first.first == handler)
+    {
+        drop((*it).second);
+        profiles.erase(it++);
+    }
+}
+
+void HandlerProfiler::forgetDevice(HANDLE device)
+{
+    ScopedCriticalSection mutex(&lock);
+
+    map<pair<void*, HANDLE>, HandlerProfile*>::iterator it = profiles.begin();
+    while(it != profiles.end())
+    {
+        if((*it).first.second != device)
+        {
+            it++;
+            continue;
+        }
+
+        drop((*it).second);
+        profiles.erase(it++);
+    }
+}
+
+// Zero everything, but keep the profiles themselves, since the slots point at them
+void HandlerProfiler::reset()
+{
+    ScopedCriticalSection mutex(&lock);
+    InterlockedExchange(&unprofiled, 0);
+
+    map<pair<void*, HANDLE>, HandlerProfile*>::iterator it;
+    for(it = profiles.begin(); it != profiles.end(); it++)
+    {
+        HandlerProfile* p = (*it).second;
+        ScopedProfile busy(p);
+        p->calls = 0;
+        p->totalTicks = 0;
+        p->maxTicks = 0;
+        p->cycles = 0;
+        p->latency.reset();
+    }
+}
+
+// Each profile is read in one piece, but they're not all from the same moment
+vector<HandlerStats> HandlerProfiler::snapshot()
+{
+    ScopedCriticalSection mutex(&lock);
+
+    vector<HandlerStats> result;
+    map<pair<void*, HANDLE>, HandlerProfile*>::iterator it;
+    for(it = profiles.begin(); it != profiles.end(); it++)
+    {
+        HandlerProfile* p = (*it).second;
+        ScopedProfile busy(p);
+        if(p->calls == 0)
+            continue;
+
+        HandlerStats stats;
+        stats.handler = p->handler;
+        stats.keyboard = p->keyboard;
+        stats.device = p->device;
+        stats.calls = p->calls;
+        stats.totalUs = p->totalTicks / ticksPerUs;
+        stats.meanUs = stats.totalUs / stats.calls;
+        stats.p99Us = p->latency.summarize(ticksPerUs).p99Us;
+        stats.maxUs = p->maxTicks / ticksPerUs;
+        stats.cpuCycles = p->cycles;
+        result.push_back(stats);
+    }
+
+    return result;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Listener
+
+static DWORD WINAPI ProfileListenerLoop(LPVOID iValue)
+{
+    ((HandlerProfiler*)iValue)->_RunListener();
+    return 0;
+}
+
+void HandlerProfiler::_RunListener()
+{
+    while(WAIT_TIMEOUT == WaitForSingleObject(listenerStop, intervalMs))
+    {
+        vector<HandlerStats> stats = snapshot();
+        listener->HandleStats(stats);
+    }
+}
+
+void HandlerProfiler::stopListener()
+{
+    if(listenerThread == 0)
+        return;
+
+    SetEvent(listenerStop);
+    WaitForSingleObject(listenerThread, INFINITE);
+    CloseHandle(listenerThread);
+    listenerThread = 0;
+    ResetEvent(listenerStop);
+}
+
+// Swap the listener. Once this returns the old one won't be called again.
+void HandlerProfiler::setListener(HandlerStatsListener* listener, DWORD intervalMs)
+{
+    stopListener();
+
+    this->listener = listener;
+    this->intervalMs = (intervalMs == 0) ? 1 : intervalMs;
+
+    if(listener == NULL)
+        return;
+
+    DWORD threadId = 0;
+    if(NULL == (listenerThread = CreateThread(NULL, 0, ProfileListenerLoop, this, 0, &threadId)))
+    {
+        listenerThread = 0;
+        this->listener = NULL;
+        throw KaptivateException("Failed to create the handler profile thread");
+    }
+}
@@ -0,0 +1,160 @@
+/*
+ * handler_profiler.hpp
+ * This file is a part of Kaptivate
+ * https://github.com/FunkyTownEnterprises/Kaptivate
+ *
+ * Copyright (c) 2011 Ben Cable, Chris Eberle
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include "kaptivate.hpp"
+#include "latency_tracer.hpp"
+
+#include <map>
+#include <utility>
+#include <vector>
+
+// How many profiles there can be at once. Past that, calls for a new handler and device go unprofiled, and
+// are just counted.
+#define PROFILE_SLOT_LIMIT 2048
+
+// Slots in the (handler, device) -> profile table. A power of two, at least twice the limit.
+#define PROFILE_HASH_SIZE 4096
+
+// The profile of a slot whose profile has been dropped. Lookups carry on past it; a new profile can have it.
+#define PROFILE_SLOT_FREED ((HandlerProfile*)1)
+
+namespace Kaptivate
+{
+    // Everything known about one handler on one device. Dispatch takes no locks, so a device's chain can
+    // be running on the hook thread and the raw thread (with speculative dispatch) at once, and the profiler
+    // reads and resets profiles from other threads. Everyone holds a ScopedProfile while touching the numbers.
+    struct HandlerProfile
+    {
+        void* handler;
+        HANDLE device;
+        bool keyboard;
+        volatile LONG busy;
+
+        unsigned int calls;
+        LONGLONG totalTicks;
+        LONGLONG maxTicks;
+        ULONGLONG cycles;
+        LatencyHistogram latency;
+    };
+
+    // Holds a profile while its numbers are changed or read. Two threads almost never want the same one at
+    // once, so this just spins.
+    class ScopedProfile
+    {
+    private:
+        HandlerProfile* profile;
+
+    public:
+        ScopedProfile(HandlerProfile* profile) : profile(profile)
+        {
+            while(InterlockedCompareExchange(&profile->busy, 1, 0) != 0)
+                YieldProcessor();
+        }
+
+        ~ScopedProfile()
+        {
+            InterlockedExchange(&profile->busy, 0);
+        }
+    };
+
+    // One entry in the (handler, device) -> profile table. A NULL profile means the slot has never been
+    // used.
+    struct ProfileSlot
+    {
+        void* handler;
+        HANDLE device;
+        HandlerProfile* volatile profile;
+    };
+
+    // Owns every HandlerProfile, and the thread that hands snapshots to a listener. Profiles are never
+    // freed before the profiler itself: a dropped one is kept for the next new one instead, since dispatch
+    // may have only just found it. The worst that can do is charge one call to the wrong handler.
+    class HandlerProfiler
+    {
+    private:
+        CRITICAL_SECTION lock;
+        std::map<std::pair<void*, HANDLE>, HandlerProfile*> profiles;
+        std::vector<HandlerProfile*> spare;
+
+        // Slots are never emptied, only marked freed, and the profile is written last, so they can be looked
+        // through without the lock
+        ProfileSlot slots[PROFILE_HASH_SIZE];
+        volatile unsigned int slotCount;
+        volatile LONG unprofiled;
+        volatile LONG enabled;
+        double ticksPerUs;
+
+        // Only changed while the listener thread isn't running
+        HandlerStatsListener* listener;
+        DWORD intervalMs;
+        HANDLE listenerThread;
+        HANDLE listenerStop;
+
+        void stopListener();
+        void drop(HandlerProfile* p);
+
+        // Not copyable
+        HandlerProfiler(const HandlerProfiler&);
+        HandlerProfiler& operator=(const HandlerProfiler&);
+
+    public:
+        HandlerProfiler();
+        ~HandlerProfiler();
+
+        bool isEnabled() const { return enabled != 0; }
+        void setEnabled(bool on) { InterlockedExchange(&enabled, on ? 1 : 0); }
+
+        // Find the profile for a handler on a device without taking any lock. NULL if there isn't one yet.
+        HandlerProfile* find(void* handler, HANDLE device) const;
+
+        // Find the profile for a handler on a device, making it if need be, which takes a lock. NULL (and
+        // counted) if there are too many already.
+        HandlerProfile* profile(void* handler, HANDLE device, bool keyboard);
+
+        // Drop the profiles of a handler that's been unregistered, or of a device that's gone. Only once
+        // dispatch can't call that handler or see that device any more, or it would just make them again.
+        void forgetHandler(void* handler);
+        void forgetDevice(HANDLE device);
+
+        // Calls that weren't profiled because there were too many profiles
+        unsigned int getUnprofiled() const { return (unsigned int)unprofiled; }
+
+        void reset();
+        std::vector<HandlerStats> snapshot();
+
+        void setListener(HandlerStatsListener* listener, DWORD intervalMs);
+
+        // Listener thread
+        void _RunListener();
+    };
+}
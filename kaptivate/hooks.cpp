@@ -72,8 +72,9 @@ static LRESULT CALLBACK keyboardEvent(int nCode, WPARAM wParam, LPARAM lParam)
     // Fun little tidbit: since this function is executed in a seperate memory space by a different
     // thread, it's impossible to debug this particular function (well, there's always file IO)
 
-    // Should we even try?
-    if(nCode < 0 || _paused == 1 || _callbackHwnd == 0 || _kbHookAlive == 0 || _initialized == 0 || _keyboardMsg == 0)
+    // Should we even try? HC_NOREMOVE means someone is only peeking; we'll hear about the same
+    // keystroke again with HC_ACTION when it's actually removed from the queue.
+    if(nCode != HC_ACTION || _paused == 1 || _callbackHwnd == 0 || _kbHookAlive == 0 || _initialized == 0 || _keyboardMsg == 0)
     {
         return CallNextHookEx(_keyboardHook, nCode, wParam, lParam);
     }
@@ -110,8 +111,8 @@ static LRESULT CALLBACK mouseEvent(int nCode, WPARAM wParam, LPARAM lParam)
     // Fun little tidbit: since this function is executed in a seperate memory space by a different
     // thread, it's impossible to debug this particular function (well, there's always file IO)
 
-    // Derp
-    if(nCode < 0 || _paused == 1 || _callbackHwnd == 0 || _mouseHookAlive == 0 || _initialized == 0 || _mouseMsg == 0)
+    // Derp (and see above about HC_NOREMOVE)
+    if(nCode != HC_ACTION || _paused == 1 || _callbackHwnd == 0 || _mouseHookAlive == 0 || _initialized == 0 || _mouseMsg == 0)
     {
         return CallNextHookEx(_mouseHook, nCode, wParam, lParam);
     }
@@ -230,3 +231,16 @@ int kaptivateHookUnpause()
 
     return -1;
 }
+
+// Whether the hooks are still asking for decisions. A hook that once timed out gives up for good
+// (until it's set up again), so this is how anyone finds out about it.
+int kaptivateHookAlive()
+{
+    if(!_initialized)
+        return 0;
+    if(_keyboardHook && !_kbHookAlive)
+        return 0;
+    if(_mouseHook && !_mouseHookAlive)
+        return 0;
+    return 1;
+}
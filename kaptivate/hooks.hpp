@@ -36,3 +36,5 @@ int kaptivateHookUninit();
 
 int kaptivateHookPause();
 int kaptivateHookUnpause();
+
+int kaptivateHookAlive();
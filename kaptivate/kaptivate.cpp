@@ -29,27 +29,24 @@
  * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
-/*
- * Quick overview:
- * - Raw input API - tells us which device sent us a keyboard / mouse event
- * - Keyboard hook API - lets us decide whether or not other apps see a key / mouse event
- * - Goal - decide which events we want to let through while KNOWING where they came from
- * 
- * Problems to overcome:
- *    1. Neither API can be easily used with the other
- *    2. There is NO GUARANTEED ORDER for which API will generate an event first
- */
-
 #include "stdafx.hpp"
 #include "kaptivate.hpp"
 #include "kaptivate_exceptions.hpp"
-#include "hooks.hpp"
 #include "event_dispatcher.hpp"
 #include "event_queue.hpp"
+#include "key_correlator.hpp"
+#include "mouse_correlator.hpp"
+#include "observer_pool.hpp"
+#include "win32_backend.hpp"
+#include "capture_recorder.hpp"
+#include "latency_tracer.hpp"
+#include "handler_profiler.hpp"
+#include "flight_recorder.hpp"
 #include "scoped_mutex.hpp"
 
 #include <iostream>
 #include <assert.h>
+#include <string.h>
 
 using namespace std;
 using namespace Kaptivate;
@@ -57,28 +54,14 @@ using namespace Kaptivate;
 ////////////////////////////////////////////////////////////////////////////////
 // defines
 
-#define MOUSE_MESSAGE    (WM_USER + 1011)
-#define KEYBOARD_MESSAGE (WM_USER + 1012)
-#define PING_MESSAGE     (WM_USER + 1013)
-#define QUIT_MESSAGE     (WM_USER + 1014)
+// How long before the hook's own timeout we stop waiting for a raw event and answer anyway. If the hook
+// times out it stops asking us altogether, so this needs to leave room for the reply to get back.
+#define HOOK_MARGIN_MS 100
 
 ////////////////////////////////////////////////////////////////////////////////
 // Static and extern data
 
-extern HMODULE kaptivateDllModule;
 extern HANDLE kaptivateMutex;
-static KaptivateAPI* _localInstance = NULL;
-
-////////////////////////////////////////////////////////////////////////////////
-// Data passed from startCapture to the main event loop
-
-typedef struct _kapMsgLoopParams
-{
-    HWND callbackWindow;
-    HANDLE msgEvent;
-    bool success;
-} kapMsgLoopParams;
-
 
 ////////////////////////////////////////////////////////////////////////////////
 // Creation / destruction
@@ -91,18 +74,27 @@ KaptivateAPI::KaptivateAPI()
 {
     running = false;
     suspended = false;
-    rawKeyboardRunning = false;
-    rawMouseRunning = false;
-    userWantsMouse = false;
-    userWantsKeyboard = false;
+    hookWaitMs = INFINITE;
+    defaultDecision = PERMIT;
+    speculativeDispatch = false;
 
     dispatcher = new EventDispatcher();
     events = new EventQueue();
-
-    hookCallbackWindow = 0;
-    rawCallbackWindow = 0;
-    hookMsgLoopThread = 0;
-    rawMsgLoopThread = 0;
+    correlator = new KeyCorrelator();
+    mouseCorrelator = new MouseCorrelator();
+    observers = new ObserverPool(dispatcher);
+    recorder = new CaptureRecorder();
+    recording = false;
+    tracer = new LatencyTracer();
+    profiler = new HandlerProfiler();
+    dispatcher->setHandlerProfiler(profiler, false);
+    flight = new FlightRecorder();
+    rawSequence = 0;
+    devicesPending = 0;
+    deviceScans = 0;
+
+    defaultBackend = new Win32Backend();
+    backend = defaultBackend;
 }
 
 // Destructor
@@ -110,12 +102,37 @@ KaptivateAPI::~KaptivateAPI()
 {
     if(isRunning())
         stopCapture();
+    waitForDeviceScans();
+
+    delete observers;
+    observers = NULL;
+
+    delete defaultBackend;
+    defaultBackend = NULL;
+    backend = NULL;
 
     delete dispatcher;
     dispatcher = NULL;
 
     delete events;
     events = NULL;
+
+    delete correlator;
+    correlator = NULL;
+    delete mouseCorrelator;
+    mouseCorrelator = NULL;
+
+    delete recorder;
+    recorder = NULL;
+
+    delete tracer;
+    tracer = NULL;
+
+    delete flight;
+    flight = NULL;
+
+    delete profiler;
+    profiler = NULL;
 }
 
 // Get an instance of this thing
@@ -129,7 +146,6 @@ KaptivateAPI* KaptivateAPI::getInstance()
         {
             if(NULL == (singleton = new KaptivateAPI()))
                 throw bad_alloc();
-            _localInstance = singleton;
         }
     }
     catch(bad_alloc&)
@@ -146,7 +162,6 @@ void KaptivateAPI::destroyInstance()
     ScopedLock lock(kaptivateMutex);
     if(singleton != NULL)
     {
-        _localInstance = NULL;
         delete singleton;
         singleton = NULL;
     }
@@ -156,290 +171,335 @@ void KaptivateAPI::destroyInstance()
 ////////////////////////////////////////////////////////////////////////////////
 // Event processing
 
-// Translate a raw keyboard event and stuff it into the queue
-void KaptivateAPI::ProcessRawKeyboardInput(RAWINPUT* raw)
+// A raw keyboard event has come in from the backend. Number it (and its device) and stuff it into the queue.
+void KaptivateAPI::pushRawKeyboard(EventRecord& rec)
 {
-    bool keyUp = false;
-    if((raw->data.keyboard.Flags & RI_KEY_BREAK) == RI_KEY_BREAK)
-        keyUp = true;
-    else if((raw->data.keyboard.Flags & RI_KEY_MAKE) != RI_KEY_MAKE)
-        return;
+    rec.sequence = rawSequence++;
+    rec.deviceIndex = (unsigned short)dispatcher->deviceIndex(rec.device);
+    if(recording)
+        recorder->raw(rec);
+    if(flight->isEnabled())
+        flight->raw(rec);
 
-    HANDLE device = raw->header.hDevice;
-    unsigned int vkey = raw->data.keyboard.VKey;
-    unsigned int scanCode = raw->data.keyboard.MakeCode;
-    unsigned int message = raw->data.keyboard.Message;
+    // Decide it now, while the hook (if it's even been called yet) isn't waiting on us
+    if(speculativeDispatch)
+    {
+        KeyboardEvent evt(rec);
+        dispatcher->handleKeyboard(evt);
+        rec.flags |= EVENT_DISPATCHED;
+    }
+
+    traceEnqueue(&rec, 1);
+    events->EnqueueKeyboardEvent(rec);
+}
 
-    KeyboardEvent* kev = new KeyboardEvent(device, vkey, scanCode, message, keyUp);
-    events->EnqueueKeyboardEvent(kev);
+// Same for a raw mouse event
+void KaptivateAPI::pushRawMouse(EventRecord& rec)
+{
+    rec.sequence = rawSequence++;
+    rec.deviceIndex = (unsigned short)dispatcher->deviceIndex(rec.device);
+    if(recording)
+        recorder->raw(rec);
+    if(flight->isEnabled())
+        flight->raw(rec);
+    traceEnqueue(&rec, 1);
+    events->EnqueueMouseEvent(rec);
 }
 
-// We're being asked to interpret a keyboard hook event. Wait for the raw keyboard event, and ask the user what to
-// do with it. Make a decision, and return it to the hook so that it can prevent other apps from recieving the event
-// (if so desired).
-LRESULT KaptivateAPI::ProcessKeyboardHook(HWND hWnd, WPARAM wParam, LPARAM lParam)
+// A whole batch of raw events. Number them all, then queue each run of keyboard or mouse events at once, so
+// the hook thread is woken once per run instead of once per event.
+void KaptivateAPI::pushRawBatch(EventRecord* records, unsigned int count)
 {
-    unsigned int vkey = (unsigned int)wParam & 255;
-    unsigned int scanCode = (((unsigned int)lParam) >> 16) & 255;
+    for(unsigned int i = 0; i < count; i++)
+    {
+        records[i].sequence = rawSequence++;
+        records[i].deviceIndex = (unsigned short)dispatcher->deviceIndex(records[i].device);
+        if(recording)
+            recorder->raw(records[i]);
+        if(flight->isEnabled())
+            flight->raw(records[i]);
+        if(speculativeDispatch && records[i].type == KEYBOARD_EVENT)
+        {
+            KeyboardEvent evt(records[i]);
+            dispatcher->handleKeyboard(evt);
+            records[i].flags |= EVENT_DISPATCHED;
+        }
+    }
 
-    KeyboardEvent* evt = events->DequeueKeyboardEvent();
-    if(NULL == evt)
-        return 0;
+    traceEnqueue(records, count);
 
-    LRESULT retCode = 0; // 0 means pass along
-    dispatcher->handleKeyboard(*evt);
-    if(evt->getDecision() == CONSUME)
-        retCode = 1; // 1 means consume
+    unsigned int start = 0;
+    while(start < count)
+    {
+        bool keyboard = (records[start].type == KEYBOARD_EVENT);
+        unsigned int end = start + 1;
+        while(end < count && (records[end].type == KEYBOARD_EVENT) == keyboard)
+            end++;
 
-    delete evt;
-    return retCode;
+        if(keyboard)
+            events->EnqueueKeyboardBatch(records + start, end - start);
+        else
+            events->EnqueueMouseBatch(records + start, end - start);
+        start = end;
+    }
 }
 
-// Translate a raw mouse event and stuff it into the queue
-void KaptivateAPI::ProcessRawMouseInput(RAWINPUT* raw)
+// A backend has a keyboard of its own
+void KaptivateAPI::announceKeyboard(HANDLE device, const string& name)
 {
+    dispatcher->addKeyboardDevice(device, name);
 }
 
-// We're being asked to interpret a mouse hook event. Wait for the raw mouse event, and ask the user what to do
-// with it. Make a decision, and return it to the hook so that it can prevent other apps from recieving the
-// event (if so desired).
-LRESULT KaptivateAPI::ProcessMouseHook(HWND hWnd, WPARAM wParam, LPARAM lParam)
+// A backend has a mouse of its own
+void KaptivateAPI::announceMouse(HANDLE device, const string& name)
 {
-    return 0;
+    dispatcher->addMouseDevice(device, name);
 }
 
-// Our window has recieved an event from the raw api. Figure out what it is, and process it if appropriate.
-void KaptivateAPI::ProcessRawInput(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
+// Runs on a pool thread
+static DWORD WINAPI DeviceScanWork(LPVOID param)
 {
-    unsigned int pcbSize = 0;
-    GetRawInputData((HRAWINPUT)lParam, RID_INPUT, NULL, &pcbSize, sizeof(RAWINPUTHEADER));
-    if(pcbSize == 0)
-        return;
+    ((KaptivateAPI*)param)->_ScanDevices();
+    return 0;
+}
 
-    void* buf = malloc(pcbSize);
-    if(buf == NULL)
+// Devices have come or gone. Rescanning means asking Windows about every device, which isn't something the raw
+// thread should be waiting on, so it's done on a pool thread instead. A burst of changes only needs one rescan.
+void KaptivateAPI::devicesChanged()
+{
+    if(InterlockedExchange(&devicesPending, 1) != 0)
         return;
-    if(pcbSize != GetRawInputData((HRAWINPUT)lParam, RID_INPUT, buf, &pcbSize, sizeof(RAWINPUTHEADER)))
-        goto cleanup;
-
-    RAWINPUT* raw = (RAWINPUT*)buf;
-    if(raw->header.dwType == RIM_TYPEMOUSE)
-        ProcessRawMouseInput(raw);
-    else if(raw->header.dwType == RIM_TYPEKEYBOARD)
-        ProcessRawKeyboardInput(raw);
 
-cleanup:
-    free(buf);
-    return;
+    InterlockedIncrement(&deviceScans);
+    if(!QueueUserWorkItem(DeviceScanWork, this, WT_EXECUTEDEFAULT))
+    {
+        InterlockedDecrement(&deviceScans);
+        InterlockedExchange(&devicesPending, 0);
+    }
 }
 
-// The keyboard or mouse hook has been called. This method gets called through some very special magic.
-// Decide what kind of event we're responding to, and call the appropriate handler.
-LRESULT KaptivateAPI::_ProcessHookWndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
+// Bring the handlers up to date with whatever's plugged in now
+void KaptivateAPI::_ScanDevices()
 {
-    if(MOUSE_MESSAGE == message)
-    {
-        if(suspended)
-            return 0;
-        return ProcessMouseHook(hWnd, wParam, lParam);
-    }
-    else if(KEYBOARD_MESSAGE == message)
-    {
-        if(suspended)
-            return 0;
-        return ProcessKeyboardHook(hWnd, wParam, lParam);
-    }
-    else if(PING_MESSAGE == message)
+    // Anything that changes from here on gets a rescan of its own
+    InterlockedExchange(&devicesPending, 0);
+
+    try
     {
-        // Ping / Pong
-        return 1;
+        dispatcher->scanDevices();
     }
-    else if(QUIT_MESSAGE == message)
+    catch(...)
     {
-        PostQuitMessage(0);
+        // Try again next time something changes
     }
 
-    return DefWindowProc(hWnd, message, wParam, lParam);
+    InterlockedDecrement(&deviceScans);
 }
 
-LRESULT KaptivateAPI::_ProcessRawWndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
+// Rescans use the dispatcher, so it has to stay around until they're done
+void KaptivateAPI::waitForDeviceScans()
 {
-    if(WM_INPUT == message)
-    {
-        if(!suspended)
-            ProcessRawInput(hWnd, message, wParam, lParam);
-        return 0;
-    }
-    else if(PING_MESSAGE == message)
-    {
-        // Ping / Pong
-        return 1;
-    }
-    else if(QUIT_MESSAGE == message)
+    while(deviceScans > 0)
+        Sleep(1);
+}
+
+// The backend wants to know what to do with a keystroke. Find the raw keyboard event that goes with it, and ask
+// the user what to do with it.
+Decision KaptivateAPI::decideKeyboard(unsigned int vkey, unsigned int scanCode, bool keyUp)
+{
+    bool tracing = tracer->isEnabled();
+    bool flying = flight->isEnabled();
+    LONGLONG asked = (recording || tracing || flying) ? LatencyTracer::stamp() : 0;
+    if(flying)
+        flight->asked(asked, KEYBOARD_EVENT, vkey | (scanCode << 16), keyUp);
+
+    EventRecord rec;
+    if(!correlator->match(events, vkey, scanCode, keyUp, hookWaitMs, rec))
     {
-        PostQuitMessage(0);
+        Decision decision = timeoutDecision();
+        if(tracing)
+            traceDecision(asked, NULL);
+        if(flying)
+            flight->timedOut(asked, KEYBOARD_EVENT, decision);
+        if(recording)
+            recorder->keyboardDecision(asked, CAPTURE_LOG_NO_SEQUENCE, vkey, scanCode, keyUp, decision);
+        return decision;
     }
 
-    return DefWindowProc(hWnd, message, wParam, lParam);
+    if(tracing)
+        traceFound(asked, rec);
+
+    KeyboardEvent evt(rec);
+    if((rec.flags & EVENT_DISPATCHED) == 0)
+        dispatcher->handleKeyboard(evt);
+
+    // Let the observers know how it turned out. Anything they miss is counted by the pool.
+    if(dispatcher->hasKeyboardObservers())
+        observers->submitKeyboard(rec);
+
+    Decision decision = (evt.getDecision() == CONSUME) ? CONSUME : PERMIT;
+    if(tracing)
+        traceDecision(asked, &rec);
+    if(flying)
+        flight->decided(asked, rec, decision);
+    if(recording)
+        recorder->keyboardDecision(asked, rec.sequence, vkey, scanCode, keyUp, decision);
+    return decision;
 }
 
-////////////////////////////////////////////////////////////////////////////////
-// Main event loop (seperate thread)
+// What to say when the raw event didn't turn up in time
+Decision KaptivateAPI::timeoutDecision() const
+{
+    // If we're shutting down, just get out of the way
+    if(!events->running())
+        return PERMIT;
+    return defaultDecision;
+}
 
-// The one, the only, WndProc handler for Kaptivate. All messages from the hooks eventually wind up here.
-static LRESULT CALLBACK HookWndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
+// The backend wants to know what to do with a mouse event. Find the raw mouse event that goes with it, and
+// ask the user what to do with it.
+Decision KaptivateAPI::decideMouse(unsigned int message)
 {
-    if(_localInstance)
-    {
-        return _localInstance->_ProcessHookWndProc(hWnd, message, wParam, lParam);
-    }
-    else
+    if(MouseCorrelator::keyForMessage(message) == 0)
+        return PERMIT;
+
+    bool tracing = tracer->isEnabled();
+    bool flying = flight->isEnabled();
+    LONGLONG asked = (recording || tracing || flying) ? LatencyTracer::stamp() : 0;
+    if(flying)
+        flight->asked(asked, MOUSE_BUTTON_EVENT, message, false);
+
+    EventRecord rec;
+    bool found = mouseCorrelator->match(events, message, hookWaitMs, rec);
+
+    // Raw events no hook call will be answered with still go to the handlers, they came first
+    EventRecord stale;
+    while(mouseCorrelator->takeStale(stale))
+        dispatchMouse(stale);
+
+    // Most likely there was never going to be a raw event, so let it through
+    if(!found)
     {
-        return DefWindowProc(hWnd, message, wParam, lParam);
+        Decision decision = PERMIT;
+        if(tracing)
+            traceDecision(asked, NULL);
+        if(flying)
+            flight->timedOut(asked, MOUSE_BUTTON_EVENT, decision);
+        if(recording)
+            recorder->mouseDecision(asked, CAPTURE_LOG_NO_SEQUENCE, message, decision);
+        return decision;
     }
+
+    if(tracing)
+        traceFound(asked, rec);
+
+    Decision decision = dispatchMouse(rec);
+    if(tracing)
+        traceDecision(asked, &rec);
+    if(flying)
+        flight->decided(asked, rec, decision);
+    if(recording)
+        recorder->mouseDecision(asked, rec.sequence, message, decision);
+    return decision;
 }
 
-static LRESULT CALLBACK RawWndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
+// Run the mouse handlers on a raw event and let the observers know how it turned out
+Decision KaptivateAPI::dispatchMouse(EventRecord& rec)
 {
-    if(_localInstance)
+    Decision decision = UNDECIDED;
+    if(rec.type == MOUSE_MOVE_EVENT)
     {
-        return _localInstance->_ProcessRawWndProc(hWnd, message, wParam, lParam);
+        MouseMoveEvent evt(rec);
+        dispatcher->handleMouseMove(evt);
+        decision = evt.getDecision();
     }
-    else
+    else if(rec.type == MOUSE_BUTTON_EVENT)
+    {
+        MouseButtonEvent evt(rec);
+        dispatcher->handleMouseButton(evt);
+        decision = evt.getDecision();
+    }
+    else if(rec.type == MOUSE_WHEEL_EVENT)
     {
-        return DefWindowProc(hWnd, message, wParam, lParam);
+        MouseWheelEvent evt(rec);
+        dispatcher->handleMouseWheel(evt);
+        decision = evt.getDecision();
     }
+
+    if(dispatcher->hasMouseObservers())
+        observers->submitMouse(rec);
+
+    return (decision == CONSUME) ? CONSUME : PERMIT;
 }
 
-// Runs in a separate thread. Create an invisible window and process all events for that window until the window
-// is told to die.
-static DWORD WINAPI HookMessageLoop(LPVOID iValue)
+// Stamp raw events on their way into the queue. Always clears the stamp when tracing is off, so that the
+// hook thread never sees a stale one if it gets turned on.
+void KaptivateAPI::traceEnqueue(EventRecord* records, unsigned int count)
 {
-    kapMsgLoopParams* params = (kapMsgLoopParams*)iValue;
-    params->success = false;
-
+    if(!tracer->isEnabled())
     {
-        // Register a window class
-
-        WNDCLASSEX wce;
-
-        wce.cbSize = sizeof(WNDCLASSEX);
-        wce.style = CS_HREDRAW | CS_VREDRAW;
-        wce.lpfnWndProc = (WNDPROC)HookWndProc;
-        wce.cbClsExtra = 0;
-        wce.cbWndExtra = 0;
-        wce.hInstance = (HINSTANCE)kaptivateDllModule;
-        wce.hIcon = NULL;
-        wce.hIconSm = NULL;
-        wce.hCursor = NULL;
-        wce.hbrBackground = (HBRUSH)GetStockObject(NULL_BRUSH);
-        wce.lpszMenuName = NULL;
-        wce.lpszClassName = L"KaptivateHookMsgWnd";
-
-        if (!RegisterClassEx(&wce))
-        {
-            SetEvent(params->msgEvent);
-            return -1;
-        }
-
-        // Set up the win32 message-only window which recieves messages
-        if(NULL == (params->callbackWindow = CreateWindowEx(NULL, L"KaptivateHookMsgWnd", NULL, NULL, CW_USEDEFAULT,
-            CW_USEDEFAULT, 0, 0, HWND_MESSAGE, NULL, (HINSTANCE)kaptivateDllModule, NULL)))
-        {
-            SetEvent(params->msgEvent);
-            return -1;
-        }
-
-        // Signal the main thread that we're ready
-        params->success = true;
-        SetEvent(params->msgEvent);
+        for(unsigned int i = 0; i < count; i++)
+            records[i].enqueued = 0;
+        return;
     }
 
-    // Finally we get to the main event loop
-    MSG msg;
-    BOOL bRet;
-    while ((bRet = GetMessage(&msg, NULL, 0, 0)) != 0)
+    LONGLONG now = LatencyTracer::stamp();
+    for(unsigned int i = 0; i < count; i++)
     {
-        if(bRet == -1)
-        {
-            break;
-        }
-        else
-        {
-            TranslateMessage(&msg);
-            DispatchMessage(&msg);
-        }
+        records[i].enqueued = now;
+        tracer->record(LATENCY_DECODE, now - records[i].timestamp);
     }
+}
 
-    DestroyWindow(params->callbackWindow);
-
-    return 0;
+// The hook thread has its raw event
+void KaptivateAPI::traceFound(LONGLONG asked, const EventRecord& rec)
+{
+    LONGLONG now = LatencyTracer::stamp();
+    tracer->record(LATENCY_HOOK_WAIT, now - asked);
+    if(rec.enqueued != 0)
+        tracer->record(LATENCY_QUEUED, now - rec.enqueued);
 }
 
+// ...and has its answer. rec is NULL when it gave up waiting for the raw event.
+void KaptivateAPI::traceDecision(LONGLONG asked, const EventRecord* rec)
+{
+    LONGLONG now = LatencyTracer::stamp();
+    tracer->record(LATENCY_HOOK, now - asked);
+    if(rec != NULL)
+        tracer->record(LATENCY_TOTAL, now - rec->timestamp);
+}
 
-static DWORD WINAPI RawMessageLoop(LPVOID iValue)
+// Open the capture log, if there's meant to be one, and write down the devices we already know about. The
+// dispatcher writes down any that turn up after that.
+void KaptivateAPI::startRecording()
 {
-    kapMsgLoopParams* params = (kapMsgLoopParams*)iValue;
-    params->success = false;
+    recording = false;
+    if(recorder->getPath().empty())
+        return;
 
-    {
-        // Register a window class
-
-        WNDCLASSEX wce;
-
-        wce.cbSize = sizeof(WNDCLASSEX);
-        wce.style = CS_HREDRAW | CS_VREDRAW;
-        wce.lpfnWndProc = (WNDPROC)RawWndProc;
-        wce.cbClsExtra = 0;
-        wce.cbWndExtra = 0;
-        wce.hInstance = (HINSTANCE)kaptivateDllModule;
-        wce.hIcon = NULL;
-        wce.hIconSm = NULL;
-        wce.hCursor = NULL;
-        wce.hbrBackground = (HBRUSH)GetStockObject(NULL_BRUSH);
-        wce.lpszMenuName = NULL;
-        wce.lpszClassName = L"KaptivateRawMsgWnd";
-
-        if (!RegisterClassEx(&wce))
-        {
-            SetEvent(params->msgEvent);
-            return -1;
-        }
+    recorder->open();
+    dispatcher->setRecorder(recorder);
 
-        // Set up the win32 message-only window which recieves messages
-        if(NULL == (params->callbackWindow = CreateWindowEx(NULL, L"KaptivateRawMsgWnd", NULL, NULL, CW_USEDEFAULT,
-            CW_USEDEFAULT, 0, 0, HWND_MESSAGE, NULL, (HINSTANCE)kaptivateDllModule, NULL)))
-        {
-            SetEvent(params->msgEvent);
-            return -1;
-        }
+    vector<KeyboardInfo> keyboards = dispatcher->knownKeyboards();
+    for(size_t i = 0; i < keyboards.size(); i++)
+        recorder->device(KEYBOARD_EVENT, keyboards[i].device, keyboards[i].name);
 
-        // Signal the main thread that we're ready
-        params->success = true;
-        SetEvent(params->msgEvent);
-    }
+    vector<MouseInfo> mice = dispatcher->knownMice();
+    for(size_t i = 0; i < mice.size(); i++)
+        recorder->device(MOUSE_BUTTON_EVENT, mice[i].device, mice[i].name);
 
-    // Finally we get to the main event loop
-    MSG msg;
-    BOOL bRet;
-    while ((bRet = GetMessage(&msg, NULL, 0, 0)) != 0)
-    {
-        if(bRet == -1)
-        {
-            break;
-        }
-        else
-        {
-            TranslateMessage(&msg);
-            DispatchMessage(&msg);
-        }
-    }
-
-    DestroyWindow(params->callbackWindow);
+    recording = true;
+}
 
-    return 0;
+// Close the capture log, once the dispatcher has stopped writing devices to it
+void KaptivateAPI::stopRecording()
+{
+    dispatcher->setRecorder(NULL);
+    recorder->close();
+    recording = false;
 }
 
+
 ////////////////////////////////////////////////////////////////////////////////
 // Start / Stop
 
@@ -451,78 +511,48 @@ void KaptivateAPI::startCapture(bool wantMouse, bool wantKeyboard, bool startSus
     if(running)
         throw KaptivateException("Kaptivate is already running");
     suspended = startSuspended;
-    events->start();
+    rawSequence = 0;
 
-    {
-        // Set up the hook message loop thread
-
-        kapMsgLoopParams params;
-        params.callbackWindow = 0;
-        params.msgEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
-        params.success = false;
-
-        // Spin up the hook thread
-        DWORD threadId = 0;
-        if(NULL == (this->hookMsgLoopThread = CreateThread(NULL, 0, HookMessageLoop, &params, 0, &threadId)))
-            throw KaptivateException("Failed to create the hook loop thread loop");
-
-        // Wait for the thread to decide whether or not everything is good
-        WaitForSingleObject(params.msgEvent, INFINITE);
-        CloseHandle (params.msgEvent);
-        if(!params.success)
-            throw KaptivateException("Failed to initialize the hook message window");
-        this->hookCallbackWindow = params.callbackWindow;
-        if(!pingMessageWindow(this->hookCallbackWindow))
-            throw KaptivateException("Something horrible has happened");
-    }
+    // Leave the hook enough time to hear back from us before it gives up
+    if(msgTimeoutMs > 2 * HOOK_MARGIN_MS)
+        hookWaitMs = msgTimeoutMs - HOOK_MARGIN_MS;
+    else
+        hookWaitMs = msgTimeoutMs / 2;
+
+    // A raw event nobody has asked about by the time the hook would have given up never will be
+    correlator->reset(msgTimeoutMs > 1000 ? msgTimeoutMs : 1000);
+    mouseCorrelator->reset(msgTimeoutMs > 1000 ? msgTimeoutMs : 1000);
+
+    // Everything from here on goes in the log
+    startRecording();
+    tracer->reset();
+    profiler->reset();
 
+    events->start();
+
+    // The hooks hand events to the observer threads, so those have to be up first
+    if(!observers->start())
     {
-        // Set up the raw message loop thread
-
-        kapMsgLoopParams params;
-        params.callbackWindow = 0;
-        params.msgEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
-        params.success = false;
-
-        // Spin up the raw thread
-        DWORD threadId = 0;
-        if(NULL == (this->rawMsgLoopThread = CreateThread(NULL, 0, RawMessageLoop, &params, 0, &threadId)))
-            throw KaptivateException("Failed to create the raw loop thread loop");
-
-        // Wait for the thread to decide whether or not everything is good
-        WaitForSingleObject(params.msgEvent, INFINITE);
-        CloseHandle (params.msgEvent);
-        if(!params.success)
-            throw KaptivateException("Failed to initialize the raw message window");
-        this->rawCallbackWindow = params.callbackWindow;
-        if(!pingMessageWindow(this->rawCallbackWindow))
-            throw KaptivateException("Something horrible has happened");
+        events->stop();
+        stopRecording();
+        throw KaptivateException("Failed to create the observer threads");
     }
 
-    // Finally set up the hooks
     try
     {
-        if(!startSuspended)
-        {
-            if(!startRawCapture(wantMouse, wantKeyboard))
-                throw KaptivateException("Failed to start raw capture");
-        }
-
-        short ss = (startSuspended) ? 1 : 0;
-        if(0 != kaptivateHookInit(this->hookCallbackWindow, KEYBOARD_MESSAGE,
-                                  MOUSE_MESSAGE, msgTimeoutMs, ss))
-            throw KaptivateException("Failed to initialize the hooks");
+        backend->start(this, wantMouse, wantKeyboard, startSuspended, msgTimeoutMs);
     }
     catch(...)
     {
-        kaptivateHookUninit();
-        stopRawCapture();
-        tryStopMsgLoop();
+        events->stop();
+        observers->stop();
+        stopRecording();
         throw;
     }
 
-    userWantsMouse = wantMouse;
-    userWantsKeyboard = wantKeyboard;
+    // Dump if the hooks go quiet
+    flight->watch(backend);
+
     running = true;
 }
 
@@ -535,221 +565,260 @@ void KaptivateAPI::stopCapture()
     // First stop the event queue
     events->stop();
 
-    // Next stop any further messages from being generated
-    if(0 != kaptivateHookUninit())
-        throw KaptivateException("Failed to uninitialize the hooks");
+    // Next take down the hooks and whatever feeds them. They're meant to go quiet now.
+    flight->watch(NULL);
+    backend->stop();
+    waitForDeviceScans();
 
-    // Stop the raw events from coming in
-    if(!stopRawCapture())
-        throw KaptivateException("Failed to stop raw capture");
+    // Nothing is deciding events any more, so the observers are done too
+    if(!observers->stop())
+        throw KaptivateException("Failed to stop the observer threads");
 
-    // Attempt to shut down the message window
-    if(!tryStopMsgLoop())
-        throw KaptivateException("Failed to stop the Kaptivate message loop");
+    // Nothing more can happen, so the log is complete
+    stopRecording();
 
     running = false;
-    userWantsMouse = false;
-    userWantsKeyboard = false;
 }
 
-// Attempt to stop the message loop thread
-bool KaptivateAPI::tryStopMsgLoop()
+
+////////////////////////////////////////////////////////////////////////////////
+// Suspend / Resume
+
+// Keep our hooks alive, but temporarily suspend capturing the events
+void KaptivateAPI::suspendCapture()
 {
-    // Tell the hook window we're done
-    DWORD res = 0;
-    if(0 == SendMessageTimeout(this->hookCallbackWindow, QUIT_MESSAGE, 0, 0, SMTO_ABORTIFHUNG, 5000, &res))
-        return false;
+    if(!running)
+        throw KaptivateException("Kaptivate is not currently running");
+    if(suspended)
+        throw KaptivateException("Kaptivate is already suspended");
+    backend->suspend();
+    suspended = true;
+}
 
-    // Wait for the hook thread to return
-    if(WAIT_OBJECT_0 != WaitForSingleObject(this->hookMsgLoopThread, 5000))
-        return false;
+// Assume that our hooks are alive, and resume capturing events
+void KaptivateAPI::resumeCapture()
+{
+    if(!running)
+        throw KaptivateException("Kaptivate is not currently running");
+    if(!suspended)
+        throw KaptivateException("Kaptivate is already running");
+    backend->resume();
+    suspended = false;
+}
 
-    // Tell the raw window we're done
-    res = 0;
-    if(0 == SendMessageTimeout(this->rawCallbackWindow, QUIT_MESSAGE, 0, 0, SMTO_ABORTIFHUNG, 5000, &res))
-        return false;
 
-    // Wait for the raw thread to return
-    if(WAIT_OBJECT_0 != WaitForSingleObject(this->rawMsgLoopThread, 5000))
+////////////////////////////////////////////////////////////////////////////////
+// Status
+
+// Is Kaptivate initialized and capturing events?
+bool KaptivateAPI::isRunning() const
+{
+    if(!running)
         return false;
+    return backend->isAlive();
+}
 
-    return true;
+// Is Kaptivate paused?
+bool KaptivateAPI::isSuspended() const
+{
+    return suspended;
 }
 
-// Register for raw input events
-bool KaptivateAPI::startRawCapture(bool wantMouse, bool wantKeyboard)
+
+////////////////////////////////////////////////////////////////////////////////
+// Queue limits
+
+// Change how many keyboard events may be waiting for the hook, and what happens past that
+void KaptivateAPI::setKeyboardQueueLimit(unsigned int capacity, OverflowPolicy policy)
 {
-    if(rawKeyboardRunning || rawMouseRunning)
-        throw KaptivateException("The raw capture events are still running");
+    if(running)
+        throw KaptivateException("Queue limits can't be changed while Kaptivate is running");
+    events->setKeyboardLimit(capacity, policy);
+}
 
-    unsigned int ct = 0;
-    if(wantKeyboard) ++ct;
-    if(wantMouse) ++ct;
+// Change how many mouse events may be waiting for the hook, and what happens past that
+void KaptivateAPI::setMouseQueueLimit(unsigned int capacity, OverflowPolicy policy)
+{
+    if(running)
+        throw KaptivateException("Queue limits can't be changed while Kaptivate is running");
+    events->setMouseLimit(capacity, policy);
+}
 
-    // Should never happen
-    if(ct == 0)
-        return false;
+// How is the keyboard queue holding up?
+QueueStats KaptivateAPI::getKeyboardQueueStats() const
+{
+    return events->getKeyboardStats();
+}
 
-    RAWINPUTDEVICE* rid = new RAWINPUTDEVICE[ct];
-    ct = 0;
+// How is the mouse queue holding up?
+QueueStats KaptivateAPI::getMouseQueueStats() const
+{
+    return events->getMouseStats();
+}
 
-    // Register for keyboard events in the background
-    if(wantKeyboard)
-    {
-        rid[ct].usUsagePage = 0x01; // It's a keyboard
-        rid[ct].usUsage = 0x06;
-        rid[ct].dwFlags = RIDEV_INPUTSINK | RIDEV_NOLEGACY | RIDEV_NOHOTKEYS;
-        rid[ct].hwndTarget = this->rawCallbackWindow;
-        ++ct;
-    }
+// What should happen to an event whose raw half never showed up?
+void KaptivateAPI::setDefaultDecision(Decision decision)
+{
+    if(decision != PERMIT && decision != CONSUME)
+        throw KaptivateException("The default decision must be PERMIT or CONSUME");
+    defaultDecision = decision;
+}
 
-    // Register for mouse events in the background
-    if(wantMouse)
-    {
-        rid[ct].usUsagePage = 0x01; // It's a mouse
-        rid[ct].usUsage = 0x02;
-        rid[ct].dwFlags = RIDEV_INPUTSINK | RIDEV_NOLEGACY | RIDEV_CAPTUREMOUSE;
-        rid[ct].hwndTarget = this->rawCallbackWindow;
-        ++ct;
-    }
+Decision KaptivateAPI::getDefaultDecision() const
+{
+    return defaultDecision;
+}
 
-    BOOL ret = RegisterRawInputDevices(rid, ct, sizeof(RAWINPUTDEVICE));
-    delete[] rid;
+// How well are keyboard hook calls being paired up with raw events?
+CorrelationStats KaptivateAPI::getKeyboardCorrelationStats() const
+{
+    return correlator->getStats();
+}
 
-    if(!ret)
-        return false;
+// ...and mouse hook calls?
+CorrelationStats KaptivateAPI::getMouseCorrelationStats() const
+{
+    return mouseCorrelator->getStats();
+}
 
-    rawKeyboardRunning = wantKeyboard;
-    rawMouseRunning = wantMouse;
+// Should the keyboard handlers run on the raw thread, ahead of the hook?
+void KaptivateAPI::setSpeculativeDispatch(bool enabled)
+{
+    if(running)
+        throw KaptivateException("Speculative dispatch can't be changed while Kaptivate is running");
+    speculativeDispatch = enabled;
+}
 
-    return true;
+bool KaptivateAPI::getSpeculativeDispatch() const
+{
+    return speculativeDispatch;
 }
 
-// Unregister all raw input events
-bool KaptivateAPI::stopRawCapture()
+// Write everything to a capture log from now on
+void KaptivateAPI::setRecordFile(const string& path)
 {
-    if(!rawKeyboardRunning && !rawMouseRunning)
-        return true;
+    if(running)
+        throw KaptivateException("The capture log can't be changed while Kaptivate is running");
+    recorder->setPath(path);
+}
 
-    unsigned int ct = 0;
-    if(rawKeyboardRunning) ++ct;
-    if(rawMouseRunning) ++ct;
+unsigned int KaptivateAPI::getRecordDropped() const
+{
+    return recorder->getDropped();
+}
 
-    // Should never happen
-    if(ct == 0)
-        return false;
+bool KaptivateAPI::getRecordFailed() const
+{
+    return recorder->hasFailed();
+}
 
-    RAWINPUTDEVICE* rid = new RAWINPUTDEVICE[ct];
-    ct = 0;
+// Per-stage latency histograms
+void KaptivateAPI::setLatencyTracing(bool enabled)
+{
+    tracer->setEnabled(enabled);
+    dispatcher->setHandlerLatency(enabled ? tracer->histogram(LATENCY_HANDLER) : NULL);
+}
 
-    // Register for keyboard events in the background
-    if(rawKeyboardRunning)
-    {
-        rid[ct].usUsagePage = 0x01;
-        rid[ct].usUsage = 0x06; // It's a keyboard
-        rid[ct].dwFlags = RIDEV_REMOVE;
-        rid[ct].hwndTarget = 0x0;
-        ++ct;
-    }
+bool KaptivateAPI::getLatencyTracing() const
+{
+    return tracer->isEnabled();
+}
 
-    // Register for mouse events in the background
-    if(rawMouseRunning)
-    {
-        rid[ct].usUsagePage = 0x01;
-        rid[ct].usUsage = 0x02; // It's a mouse
-        rid[ct].dwFlags = RIDEV_REMOVE;
-        rid[ct].hwndTarget = 0x0;
-        ++ct;
-    }
+LatencyStats KaptivateAPI::getLatencyStats() const
+{
+    return tracer->getStats();
+}
 
-    // Actually we're unregistering them.
-    BOOL ret = RegisterRawInputDevices(rid, ct, sizeof(RAWINPUTDEVICE));
-    delete[] rid;
+void KaptivateAPI::resetLatencyStats()
+{
+    tracer->reset();
+}
 
-    if(!ret)
-        return false;
+// Per-handler profiles
+void KaptivateAPI::setHandlerProfiling(bool enabled)
+{
+    profiler->setEnabled(enabled);
+    dispatcher->setHandlerProfiler(profiler, enabled);
+}
 
-    rawKeyboardRunning = false;
-    rawMouseRunning = false;
+bool KaptivateAPI::getHandlerProfiling() const
+{
+    return profiler->isEnabled();
+}
 
-    return true;
+vector<HandlerStats> KaptivateAPI::getHandlerStats() const
+{
+    return profiler->snapshot();
 }
 
-// Ensure that the message window is alive and kicking
-bool KaptivateAPI::pingMessageWindow(HWND wnd) const
+void KaptivateAPI::resetHandlerStats()
 {
-    LRESULT res;
-    DWORD dwres = 0;
+    profiler->reset();
+}
 
-    while(true)
-    {
-        res = SendMessageTimeout(wnd, PING_MESSAGE, 0, 0, SMTO_ABORTIFHUNG, 5000, &dwres);
-        if(0 == res)
-        {
-            if(ERROR_TIMEOUT == GetLastError())
-                return false;
-        }
-        else if(1 == res)
-        {
-            return true;
-        }
-    }
+unsigned int KaptivateAPI::getUnprofiledCalls() const
+{
+    return profiler->getUnprofiled();
 }
 
+void KaptivateAPI::setHandlerStatsListener(HandlerStatsListener* listener, DWORD intervalMs)
+{
+    profiler->setListener(listener, intervalMs);
+}
 
-////////////////////////////////////////////////////////////////////////////////
-// Suspend / Resume
+// The flight recorder
+void KaptivateAPI::setFlightRecorder(bool enabled, const string& dumpPrefix, DWORD slowMs)
+{
+    flight->configure(enabled, dumpPrefix, slowMs);
+    if(enabled && running)
+        flight->watch(backend);
+}
 
-// Keep our hooks alive, but temporarily suspend capturing the events
-void KaptivateAPI::suspendCapture()
+bool KaptivateAPI::getFlightRecorder() const
 {
-    if(!running)
-        throw KaptivateException("Kaptivate is not currently running");
-    if(suspended)
-        throw KaptivateException("Kaptivate is already suspended");
-    if(0 != kaptivateHookPause())
-        throw KaptivateException("Unable to suspend hook processing");
-    suspended = true;
+    return flight->isEnabled();
 }
 
-// Assume that our hooks are alive, and resume capturing events
-void KaptivateAPI::resumeCapture()
+void KaptivateAPI::dumpFlightRecorder(const string& path)
 {
-    if(!running)
-        throw KaptivateException("Kaptivate is not currently running");
-    if(!suspended)
-        throw KaptivateException("Kaptivate is already running");
-    suspended = true;
-    if(0 != kaptivateHookUnpause())
-        throw KaptivateException("Unable to resume hook processing");
+    flight->dump(path, FLIGHT_DUMP_REQUESTED);
 }
 
+// Capture from somewhere other than the Windows hooks
+void KaptivateAPI::setBackend(InputBackend* backend)
+{
+    if(running)
+        throw KaptivateException("The backend can't be changed while Kaptivate is running");
+    this->backend = (backend != NULL) ? backend : defaultBackend;
+}
 
-////////////////////////////////////////////////////////////////////////////////
-// Status
+void KaptivateAPI::setObserverThreads(unsigned int count)
+{
+    if(running)
+        throw KaptivateException("The observer threads can't be changed while Kaptivate is running");
+    observers->setThreads(count);
+}
 
-// Is Kaptivate initialized and capturing events?
-bool KaptivateAPI::isRunning() const
+unsigned int KaptivateAPI::getObserverThreads() const
 {
-    if(!running)
-        return false;
-    if(!pingMessageWindow(this->hookCallbackWindow))
-        return false;
-    if(!pingMessageWindow(this->rawCallbackWindow))
-        return false;
-    return true;
+    return observers->getThreads();
 }
 
-// Is Kaptivate paused?
-bool KaptivateAPI::isSuspended() const
+unsigned int KaptivateAPI::getObserverDrops() const
 {
-    return suspended;
+    return observers->getDropped();
 }
 
 
 ////////////////////////////////////////////////////////////////////////////////
 // Device enumeration
 
+// Keep what enumerating finds in a file, for next time
+void KaptivateAPI::setDeviceCacheFile(const string& path)
+{
+    dispatcher->setDeviceCache(path);
+}
+
 // Get a list of all attached keyboards
 vector<KeyboardInfo> KaptivateAPI::enumerateKeyboards()
 {
@@ -767,15 +836,27 @@ vector<MouseInfo> KaptivateAPI::enumerateMice()
 // Event handler registration / unregistration
 
 // Tell kaptivate that you're interested in processing messages from a particular keyboard
-void KaptivateAPI::registerKeyboardHandler(string idRegex, KeyboardHandler* handler)
+void KaptivateAPI::registerKeyboardHandler(string idRegex, KeyboardHandler* handler, bool observeOnly)
 {
-    dispatcher->registerKeyboardHandler(idRegex, handler);
+    dispatcher->registerKeyboardHandler(idRegex, handler, observeOnly);
 }
 
 // Tell kaptivate that you're interested in processing messages from a particular mouse
-void KaptivateAPI::resgisterMouseHandler(string idRegex, MouseHandler* handler)
+void KaptivateAPI::resgisterMouseHandler(string idRegex, MouseHandler* handler, bool observeOnly)
 {
-    dispatcher->resgisterMouseHandler(idRegex, handler);
+    dispatcher->resgisterMouseHandler(idRegex, handler, observeOnly);
+}
+
+// Tell kaptivate that you also want the events of keyboards it doesn't know yet
+void KaptivateAPI::registerDefaultKeyboardHandler(KeyboardHandler* handler, bool observeOnly)
+{
+    dispatcher->registerDefaultKeyboardHandler(handler, observeOnly);
+}
+
+// Tell kaptivate that you also want the events of mice it doesn't know yet
+void KaptivateAPI::registerDefaultMouseHandler(MouseHandler* handler, bool observeOnly)
+{
+    dispatcher->registerDefaultMouseHandler(handler, observeOnly);
 }
 
 // Tell kaptivate that a particular keyboard handler is going away
@@ -791,18 +872,40 @@ void KaptivateAPI::unregisterMouseHandler(MouseHandler* handler)
 }
 
 
+////////////////////////////////////////////////////////////////////////////////
+// Default batch handlers
+
+void KeyboardHandler::HandleKeyEvents(KeyboardEvent* events, unsigned int count)
+{
+    for(unsigned int i = 0; i < count; i++)
+        HandleKeyEvent(events[i]);
+}
+
+void MouseHandler::HandleButtonEvents(MouseButtonEvent* events, unsigned int count)
+{
+    for(unsigned int i = 0; i < count; i++)
+        HandleButtonEvent(events[i]);
+}
+
+void MouseHandler::HandleWheelEvents(MouseWheelEvent* events, unsigned int count)
+{
+    for(unsigned int i = 0; i < count; i++)
+        HandleWheelEvent(events[i]);
+}
+
+void MouseHandler::HandleMoveEvents(MouseMoveEvent* events, unsigned int count)
+{
+    for(unsigned int i = 0; i < count; i++)
+        HandleMoveEvent(events[i]);
+}
+
+
 ////////////////////////////////////////////////////////////////////////////////
 // Keyboard Event
 
-KeyboardEvent::KeyboardEvent(HANDLE device, unsigned int vkey, unsigned int scanCode,
-                             unsigned int wmMessage, bool keyUp)
+KeyboardEvent::KeyboardEvent(EventRecord& record)
 {
-    this->decision = UNDECIDED;
-    this->deviceHandle = device;
-    this->vkey = vkey;
-    this->scanCode = scanCode;
-    this->wmMessage = wmMessage;
-    this->keyUp = keyUp;
+    this->record = &record;
     this->info = NULL;
 }
 
@@ -810,9 +913,14 @@ KeyboardEvent::~KeyboardEvent()
 {
 }
 
+const EventRecord& KeyboardEvent::getRecord() const
+{
+    return *this->record;
+}
+
 HANDLE KeyboardEvent::getDeviceHandle() const
 {
-    return this->deviceHandle;
+    return this->record->device;
 }
 
 KeyboardInfo* KeyboardEvent::getDeviceInfo() const
@@ -830,43 +938,41 @@ void KeyboardEvent::setDeviceInfo(KeyboardInfo* kbdInfo)
 
 unsigned int KeyboardEvent::getVkey() const
 {
-
-    return vkey;
+    return record->data.keyboard.vkey;
 }
 
 unsigned int KeyboardEvent::getScanCode() const
 {
-    return scanCode;
+    return record->data.keyboard.scanCode;
 }
 
 unsigned int KeyboardEvent::getWindowMessage() const
 {
-    return wmMessage;
+    return record->data.keyboard.wmMessage;
 }
 
 bool KeyboardEvent::getKeyUp() const
 {
-    return keyUp;
+    return record->data.keyboard.keyUp;
 }
 
 Decision KeyboardEvent::getDecision() const
 {
-    return decision;
+    return (Decision)record->decision;
 }
 
 void KeyboardEvent::setDecision(Decision decision)
 {
-    this->decision = decision;
+    record->decision = (unsigned char)decision;
 }
 
 
 ////////////////////////////////////////////////////////////////////////////////
 // Mouse Button Event
 
-MouseButtonEvent::MouseButtonEvent(HANDLE device)
+MouseButtonEvent::MouseButtonEvent(EventRecord& record)
 {
-    this->decision = UNDECIDED;
-    this->deviceHandle = device;
+    this->record = &record;
     this->info = NULL;
 }
 
@@ -874,9 +980,14 @@ MouseButtonEvent::~MouseButtonEvent()
 {
 }
 
+const EventRecord& MouseButtonEvent::getRecord() const
+{
+    return *this->record;
+}
+
 HANDLE MouseButtonEvent::getDeviceHandle() const
 {
-    return this->deviceHandle;
+    return this->record->device;
 }
 
 MouseInfo* MouseButtonEvent::getDeviceInfo() const
@@ -892,24 +1003,28 @@ void MouseButtonEvent::setDeviceInfo(MouseInfo* mouseInfo)
     }
 }
 
+unsigned int MouseButtonEvent::getButtonFlags() const
+{
+    return record->data.button.buttonFlags;
+}
+
 Decision MouseButtonEvent::getDecision() const
 {
-    return decision;
+    return (Decision)record->decision;
 }
 
 void MouseButtonEvent::setDecision(Decision decision)
 {
-    this->decision = decision;
+    record->decision = (unsigned char)decision;
 }
 
 
 ////////////////////////////////////////////////////////////////////////////////
 // Mouse Wheel Event
 
-MouseWheelEvent::MouseWheelEvent(HANDLE device)
+MouseWheelEvent::MouseWheelEvent(EventRecord& record)
 {
-    this->decision = UNDECIDED;
-    this->deviceHandle = device;
+    this->record = &record;
     this->info = NULL;
 }
 
@@ -917,9 +1032,14 @@ MouseWheelEvent::~MouseWheelEvent()
 {
 }
 
+const EventRecord& MouseWheelEvent::getRecord() const
+{
+    return *this->record;
+}
+
 HANDLE MouseWheelEvent::getDeviceHandle() const
 {
-    return this->deviceHandle;
+    return this->record->device;
 }
 
 MouseInfo* MouseWheelEvent::getDeviceInfo() const
@@ -935,24 +1055,38 @@ void MouseWheelEvent::setDeviceInfo(MouseInfo* mouseInfo)
     }
 }
 
+int MouseWheelEvent::getDelta() const
+{
+    return record->data.wheel.delta;
+}
+
+bool MouseWheelEvent::isHorizontal() const
+{
+    return record->data.wheel.horizontal;
+}
+
+unsigned int MouseWheelEvent::getSampleCount() const
+{
+    return record->samples;
+}
+
 Decision MouseWheelEvent::getDecision() const
 {
-    return decision;
+    return (Decision)record->decision;
 }
 
 void MouseWheelEvent::setDecision(Decision decision)
 {
-    this->decision = decision;
+    record->decision = (unsigned char)decision;
 }
 
 
 ////////////////////////////////////////////////////////////////////////////////
 // Mouse Move Event
 
-MouseMoveEvent::MouseMoveEvent(HANDLE device)
+MouseMoveEvent::MouseMoveEvent(EventRecord& record)
 {
-    this->decision = UNDECIDED;
-    this->deviceHandle = device;
+    this->record = &record;
     this->info = NULL;
 }
 
@@ -960,9 +1094,14 @@ MouseMoveEvent::~MouseMoveEvent()
 {
 }
 
+const EventRecord& MouseMoveEvent::getRecord() const
+{
+    return *this->record;
+}
+
 HANDLE MouseMoveEvent::getDeviceHandle() const
 {
-    return this->deviceHandle;
+    return this->record->device;
 }
 
 MouseInfo* MouseMoveEvent::getDeviceInfo() const
@@ -978,12 +1117,32 @@ void MouseMoveEvent::setDeviceInfo(MouseInfo* mouseInfo)
     }
 }
 
+int MouseMoveEvent::getDeltaX() const
+{
+    return record->data.move.dx;
+}
+
+int MouseMoveEvent::getDeltaY() const
+{
+    return record->data.move.dy;
+}
+
+bool MouseMoveEvent::isAbsolute() const
+{
+    return record->data.move.absolute;
+}
+
+unsigned int MouseMoveEvent::getSampleCount() const
+{
+    return record->samples;
+}
+
 Decision MouseMoveEvent::getDecision() const
 {
-    return decision;
+    return (Decision)record->decision;
 }
 
 void MouseMoveEvent::setDecision(Decision decision)
 {
-    this->decision = decision;
+    record->decision = (unsigned char)decision;
 }
@@ -52,6 +52,154 @@ namespace Kaptivate
         PASS = 8
     };
 
+    // What kind of input an EventRecord describes
+    enum EventType
+    {
+        KEYBOARD_EVENT = 1,
+        MOUSE_BUTTON_EVENT = 2,
+        MOUSE_WHEEL_EVENT = 3,
+        MOUSE_MOVE_EVENT = 4
+    };
+
+    // Bits in EventRecord::flags
+    enum EventFlags
+    {
+        EVENT_DISPATCHED = 1          // The handlers have already been run, the decision is final
+    };
+
+    // Payloads for each kind of event
+    struct KeyboardData
+    {
+        unsigned short vkey;
+        unsigned short scanCode;
+        unsigned int wmMessage;
+        bool keyUp;
+    };
+
+    struct MouseButtonData
+    {
+        unsigned short buttonFlags;   // One RI_MOUSE_*_BUTTON_DOWN / _UP transition
+    };
+
+    struct MouseWheelData
+    {
+        int delta;                    // Multiples of WHEEL_DELTA, positive is away from the user
+        bool horizontal;
+    };
+
+    struct MouseMoveData
+    {
+        int dx;
+        int dy;
+        bool absolute;
+    };
+
+    // Everything there is to know about one input event, in a single flat record that can be copied
+    // around by value. The event classes below are thin views over one of these.
+    struct EventRecord
+    {
+        LONGLONG timestamp;           // QueryPerformanceCounter ticks when the raw event was decoded
+        unsigned int sequence;        // Assigned by the raw input thread, increases by one per event
+        HANDLE device;
+        unsigned char type;           // EventType
+        unsigned char decision;       // Decision
+        unsigned short samples;       // How many raw events were merged into this one (mouse moves / wheels)
+        unsigned short deviceIndex;   // Kaptivate's own small number for the device, 0 until it's been given one
+
+        union
+        {
+            KeyboardData keyboard;
+            MouseButtonData button;
+            MouseWheelData wheel;
+            MouseMoveData move;
+        } data;
+
+        unsigned int flags;           // EventFlags
+        LONGLONG enqueued;            // Ticks when it was queued for the hook thread, 0 unless tracing latency
+    };
+
+    // What to do with new events when a queue is already holding as many as it's allowed to
+    enum OverflowPolicy
+    {
+        OVERFLOW_BLOCK = 1,           // Make the raw input thread wait until there's room
+        OVERFLOW_DROP_OLDEST = 2,     // Throw away the oldest queued events
+        OVERFLOW_DROP_NEWEST = 3,     // Throw away the incoming event
+        OVERFLOW_COALESCE = 4         // Merge the oldest mouse moves and wheel turns into later ones, drop anything else
+    };
+
+    // A snapshot of how an event queue is coping
+    struct QueueStats
+    {
+        unsigned int capacity;
+        OverflowPolicy policy;
+        unsigned int depth;           // Events waiting right now
+        unsigned int highWater;       // The most events that have been waiting at once
+        unsigned int dropped;         // Events thrown away
+        unsigned int coalesced;       // Events merged into a later one because the queue was full
+        unsigned int blocked;         // Events the raw input thread had to wait to queue
+    };
+
+    // How well keyboard or mouse hook calls are being paired up with raw events
+    struct CorrelationStats
+    {
+        unsigned int matched;         // Hook calls that found their raw event
+        unsigned int missed;          // Hook calls that gave up waiting for it
+        unsigned int late;            // Raw events that showed up after their hook call gave up
+        unsigned int expired;         // Raw events no hook call ever asked about
+        unsigned int pending;         // Raw events waiting for their hook call right now
+    };
+
+    // The parts of an event's life that latency tracing measures
+    enum LatencyStage
+    {
+        LATENCY_DECODE = 0,           // Raw event decoded -> queued for the hook thread
+        LATENCY_QUEUED = 1,           // Queued -> paired up with its hook call
+        LATENCY_HOOK_WAIT = 2,        // Hook called -> its raw event found
+        LATENCY_HANDLER = 3,          // One call to one handler
+        LATENCY_HOOK = 4,             // Hook called -> decision made (what every keystroke on the system waits for)
+        LATENCY_TOTAL = 5,            // Raw event decoded -> decision made
+        LATENCY_STAGES = 6
+    };
+
+    // Percentiles are accurate to about 6%
+    struct StageLatency
+    {
+        unsigned int count;
+        double meanUs;
+        double p50Us;
+        double p90Us;
+        double p99Us;
+        double p999Us;
+        double maxUs;
+    };
+
+    struct LatencyStats
+    {
+        bool enabled;
+        StageLatency stages[LATENCY_STAGES]; // Indexed by LatencyStage
+    };
+
+    // How one handler is doing on one device. Only the calls that decide events are counted, not observers.
+    struct HandlerStats
+    {
+        void* handler;                // The KeyboardHandler* or MouseHandler*
+        bool keyboard;
+        HANDLE device;
+        unsigned int calls;
+        double totalUs;               // Wall time
+        double meanUs;
+        double p99Us;
+        double maxUs;
+        ULONGLONG cpuCycles;          // Cycles charged to the calling thread, so time spent blocked doesn't count
+    };
+
+    // Gets handler profiles every so often, on a thread of its own
+    class KAPTIVATE_API HandlerStatsListener
+    {
+    public:
+        virtual void HandleStats(const std::vector<HandlerStats>& stats) = 0;
+    };
+
     // Information about a particular keyboard
     struct KeyboardInfo
     {
@@ -63,19 +211,15 @@ namespace Kaptivate
     class KAPTIVATE_API KeyboardEvent
     {
     private:
-        HANDLE deviceHandle;
+        EventRecord* record;
         KeyboardInfo* info;
 
-        unsigned int vkey;
-        unsigned int scanCode;
-        unsigned int wmMessage;
-        bool keyUp;
-        Decision decision;
-
     public:
-        KeyboardEvent(HANDLE device, unsigned int vkey, unsigned int scanCode, unsigned int wmMessage, bool keyUp);
+        KeyboardEvent(EventRecord& record);
         ~KeyboardEvent();
 
+        const EventRecord& getRecord() const;
+
         HANDLE getDeviceHandle() const;
         KeyboardInfo* getDeviceInfo() const;
         void setDeviceInfo(KeyboardInfo* kbdInfo);
@@ -94,6 +238,11 @@ namespace Kaptivate
     {
     public:
         virtual void HandleKeyEvent(KeyboardEvent& evt) = 0;
+
+        // Called instead of HandleKeyEvent when registered as observe-only. The events are all from the same
+        // device, in order, and have already been decided. By default this just calls HandleKeyEvent for
+        // each one; override it to process the whole batch at once.
+        virtual void HandleKeyEvents(KeyboardEvent* events, unsigned int count);
     };
 
     // Information about a particular mouse
@@ -107,18 +256,21 @@ namespace Kaptivate
     class KAPTIVATE_API MouseButtonEvent
     {
     private:
-        HANDLE deviceHandle;
+        EventRecord* record;
         MouseInfo* info;
-        Decision decision;
 
     public:
-        MouseButtonEvent(HANDLE device);
+        MouseButtonEvent(EventRecord& record);
         ~MouseButtonEvent();
 
+        const EventRecord& getRecord() const;
+
         HANDLE getDeviceHandle() const;
         MouseInfo* getDeviceInfo() const;
         void setDeviceInfo(MouseInfo* mouseInfo);
 
+        unsigned int getButtonFlags() const;
+
         Decision getDecision() const;
         void setDecision(Decision decision);
     };
@@ -127,18 +279,23 @@ namespace Kaptivate
     class KAPTIVATE_API MouseWheelEvent
     {
     private:
-        HANDLE deviceHandle;
+        EventRecord* record;
         MouseInfo* info;
-        Decision decision;
 
     public:
-        MouseWheelEvent(HANDLE device);
+        MouseWheelEvent(EventRecord& record);
         ~MouseWheelEvent();
 
+        const EventRecord& getRecord() const;
+
         HANDLE getDeviceHandle() const;
         MouseInfo* getDeviceInfo() const;
         void setDeviceInfo(MouseInfo* mouseInfo);
 
+        int getDelta() const;
+        bool isHorizontal() const;
+        unsigned int getSampleCount() const;
+
         Decision getDecision() const;
         void setDecision(Decision decision);
     };
@@ -147,18 +304,24 @@ namespace Kaptivate
     class KAPTIVATE_API MouseMoveEvent
     {
     private:
-        HANDLE deviceHandle;
+        EventRecord* record;
         MouseInfo* info;
-        Decision decision;
 
     public:
-        MouseMoveEvent(HANDLE device);
+        MouseMoveEvent(EventRecord& record);
         ~MouseMoveEvent();
 
+        const EventRecord& getRecord() const;
+
         HANDLE getDeviceHandle() const;
         MouseInfo* getDeviceInfo() const;
         void setDeviceInfo(MouseInfo* mouseInfo);
 
+        int getDeltaX() const;
+        int getDeltaY() const;
+        bool isAbsolute() const;
+        unsigned int getSampleCount() const;
+
         Decision getDecision() const;
         void setDecision(Decision decision);
     };
@@ -170,14 +333,82 @@ namespace Kaptivate
         virtual void HandleButtonEvent(MouseButtonEvent& evt) = 0;
         virtual void HandleWheelEvent(MouseWheelEvent& evt) = 0;
         virtual void HandleMoveEvent(MouseMoveEvent& evt) = 0;
+
+        // Called instead of the methods above when registered as observe-only, with a batch of events of
+        // one kind from one device. See KeyboardHandler::HandleKeyEvents.
+        virtual void HandleButtonEvents(MouseButtonEvent* events, unsigned int count);
+        virtual void HandleWheelEvents(MouseWheelEvent* events, unsigned int count);
+        virtual void HandleMoveEvents(MouseMoveEvent* events, unsigned int count);
+    };
+
+    // Where a backend sends what it captures. KaptivateAPI is the only one of these.
+    class KAPTIVATE_API InputSink
+    {
+    public:
+        virtual ~InputSink() {}
+
+        // Capture side: a device has reported an event. Everything but the sequence number must be filled
+        // in. Always called from the same thread.
+        virtual void pushRawKeyboard(EventRecord& rec) = 0;
+        virtual void pushRawMouse(EventRecord& rec) = 0;
+
+        // Same, for everything a backend read in one go. Keyboard and mouse records may be mixed, in the
+        // order they arrived. Cheaper than pushing them one at a time.
+        virtual void pushRawBatch(EventRecord* records, unsigned int count) = 0;
+
+        // Tell the handlers about a device that the Windows device list doesn't know about. Call these from
+        // InputBackend::start, before any events from the device are pushed.
+        virtual void announceKeyboard(HANDLE device, const std::string& name) = 0;
+        virtual void announceMouse(HANDLE device, const std::string& name) = 0;
+
+        // Something has been plugged in or pulled out. Safe from any thread, the capture thread included:
+        // the device list is looked at again later, somewhere else.
+        virtual void devicesChanged() = 0;
+
+        // Decision side: something wants to know whether to let an event through. Waits for the matching
+        // raw event, runs the handlers on it and returns PERMIT or CONSUME. Always called from the same
+        // thread, which may or may not be the capture thread. message is the mouse message the hook was
+        // called with (WM_MOUSEMOVE, WM_LBUTTONDOWN, WM_MOUSEWHEEL and so on); it decides which kind of raw
+        // event answers it, and messages no raw event stands for are let through without asking.
+        virtual Decision decideKeyboard(unsigned int vkey, unsigned int scanCode, bool keyUp) = 0;
+        virtual Decision decideMouse(unsigned int message) = 0;
+    };
+
+    // Where events come from, and where decisions go. Kaptivate uses the Windows raw input API and hooks
+    // unless it's told otherwise. The rest of the library is Windows only, so there are no backends for
+    // other platforms (see the README).
+    class KAPTIVATE_API InputBackend
+    {
+    public:
+        virtual ~InputBackend() {}
+
+        // Start feeding the sink. Throws a KaptivateException (after cleaning up) if that's not possible.
+        virtual void start(InputSink* sink, bool wantMouse, bool wantKeyboard, bool startSuspended, UINT msgTimeoutMs) = 0;
+
+        // Stop feeding the sink. Nothing is pushed or asked about once this returns.
+        virtual void stop() = 0;
+
+        // While suspended, everything is let through without asking the sink
+        virtual void suspend() = 0;
+        virtual void resume() = 0;
+
+        // Is capture still working?
+        virtual bool isAlive() const = 0;
     };
 
     // Dummy declarations
     class EventDispatcher;
     class EventQueue;
+    class KeyCorrelator;
+    class MouseCorrelator;
+    class ObserverPool;
+    class CaptureRecorder;
+    class LatencyTracer;
+    class HandlerProfiler;
+    class FlightRecorder;
 
     // The main Kaptivate API
-    class KAPTIVATE_API KaptivateAPI
+    class KAPTIVATE_API KaptivateAPI : private InputSink
     {
     private:
 
@@ -189,37 +420,63 @@ namespace Kaptivate
         // Class members
         EventDispatcher* dispatcher;
         EventQueue* events;
+        KeyCorrelator* correlator;
+        MouseCorrelator* mouseCorrelator;
+        ObserverPool* observers;
 
-        // Status
-        bool running;
-        bool suspended;
+        // Where the events come from
+        InputBackend* backend;
+        InputBackend* defaultBackend;
+
+        // Only touched by the raw input thread
+        unsigned int rawSequence;
 
-        // Stuff for the main message loop thread
-        HANDLE hookMsgLoopThread;
-        HANDLE rawMsgLoopThread;
-        HWND hookCallbackWindow;
-        HWND rawCallbackWindow;
+        // Device rescans: whether one is waiting to start, and how many haven't finished yet
+        volatile LONG devicesPending;
+        volatile LONG deviceScans;
 
-        // To keep track of what type of devices we want from the raw API
-        bool rawKeyboardRunning;
-        bool rawMouseRunning;
-        bool userWantsMouse;
-        bool userWantsKeyboard;
+        // Writes everything to a capture log, if asked to
+        CaptureRecorder* recorder;
+        bool recording;
 
-        // Internal utility methods
-        bool tryStopMsgLoop();
-        bool pingMessageWindow(HWND wnd) const;
-        bool startRawCapture(bool wantMouse, bool wantKeyboard);
-        bool stopRawCapture();
+        // Per-stage latency histograms, if asked for
+        LatencyTracer* tracer;
 
-        // Message processing methods
-        void ProcessRawInput(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam);
+        // Per-handler profiles, if asked for
+        HandlerProfiler* profiler;
 
-        LRESULT ProcessMouseHook(HWND hWnd, WPARAM wParam, LPARAM lParam);
-        void ProcessRawMouseInput(RAWINPUT* raw);
+        // The last few thousand events, in memory, if asked for
+        FlightRecorder* flight;
+
+        // Status
+        bool running;
+        bool suspended;
 
-        LRESULT ProcessKeyboardHook(HWND hWnd, WPARAM wParam, LPARAM lParam);
-        void ProcessRawKeyboardInput(RAWINPUT* raw);
+        // How long a hook call may wait for its raw event, and what it says if the event doesn't show up
+        DWORD hookWaitMs;
+        Decision defaultDecision;
+
+        // Run the keyboard handlers on the raw thread instead of the hook thread?
+        bool speculativeDispatch;
+
+        // InputSink
+        void pushRawKeyboard(EventRecord& rec);
+        void pushRawMouse(EventRecord& rec);
+        void pushRawBatch(EventRecord* records, unsigned int count);
+        void announceKeyboard(HANDLE device, const std::string& name);
+        void announceMouse(HANDLE device, const std::string& name);
+        void devicesChanged();
+        Decision decideKeyboard(unsigned int vkey, unsigned int scanCode, bool keyUp);
+        Decision decideMouse(unsigned int message);
+
+        Decision timeoutDecision() const;
+        Decision dispatchMouse(EventRecord& rec);
+        void startRecording();
+        void stopRecording();
+        void traceEnqueue(EventRecord* records, unsigned int count);
+        void traceFound(LONGLONG asked, const EventRecord& rec);
+        void traceDecision(LONGLONG asked, const EventRecord* rec);
+        void waitForDeviceScans();
 
     public:
 
@@ -245,18 +502,118 @@ namespace Kaptivate
         bool isRunning() const;
         bool isSuspended() const;
 
+        // Queue limits. These can only be changed while Kaptivate isn't running. The statistics are reset
+        // every time capture starts.
+        void setKeyboardQueueLimit(unsigned int capacity, OverflowPolicy policy);
+        void setMouseQueueLimit(unsigned int capacity, OverflowPolicy policy);
+        QueueStats getKeyboardQueueStats() const;
+        QueueStats getMouseQueueStats() const;
+
+        // The decision used when a keyboard hook call gives up waiting for its raw event (which happens
+        // shortly before the hook itself would give up on us). PERMIT by default. Mouse hook calls only wait
+        // a few ms, since many mouse messages have no raw event behind them, and are always permitted.
+        void setDefaultDecision(Decision decision);
+        Decision getDefaultDecision() const;
+
+        // Safe from any thread, but only a snapshot. Reset every time capture starts.
+        CorrelationStats getKeyboardCorrelationStats() const;
+        CorrelationStats getMouseCorrelationStats() const;
+
+        // Speculative dispatch runs the keyboard handlers as soon as the raw event arrives, on the raw input
+        // thread, and keeps the decision with the event. When the hook asks, the answer is usually already
+        // there, so the time your handlers take no longer holds up the hook (and every keystroke on the
+        // system) whenever the raw event gets in first. Your keyboard handlers will then be called from the
+        // raw input thread instead of the hook thread, while mouse handlers stay on the hook thread; with
+        // mouse capture on, the two run at the same time, so a handler that's both a KeyboardHandler and a
+        // MouseHandler must cope with being called from both at once. Can only be changed while Kaptivate
+        // isn't running.
+        void setSpeculativeDispatch(bool enabled);
+        bool getSpeculativeDispatch() const;
+
+        // Capture from something other than the Windows hooks. The backend stays yours, and must outlive
+        // its use here; NULL goes back to the Windows hooks. Can only be changed while Kaptivate isn't running.
+        void setBackend(InputBackend* backend);
+
+        // Record every raw event and every decision (with when it was asked for) to a binary log, along with
+        // every device that's known or turns up. The log is rewritten every time capture starts; an empty
+        // path turns recording off. Play it back with ReplayBackend. Can only be changed while Kaptivate
+        // isn't running.
+        void setRecordFile(const std::string& path);
+
+        // Log entries lost because the disk couldn't keep up, during the last capture
+        unsigned int getRecordDropped() const;
+
+        // Did writing the log fail during the last capture (disk full, say)? If so it stops where the
+        // failure happened, and everything after that is counted in getRecordDropped.
+        bool getRecordFailed() const;
+
+        // Time every stage of every event's life (see LatencyStage) into histograms. It costs a few
+        // timer reads per event and no locks, so it can be left on. Can be turned on and off at any time.
+        // The histograms are reset every time capture starts.
+        void setLatencyTracing(bool enabled);
+        bool getLatencyTracing() const;
+        LatencyStats getLatencyStats() const;
+        void resetLatencyStats();
+
+        // Profile every handler call on every device: call count, wall time, CPU cycles and a latency
+        // histogram. Costs nothing while off. Can be turned on and off at any time; the profiles are reset
+        // every time capture starts. The listener, if any, gets a snapshot every intervalMs until it's
+        // replaced or set to NULL, and must stay around until then. Profiles go once their handler is
+        // unregistered or their device unplugged. There can be a couple of thousand at once; calls that
+        // would need another are only counted, in getUnprofiledCalls.
+        void setHandlerProfiling(bool enabled);
+        bool getHandlerProfiling() const;
+        std::vector<HandlerStats> getHandlerStats() const;
+        unsigned int getUnprofiledCalls() const;
+        void resetHandlerStats();
+        void setHandlerStatsListener(HandlerStatsListener* listener, DWORD intervalMs = 1000);
+
+        // Keep the last few thousand raw events, hook calls and decisions in memory, at the cost of a copy
+        // per event. With a dump prefix, they're written to <prefix>-NNN.kfr whenever a keyboard hook call
+        // gives up waiting, a decision takes longer than slowMs (0 for never), or the hooks stop answering;
+        // at most one every few seconds. kaptivate_flight turns a dump into a trace you can look at. Can be
+        // changed at any time.
+        void setFlightRecorder(bool enabled, const std::string& dumpPrefix = "", DWORD slowMs = 0);
+        bool getFlightRecorder() const;
+
+        // Write out what the flight recorder has right now
+        void dumpFlightRecorder(const std::string& path);
+
+        // Remember device names, and which handlers want which devices, in a file. Enumerating again in the
+        // same Windows session then takes them from there instead of asking about every device, so routing
+        // can start straight away; they're checked in the background afterwards, and the file is kept up to
+        // date. An empty path turns it off. Can be changed at any time, but is only any use before enumerating.
+        void setDeviceCacheFile(const std::string& path);
+
         // Enumeration
         std::vector<KeyboardInfo> enumerateKeyboards();
         std::vector<MouseInfo> enumerateMice();
 
-        // Registration
-        void registerKeyboardHandler(std::string idRegex, KeyboardHandler* handler);
-        void resgisterMouseHandler(std::string idRegex, MouseHandler* handler);
+        // Registration. Observe-only handlers see every event from a matching device after it has been
+        // decided, in batches, on one of the observer threads. They can't change the decision, but they
+        // never hold up the hook either. Each device always goes to the same observer thread, so its events
+        // arrive in order. Once unregister returns, the handler won't be called again.
+        //
+        // A device that shows up without having been enumerated is looked up in the background. Until its
+        // name is known its events only go to the handlers registered with registerDefault*Handler, which
+        // get them with no device info (getDeviceInfo() returns NULL). After that it's matched like any other.
+        void registerKeyboardHandler(std::string idRegex, KeyboardHandler* handler, bool observeOnly = false);
+        void resgisterMouseHandler(std::string idRegex, MouseHandler* handler, bool observeOnly = false);
+        void registerDefaultKeyboardHandler(KeyboardHandler* handler, bool observeOnly = false);
+        void registerDefaultMouseHandler(MouseHandler* handler, bool observeOnly = false);
         void unregisterKeyboardHandler(KeyboardHandler* handler);
         void unregisterMouseHandler(MouseHandler* handler);
 
-        // Window message processing
-        LRESULT _ProcessHookWndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam);
-        LRESULT _ProcessRawWndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam);
+        // How many threads feed the observe-only handlers. Defaults to the number of processors, up to 4.
+        // Can only be changed while Kaptivate isn't running.
+        void setObserverThreads(unsigned int count);
+        unsigned int getObserverThreads() const;
+
+        // How many decided events were thrown away instead of going to the observe-only handlers, because
+        // their thread was too far behind. Reset each time Kaptivate starts.
+        unsigned int getObserverDrops() const;
+
+        // Internal use only
+        void _ScanDevices();
     };
 }
@@ -0,0 +1,311 @@
+/*
+ * key_correlator.cpp
+ * This file is a part of Kaptivate
+ * https://github.com/FunkyTownEnterprises/Kaptivate
+ *
+ * Copyright (c) 2011 Ben Cable, Chris Eberle
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "stdafx.hpp"
+#include "key_correlator.hpp"
+#include "event_queue.hpp"
+#include "kaptivate_exceptions.hpp"
+
+using namespace Kaptivate;
+
+// Entry states
+#define ENTRY_EMPTY  0
+#define ENTRY_RAW    1   // A raw event waiting for its hook call
+#define ENTRY_MISSED 2   // A hook call that gave up, waiting for its raw event to show up late
+
+// How long a hook call that gave up waits for its raw event to be recognised as late
+#define MISS_TTL_MS 500
+
+// The table never gets more than this full (in quarters), so probe chains stay short
+#define MAX_LOAD_QUARTERS 3
+
+KeyCorrelator::KeyCorrelator(unsigned int capacity, DWORD ttlMs)
+{
+    unsigned int actual = 16;
+    while(actual < capacity && actual < 0x10000)
+        actual <<= 1;
+
+    slots = new Entry[actual];
+    mask = actual - 1;
+
+    LARGE_INTEGER freq;
+    QueryPerformanceFrequency(&freq);
+    ticksPerMs = freq.QuadPart / 1000;
+    if(ticksPerMs == 0)
+        ticksPerMs = 1;
+
+    reset(ttlMs);
+}
+
+KeyCorrelator::~KeyCorrelator()
+{
+    delete[] slots;
+    slots = NULL;
+}
+
+void KeyCorrelator::reset(DWORD ttlMs)
+{
+    for(unsigned int i = 0; i <= mask; i++)
+        slots[i].state = ENTRY_EMPTY;
+    used = 0;
+
+    ttlTicks = (LONGLONG)ttlMs * ticksPerMs;
+    missTtlTicks = (LONGLONG)MISS_TTL_MS * ticksPerMs;
+    nextSweep = 0;
+
+    matched = 0;
+    missed = 0;
+    late = 0;
+    expired = 0;
+    pending = 0;
+}
+
+// Everything the raw and hook sides agree on about a keystroke, packed into one word
+unsigned int KeyCorrelator::makeKey(unsigned int vkey, unsigned int scanCode, bool keyUp)
+{
+    return (vkey & 0xFF) | ((scanCode & 0xFF) << 8) | (keyUp ? 0x10000 : 0);
+}
+
+// Where a key's probe chain starts (Fibonacci hashing)
+unsigned int KeyCorrelator::home(unsigned int key) const
+{
+    return ((key + 1) * 2654435761u) & mask;
+}
+
+LONGLONG KeyCorrelator::now() const
+{
+    LARGE_INTEGER n;
+    QueryPerformanceCounter(&n);
+    return n.QuadPart;
+}
+
+bool KeyCorrelator::match(EventQueue* queue, unsigned int vkey, unsigned int scanCode, bool keyUp, DWORD timeoutMs,
+                          EventRecord& rec)
+{
+    unsigned int key = makeKey(vkey, scanCode, keyUp);
+    LONGLONG started = now();
+    LONGLONG deadline = started + (LONGLONG)timeoutMs * ticksPerMs;
+
+    sweep(started, false);
+
+    // Usually the raw event is already here
+    pull(queue, 0, started);
+    if(take(key, rec, started))
+    {
+        matched++;
+        return true;
+    }
+
+    // Keep pulling until ours shows up
+    while(queue->running())
+    {
+        LONGLONG t = now();
+        DWORD remaining = INFINITE;
+        if(timeoutMs != INFINITE)
+        {
+            if(t >= deadline)
+                break;
+            remaining = (DWORD)((deadline - t + ticksPerMs - 1) / ticksPerMs);
+        }
+
+        if(!pull(queue, remaining, t))
+            continue;
+
+        if(take(key, rec, now()))
+        {
+            matched++;
+            return true;
+        }
+    }
+
+    if(queue->running())
+    {
+        missed++;
+        markMissed(key, now());
+    }
+
+    return false;
+}
+
+CorrelationStats KeyCorrelator::getStats() const
+{
+    CorrelationStats stats;
+    stats.matched = matched;
+    stats.missed = missed;
+    stats.late = late;
+    stats.expired = expired;
+    stats.pending = pending;
+    return stats;
+}
+
+// Move whatever raw events are waiting (waiting up to timeoutMs for the first) into the table
+bool KeyCorrelator::pull(EventQueue* queue, DWORD timeoutMs, LONGLONG now)
+{
+    unsigned int count = queue->DequeueKeyboardBatch(batch, sizeof(batch) / sizeof(batch[0]), timeoutMs);
+    for(unsigned int i = 0; i < count; i++)
+        insert(batch[i], now);
+    return count > 0;
+}
+
+// File a raw event under its key, unless it's the late arrival of a hook call that already gave up
+void KeyCorrelator::insert(const EventRecord& rec, LONGLONG now)
+{
+    const KeyboardData& kbd = rec.data.keyboard;
+    unsigned int key = makeKey(kbd.vkey, kbd.scanCode, kbd.keyUp);
+
+    for(unsigned int i = home(key); slots[i].state != ENTRY_EMPTY; i = (i + 1) & mask)
+    {
+        if(slots[i].state == ENTRY_MISSED && slots[i].key == key && slots[i].expires > now)
+        {
+            // Too late, its hook call has already been answered
+            remove(i);
+            late++;
+            return;
+        }
+    }
+
+    put(key, ENTRY_RAW, rec.timestamp + ttlTicks, &rec);
+}
+
+// Take the oldest raw event filed under a key
+bool KeyCorrelator::take(unsigned int key, EventRecord& rec, LONGLONG now)
+{
+    unsigned int found = mask + 1;
+    for(unsigned int i = home(key); slots[i].state != ENTRY_EMPTY; i = (i + 1) & mask)
+    {
+        Entry& e = slots[i];
+        if(e.state != ENTRY_RAW || e.key != key || e.expires <= now)
+            continue;
+        if(found > mask || (int)(e.rec.sequence - slots[found].rec.sequence) < 0)
+            found = i;
+    }
+
+    if(found > mask)
+        return false;
+
+    rec = slots[found].rec;
+    remove(found);
+    return true;
+}
+
+// Remember that a hook call gave up on a key, so that its raw event can be recognised when it shows up
+void KeyCorrelator::markMissed(unsigned int key, LONGLONG now)
+{
+    put(key, ENTRY_MISSED, now + missTtlTicks, NULL);
+}
+
+// Add an entry, making room first if the table is getting full
+void KeyCorrelator::put(unsigned int key, unsigned char state, LONGLONG expires, const EventRecord* rec)
+{
+    if(used >= ((mask + 1) / 4) * MAX_LOAD_QUARTERS)
+    {
+        sweep(now(), true);
+
+        // Still full? Then the oldest entry has to go.
+        if(used >= ((mask + 1) / 4) * MAX_LOAD_QUARTERS)
+        {
+            unsigned int oldest = mask + 1;
+            for(unsigned int i = 0; i <= mask; i++)
+            {
+                if(slots[i].state != ENTRY_EMPTY && (oldest > mask || slots[i].expires < slots[oldest].expires))
+                    oldest = i;
+            }
+
+            if(slots[oldest].state == ENTRY_RAW)
+                expired++;
+            remove(oldest);
+        }
+    }
+
+    unsigned int i = home(key);
+    while(slots[i].state != ENTRY_EMPTY)
+        i = (i + 1) & mask;
+
+    slots[i].key = key;
+    slots[i].state = state;
+    slots[i].expires = expires;
+    if(rec)
+    {
+        slots[i].rec = *rec;
+        pending++;
+    }
+    used++;
+}
+
+// Empty a slot, shifting later members of the probe chain back so that lookups never need tombstones
+void KeyCorrelator::remove(unsigned int index)
+{
+    if(slots[index].state == ENTRY_RAW)
+        pending--;
+
+    unsigned int i = index;
+    unsigned int j = index;
+    while(true)
+    {
+        j = (j + 1) & mask;
+        if(slots[j].state == ENTRY_EMPTY)
+            break;
+
+        // Leave the entry alone if its home is cyclically within (i, j]
+        unsigned int k = home(slots[j].key);
+        if((i <= j) ? (i < k && k <= j) : (i < k || k <= j))
+            continue;
+
+        slots[i] = slots[j];
+        i = j;
+    }
+
+    slots[i].state = ENTRY_EMPTY;
+    used--;
+}
+
+// Throw out expired entries. Unless forced, only bothers every so often.
+void KeyCorrelator::sweep(LONGLONG now, bool force)
+{
+    if(!force && now < nextSweep)
+        return;
+    nextSweep = now + missTtlTicks;
+
+    unsigned int i = 0;
+    while(i <= mask)
+    {
+        if(slots[i].state != ENTRY_EMPTY && slots[i].expires <= now)
+        {
+            if(slots[i].state == ENTRY_RAW)
+                expired++;
+
+            // Removing shifts a later entry into this slot, so look at it again
+            remove(i);
+            continue;
+        }
+        i++;
+    }
+}
@@ -0,0 +1,113 @@
+/*
+ * key_correlator.hpp
+ * This file is a part of Kaptivate
+ * https://github.com/FunkyTownEnterprises/Kaptivate
+ *
+ * Copyright (c) 2011 Ben Cable, Chris Eberle
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include "kaptivate.hpp"
+
+namespace Kaptivate
+{
+    class EventQueue;
+
+    // Pairs keyboard hook calls with the raw events they belong to.
+    //
+    // Neither API promises to go first, and the hook can be called for keys that never produce a raw event
+    // (or the other way around), so simply taking the oldest raw event for every hook call lets the two
+    // drift apart. Instead raw events are pulled off the queue into a small open-addressing table, keyed on
+    // (vkey, scan code, key up), and each hook call takes the oldest entry with its own key. Entries that
+    // nobody asks for expire after a while.
+    //
+    // When a hook call gives up waiting, a short-lived marker is left behind, so that the raw event it was
+    // waiting for is recognised as late and thrown away rather than being handed to the next hook call.
+    //
+    // Only ever used by the hook thread.
+    class KeyCorrelator
+    {
+    private:
+        struct Entry
+        {
+            unsigned int key;
+            unsigned char state;
+            LONGLONG expires;
+            EventRecord rec;
+        };
+
+        Entry* slots;
+        unsigned int mask;
+        unsigned int used;
+
+        LONGLONG ticksPerMs;
+        LONGLONG ttlTicks;
+        LONGLONG missTtlTicks;
+        LONGLONG nextSweep;
+
+        // Where raw events land on their way from the queue into the table
+        EventRecord batch[32];
+
+        // Stats, read from other threads
+        volatile unsigned int matched;
+        volatile unsigned int missed;
+        volatile unsigned int late;
+        volatile unsigned int expired;
+        volatile unsigned int pending;
+
+        static unsigned int makeKey(unsigned int vkey, unsigned int scanCode, bool keyUp);
+        unsigned int home(unsigned int key) const;
+        LONGLONG now() const;
+
+        bool pull(EventQueue* queue, DWORD timeoutMs, LONGLONG now);
+        void insert(const EventRecord& rec, LONGLONG now);
+        bool take(unsigned int key, EventRecord& rec, LONGLONG now);
+        void markMissed(unsigned int key, LONGLONG now);
+        void put(unsigned int key, unsigned char state, LONGLONG expires, const EventRecord* rec);
+        void remove(unsigned int index);
+        void sweep(LONGLONG now, bool force);
+
+        // Not copyable
+        KeyCorrelator(const KeyCorrelator&);
+        KeyCorrelator& operator=(const KeyCorrelator&);
+
+    public:
+        // capacity is rounded up to a power of two, ttlMs is how long a raw event waits for its hook call
+        KeyCorrelator(unsigned int capacity = 256, DWORD ttlMs = 5000);
+        ~KeyCorrelator();
+
+        // Forget everything and zero the stats. Not safe while the hook thread is running.
+        void reset(DWORD ttlMs);
+
+        // Find the raw event for a hook call, pulling raw events off the queue until it turns up or timeoutMs
+        // runs out. Returns false if it didn't turn up.
+        bool match(EventQueue* queue, unsigned int vkey, unsigned int scanCode, bool keyUp, DWORD timeoutMs,
+                   EventRecord& rec);
+
+        CorrelationStats getStats() const;
+    };
+}
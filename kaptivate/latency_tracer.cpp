@@ -0,0 +1,139 @@
+/*
+ * latency_tracer.cpp
+ * This file is a part of Kaptivate
+ * https://github.com/FunkyTownEnterprises/Kaptivate
+ *
+ * Copyright (c) 2011 Ben Cable, Chris Eberle
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "stdafx.hpp"
+#include "latency_tracer.hpp"
+
+#include <vector>
+#include <string.h>
+
+using namespace Kaptivate;
+
+////////////////////////////////////////////////////////////////////////////////
+// LatencyHistogram
+
+LatencyHistogram::LatencyHistogram()
+{
+    reset();
+}
+
+ULONGLONG LatencyHistogram::bucketBase(unsigned int bucket)
+{
+    if(bucket < 2 * LATENCY_SUB_BUCKETS)
+        return bucket;
+
+    unsigned int shift = bucket / LATENCY_SUB_BUCKETS - 1;
+    ULONGLONG mantissa = bucket % LATENCY_SUB_BUCKETS + LATENCY_SUB_BUCKETS;
+    return mantissa << shift;
+}
+
+void LatencyHistogram::reset()
+{
+    for(unsigned int i = 0; i < LATENCY_BUCKETS; i++)
+        InterlockedExchange(&counts[i], 0);
+}
+
+// Percentiles come out as the middle of the bucket they fall in. The counts are read while they may still
+// be changing, so the result is only ever a close snapshot.
+StageLatency LatencyHistogram::summarize(double ticksPerUs) const
+{
+    StageLatency result;
+    memset(&result, 0, sizeof(StageLatency));
+
+    std::vector<LONG> snapshot(LATENCY_BUCKETS);
+    ULONGLONG total = 0;
+    double sum = 0.0;
+    int highest = -1;
+    for(unsigned int i = 0; i < LATENCY_BUCKETS; i++)
+    {
+        snapshot[i] = counts[i];
+        if(snapshot[i] <= 0)
+            continue;
+
+        total += snapshot[i];
+        double mid = (bucketBase(i) + bucketBase(i + 1)) / 2.0;
+        sum += mid * snapshot[i];
+        highest = i;
+    }
+
+    if(total == 0)
+        return result;
+
+    result.count = (unsigned int)total;
+    result.meanUs = sum / total / ticksPerUs;
+    result.maxUs = (double)bucketBase(highest + 1) / ticksPerUs;
+
+    const double pcts[] = { 0.50, 0.90, 0.99, 0.999 };
+    double* outs[] = { &result.p50Us, &result.p90Us, &result.p99Us, &result.p999Us };
+    unsigned int next = 0;
+    ULONGLONG seen = 0;
+    for(unsigned int i = 0; i < LATENCY_BUCKETS && next < 4; i++)
+    {
+        if(snapshot[i] <= 0)
+            continue;
+        seen += snapshot[i];
+        while(next < 4 && seen >= (ULONGLONG)(pcts[next] * total + 0.5))
+        {
+            double mid = (bucketBase(i) + bucketBase(i + 1)) / 2.0;
+            *outs[next++] = mid / ticksPerUs;
+        }
+    }
+
+    return result;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// LatencyTracer
+
+LatencyTracer::LatencyTracer()
+{
+    enabled = 0;
+
+    LARGE_INTEGER freq;
+    QueryPerformanceFrequency(&freq);
+    ticksPerUs = (double)freq.QuadPart / 1000000.0;
+}
+
+void LatencyTracer::reset()
+{
+    for(int i = 0; i < LATENCY_STAGES; i++)
+        stages[i].reset();
+}
+
+LatencyStats LatencyTracer::getStats() const
+{
+    LatencyStats stats;
+    memset(&stats, 0, sizeof(LatencyStats));
+    stats.enabled = isEnabled();
+    for(int i = 0; i < LATENCY_STAGES; i++)
+        stats.stages[i] = stages[i].summarize(ticksPerUs);
+    return stats;
+}
@@ -0,0 +1,131 @@
+/*
+ * latency_tracer.hpp
+ * This file is a part of Kaptivate
+ * https://github.com/FunkyTownEnterprises/Kaptivate
+ *
+ * Copyright (c) 2011 Ben Cable, Chris Eberle
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include "kaptivate.hpp"
+#include <intrin.h>
+
+#pragma intrinsic(_BitScanReverse)
+
+// Each power of two is split into this many buckets, so a bucket is never more than 1/16th (about 6%)
+// wider than the values in it. Values below 32 ticks get a bucket each.
+#define LATENCY_SUB_BITS    4
+#define LATENCY_SUB_BUCKETS (1 << LATENCY_SUB_BITS)
+#define LATENCY_BUCKETS     (64 * LATENCY_SUB_BUCKETS)
+
+namespace Kaptivate
+{
+    // A log-linear histogram of tick counts, in the style of HdrHistogram. Recording is one bit scan and
+    // one increment, with no locks and no allocation.
+    class LatencyHistogram
+    {
+    private:
+        volatile LONG counts[LATENCY_BUCKETS];
+
+    public:
+        LatencyHistogram();
+
+        static unsigned int bucketOf(ULONGLONG ticks)
+        {
+            if(ticks < 2 * LATENCY_SUB_BUCKETS)
+                return (unsigned int)ticks;
+
+            unsigned long high = (unsigned long)(ticks >> 32);
+            unsigned long msb;
+            if(high != 0)
+            {
+                _BitScanReverse(&msb, high);
+                msb += 32;
+            }
+            else
+            {
+                _BitScanReverse(&msb, (unsigned long)ticks);
+            }
+
+            unsigned int shift = msb - LATENCY_SUB_BITS;
+            return shift * LATENCY_SUB_BUCKETS + (unsigned int)(ticks >> shift);
+        }
+
+        // The smallest value that lands in a bucket
+        static ULONGLONG bucketBase(unsigned int bucket);
+
+        // Only one thread may record into a histogram this way
+        void record(LONGLONG ticks)
+        {
+            counts[bucketOf(ticks < 0 ? 0 : (ULONGLONG)ticks)]++;
+        }
+
+        // Any number of threads
+        void recordShared(LONGLONG ticks)
+        {
+            InterlockedIncrement(&counts[bucketOf(ticks < 0 ? 0 : (ULONGLONG)ticks)]);
+        }
+
+        void reset();
+        StageLatency summarize(double ticksPerUs) const;
+    };
+
+    // A histogram for every stage of an event's life (see LatencyStage). The hook thread owns most of
+    // them; the decode stage belongs to the raw thread and the handler stage is shared, since speculative
+    // dispatch runs handlers on the raw thread.
+    class LatencyTracer
+    {
+    private:
+        LatencyHistogram stages[LATENCY_STAGES];
+        volatile LONG enabled;
+        double ticksPerUs;
+
+        // Not copyable
+        LatencyTracer(const LatencyTracer&);
+        LatencyTracer& operator=(const LatencyTracer&);
+
+    public:
+        LatencyTracer();
+
+        // Same clock as EventRecord::timestamp
+        static LONGLONG stamp()
+        {
+            LARGE_INTEGER li;
+            QueryPerformanceCounter(&li);
+            return li.QuadPart;
+        }
+
+        bool isEnabled() const { return enabled != 0; }
+        void setEnabled(bool on) { InterlockedExchange(&enabled, on ? 1 : 0); }
+
+        void record(LatencyStage stage, LONGLONG ticks) { stages[stage].record(ticks); }
+        LatencyHistogram* histogram(LatencyStage stage) { return &stages[stage]; }
+
+        void reset();
+        LatencyStats getStats() const;
+    };
+}
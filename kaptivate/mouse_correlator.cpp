@@ -0,0 +1,384 @@
+/*
+ * mouse_correlator.cpp
+ * This file is a part of Kaptivate
+ * https://github.com/FunkyTownEnterprises/Kaptivate
+ *
+ * Copyright (c) 2011 Ben Cable, Chris Eberle
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "stdafx.hpp"
+#include "mouse_correlator.hpp"
+#include "event_queue.hpp"
+
+using namespace Kaptivate;
+
+// Keys for the kinds of raw event a hook call can wait for. Buttons are keyed on their RI_MOUSE_*_BUTTON_*
+// bits, which all fit below these.
+#define KEY_BUTTONS  0x0FFFF
+#define KEY_MOVE     0x10000
+#define KEY_WHEEL    0x20000
+#define KEY_HWHEEL   0x40000
+
+// How long a hook call that gave up waits for its raw event to be recognised as late
+#define MISS_TTL_MS 500
+
+// The longest a mouse hook call waits for its raw event. Plenty of mouse messages have none behind them
+// (SetCursorPos, a window moving under a cursor that isn't, messages made up from touch or pen input), and
+// the app can't do anything else while its hook call waits. A move doesn't wait at all.
+#define MOUSE_WAIT_MS 10
+
+// Raw events waiting for their hook call. Past this, the oldest is given up on.
+#define MAX_PENDING 64
+
+MouseCorrelator::MouseCorrelator(DWORD ttlMs)
+{
+    LARGE_INTEGER freq;
+    QueryPerformanceFrequency(&freq);
+    ticksPerMs = freq.QuadPart / 1000;
+    if(ticksPerMs == 0)
+        ticksPerMs = 1;
+
+    reset(ttlMs);
+}
+
+void MouseCorrelator::reset(DWORD ttlMs)
+{
+    pending.clear();
+    pending.reserve(MAX_PENDING + 1);
+    misses.clear();
+    stale.clear();
+    stale.reserve(MAX_PENDING);
+    nextStale = 0;
+
+    ttlTicks = (LONGLONG)ttlMs * ticksPerMs;
+    missTtlTicks = (LONGLONG)MISS_TTL_MS * ticksPerMs;
+
+    matched = 0;
+    missed = 0;
+    late = 0;
+    expired = 0;
+    waiting = 0;
+}
+
+unsigned int MouseCorrelator::keyForMessage(unsigned int message)
+{
+    switch(message)
+    {
+    case WM_MOUSEMOVE:
+    case WM_NCMOUSEMOVE:
+        return KEY_MOVE;
+    case WM_MOUSEWHEEL:
+        return KEY_WHEEL;
+    case WM_MOUSEHWHEEL:
+        return KEY_HWHEEL;
+
+    case WM_LBUTTONDOWN:
+    case WM_LBUTTONDBLCLK:
+    case WM_NCLBUTTONDOWN:
+    case WM_NCLBUTTONDBLCLK:
+        return RI_MOUSE_LEFT_BUTTON_DOWN;
+    case WM_LBUTTONUP:
+    case WM_NCLBUTTONUP:
+        return RI_MOUSE_LEFT_BUTTON_UP;
+    case WM_RBUTTONDOWN:
+    case WM_RBUTTONDBLCLK:
+    case WM_NCRBUTTONDOWN:
+    case WM_NCRBUTTONDBLCLK:
+        return RI_MOUSE_RIGHT_BUTTON_DOWN;
+    case WM_RBUTTONUP:
+    case WM_NCRBUTTONUP:
+        return RI_MOUSE_RIGHT_BUTTON_UP;
+    case WM_MBUTTONDOWN:
+    case WM_MBUTTONDBLCLK:
+    case WM_NCMBUTTONDOWN:
+    case WM_NCMBUTTONDBLCLK:
+        return RI_MOUSE_MIDDLE_BUTTON_DOWN;
+    case WM_MBUTTONUP:
+    case WM_NCMBUTTONUP:
+        return RI_MOUSE_MIDDLE_BUTTON_UP;
+
+    // Which X button it was is in the hook's MOUSEHOOKSTRUCTEX, which lives in someone else's process
+    case WM_XBUTTONDOWN:
+    case WM_XBUTTONDBLCLK:
+    case WM_NCXBUTTONDOWN:
+    case WM_NCXBUTTONDBLCLK:
+        return RI_MOUSE_BUTTON_4_DOWN | RI_MOUSE_BUTTON_5_DOWN;
+    case WM_XBUTTONUP:
+    case WM_NCXBUTTONUP:
+        return RI_MOUSE_BUTTON_4_UP | RI_MOUSE_BUTTON_5_UP;
+    }
+
+    return 0;
+}
+
+unsigned int MouseCorrelator::messageFor(const EventRecord& rec)
+{
+    if(rec.type == MOUSE_MOVE_EVENT)
+        return WM_MOUSEMOVE;
+    if(rec.type == MOUSE_WHEEL_EVENT)
+        return rec.data.wheel.horizontal ? WM_MOUSEHWHEEL : WM_MOUSEWHEEL;
+
+    unsigned short flags = rec.data.button.buttonFlags;
+    if(flags & RI_MOUSE_LEFT_BUTTON_DOWN)
+        return WM_LBUTTONDOWN;
+    if(flags & RI_MOUSE_LEFT_BUTTON_UP)
+        return WM_LBUTTONUP;
+    if(flags & RI_MOUSE_RIGHT_BUTTON_DOWN)
+        return WM_RBUTTONDOWN;
+    if(flags & RI_MOUSE_RIGHT_BUTTON_UP)
+        return WM_RBUTTONUP;
+    if(flags & RI_MOUSE_MIDDLE_BUTTON_DOWN)
+        return WM_MBUTTONDOWN;
+    if(flags & RI_MOUSE_MIDDLE_BUTTON_UP)
+        return WM_MBUTTONUP;
+    if(flags & (RI_MOUSE_BUTTON_4_DOWN | RI_MOUSE_BUTTON_5_DOWN))
+        return WM_XBUTTONDOWN;
+    return WM_XBUTTONUP;
+}
+
+// The kind of hook call a raw event answers
+unsigned int MouseCorrelator::makeKey(const EventRecord& rec)
+{
+    if(rec.type == MOUSE_MOVE_EVENT)
+        return KEY_MOVE;
+    if(rec.type == MOUSE_WHEEL_EVENT)
+        return rec.data.wheel.horizontal ? KEY_HWHEEL : KEY_WHEEL;
+    return rec.data.button.buttonFlags & KEY_BUTTONS;
+}
+
+// Does a raw event answer a hook call with this key? A button key may stand for more than one button.
+bool MouseCorrelator::matches(unsigned int key, const EventRecord& rec)
+{
+    if((key & KEY_BUTTONS) != 0)
+        return rec.type == MOUSE_BUTTON_EVENT && (rec.data.button.buttonFlags & key) != 0;
+    return makeKey(rec) == key;
+}
+
+LONGLONG MouseCorrelator::now() const
+{
+    LARGE_INTEGER n;
+    QueryPerformanceCounter(&n);
+    return n.QuadPart;
+}
+
+bool MouseCorrelator::match(EventQueue* queue, unsigned int message, DWORD timeoutMs, EventRecord& rec)
+{
+    unsigned int key = keyForMessage(message);
+    if(key == 0)
+        return false;
+
+    if(key == KEY_MOVE)
+        timeoutMs = 0;
+    else if(timeoutMs > MOUSE_WAIT_MS)
+        timeoutMs = MOUSE_WAIT_MS;
+
+    LONGLONG started = now();
+    LONGLONG deadline = started + (LONGLONG)timeoutMs * ticksPerMs;
+
+    sweep(started);
+
+    // Usually the raw event is already here
+    pull(queue, 0, started);
+    if(take(key, rec))
+    {
+        matched++;
+        return true;
+    }
+
+    // Keep pulling until ours shows up
+    while(queue->running())
+    {
+        LONGLONG t = now();
+        DWORD remaining = INFINITE;
+        if(timeoutMs != INFINITE)
+        {
+            if(t >= deadline)
+                break;
+            remaining = (DWORD)((deadline - t + ticksPerMs - 1) / ticksPerMs);
+        }
+
+        if(!pull(queue, remaining, t))
+            continue;
+
+        if(take(key, rec))
+        {
+            matched++;
+            return true;
+        }
+    }
+
+    // A late move is just an older one for the next move hook call to skip past, so only the others leave
+    // a marker
+    if(queue->running())
+    {
+        missed++;
+        if(key != KEY_MOVE)
+        {
+            Missed m;
+            m.key = key;
+            m.expires = now() + missTtlTicks;
+            misses.push_back(m);
+        }
+    }
+
+    return false;
+}
+
+bool MouseCorrelator::takeStale(EventRecord& rec)
+{
+    if(nextStale < stale.size())
+    {
+        rec = stale[nextStale++];
+        return true;
+    }
+
+    stale.clear();
+    nextStale = 0;
+    return false;
+}
+
+CorrelationStats MouseCorrelator::getStats() const
+{
+    CorrelationStats stats;
+    stats.matched = matched;
+    stats.missed = missed;
+    stats.late = late;
+    stats.expired = expired;
+    stats.pending = waiting;
+    return stats;
+}
+
+// Move whatever raw events are waiting (waiting up to timeoutMs for the first) onto the list
+bool MouseCorrelator::pull(EventQueue* queue, DWORD timeoutMs, LONGLONG now)
+{
+    unsigned int count = queue->DequeueMouseBatch(batch, sizeof(batch) / sizeof(batch[0]), timeoutMs);
+    for(unsigned int i = 0; i < count; i++)
+        insert(batch[i], now);
+    waiting = (unsigned int)pending.size();
+    return count > 0;
+}
+
+// Add a raw event to the list, unless it's the late arrival of a hook call that already gave up
+void MouseCorrelator::insert(const EventRecord& rec, LONGLONG now)
+{
+    for(size_t i = 0; i < misses.size(); i++)
+    {
+        if(misses[i].expires > now && matches(misses[i].key, rec))
+        {
+            // Too late, its hook call has already been answered
+            misses.erase(misses.begin() + i);
+            late++;
+            return;
+        }
+    }
+
+    Pending p;
+    p.expires = rec.timestamp + ttlTicks;
+    p.rec = rec;
+    pending.push_back(p);
+
+    if(pending.size() > MAX_PENDING)
+    {
+        makeStale(0);
+        expired++;
+    }
+}
+
+// Take the raw event for a hook call: the oldest of its kind, except for moves, where it's the newest and the
+// older ones are stale
+bool MouseCorrelator::take(unsigned int key, EventRecord& rec)
+{
+    size_t found = pending.size();
+    for(size_t i = 0; i < pending.size(); i++)
+    {
+        if(!matches(key, pending[i].rec))
+            continue;
+        found = i;
+        if(key != KEY_MOVE)
+            break;
+    }
+
+    if(found == pending.size())
+        return false;
+
+    rec = pending[found].rec;
+    pending.erase(pending.begin() + found);
+
+    if(key == KEY_MOVE)
+    {
+        size_t i = 0;
+        while(i < found && i < pending.size())
+        {
+            if(matches(KEY_MOVE, pending[i].rec))
+            {
+                makeStale(i);
+                found--;
+            }
+            else
+            {
+                i++;
+            }
+        }
+    }
+
+    waiting = (unsigned int)pending.size();
+    return true;
+}
+
+void MouseCorrelator::makeStale(size_t index)
+{
+    stale.push_back(pending[index].rec);
+    pending.erase(pending.begin() + index);
+}
+
+// Give up on raw events nobody has asked about, and forget old markers
+void MouseCorrelator::sweep(LONGLONG now)
+{
+    size_t i = 0;
+    while(i < pending.size())
+    {
+        if(pending[i].expires <= now)
+        {
+            makeStale(i);
+            expired++;
+        }
+        else
+        {
+            i++;
+        }
+    }
+
+    i = 0;
+    while(i < misses.size())
+    {
+        if(misses[i].expires <= now)
+            misses.erase(misses.begin() + i);
+        else
+            i++;
+    }
+
+    waiting = (unsigned int)pending.size();
+}
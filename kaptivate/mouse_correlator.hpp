@@ -0,0 +1,127 @@
+/*
+ * mouse_correlator.hpp
+ * This file is a part of Kaptivate
+ * https://github.com/FunkyTownEnterprises/Kaptivate
+ *
+ * Copyright (c) 2011 Ben Cable, Chris Eberle
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include "kaptivate.hpp"
+#include <vector>
+
+namespace Kaptivate
+{
+    class EventQueue;
+
+    // Pairs mouse hook calls with the raw events they belong to.
+    //
+    // The hook is told which message it's being called for but not which device, so raw mouse events are
+    // pulled off the queue into a short list in arrival order, and each hook call takes the oldest one of its
+    // own kind: a move, a wheel turn in the same direction, or the button transition its message stands for.
+    // Taking the oldest raw event of any kind instead lets a backlog of moves answer a click.
+    //
+    // Windows coalesces WM_MOUSEMOVE, so there are usually fewer move hook calls than raw moves. A move hook
+    // call takes the newest raw move, and the ones before it are handed back as stale, as are raw events that
+    // no hook call asks about before they expire. Stale events should still go to the handlers, but there's
+    // no hook call to give their decision to.
+    //
+    // As with KeyCorrelator, a hook call that gives up leaves a short-lived marker behind, so that its raw
+    // event is recognised as late and thrown away rather than answering the next hook call of its kind.
+    //
+    // Only ever used by the hook thread.
+    class MouseCorrelator
+    {
+    private:
+        struct Pending
+        {
+            LONGLONG expires;
+            EventRecord rec;
+        };
+
+        struct Missed
+        {
+            unsigned int key;
+            LONGLONG expires;
+        };
+
+        std::vector<Pending> pending;
+        std::vector<Missed> misses;
+        std::vector<EventRecord> stale;
+        size_t nextStale;
+
+        LONGLONG ticksPerMs;
+        LONGLONG ttlTicks;
+        LONGLONG missTtlTicks;
+
+        // Where raw events land on their way from the queue into the list
+        EventRecord batch[32];
+
+        // Stats, read from other threads
+        volatile unsigned int matched;
+        volatile unsigned int missed;
+        volatile unsigned int late;
+        volatile unsigned int expired;
+        volatile unsigned int waiting;
+
+        static unsigned int makeKey(const EventRecord& rec);
+        static bool matches(unsigned int key, const EventRecord& rec);
+        LONGLONG now() const;
+
+        bool pull(EventQueue* queue, DWORD timeoutMs, LONGLONG now);
+        void insert(const EventRecord& rec, LONGLONG now);
+        bool take(unsigned int key, EventRecord& rec);
+        void makeStale(size_t index);
+        void sweep(LONGLONG now);
+
+        // Not copyable
+        MouseCorrelator(const MouseCorrelator&);
+        MouseCorrelator& operator=(const MouseCorrelator&);
+
+    public:
+        // ttlMs is how long a raw event waits for its hook call
+        MouseCorrelator(DWORD ttlMs = 5000);
+
+        // Forget everything and zero the stats. Not safe while the hook thread is running.
+        void reset(DWORD ttlMs);
+
+        // What a mouse hook message waits for: 0 if there's no raw event behind it at all. The message for a
+        // raw event is the first one Windows would send for it, for backends that make their own.
+        static unsigned int keyForMessage(unsigned int message);
+        static unsigned int messageFor(const EventRecord& rec);
+
+        // Find the raw event for a hook call, pulling raw events off the queue until it turns up or timeoutMs
+        // runs out, which is never more than a few ms. A move only takes what's already here. Returns false
+        // if it didn't turn up.
+        bool match(EventQueue* queue, unsigned int message, DWORD timeoutMs, EventRecord& rec);
+
+        // Raw events that won't be paired with a hook call, oldest first. Take them after every match.
+        bool takeStale(EventRecord& rec);
+
+        CorrelationStats getStats() const;
+    };
+}
@@ -0,0 +1,207 @@
+/*
+ * observer_pool.cpp
+ * This file is a part of Kaptivate
+ * https://github.com/FunkyTownEnterprises/Kaptivate
+ *
+ * Copyright (c) 2011 Ben Cable, Chris Eberle
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "stdafx.hpp"
+#include "observer_pool.hpp"
+#include "event_queue.hpp"
+#include "kaptivate_exceptions.hpp"
+
+using namespace std;
+using namespace Kaptivate;
+
+// How many decided events a worker takes off its queue at a time
+#define OBSERVER_BATCH_SIZE 256
+
+// Never more workers than this by default, observers aren't supposed to need a lot of CPU
+#define MAX_DEFAULT_THREADS 4
+
+ObserverPool::ObserverPool(EventDispatcher* dispatcher)
+{
+    this->dispatcher = dispatcher;
+    dropped = 0;
+
+    SYSTEM_INFO sysInfo;
+    GetSystemInfo(&sysInfo);
+    threads = sysInfo.dwNumberOfProcessors;
+    if(threads < 1)
+        threads = 1;
+    if(threads > MAX_DEFAULT_THREADS)
+        threads = MAX_DEFAULT_THREADS;
+}
+
+ObserverPool::~ObserverPool()
+{
+    stop();
+}
+
+void ObserverPool::setThreads(unsigned int count)
+{
+    if(running())
+        throw KaptivateException("The observer threads can't be changed while they're running");
+    if(count == 0)
+        throw KaptivateException("At least one observer thread is needed");
+
+    threads = count;
+}
+
+unsigned int ObserverPool::getThreads() const
+{
+    return threads;
+}
+
+bool ObserverPool::running() const
+{
+    return !workers.empty();
+}
+
+// Runs in a separate thread, feeding the observers until the worker's queue is stopped
+static DWORD WINAPI ObserverLoop(LPVOID iValue)
+{
+    ObserverWorker* worker = (ObserverWorker*)iValue;
+    worker->pool->_RunWorker(worker);
+    return 0;
+}
+
+// Take decided events off the worker's queue as many at a time as are waiting, and hand them out
+void ObserverPool::_RunWorker(ObserverWorker* worker)
+{
+    vector<EventRecord> batch(OBSERVER_BATCH_SIZE);
+    while(worker->queue->running())
+    {
+        unsigned int count = worker->queue->DequeueBatch(&batch[0], OBSERVER_BATCH_SIZE, INFINITE);
+        if(count > 0)
+            dispatcher->observeBatch(&batch[0], count, worker->scratch);
+    }
+}
+
+bool ObserverPool::start()
+{
+    if(running())
+        return false;
+
+    dropped = 0;
+    for(unsigned int i = 0; i < threads; i++)
+    {
+        ObserverWorker* worker = new ObserverWorker();
+        worker->pool = this;
+        worker->queue = new EventQueue();
+        worker->queue->setSpinCount(0);
+        worker->queue->start();
+        worker->thread = 0;
+        workers.push_back(worker);
+
+        DWORD threadId = 0;
+        if(NULL == (worker->thread = CreateThread(NULL, 0, ObserverLoop, worker, 0, &threadId)))
+        {
+            stop();
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Stop feeding the observers and wait for every worker to finish with whatever batch it's on
+bool ObserverPool::stop()
+{
+    bool clean = true;
+    for(size_t i = 0; i < workers.size(); i++)
+        workers[i]->queue->stop();
+
+    for(size_t i = 0; i < workers.size(); i++)
+    {
+        if(workers[i]->thread == 0)
+            continue;
+
+        if(WAIT_OBJECT_0 != WaitForSingleObject(workers[i]->thread, 5000))
+        {
+            // Leak this one rather than pull its queue out from under it
+            clean = false;
+            workers[i] = NULL;
+        }
+    }
+
+    destroyWorkers();
+    return clean;
+}
+
+void ObserverPool::destroyWorkers()
+{
+    for(size_t i = 0; i < workers.size(); i++)
+    {
+        ObserverWorker* worker = workers[i];
+        if(worker == NULL)
+            continue;
+
+        if(worker->thread != 0)
+            CloseHandle(worker->thread);
+        delete worker->queue;
+        delete worker;
+    }
+
+    workers.clear();
+}
+
+// Every device always goes to the same worker
+ObserverWorker* ObserverPool::workerFor(HANDLE device) const
+{
+    // Device handles tend to be multiples of some small power of two, so mix the bits up a little first
+    UINT_PTR h = (UINT_PTR)device;
+    h ^= h >> 16;
+    h *= 0x45d9f3b;
+    h ^= h >> 16;
+    return workers[h % workers.size()];
+}
+
+bool ObserverPool::submitKeyboard(const EventRecord& rec)
+{
+    if(workers.empty() || !workerFor(rec.device)->queue->EnqueueKeyboardEvent(rec))
+    {
+        dropped++;
+        return false;
+    }
+    return true;
+}
+
+bool ObserverPool::submitMouse(const EventRecord& rec)
+{
+    if(workers.empty() || !workerFor(rec.device)->queue->EnqueueMouseEvent(rec))
+    {
+        dropped++;
+        return false;
+    }
+    return true;
+}
+
+unsigned int ObserverPool::getDropped() const
+{
+    return dropped;
+}
@@ -0,0 +1,96 @@
+/*
+ * observer_pool.hpp
+ * This file is a part of Kaptivate
+ * https://github.com/FunkyTownEnterprises/Kaptivate
+ *
+ * Copyright (c) 2011 Ben Cable, Chris Eberle
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include "kaptivate.hpp"
+#include "event_dispatcher.hpp"
+#include <vector>
+
+namespace Kaptivate
+{
+    class EventQueue;
+    class ObserverPool;
+
+    // One observer thread, with its own queue and scratch space
+    struct ObserverWorker
+    {
+        ObserverPool* pool;
+        EventQueue* queue;
+        HANDLE thread;
+
+        ObserverScratch scratch;
+    };
+
+    // Feeds decided events to the observe-only handlers on a few threads of their own.
+    //
+    // Every device is tied to one worker (by its handle), so a device's events always reach its observers
+    // in order, while a slow observer on one device doesn't hold up the others. Each worker has its own
+    // EventQueue with the hook thread as the only producer, so submitting an event never takes a lock.
+    class ObserverPool
+    {
+    private:
+        EventDispatcher* dispatcher;
+        std::vector<ObserverWorker*> workers;
+        unsigned int threads;
+        volatile unsigned int dropped;
+
+        ObserverWorker* workerFor(HANDLE device) const;
+        void destroyWorkers();
+
+        // Not copyable
+        ObserverPool(const ObserverPool&);
+        ObserverPool& operator=(const ObserverPool&);
+
+    public:
+        ObserverPool(EventDispatcher* dispatcher);
+        ~ObserverPool();
+
+        // How many workers to start. Throws if the pool is running.
+        void setThreads(unsigned int count);
+        unsigned int getThreads() const;
+
+        bool start();
+        bool stop();
+        bool running() const;
+
+        // Hook thread only. Returns false if the event was thrown away (stopped, or the worker is too far
+        // behind).
+        bool submitKeyboard(const EventRecord& rec);
+        bool submitMouse(const EventRecord& rec);
+
+        // How many decided events never reached the observers since the pool was started
+        unsigned int getDropped() const;
+
+        // Worker thread
+        void _RunWorker(ObserverWorker* worker);
+    };
+}
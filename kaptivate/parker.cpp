@@ -0,0 +1,89 @@
+/*
+ * parker.cpp
+ * This file is a part of Kaptivate
+ * https://github.com/FunkyTownEnterprises/Kaptivate
+ *
+ * Copyright (c) 2011 Ben Cable, Chris Eberle
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "stdafx.hpp"
+#include "parker.hpp"
+#include "kaptivate_exceptions.hpp"
+
+using namespace Kaptivate;
+
+ConsumerParker::ConsumerParker()
+{
+    parked = 0;
+    if(NULL == (wakeSignal = CreateEvent(NULL, FALSE, FALSE, NULL)))
+        throw KaptivateException("Unable to create the consumer wakeup event");
+}
+
+ConsumerParker::~ConsumerParker()
+{
+    CloseHandle(wakeSignal);
+    wakeSignal = 0;
+}
+
+// Announce that we're about to go to sleep. The interlocked exchange is a full barrier, so the producer
+// either sees the flag or we see its item on our next look at the queue.
+void ConsumerParker::prepare()
+{
+    InterlockedExchange(&parked, 1);
+}
+
+// We found something after all, never mind
+void ConsumerParker::cancel()
+{
+    InterlockedExchange(&parked, 0);
+}
+
+// Sleep until the producer wakes us, the stop signal fires, or we time out. Returns the
+// WaitForMultipleObjects result: WAIT_OBJECT_0 means "go look at the queue again". The wakeup event
+// may be left over from a producer racing with cancel(), so callers must always re-check the queue
+// rather than assume there's something in it.
+DWORD ConsumerParker::park(HANDLE stopSignal, DWORD timeoutMs)
+{
+    HANDLE handles[2];
+    handles[0] = wakeSignal;
+    handles[1] = stopSignal;
+
+    DWORD res = WaitForMultipleObjects(2, handles, FALSE, timeoutMs);
+    InterlockedExchange(&parked, 0);
+    return res;
+}
+
+// Wake the consumer, but only if it's actually asleep
+bool ConsumerParker::unpark()
+{
+    if(1 == InterlockedCompareExchange(&parked, 0, 1))
+    {
+        SetEvent(wakeSignal);
+        return true;
+    }
+
+    return false;
+}
@@ -0,0 +1,69 @@
+/*
+ * parker.hpp
+ * This file is a part of Kaptivate
+ * https://github.com/FunkyTownEnterprises/Kaptivate
+ *
+ * Copyright (c) 2011 Ben Cable, Chris Eberle
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+namespace Kaptivate
+{
+    // Lets a consumer sleep while its queue is empty without making the producer pay for a kernel call on
+    // every item. The producer only signals when the consumer has actually announced that it is asleep.
+    //
+    // Consumer:                              Producer:
+    //   if(queue.pop(x)) return x;             queue.push(x);
+    //   parker.prepare();                      parker.unpark();
+    //   if(queue.pop(x)) { parker.cancel(); return x; }
+    //   parker.park(stopSignal, timeout);
+    //
+    // The second pop after prepare() is what makes this safe: anything pushed before the producer could
+    // see the parked flag is picked up there, anything pushed after it gets a wakeup.
+    class ConsumerParker
+    {
+    private:
+        volatile LONG parked;
+        HANDLE wakeSignal;
+
+        // Not copyable
+        ConsumerParker(const ConsumerParker&);
+        ConsumerParker& operator=(const ConsumerParker&);
+
+    public:
+        ConsumerParker();
+        ~ConsumerParker();
+
+        // Consumer side
+        void prepare();
+        void cancel();
+        DWORD park(HANDLE stopSignal, DWORD timeoutMs);
+
+        // Producer side. Returns true if the consumer was asleep and had to be woken.
+        bool unpark();
+    };
+}
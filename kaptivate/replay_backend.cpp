@@ -0,0 +1,582 @@
+/*
+ * replay_backend.cpp
+ * This file is a part of Kaptivate
+ * https://github.com/FunkyTownEnterprises/Kaptivate
+ *
+ * Copyright (c) 2011 Ben Cable, Chris Eberle
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "stdafx.hpp"
+#include "replay_backend.hpp"
+#include "capture_log.hpp"
+#include "kaptivate_exceptions.hpp"
+
+#include <algorithm>
+#include <vector>
+#include <string.h>
+
+using namespace std;
+using namespace Kaptivate;
+
+// How many raw events are pushed in one go when the raw thread has fallen behind
+#define REPLAY_BATCH_SIZE 256
+
+// How long both threads get to settle before the first event is due
+#define REPLAY_LEAD_MS 20
+
+////////////////////////////////////////////////////////////////////////////////
+// State
+
+namespace Kaptivate
+{
+    struct ReplayDevice
+    {
+        unsigned char type;
+        HANDLE device;
+        string name;
+    };
+
+    // A decision from the log, with its time already converted to our ticks
+    struct ReplayDecision
+    {
+        LONGLONG at;                  // Ticks after the start
+        bool keyboard;
+        unsigned int vkey;
+        unsigned int scanCode;
+        bool keyUp;
+        unsigned int message;         // Mouse only
+        Decision decision;
+        size_t needRaw;               // Raw events that have to be pushed before it's asked for (speed 0)
+    };
+
+    struct ReplayRaw
+    {
+        LONGLONG at;
+        LogRaw raw;
+    };
+
+    struct ReplayState
+    {
+        InputSink* sink;
+        double speed;
+        vector<ReplayDevice> devices;
+        vector<ReplayRaw> raws;
+        vector<ReplayDecision> decisions;
+        LONGLONG recordedTicks;       // In the log's ticks
+        LONGLONG logTicksPerSecond;
+
+        HANDLE rawThread;
+        HANDLE hookThread;
+        volatile LONG stopping;
+        volatile bool suspended;
+        bool wantMouse;
+        bool wantKeyboard;
+
+        double ticksPerUs;
+        LONGLONG startTicks;
+        LONGLONG lastDecision;
+        volatile LONG rawPushed;      // Index of the next raw event, as far as the hook thread is concerned
+
+        // Only touched by the raw and hook threads until they're done
+        unsigned int rawEvents;
+        unsigned int decided;
+        unsigned int mismatches;
+        unsigned int firstMismatch;
+    };
+}
+
+static LONGLONG now()
+{
+    LARGE_INTEGER li;
+    QueryPerformanceCounter(&li);
+    return li.QuadPart;
+}
+
+static bool rawEarlier(const ReplayRaw& a, const ReplayRaw& b)
+{
+    return a.raw.sequence < b.raw.sequence;
+}
+
+static bool rawBefore(const ReplayRaw& a, unsigned int sequence)
+{
+    return a.raw.sequence < sequence;
+}
+
+static bool decisionEarlier(const ReplayDecision& a, const ReplayDecision& b)
+{
+    return a.at < b.at;
+}
+
+// Wait for the clock to reach a point, sleeping while it's far off and spinning once it's close
+static bool waitFor(ReplayState* state, LONGLONG when)
+{
+    while(true)
+    {
+        if(state->stopping)
+            return false;
+
+        LONGLONG left = when - now();
+        if(left <= 0)
+            return true;
+
+        if(left > 2000 * state->ticksPerUs)
+            Sleep(1);
+        else
+            YieldProcessor();
+    }
+}
+
+static bool wanted(ReplayState* state, unsigned char type)
+{
+    return (type == KEYBOARD_EVENT) ? state->wantKeyboard : state->wantMouse;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Loading
+
+static void readLog(const string& path, vector<char>& bytes)
+{
+    HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                              FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if(file == INVALID_HANDLE_VALUE)
+        throw KaptivateException("Unable to open the capture log");
+
+    DWORD size = GetFileSize(file, NULL);
+    if(size == INVALID_FILE_SIZE)
+    {
+        CloseHandle(file);
+        throw KaptivateException("Unable to read the capture log");
+    }
+
+    bytes.resize(size);
+    DWORD got = 0;
+    BOOL ok = (size == 0) || ReadFile(file, &bytes[0], size, &got, NULL);
+    CloseHandle(file);
+    if(!ok || got != size)
+        throw KaptivateException("Unable to read the capture log");
+}
+
+// Pull the entries apart. A log cut short (say the process died) is fine, everything up to the last whole
+// entry is kept.
+static void parseLog(const vector<char>& bytes, ReplayState* state)
+{
+    LogFileHeader header;
+    if(bytes.size() < sizeof(header))
+        throw KaptivateException("Not a capture log");
+    memcpy(&header, &bytes[0], sizeof(header));
+    if(memcmp(header.magic, CAPTURE_LOG_MAGIC, sizeof(header.magic)) != 0)
+        throw KaptivateException("Not a capture log");
+    if(header.version != CAPTURE_LOG_VERSION)
+        throw KaptivateException("Unsupported capture log version");
+    if(header.ticksPerSecond <= 0)
+        throw KaptivateException("Corrupt capture log");
+
+    state->logTicksPerSecond = header.ticksPerSecond;
+
+    vector<LogRaw> raws;
+    vector<LogKeyDecision> keys;
+    vector<LogMouseDecision> mice;
+
+    size_t pos = sizeof(header);
+    size_t end = bytes.size();
+    while(pos < end)
+    {
+        unsigned char kind = (unsigned char)bytes[pos];
+        size_t left = end - pos;
+
+        if(kind == LOG_DEVICE)
+        {
+            LogDevice entry;
+            if(left < sizeof(entry))
+                break;
+            memcpy(&entry, &bytes[pos], sizeof(entry));
+            if(left < sizeof(entry) + entry.nameLength)
+                break;
+
+            ReplayDevice device;
+            device.type = entry.type;
+            device.device = (HANDLE)(UINT_PTR)entry.device;
+            device.name.assign(&bytes[pos + sizeof(entry)], entry.nameLength);
+            state->devices.push_back(device);
+            pos += sizeof(entry) + entry.nameLength;
+        }
+        else if(kind == LOG_RAW)
+        {
+            if(left < sizeof(LogRaw))
+                break;
+            raws.push_back(LogRaw());
+            memcpy(&raws.back(), &bytes[pos], sizeof(LogRaw));
+            pos += sizeof(LogRaw);
+        }
+        else if(kind == LOG_KEY_DECISION)
+        {
+            if(left < sizeof(LogKeyDecision))
+                break;
+            keys.push_back(LogKeyDecision());
+            memcpy(&keys.back(), &bytes[pos], sizeof(LogKeyDecision));
+            pos += sizeof(LogKeyDecision);
+        }
+        else if(kind == LOG_MOUSE_DECISION)
+        {
+            if(left < sizeof(LogMouseDecision))
+                break;
+            mice.push_back(LogMouseDecision());
+            memcpy(&mice.back(), &bytes[pos], sizeof(LogMouseDecision));
+            pos += sizeof(LogMouseDecision);
+        }
+        else
+        {
+            throw KaptivateException("Corrupt capture log");
+        }
+    }
+
+    // Everything is timed from the first thing that happened
+    LONGLONG first = 0, last = 0;
+    bool any = false;
+    for(size_t i = 0; i < raws.size(); i++)
+    {
+        if(!any || raws[i].timestamp < first) first = raws[i].timestamp;
+        if(!any || raws[i].timestamp > last) last = raws[i].timestamp;
+        any = true;
+    }
+    for(size_t i = 0; i < keys.size(); i++)
+    {
+        if(!any || keys[i].asked < first) first = keys[i].asked;
+        if(!any || keys[i].asked > last) last = keys[i].asked;
+        any = true;
+    }
+    for(size_t i = 0; i < mice.size(); i++)
+    {
+        if(!any || mice[i].asked < first) first = mice[i].asked;
+        if(!any || mice[i].asked > last) last = mice[i].asked;
+        any = true;
+    }
+    state->recordedTicks = last - first;
+
+    // Log ticks to our ticks, squeezed by the speed. At speed 0 the times are only used for ordering.
+    LARGE_INTEGER freq;
+    QueryPerformanceFrequency(&freq);
+    double scale = (double)freq.QuadPart / (double)header.ticksPerSecond;
+    if(state->speed > 0.0)
+        scale /= state->speed;
+
+    for(size_t i = 0; i < raws.size(); i++)
+    {
+        ReplayRaw r;
+        r.at = (LONGLONG)((raws[i].timestamp - first) * scale);
+        r.raw = raws[i];
+        state->raws.push_back(r);
+    }
+    sort(state->raws.begin(), state->raws.end(), rawEarlier);
+
+    for(size_t i = 0; i < keys.size(); i++)
+    {
+        ReplayDecision d;
+        d.at = (LONGLONG)((keys[i].asked - first) * scale);
+        d.keyboard = true;
+        d.vkey = keys[i].vkey;
+        d.scanCode = keys[i].scanCode;
+        d.keyUp = keys[i].keyUp != 0;
+        d.message = 0;
+        d.decision = (Decision)keys[i].decision;
+        d.needRaw = 0;
+        if(keys[i].sequence != CAPTURE_LOG_NO_SEQUENCE)
+            d.needRaw = (lower_bound(state->raws.begin(), state->raws.end(), keys[i].sequence, rawBefore) - state->raws.begin()) + 1;
+        state->decisions.push_back(d);
+    }
+
+    for(size_t i = 0; i < mice.size(); i++)
+    {
+        ReplayDecision d;
+        d.at = (LONGLONG)((mice[i].asked - first) * scale);
+        d.keyboard = false;
+        d.vkey = d.scanCode = 0;
+        d.keyUp = false;
+        d.message = mice[i].message;
+        d.decision = (Decision)mice[i].decision;
+        d.needRaw = 0;
+        if(mice[i].sequence != CAPTURE_LOG_NO_SEQUENCE)
+            d.needRaw = (lower_bound(state->raws.begin(), state->raws.end(), mice[i].sequence, rawBefore) - state->raws.begin()) + 1;
+        state->decisions.push_back(d);
+    }
+    stable_sort(state->decisions.begin(), state->decisions.end(), decisionEarlier);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Creation / destruction
+
+ReplayBackend::ReplayBackend(const string& path, double speed)
+{
+    if(speed < 0.0)
+        throw KaptivateException("The replay speed can't be negative");
+
+    state = new ReplayState();
+    state->sink = NULL;
+    state->speed = speed;
+    state->recordedTicks = 0;
+    state->logTicksPerSecond = 1;
+    state->rawThread = 0;
+    state->hookThread = 0;
+    state->stopping = 0;
+    state->suspended = false;
+    state->wantMouse = true;
+    state->wantKeyboard = true;
+    state->startTicks = 0;
+    state->lastDecision = 0;
+    state->rawPushed = 0;
+    state->rawEvents = 0;
+    state->decided = 0;
+    state->mismatches = 0;
+    state->firstMismatch = 0;
+
+    LARGE_INTEGER freq;
+    QueryPerformanceFrequency(&freq);
+    state->ticksPerUs = (double)freq.QuadPart / 1000000.0;
+
+    try
+    {
+        vector<char> bytes;
+        readLog(path, bytes);
+        parseLog(bytes, state);
+    }
+    catch(...)
+    {
+        delete state;
+        state = NULL;
+        throw;
+    }
+}
+
+ReplayBackend::~ReplayBackend()
+{
+    stop();
+    delete state;
+    state = NULL;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Threads
+
+static DWORD WINAPI ReplayRawLoop(LPVOID iValue)
+{
+    ((ReplayBackend*)iValue)->_RunRaw();
+    return 0;
+}
+
+static DWORD WINAPI ReplayHookLoop(LPVOID iValue)
+{
+    ((ReplayBackend*)iValue)->_RunHook();
+    return 0;
+}
+
+// Push each raw event when it's due, along with anything else that's already overdue
+void ReplayBackend::_RunRaw()
+{
+    vector<EventRecord> batch(REPLAY_BATCH_SIZE);
+    size_t next = 0;
+    bool asap = (state->speed == 0.0);
+
+    while(next < state->raws.size())
+    {
+        if(!asap && !waitFor(state, state->startTicks + state->raws[next].at))
+            return;
+        if(state->stopping)
+            return;
+
+        LONGLONG t = now() - state->startTicks;
+        unsigned int count = 0;
+        while(next < state->raws.size() && count < REPLAY_BATCH_SIZE && (asap || state->raws[next].at <= t))
+        {
+            const LogRaw& raw = state->raws[next++].raw;
+            if(!wanted(state, raw.type))
+                continue;
+
+            EventRecord& rec = batch[count++];
+            memset(&rec, 0, sizeof(EventRecord));
+            rec.timestamp = now();
+            rec.device = (HANDLE)(UINT_PTR)raw.device;
+            rec.type = raw.type;
+            rec.decision = UNDECIDED;
+            rec.samples = raw.samples;
+            memcpy(&rec.data, raw.data, sizeof(rec.data));
+        }
+
+        if(count > 0 && !state->suspended)
+        {
+            state->sink->pushRawBatch(&batch[0], count);
+            state->rawEvents += count;
+        }
+        InterlockedExchange(&state->rawPushed, (LONG)next);
+    }
+}
+
+// Ask for each decision again when it's due, and see whether it comes out the same
+void ReplayBackend::_RunHook()
+{
+    bool asap = (state->speed == 0.0);
+
+    for(size_t i = 0; i < state->decisions.size(); i++)
+    {
+        const ReplayDecision& rd = state->decisions[i];
+        if(!wanted(state, rd.keyboard ? KEYBOARD_EVENT : MOUSE_BUTTON_EVENT))
+            continue;
+
+        if(asap)
+        {
+            while((size_t)state->rawPushed < rd.needRaw)
+            {
+                if(state->stopping)
+                    return;
+                YieldProcessor();
+            }
+        }
+        else if(!waitFor(state, state->startTicks + rd.at))
+        {
+            return;
+        }
+        if(state->suspended)
+            continue;
+
+        Decision decision;
+        if(rd.keyboard)
+            decision = state->sink->decideKeyboard(rd.vkey, rd.scanCode, rd.keyUp);
+        else
+            decision = state->sink->decideMouse(rd.message);
+
+        state->lastDecision = now();
+        if(decision != rd.decision)
+        {
+            if(state->mismatches == 0)
+                state->firstMismatch = (unsigned int)i;
+            state->mismatches++;
+        }
+        state->decided++;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// InputBackend
+
+// Announce the recorded devices, then set both threads loose on the log
+void ReplayBackend::start(InputSink* sink, bool wantMouse, bool wantKeyboard, bool startSuspended, UINT msgTimeoutMs)
+{
+    if(state->rawThread != 0 || state->hookThread != 0)
+        throw KaptivateException("The replay backend is already running");
+
+    state->sink = sink;
+    state->stopping = 0;
+    state->suspended = startSuspended;
+    state->wantMouse = wantMouse;
+    state->wantKeyboard = wantKeyboard;
+    state->lastDecision = 0;
+    state->rawPushed = 0;
+    state->rawEvents = 0;
+    state->decided = 0;
+    state->mismatches = 0;
+    state->firstMismatch = 0;
+
+    for(size_t i = 0; i < state->devices.size(); i++)
+    {
+        const ReplayDevice& device = state->devices[i];
+        if(!wanted(state, device.type))
+            continue;
+        if(device.type == KEYBOARD_EVENT)
+            sink->announceKeyboard(device.device, device.name);
+        else
+            sink->announceMouse(device.device, device.name);
+    }
+
+    state->startTicks = now() + (LONGLONG)(REPLAY_LEAD_MS * 1000.0 * state->ticksPerUs);
+
+    DWORD threadId = 0;
+    if(NULL == (state->rawThread = CreateThread(NULL, 0, ReplayRawLoop, this, 0, &threadId)))
+        throw KaptivateException("Failed to create the replay raw thread");
+    if(NULL == (state->hookThread = CreateThread(NULL, 0, ReplayHookLoop, this, 0, &threadId)))
+    {
+        stop();
+        throw KaptivateException("Failed to create the replay hook thread");
+    }
+}
+
+// Tell both threads to give up and wait for them
+void ReplayBackend::stop()
+{
+    InterlockedExchange(&state->stopping, 1);
+
+    HANDLE threads[2] = { state->rawThread, state->hookThread };
+    for(int i = 0; i < 2; i++)
+    {
+        if(threads[i] == 0)
+            continue;
+        WaitForSingleObject(threads[i], 5000);
+        CloseHandle(threads[i]);
+    }
+
+    state->rawThread = 0;
+    state->hookThread = 0;
+}
+
+void ReplayBackend::suspend()
+{
+    state->suspended = true;
+}
+
+void ReplayBackend::resume()
+{
+    state->suspended = false;
+}
+
+bool ReplayBackend::isAlive() const
+{
+    return state->rawThread != 0 && !state->stopping;
+}
+
+bool ReplayBackend::waitUntilDone(DWORD timeoutMs)
+{
+    HANDLE threads[2] = { state->rawThread, state->hookThread };
+    if(threads[0] == 0 || threads[1] == 0)
+        return true;
+    return WAIT_OBJECT_0 == WaitForMultipleObjects(2, threads, TRUE, timeoutMs);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Report
+
+ReplayReport ReplayBackend::getReport() const
+{
+    ReplayReport report;
+    memset(&report, 0, sizeof(ReplayReport));
+    report.rawEvents = state->rawEvents;
+    report.requests = (unsigned int)state->decisions.size();
+    report.decided = state->decided;
+    report.mismatches = state->mismatches;
+    report.firstMismatch = state->firstMismatch;
+    report.recordedMs = (double)state->recordedTicks * 1000.0 / (double)state->logTicksPerSecond;
+
+    if(state->lastDecision > state->startTicks)
+        report.elapsedMs = (double)(state->lastDecision - state->startTicks) / (state->ticksPerUs * 1000.0);
+    return report;
+}
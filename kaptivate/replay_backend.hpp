@@ -0,0 +1,91 @@
+/*
+ * replay_backend.hpp
+ * This file is a part of Kaptivate
+ * https://github.com/FunkyTownEnterprises/Kaptivate
+ *
+ * Copyright (c) 2011 Ben Cable, Chris Eberle
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include "kaptivate.hpp"
+#include <string>
+
+namespace Kaptivate
+{
+    // How a replay went. A mismatch is a decision that came out differently from the one in the log.
+    struct ReplayReport
+    {
+        unsigned int rawEvents;       // Raw events pushed
+        unsigned int requests;        // Decisions in the log
+        unsigned int decided;         // Decisions asked for again
+        unsigned int mismatches;
+        unsigned int firstMismatch;   // Index of the first one among the decisions, if there were any
+        double recordedMs;            // How long the log covers
+        double elapsedMs;             // How long the replay took
+    };
+
+    struct ReplayState;
+
+    // A backend that plays back a log written with setRecordFile. The recorded devices are announced, the
+    // raw events are pushed and the decisions asked for again, each at its original time (scaled by the
+    // speed), so the dispatcher and every handler see what they saw the first time. Each new decision is
+    // checked against the recorded one.
+    //
+    // A speed of 1 is real time, 2 twice as fast and so on. A speed of 0 goes as fast as possible, only
+    // holding each decision back until its raw event has been pushed.
+    class KAPTIVATE_API ReplayBackend : public InputBackend
+    {
+    private:
+        ReplayState* state;
+
+        // Not copyable
+        ReplayBackend(const ReplayBackend&);
+        ReplayBackend& operator=(const ReplayBackend&);
+
+    public:
+        // Reads the whole log. Throws if it can't be read or isn't a capture log.
+        ReplayBackend(const std::string& path, double speed = 1.0);
+        ~ReplayBackend();
+
+        // InputBackend
+        void start(InputSink* sink, bool wantMouse, bool wantKeyboard, bool startSuspended, UINT msgTimeoutMs);
+        void stop();
+        void suspend();
+        void resume();
+        bool isAlive() const;
+
+        // Wait for the whole log to be played out. Returns false if it took longer than that.
+        bool waitUntilDone(DWORD timeoutMs);
+
+        // Only meaningful once the replay is done, or the backend has been stopped
+        ReplayReport getReport() const;
+
+        // Worker threads
+        void _RunRaw();
+        void _RunHook();
+    };
+}
@@ -0,0 +1,239 @@
+/*
+ * spsc_ring.hpp
+ * This file is a part of Kaptivate
+ * https://github.com/FunkyTownEnterprises/Kaptivate
+ *
+ * Copyright (c) 2011 Ben Cable, Chris Eberle
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include "atomic_ops.hpp"
+
+namespace Kaptivate
+{
+    // A bounded, lock-free queue with exactly one producer thread and exactly one consumer thread. Neither
+    // push nor pop ever blocks or calls into the kernel. If the consumer needs to sleep while the ring is
+    // empty, pair the ring with a ConsumerParker.
+    //
+    // The indices run freely and wrap at 2^32; the capacity is always a power of two so that the slot for
+    // an index is just (index & mask).
+    template <typename T>
+    class SpscRing
+    {
+    private:
+        // Read-only after construction, shared by both threads
+        T* slots;
+        unsigned int mask;
+
+        char pad0[KAPTIVATE_CACHE_LINE];
+
+        // Written by the producer. cachedHead is the producer's last look at head, so it only has to touch
+        // the consumer's cache line when the ring appears to be full.
+        volatile unsigned int tail;
+        unsigned int cachedHead;
+
+        char pad1[KAPTIVATE_CACHE_LINE];
+
+        // Written by the consumer. cachedTail is the same trick in the other direction.
+        volatile unsigned int head;
+        unsigned int cachedTail;
+
+        char pad2[KAPTIVATE_CACHE_LINE];
+
+        // Not copyable
+        SpscRing(const SpscRing&);
+        SpscRing& operator=(const SpscRing&);
+
+    public:
+        explicit SpscRing(unsigned int capacity);
+        ~SpscRing();
+
+        // Producer side. Returns false if the ring is full.
+        bool push(const T& item);
+
+        // Producer side. Same, but treats the ring as full once it holds limit items.
+        bool push(const T& item, unsigned int limit);
+
+        // Consumer side. Returns false if the ring is empty.
+        bool pop(T& item);
+        bool empty();
+
+        // Consumer side. Copies out up to maxCount items and returns how many, publishing the new head
+        // once for the whole batch.
+        unsigned int popBatch(T* items, unsigned int maxCount);
+
+        // Consumer side. Look at the index'th oldest item without taking it (NULL if there aren't that
+        // many), and throw away the oldest once done with it. The consumer may modify items it's looking
+        // at, the producer never touches them again. Pointers are only good until the next dropFront().
+        T* peek(unsigned int index);
+        void dropFront();
+
+        // Consumer side. How many items are waiting right now (exact, as far as the consumer can tell).
+        unsigned int available();
+
+        // Safe from either side, but only a snapshot
+        unsigned int size() const;
+        unsigned int capacity() const;
+    };
+
+    template <typename T>
+    SpscRing<T>::SpscRing(unsigned int capacity)
+    {
+        unsigned int actual = 2;
+        while(actual < capacity && actual < 0x80000000)
+            actual <<= 1;
+
+        slots = new T[actual];
+        mask = actual - 1;
+        tail = 0;
+        cachedHead = 0;
+        head = 0;
+        cachedTail = 0;
+    }
+
+    template <typename T>
+    SpscRing<T>::~SpscRing()
+    {
+        delete[] slots;
+        slots = NULL;
+    }
+
+    template <typename T>
+    bool SpscRing<T>::push(const T& item)
+    {
+        return push(item, mask + 1);
+    }
+
+    template <typename T>
+    bool SpscRing<T>::push(const T& item, unsigned int limit)
+    {
+        if(limit > mask + 1)
+            limit = mask + 1;
+
+        unsigned int t = tail;
+        if(t - cachedHead >= limit)
+        {
+            cachedHead = loadAcquire(&head);
+            if(t - cachedHead >= limit)
+                return false;
+        }
+
+        slots[t & mask] = item;
+        storeRelease(&tail, t + 1);
+        return true;
+    }
+
+    template <typename T>
+    bool SpscRing<T>::pop(T& item)
+    {
+        unsigned int h = head;
+        if(h == cachedTail)
+        {
+            cachedTail = loadAcquire(&tail);
+            if(h == cachedTail)
+                return false;
+        }
+
+        item = slots[h & mask];
+        storeRelease(&head, h + 1);
+        return true;
+    }
+
+    template <typename T>
+    unsigned int SpscRing<T>::popBatch(T* items, unsigned int maxCount)
+    {
+        // Refresh the cached tail unless it already covers the whole request
+        unsigned int h = head;
+        if(cachedTail - h < maxCount)
+        {
+            cachedTail = loadAcquire(&tail);
+            if(h == cachedTail)
+                return 0;
+        }
+
+        unsigned int count = cachedTail - h;
+        if(count > maxCount)
+            count = maxCount;
+
+        for(unsigned int i = 0; i < count; i++)
+            items[i] = slots[(h + i) & mask];
+
+        storeRelease(&head, h + count);
+        return count;
+    }
+
+    template <typename T>
+    T* SpscRing<T>::peek(unsigned int index)
+    {
+        unsigned int h = head;
+        if(cachedTail - h <= index)
+        {
+            cachedTail = loadAcquire(&tail);
+            if(cachedTail - h <= index)
+                return NULL;
+        }
+
+        return &slots[(h + index) & mask];
+    }
+
+    template <typename T>
+    void SpscRing<T>::dropFront()
+    {
+        storeRelease(&head, head + 1);
+    }
+
+    template <typename T>
+    unsigned int SpscRing<T>::available()
+    {
+        cachedTail = loadAcquire(&tail);
+        return cachedTail - head;
+    }
+
+    template <typename T>
+    bool SpscRing<T>::empty()
+    {
+        unsigned int h = head;
+        if(h != cachedTail)
+            return false;
+        cachedTail = loadAcquire(&tail);
+        return h == cachedTail;
+    }
+
+    template <typename T>
+    unsigned int SpscRing<T>::size() const
+    {
+        unsigned int h = loadAcquire(&head);
+        unsigned int t = loadAcquire(&tail);
+        return t - h;
+    }
+
+    template <typename T>
+    unsigned int SpscRing<T>::capacity() const
+    {
+        return mask + 1;
+    }
+}
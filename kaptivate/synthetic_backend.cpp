@@ -0,0 +1,437 @@
+/*
+ * synthetic_backend.cpp
+ * This file is a part of Kaptivate
+ * https://github.com/FunkyTownEnterprises/Kaptivate
+ *
+ * Copyright (c) 2011 Ben Cable, Chris Eberle
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "stdafx.hpp"
+#include "synthetic_backend.hpp"
+#include "kaptivate_exceptions.hpp"
+
+#include <algorithm>
+#include <vector>
+#include <stdio.h>
+#include <string.h>
+
+using namespace std;
+using namespace Kaptivate;
+
+// Fake device handles start here, well away from anything Windows hands out
+#define SYNTHETIC_HANDLE_BASE 0x7ffe0000
+
+// How many raw events are pushed in one go when the raw thread has fallen behind
+#define SYNTHETIC_BATCH_SIZE 256
+
+// How long both threads get to settle before the first event is due
+#define SYNTHETIC_LEAD_MS 20
+
+// Raw mouse button flags (RI_MOUSE_LEFT_BUTTON_DOWN / _UP)
+#define SYNTHETIC_BUTTON_DOWN 0x0001
+#define SYNTHETIC_BUTTON_UP   0x0002
+
+////////////////////////////////////////////////////////////////////////////////
+// Config
+
+SyntheticConfig::SyntheticConfig()
+{
+    keyboards = 4;
+    mice = 0;
+    eventsPerSecond = 100;
+    burstLength = 1;
+    burstGapUs = 0;
+    hookSkewUs = 0;
+    durationMs = 5000;
+    seed = 1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// State
+
+namespace Kaptivate
+{
+    // One event in the schedule
+    struct ScheduledEvent
+    {
+        LONGLONG at;                  // Ticks after the start
+        unsigned int device;          // Index into the device list
+        bool keyboard;
+        bool up;                      // Key up, or button up
+    };
+
+    struct SyntheticState
+    {
+        InputSink* sink;
+        vector<ScheduledEvent> schedule;
+        vector<HANDLE> devices;
+
+        HANDLE rawThread;
+        HANDLE hookThread;
+        volatile LONG stopping;
+        volatile bool suspended;
+
+        double ticksPerUs;
+        LONGLONG startTicks;
+        LONGLONG skewTicks;
+        LONGLONG lastDecision;
+
+        // Only touched by the hook thread until it's done
+        vector<LONGLONG> latencies;
+        unsigned int decided;
+        unsigned int consumed;
+    };
+}
+
+// Same seed, same numbers, on any compiler
+static unsigned int nextRandom(unsigned int& seed)
+{
+    seed = seed * 1103515245 + 12345;
+    return (seed >> 8) & 0xffffff;
+}
+
+static bool earlier(const ScheduledEvent& a, const ScheduledEvent& b)
+{
+    if(a.at != b.at)
+        return a.at < b.at;
+    return a.device < b.device;
+}
+
+static LONGLONG now()
+{
+    LARGE_INTEGER li;
+    QueryPerformanceCounter(&li);
+    return li.QuadPart;
+}
+
+// Wait for the clock to reach a point, sleeping while it's far off and spinning once it's close
+static bool waitFor(SyntheticState* state, LONGLONG when)
+{
+    while(true)
+    {
+        if(state->stopping)
+            return false;
+
+        LONGLONG left = when - now();
+        if(left <= 0)
+            return true;
+
+        if(left > 2000 * state->ticksPerUs)
+            Sleep(1);
+        else
+            YieldProcessor();
+    }
+}
+
+// What the raw event for a scheduled event looks like
+static void fillRecord(SyntheticState* state, const ScheduledEvent& se, EventRecord& rec)
+{
+    memset(&rec, 0, sizeof(EventRecord));
+    rec.timestamp = now();
+    rec.device = state->devices[se.device];
+    rec.decision = UNDECIDED;
+    rec.samples = 1;
+
+    if(se.keyboard)
+    {
+        rec.type = KEYBOARD_EVENT;
+        rec.data.keyboard.vkey = (unsigned short)('A' + se.device % 26);
+        rec.data.keyboard.scanCode = (unsigned short)(0x10 + se.device % 26);
+        rec.data.keyboard.wmMessage = se.up ? WM_KEYUP : WM_KEYDOWN;
+        rec.data.keyboard.keyUp = se.up;
+    }
+    else
+    {
+        rec.type = MOUSE_BUTTON_EVENT;
+        rec.data.button.buttonFlags = se.up ? SYNTHETIC_BUTTON_UP : SYNTHETIC_BUTTON_DOWN;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Creation / destruction
+
+SyntheticBackend::SyntheticBackend(const SyntheticConfig& config)
+{
+    if(config.eventsPerSecond == 0 || config.burstLength == 0)
+        throw KaptivateException("The synthetic devices need to send something");
+
+    this->config = config;
+    this->state = new SyntheticState();
+    state->sink = NULL;
+    state->rawThread = 0;
+    state->hookThread = 0;
+    state->stopping = 0;
+    state->suspended = false;
+    state->startTicks = 0;
+    state->lastDecision = 0;
+    state->decided = 0;
+    state->consumed = 0;
+
+    LARGE_INTEGER freq;
+    QueryPerformanceFrequency(&freq);
+    state->ticksPerUs = (double)freq.QuadPart / 1000000.0;
+}
+
+SyntheticBackend::~SyntheticBackend()
+{
+    stop();
+    delete state;
+    state = NULL;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Threads
+
+static DWORD WINAPI SyntheticRawLoop(LPVOID iValue)
+{
+    ((SyntheticBackend*)iValue)->_RunRaw();
+    return 0;
+}
+
+static DWORD WINAPI SyntheticHookLoop(LPVOID iValue)
+{
+    ((SyntheticBackend*)iValue)->_RunHook();
+    return 0;
+}
+
+// Push each raw event when it's due. Anything that's already overdue goes along with it in the same batch,
+// the way a real backend drains its buffer.
+void SyntheticBackend::_RunRaw()
+{
+    vector<EventRecord> batch(SYNTHETIC_BATCH_SIZE);
+    size_t next = 0;
+
+    while(next < state->schedule.size())
+    {
+        if(!waitFor(state, state->startTicks + state->schedule[next].at))
+            return;
+
+        LONGLONG t = now() - state->startTicks;
+        unsigned int count = 0;
+        while(next < state->schedule.size() && count < SYNTHETIC_BATCH_SIZE && state->schedule[next].at <= t)
+            fillRecord(state, state->schedule[next++], batch[count++]);
+
+        if(!state->suspended)
+            state->sink->pushRawBatch(&batch[0], count);
+    }
+}
+
+// Ask for a decision on each event when it's due, skewed against the raw events
+void SyntheticBackend::_RunHook()
+{
+    for(size_t i = 0; i < state->schedule.size(); i++)
+    {
+        const ScheduledEvent& se = state->schedule[i];
+        LONGLONG due = state->startTicks + se.at + state->skewTicks;
+        if(!waitFor(state, due))
+            return;
+        if(state->suspended)
+            continue;
+
+        Decision decision;
+        if(se.keyboard)
+        {
+            unsigned int vkey = 'A' + se.device % 26;
+            unsigned int scanCode = 0x10 + se.device % 26;
+            decision = state->sink->decideKeyboard(vkey, scanCode, se.up);
+        }
+        else
+        {
+            decision = state->sink->decideMouse(se.up ? WM_LBUTTONUP : WM_LBUTTONDOWN);
+        }
+
+        LONGLONG done = now();
+        state->latencies.push_back(done - due);
+        state->lastDecision = done;
+        state->decided++;
+        if(decision == CONSUME)
+            state->consumed++;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// InputBackend
+
+// Work out the whole schedule up front, then set both threads loose on it
+void SyntheticBackend::start(InputSink* sink, bool wantMouse, bool wantKeyboard, bool startSuspended, UINT msgTimeoutMs)
+{
+    if(state->rawThread != 0 || state->hookThread != 0)
+        throw KaptivateException("The synthetic backend is already running");
+
+    state->sink = sink;
+    state->stopping = 0;
+    state->suspended = startSuspended;
+    state->schedule.clear();
+    state->devices.clear();
+    state->latencies.clear();
+    state->decided = 0;
+    state->consumed = 0;
+    state->lastDecision = 0;
+
+    unsigned int keyboards = wantKeyboard ? config.keyboards : 0;
+    unsigned int mice = wantMouse ? config.mice : 0;
+
+    // Make up the devices
+    char name[64];
+    for(unsigned int i = 0; i < keyboards + mice; i++)
+    {
+        HANDLE device = (HANDLE)(UINT_PTR)(SYNTHETIC_HANDLE_BASE + i);
+        state->devices.push_back(device);
+
+        if(i < keyboards)
+        {
+            sprintf_s(name, sizeof(name), "\\\\?\\SYNTHETIC#KEYBOARD#%u", i);
+            sink->announceKeyboard(device, name);
+        }
+        else
+        {
+            sprintf_s(name, sizeof(name), "\\\\?\\SYNTHETIC#MOUSE#%u", i - keyboards);
+            sink->announceMouse(device, name);
+        }
+    }
+
+    // Each device sends a burst every period, at its own random phase, with a little jitter. Keys go down
+    // and up, buttons go down and up.
+    unsigned int seed = config.seed;
+    double tpu = state->ticksPerUs;
+    LONGLONG duration = (LONGLONG)config.durationMs * 1000;
+    LONGLONG period = (LONGLONG)config.burstLength * 1000000 / config.eventsPerSecond;
+    if(period < 1)
+        period = 1;
+
+    for(unsigned int d = 0; d < state->devices.size(); d++)
+    {
+        bool up = false;
+        LONGLONG phase = nextRandom(seed) % period;
+        for(LONGLONG burst = phase; burst < duration; burst += period)
+        {
+            LONGLONG jitter = (period >= 10) ? (LONGLONG)(nextRandom(seed) % (period / 10)) : 0;
+            for(unsigned int j = 0; j < config.burstLength; j++)
+            {
+                LONGLONG at = burst + jitter + (LONGLONG)j * config.burstGapUs;
+                if(at >= duration)
+                    break;
+
+                ScheduledEvent se;
+                se.at = (LONGLONG)(at * tpu);
+                se.device = d;
+                se.keyboard = (d < keyboards);
+                se.up = up;
+                up = !up;
+                state->schedule.push_back(se);
+            }
+        }
+    }
+
+    sort(state->schedule.begin(), state->schedule.end(), earlier);
+
+    state->skewTicks = (LONGLONG)(config.hookSkewUs * tpu);
+    state->startTicks = now() + (LONGLONG)(SYNTHETIC_LEAD_MS * 1000.0 * tpu);
+
+    DWORD threadId = 0;
+    if(NULL == (state->rawThread = CreateThread(NULL, 0, SyntheticRawLoop, this, 0, &threadId)))
+        throw KaptivateException("Failed to create the synthetic raw thread");
+    if(NULL == (state->hookThread = CreateThread(NULL, 0, SyntheticHookLoop, this, 0, &threadId)))
+    {
+        stop();
+        throw KaptivateException("Failed to create the synthetic hook thread");
+    }
+}
+
+// Tell both threads to give up and wait for them
+void SyntheticBackend::stop()
+{
+    InterlockedExchange(&state->stopping, 1);
+
+    HANDLE threads[2] = { state->rawThread, state->hookThread };
+    for(int i = 0; i < 2; i++)
+    {
+        if(threads[i] == 0)
+            continue;
+        WaitForSingleObject(threads[i], 5000);
+        CloseHandle(threads[i]);
+    }
+
+    state->rawThread = 0;
+    state->hookThread = 0;
+}
+
+void SyntheticBackend::suspend()
+{
+    state->suspended = true;
+}
+
+void SyntheticBackend::resume()
+{
+    state->suspended = false;
+}
+
+bool SyntheticBackend::isAlive() const
+{
+    return state->rawThread != 0 && !state->stopping;
+}
+
+bool SyntheticBackend::waitUntilDone(DWORD timeoutMs)
+{
+    HANDLE threads[2] = { state->rawThread, state->hookThread };
+    if(threads[0] == 0 || threads[1] == 0)
+        return true;
+    return WAIT_OBJECT_0 == WaitForMultipleObjects(2, threads, TRUE, timeoutMs);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Report
+
+static double percentileUs(vector<LONGLONG>& samples, double pct, double ticksPerUs)
+{
+    if(samples.empty())
+        return 0.0;
+    size_t idx = (size_t)((samples.size() - 1) * pct);
+    nth_element(samples.begin(), samples.begin() + idx, samples.end());
+    return (double)samples[idx] / ticksPerUs;
+}
+
+SyntheticReport SyntheticBackend::getReport() const
+{
+    SyntheticReport report;
+    memset(&report, 0, sizeof(SyntheticReport));
+    report.scheduled = (unsigned int)state->schedule.size();
+    report.decided = state->decided;
+    report.consumed = state->consumed;
+
+    if(state->lastDecision > state->startTicks)
+    {
+        report.elapsedMs = (double)(state->lastDecision - state->startTicks) / (state->ticksPerUs * 1000.0);
+        report.eventsPerSecond = report.decided * 1000.0 / report.elapsedMs;
+    }
+
+    vector<LONGLONG> samples(state->latencies);
+    report.p50Us = percentileUs(samples, 0.50, state->ticksPerUs);
+    report.p99Us = percentileUs(samples, 0.99, state->ticksPerUs);
+    report.p999Us = percentileUs(samples, 0.999, state->ticksPerUs);
+    report.maxUs = percentileUs(samples, 1.0, state->ticksPerUs);
+    return report;
+}
@@ -0,0 +1,108 @@
+/*
+ * synthetic_backend.hpp
+ * This file is a part of Kaptivate
+ * https://github.com/FunkyTownEnterprises/Kaptivate
+ *
+ * Copyright (c) 2011 Ben Cable, Chris Eberle
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include "kaptivate.hpp"
+
+namespace Kaptivate
+{
+    // What the synthetic devices should do
+    struct KAPTIVATE_API SyntheticConfig
+    {
+        unsigned int keyboards;       // How many fake keyboards
+        unsigned int mice;            // How many fake mice (they only click)
+        unsigned int eventsPerSecond; // Per device, on average
+        unsigned int burstLength;     // Events per device sent together, then a longer pause
+        unsigned int burstGapUs;      // Time between the events within a burst
+        int hookSkewUs;               // When the decision is asked for, relative to the raw event. Negative
+                                      // means the hook gets in first.
+        unsigned int durationMs;      // How long the schedule runs for
+        unsigned int seed;            // Same seed, same schedule
+
+        SyntheticConfig();
+    };
+
+    // What happened. Latencies are measured from when the decision was due to be asked for, so a hook
+    // thread that falls behind shows up in them.
+    struct SyntheticReport
+    {
+        unsigned int scheduled;
+        unsigned int decided;
+        unsigned int consumed;
+        double elapsedMs;
+        double eventsPerSecond;
+        double p50Us;
+        double p99Us;
+        double p999Us;
+        double maxUs;
+    };
+
+    struct SyntheticState;
+
+    // A backend that makes up its own input: a deterministic schedule of keystrokes and clicks from any
+    // number of fake devices. One thread pushes the raw events and another asks for decisions, like the
+    // raw input and hook threads do, so the whole pipeline can be loaded and measured without touching
+    // the real keyboard and mouse.
+    //
+    // Both threads busy-wait for their next event, so expect two cores to be kept busy.
+    class KAPTIVATE_API SyntheticBackend : public InputBackend
+    {
+    private:
+        SyntheticConfig config;
+        SyntheticState* state;
+
+        // Not copyable
+        SyntheticBackend(const SyntheticBackend&);
+        SyntheticBackend& operator=(const SyntheticBackend&);
+
+    public:
+        SyntheticBackend(const SyntheticConfig& config);
+        ~SyntheticBackend();
+
+        // InputBackend
+        void start(InputSink* sink, bool wantMouse, bool wantKeyboard, bool startSuspended, UINT msgTimeoutMs);
+        void stop();
+        void suspend();
+        void resume();
+        bool isAlive() const;
+
+        // Wait for the whole schedule to be played out. Returns false if it took longer than that.
+        bool waitUntilDone(DWORD timeoutMs);
+
+        // Only meaningful once the schedule is done, or the backend has been stopped
+        SyntheticReport getReport() const;
+
+        // Worker threads
+        void _RunRaw();
+        void _RunHook();
+    };
+}
@@ -74,4 +74,30 @@ private:
 	void CleanUp() { if(_exp) trex_free(_exp); _exp = (TRex *)0; }
 	TRex *_exp;
 };
+
+class TRexSetpp
+{
+public:
+	TRexSetpp() { _set = trex_set_new(); }
+	~TRexSetpp() { trex_set_free(_set); }
+	// adds a pattern under the given id, replacing whatever had it before
+	void Add(int id, const TRexChar *pattern) {
+		const TRexChar *error;
+		if(!trex_set_add(_set,id,pattern,&error))
+			throw TRexParseException(error);
+	}
+	void Remove(int id) { trex_set_remove(_set,id); }
+	// stores the ids of the patterns that match the whole text (up to maxids of them), returns how many there were
+	int Match(const TRexChar* text, int *ids, int maxids) {
+		return trex_set_match(_set,text,ids,maxids);
+	}
+	// return true if the pattern with the given id matches the whole text
+	bool MatchOne(int id, const TRexChar* text) {
+		return trex_set_matchone(_set,id,text) != 0;
+	}
+private:
+	TRexSetpp(const TRexSetpp&);
+	TRexSetpp& operator=(const TRexSetpp&);
+	TRexSet *_set;
+};
 #endif //_TREXPP_H_
@@ -79,8 +79,13 @@ struct TRex{
 	int _currsubexp;
 	void *_jmpbuf;
 	const TRexChar **_error;
+	TRexSet *_dfa;				/* just this pattern, for trex_match */
+	int _dfastate;				/* 0 if it hasn't been tried yet, -1 if the pattern can't be done that way */
+	const TRexChar *_dfatext;	/* what the DFA last matched, which is subexpression 0 */
 };
 
+static TRexBool trex_dfa_match(TRex *exp, const TRexChar *text, TRexBool *matched);
+
 static int trex_list(TRex *exp);
 
 static int trex_newnode(TRex *exp, TRexNodeType type)
@@ -345,8 +350,9 @@ static int trex_list(TRex *exp)
 	return ret;
 }
 
-static TRexBool trex_matchcclass(int cclass,TRexChar c)
+static TRexBool trex_matchcclass(int cclass,TRexChar ch)
 {
+	int c = (unsigned char)ch; /* the ctype functions only take unsigned chars (or EOF) */
 	switch(cclass) {
 	case 'a': return isalpha(c)?TRex_True:TRex_False;
 	case 'A': return !isalpha(c)?TRex_True:TRex_False;
@@ -506,11 +512,13 @@ static const TRexChar *trex_matchnode(TRex* exp,TRexNode *node,const TRexChar *s
 		if(str == exp->_eol) return str;
 		return NULL;
 	case OP_DOT:{
+		if(str == exp->_eol) return NULL; //nothing left to match, not even the terminator
 		*str++;
 				}
 		return str;
 	case OP_NCLASS:
 	case OP_CLASS:
+		if(str == exp->_eol) return NULL;
 		if(trex_matchclass(exp,&exp->_nodes[node->left],*str)?(type == OP_CLASS?TRex_True:TRex_False):(type == OP_NCLASS?TRex_True:TRex_False)) {
 			*str++;
 			return str;
@@ -541,6 +549,9 @@ TRex *trex_compile(const TRexChar *pattern,const TRexChar **error)
 	exp->_nsize = 0;
 	exp->_matches = 0;
 	exp->_nsubexpr = 0;
+	exp->_dfa = NULL;
+	exp->_dfastate = 0;
+	exp->_dfatext = NULL;
 	exp->_first = trex_newnode(exp,OP_EXPR);
 	exp->_error = error;
 	exp->_jmpbuf = malloc(sizeof(jmp_buf));
@@ -581,6 +592,7 @@ TRex *trex_compile(const TRexChar *pattern,const TRexChar **error)
 void trex_free(TRex *exp)
 {
 	if(exp)	{
+		if(exp->_dfa) trex_set_free(exp->_dfa);
 		if(exp->_nodes) free(exp->_nodes);
 		if(exp->_jmpbuf) free(exp->_jmpbuf);
 		if(exp->_matches) free(exp->_matches);
@@ -588,7 +600,8 @@ void trex_free(TRex *exp)
 	}
 }
 
-TRexBool trex_match(TRex* exp,const TRexChar* text)
+/* the backtracking matcher, which is the only one that knows where the subexpressions are */
+static TRexBool trex_backtrack(TRex* exp,const TRexChar* text)
 {
 	const TRexChar* res = NULL;
 	exp->_bol = text;
@@ -600,10 +613,24 @@ TRexBool trex_match(TRex* exp,const TRexChar* text)
 	return TRex_True;
 }
 
+/* the DFA if the pattern can be done that way, which is linear in the length of the text whatever the
+   pattern. that's only patterns without capture groups, so the one subexpression is the whole text */
+TRexBool trex_match(TRex* exp,const TRexChar* text)
+{
+	TRexBool matched;
+	exp->_dfatext = NULL;
+	if(!trex_dfa_match(exp,text,&matched))
+		return trex_backtrack(exp,text);
+	if(matched)
+		exp->_dfatext = text;
+	return matched;
+}
+
 TRexBool trex_searchrange(TRex* exp,const TRexChar* text_begin,const TRexChar* text_end,const TRexChar** out_begin, const TRexChar** out_end)
 {
 	const TRexChar *cur = NULL;
 	int node = exp->_first;
+	exp->_dfatext = NULL;
 	if(text_begin >= text_end) return TRex_False;
 	exp->_bol = text_begin;
 	exp->_eol = text_end;
@@ -642,7 +669,625 @@ int trex_getsubexpcount(TRex* exp)
 TRexBool trex_getsubexp(TRex* exp, int n, TRexMatch *subexp)
 {
 	if( n<0 || n >= exp->_nsubexpr) return TRex_False;
+	if(exp->_dfatext) {
+		exp->_matches[0].begin = exp->_dfatext;
+		exp->_matches[0].len = (int)scstrlen(exp->_dfatext);
+		exp->_dfatext = NULL;
+	}
 	*subexp = exp->_matches[n];
 	return TRex_True;
 }
 
+/* pattern sets: every pattern in the set is compiled into one automaton (a Thompson NFA built from the
+   TRexNode program). That's run as a DFA, whose states (sets of automaton states) are only worked out as
+   the text gets to them and are kept in a cache of limited size, thrown away whenever it fills up. That
+   finds every pattern that matches the whole text in a single pass, with no backtracking. Patterns with
+   something the automaton can't do (\b, \B, or silly repeat counts) and patterns with capture groups are
+   matched on their own instead. */
+
+#define TREX_NS_CHAR	1	/* consumes one character, arg */
+#define TREX_NS_SET		2	/* consumes one character from charset arg */
+#define TREX_NS_ANY		3	/* consumes any one character */
+#define TREX_NS_SPLIT	4	/* goes to out and out1 */
+#define TREX_NS_BOL		5	/* goes to out at the start of the text */
+#define TREX_NS_EOL		6	/* goes to out at the end of the text */
+#define TREX_NS_MATCH	7	/* pattern arg matched */
+
+#define TREX_SET_MAXSTATES 4096 /* per pattern */
+#define TREX_DFA_BUDGET (512*1024) /* bytes of DFA states kept around */
+#define TREX_DFA_EXPBUDGET (32*1024) /* the same, for a single expression's trex_match */
+#define TREX_CHARSET_WORDS ((MAX_CHAR+1)/32)
+
+typedef struct {
+	int type;
+	int arg;
+	int out;
+	int out1;
+}TRexState;
+
+typedef struct {
+	int first;	/* its automaton states, in _dpool */
+	int count;
+	unsigned int hash;
+	int ends;	/* the patterns it has matched if the text ends here, in _dpool. -1 until it's needed */
+	int nends;
+}TRexDState;
+
+typedef struct {
+	int id;
+	TRex *exp;
+	int start; /* -1 if it isn't in the automaton */
+	int nstates;
+}TRexSetPattern;
+
+struct TRexSet{
+	TRexState *_states;
+	int _nstates;
+	int _nallocated;
+	unsigned int *_charsets;
+	int _ncharsets;
+	int _ncsallocated;
+	TRexSetPattern *_patterns;
+	int _npatterns;
+	int _npallocated;
+	TRexBool _borrowed;	/* the patterns' expressions aren't ours to free */
+	int _deadstates;
+	int _budget;
+	/* the DFA. characters that no state can tell apart share a class, and a DFA state only has a
+	   transition per class */
+	TRexDState *_dstates;
+	int _ndstates;
+	int _ndallocated;
+	int *_dnext;		/* _nclasses per DFA state: the next one, or -1 if it hasn't been worked out */
+	int _dnextallocated;
+	int *_dpool;
+	int _dpoolsize;
+	int _dpoolallocated;
+	int *_dhash;		/* DFA states by their automaton states */
+	int _dhashsize;
+	int _dstart;
+	size_t _dmemory;
+	size_t _dbudget;
+	int _dflushes;
+	TRexBool _dvalid;
+	unsigned char _classof[MAX_CHAR+1];
+	int _nclasses;
+	/* scratch space for running it */
+	int *_clist;
+	int *_nlist;
+	int *_stack;
+	int *_ids;
+	unsigned int *_marks;
+	unsigned int _gen;
+	int _nscratch;
+};
+
+static int trex_set_newstate(TRexSet *set, int type, int arg, int out, int out1)
+{
+	TRexState *st;
+	if(set->_budget-- <= 0) return -1;
+	if(set->_nallocated < (set->_nstates + 1)) {
+		set->_nallocated = set->_nallocated ? set->_nallocated * 2 : 64;
+		set->_states = (TRexState *)realloc(set->_states, set->_nallocated * sizeof(TRexState));
+	}
+	st = &set->_states[set->_nstates];
+	st->type = type;
+	st->arg = arg;
+	st->out = out;
+	st->out1 = out1;
+	return set->_nstates++;
+}
+
+static int trex_set_newcharset(TRexSet *set)
+{
+	if(set->_ncsallocated < (set->_ncharsets + 1)) {
+		set->_ncsallocated = set->_ncsallocated ? set->_ncsallocated * 2 : 16;
+		set->_charsets = (unsigned int *)realloc(set->_charsets, set->_ncsallocated * TREX_CHARSET_WORDS * sizeof(unsigned int));
+	}
+	memset(&set->_charsets[set->_ncharsets * TREX_CHARSET_WORDS], 0, TREX_CHARSET_WORDS * sizeof(unsigned int));
+	return set->_ncharsets++;
+}
+
+static int trex_set_compilelist(TRexSet *set, TRex *exp, int node, int cont);
+
+/* the states for one node, leading on to cont. returns the first of them, or -1 if it can't be done */
+static int trex_set_compilenode(TRexSet *set, TRex *exp, int node, int cont)
+{
+	TRexNode *n = &exp->_nodes[node];
+	int s, cs, c, i;
+	if(cont < 0) return -1;
+	switch(n->type) {
+	case OP_DOT:
+		return trex_set_newstate(set, TREX_NS_ANY, 0, cont, -1);
+	case OP_CLASS:
+	case OP_NCLASS:
+	case OP_CCLASS:
+		cs = trex_set_newcharset(set);
+		for(c = 1; c <= MAX_CHAR; c++) {
+			TRexBool in;
+			if(n->type == OP_CCLASS) in = trex_matchcclass(n->left, (TRexChar)c);
+			else in = trex_matchclass(exp, &exp->_nodes[n->left], (TRexChar)c) ? (n->type == OP_CLASS) : (n->type == OP_NCLASS);
+			if(in) set->_charsets[cs * TREX_CHARSET_WORDS + c / 32] |= 1u << (c % 32);
+		}
+		return trex_set_newstate(set, TREX_NS_SET, cs, cont, -1);
+	case OP_EXPR:
+	case OP_NOCAPEXPR:
+		return trex_set_compilelist(set, exp, n->left, cont);
+	case OP_OR: {
+			int left = trex_set_compilelist(set, exp, n->left, cont);
+			int right = trex_set_compilelist(set, exp, n->right, cont);
+			if(left < 0 || right < 0) return -1;
+			return trex_set_newstate(set, TREX_NS_SPLIT, 0, left, right);
+		}
+	case OP_GREEDY: {
+			int p0 = (n->right >> 16)&0x0000FFFF, p1 = n->right&0x0000FFFF;
+			if(p1 == 0xFFFF) {
+				/* the loop: either another one, or on we go */
+				if((s = trex_set_newstate(set, TREX_NS_SPLIT, 0, -1, cont)) < 0) return -1;
+				if((i = trex_set_compilenode(set, exp, n->left, s)) < 0) return -1;
+				set->_states[s].out = i;
+			}
+			else {
+				/* up to p1 - p0 optional ones */
+				if(p1 < p0) return -1;
+				s = cont;
+				for(i = 0; i < p1 - p0 && s >= 0; i++) {
+					int one = trex_set_compilenode(set, exp, n->left, s);
+					s = (one < 0) ? -1 : trex_set_newstate(set, TREX_NS_SPLIT, 0, one, cont);
+				}
+			}
+			/* and the p0 that have to be there */
+			for(i = 0; i < p0 && s >= 0; i++)
+				s = trex_set_compilenode(set, exp, n->left, s);
+			return s;
+		}
+	case OP_BOL:
+		return trex_set_newstate(set, TREX_NS_BOL, 0, cont, -1);
+	case OP_EOL:
+		return trex_set_newstate(set, TREX_NS_EOL, 0, cont, -1);
+	case OP_WB:
+		return -1;
+	default:
+		if(n->type > MAX_CHAR) return -1;
+		return trex_set_newstate(set, TREX_NS_CHAR, (unsigned char)n->type, cont, -1);
+	}
+}
+
+/* a node and everything after it */
+static int trex_set_compilelist(TRexSet *set, TRex *exp, int node, int cont)
+{
+	if(node == -1 || cont < 0) return cont;
+	return trex_set_compilenode(set, exp, node, trex_set_compilelist(set, exp, exp->_nodes[node].next, cont));
+}
+
+/* puts a pattern's states at the end of the automaton */
+static void trex_set_compilepattern(TRexSet *set, TRexSetPattern *p)
+{
+	int first = set->_nstates;
+	int firstcs = set->_ncharsets;
+	set->_budget = TREX_SET_MAXSTATES;
+	/* capture groups are left to the backtracker, which is the only one that can say where they are, so
+	   that whether a pattern matches doesn't depend on which of them was asked */
+	if(p->exp->_nsubexpr > 1) {
+		p->start = -1;
+		p->nstates = 0;
+		return;
+	}
+	p->start = trex_set_newstate(set, TREX_NS_MATCH, p->id, -1, -1);
+	p->start = trex_set_compilenode(set, p->exp, p->exp->_first, p->start);
+	if(p->start < 0) {
+		set->_nstates = first;
+		set->_ncharsets = firstcs;
+	}
+	p->nstates = set->_nstates - first;
+}
+
+TRexSet *trex_set_new()
+{
+	TRexSet *set = (TRexSet *)malloc(sizeof(TRexSet));
+	memset(set, 0, sizeof(TRexSet));
+	set->_dstart = -1;
+	set->_dbudget = TREX_DFA_BUDGET;
+	return set;
+}
+
+void trex_set_free(TRexSet *set)
+{
+	int i;
+	if(!set) return;
+	for(i = 0; i < set->_npatterns && !set->_borrowed; i++)
+		trex_free(set->_patterns[i].exp);
+	if(set->_patterns) free(set->_patterns);
+	if(set->_states) free(set->_states);
+	if(set->_charsets) free(set->_charsets);
+	if(set->_clist) free(set->_clist);
+	if(set->_nlist) free(set->_nlist);
+	if(set->_stack) free(set->_stack);
+	if(set->_ids) free(set->_ids);
+	if(set->_marks) free(set->_marks);
+	if(set->_dstates) free(set->_dstates);
+	if(set->_dnext) free(set->_dnext);
+	if(set->_dpool) free(set->_dpool);
+	if(set->_dhash) free(set->_dhash);
+	free(set);
+}
+
+static TRexSetPattern *trex_set_addexp(TRexSet *set, int id, TRex *exp)
+{
+	TRexSetPattern *p;
+	if(set->_npallocated < (set->_npatterns + 1)) {
+		set->_npallocated = set->_npallocated ? set->_npallocated * 2 : 16;
+		set->_patterns = (TRexSetPattern *)realloc(set->_patterns, set->_npallocated * sizeof(TRexSetPattern));
+	}
+	p = &set->_patterns[set->_npatterns++];
+	p->id = id;
+	p->exp = exp;
+	trex_set_compilepattern(set, p);
+	set->_dvalid = TRex_False;
+	return p;
+}
+
+TRexBool trex_set_add(TRexSet *set, int id, const TRexChar *pattern, const TRexChar **error)
+{
+	TRex *exp = trex_compile(pattern, error);
+	if(!exp) return TRex_False;
+	trex_set_remove(set, id);
+	trex_set_addexp(set, id, exp);
+	return TRex_True;
+}
+
+void trex_set_remove(TRexSet *set, int id)
+{
+	int i;
+	for(i = 0; i < set->_npatterns; i++) {
+		if(set->_patterns[i].id == id) break;
+	}
+	if(i == set->_npatterns) return;
+
+	/* its states stay where they are, but nothing leads to them any more */
+	if(!set->_borrowed) trex_free(set->_patterns[i].exp);
+	set->_deadstates += set->_patterns[i].nstates;
+	memmove(&set->_patterns[i], &set->_patterns[i + 1], (set->_npatterns - i - 1) * sizeof(TRexSetPattern));
+	set->_npatterns--;
+	set->_dvalid = TRex_False;
+
+	/* once most of it is dead, start again with what's left */
+	if(set->_deadstates > 256 && set->_deadstates * 2 > set->_nstates) {
+		set->_nstates = 0;
+		set->_ncharsets = 0;
+		set->_deadstates = 0;
+		for(i = 0; i < set->_npatterns; i++)
+			trex_set_compilepattern(set, &set->_patterns[i]);
+	}
+}
+
+/* a state and everything it leads to without consuming anything, as far as states that do. an end of line
+   that isn't known to be one yet is kept, to be followed (or not) once it is */
+static void trex_set_addstate(TRexSet *set, int *list, int *n, int s, TRexBool atbol, TRexBool ateol)
+{
+	int sp = 0;
+	set->_stack[sp++] = s;
+	while(sp > 0) {
+		TRexState *st;
+		s = set->_stack[--sp];
+		if(set->_marks[s] == set->_gen) continue;
+		set->_marks[s] = set->_gen;
+		st = &set->_states[s];
+		switch(st->type) {
+		case TREX_NS_SPLIT:
+			set->_stack[sp++] = st->out1;
+			set->_stack[sp++] = st->out;
+			break;
+		case TREX_NS_BOL:
+			if(atbol) set->_stack[sp++] = st->out;
+			break;
+		case TREX_NS_EOL:
+			if(ateol) set->_stack[sp++] = st->out;
+			else list[(*n)++] = s;
+			break;
+		default:
+			list[(*n)++] = s;
+		}
+	}
+}
+
+static void trex_set_nextgen(TRexSet *set)
+{
+	if(++set->_gen == 0) {
+		memset(set->_marks, 0, set->_nscratch * sizeof(unsigned int));
+		set->_gen = 1;
+	}
+}
+
+/* forgets every DFA state */
+static void trex_dfa_flush(TRexSet *set)
+{
+	set->_ndstates = 0;
+	set->_dpoolsize = 0;
+	set->_dstart = -1;
+	set->_dmemory = 0;
+	set->_dflushes++;
+	if(set->_dhash) memset(set->_dhash, -1, set->_dhashsize * sizeof(int));
+}
+
+/* splits the character classes by whether they're in a charset or not */
+static void trex_dfa_splitclasses(TRexSet *set, const unsigned int *cs)
+{
+	int remap[2][MAX_CHAR+1], c, n = 0;
+	memset(remap, -1, sizeof(remap));
+	for(c = 0; c <= MAX_CHAR; c++) {
+		int in = (cs[c / 32] >> (c % 32)) & 1;
+		int *to = &remap[in][set->_classof[c]];
+		if(*to < 0) *to = n++;
+		set->_classof[c] = (unsigned char)*to;
+	}
+	set->_nclasses = n;
+}
+
+/* gets ready to run the DFA, starting it again if the automaton has changed since last time */
+static void trex_dfa_prepare(TRexSet *set)
+{
+	int i, c;
+	unsigned char single[MAX_CHAR+1];
+
+	if(set->_nscratch < set->_nstates) {
+		set->_nscratch = set->_nstates;
+		set->_clist = (int *)realloc(set->_clist, set->_nscratch * sizeof(int));
+		set->_nlist = (int *)realloc(set->_nlist, set->_nscratch * sizeof(int));
+		set->_ids = (int *)realloc(set->_ids, set->_nscratch * sizeof(int));
+		set->_stack = (int *)realloc(set->_stack, (set->_nscratch * 2 + 1) * sizeof(int));
+		set->_marks = (unsigned int *)realloc(set->_marks, set->_nscratch * sizeof(unsigned int));
+		memset(set->_marks, 0, set->_nscratch * sizeof(unsigned int));
+	}
+	if(set->_dvalid) return;
+
+	/* a character of its own for every one a state asks for by name, then split by the charsets */
+	memset(single, 0, sizeof(single));
+	memset(set->_classof, 0, sizeof(set->_classof));
+	set->_nclasses = 1;
+	for(i = 0; i < set->_nstates; i++) {
+		if(set->_states[i].type == TREX_NS_CHAR) single[set->_states[i].arg] = 1;
+	}
+	for(c = 1; c <= MAX_CHAR; c++) {
+		if(single[c]) set->_classof[c] = (unsigned char)set->_nclasses++;
+	}
+	for(i = 0; i < set->_nstates; i++) {
+		if(set->_states[i].type == TREX_NS_SET)
+			trex_dfa_splitclasses(set, &set->_charsets[set->_states[i].arg * TREX_CHARSET_WORDS]);
+	}
+
+	trex_dfa_flush(set);
+	set->_dvalid = TRex_True;
+}
+
+static int trex_dfa_cmp(const void *a, const void *b)
+{
+	return *(const int *)a - *(const int *)b;
+}
+
+static int *trex_dfa_poolalloc(TRexSet *set, int n)
+{
+	int *p;
+	if(!set->_dpool || set->_dpoolallocated < set->_dpoolsize + n) {
+		while(set->_dpoolallocated < set->_dpoolsize + n)
+			set->_dpoolallocated = set->_dpoolallocated ? set->_dpoolallocated * 2 : 256;
+		set->_dpool = (int *)realloc(set->_dpool, set->_dpoolallocated * sizeof(int));
+	}
+	p = &set->_dpool[set->_dpoolsize];
+	set->_dpoolsize += n;
+	return p;
+}
+
+/* the DFA state for a list of automaton states, making a new one if need be (which might flush the cache) */
+static int trex_dfa_state(TRexSet *set, int *list, int n)
+{
+	unsigned int h = 2166136261u;
+	int i, d, mask;
+	size_t need = sizeof(TRexDState) + (set->_nclasses + n) * sizeof(int);
+	TRexDState *ds;
+
+	if(n > 1) qsort(list, n, sizeof(int), trex_dfa_cmp);
+	for(i = 0; i < n; i++) h = (h ^ (unsigned int)list[i]) * 16777619u;
+
+	if(set->_dhashsize) {
+		mask = set->_dhashsize - 1;
+		for(i = h & mask; set->_dhash[i] >= 0; i = (i + 1) & mask) {
+			ds = &set->_dstates[set->_dhash[i]];
+			if(ds->hash == h && ds->count == n && (n == 0 || !memcmp(&set->_dpool[ds->first], list, n * sizeof(int))))
+				return set->_dhash[i];
+		}
+	}
+
+	if(set->_ndstates > 0 && set->_dmemory + need > set->_dbudget)
+		trex_dfa_flush(set);
+
+	if(set->_ndallocated < set->_ndstates + 1) {
+		set->_ndallocated = set->_ndallocated ? set->_ndallocated * 2 : 16;
+		set->_dstates = (TRexDState *)realloc(set->_dstates, set->_ndallocated * sizeof(TRexDState));
+	}
+	if(set->_dnextallocated < (set->_ndstates + 1) * set->_nclasses) {
+		set->_dnextallocated = set->_ndallocated * set->_nclasses;
+		set->_dnext = (int *)realloc(set->_dnext, set->_dnextallocated * sizeof(int));
+	}
+	if(set->_dhashsize < (set->_ndstates + 1) * 2) {
+		set->_dhashsize = set->_dhashsize ? set->_dhashsize * 2 : 64;
+		set->_dhash = (int *)realloc(set->_dhash, set->_dhashsize * sizeof(int));
+		memset(set->_dhash, -1, set->_dhashsize * sizeof(int));
+		mask = set->_dhashsize - 1;
+		for(d = 0; d < set->_ndstates; d++) {
+			for(i = set->_dstates[d].hash & mask; set->_dhash[i] >= 0; i = (i + 1) & mask);
+			set->_dhash[i] = d;
+		}
+	}
+
+	d = set->_ndstates++;
+	ds = &set->_dstates[d];
+	ds->first = set->_dpoolsize;
+	if(n) memcpy(trex_dfa_poolalloc(set, n), list, n * sizeof(int));
+	ds->count = n;
+	ds->hash = h;
+	ds->ends = -1;
+	ds->nends = 0;
+	memset(&set->_dnext[d * set->_nclasses], -1, set->_nclasses * sizeof(int));
+	set->_dmemory += need;
+
+	mask = set->_dhashsize - 1;
+	for(i = h & mask; set->_dhash[i] >= 0; i = (i + 1) & mask);
+	set->_dhash[i] = d;
+	return d;
+}
+
+static int trex_dfa_start(TRexSet *set)
+{
+	int i, n = 0;
+	if(set->_dstart >= 0) return set->_dstart;
+	trex_set_nextgen(set);
+	for(i = 0; i < set->_npatterns; i++) {
+		if(set->_patterns[i].start >= 0)
+			trex_set_addstate(set, set->_clist, &n, set->_patterns[i].start, TRex_True, TRex_False);
+	}
+	set->_dstart = trex_dfa_state(set, set->_clist, n);
+	return set->_dstart;
+}
+
+/* where a DFA state goes on a character */
+static int trex_dfa_step(TRexSet *set, int d, unsigned char c)
+{
+	int cls = set->_classof[c], next = set->_dnext[d * set->_nclasses + cls];
+	int i, n = 0, first, count, flushes;
+	if(next >= 0) return next;
+
+	first = set->_dstates[d].first;
+	count = set->_dstates[d].count;
+	trex_set_nextgen(set);
+	for(i = 0; i < count; i++) {
+		TRexState *st = &set->_states[set->_dpool[first + i]];
+		TRexBool takes;
+		switch(st->type) {
+		case TREX_NS_CHAR: takes = (st->arg == c); break;
+		case TREX_NS_ANY: takes = TRex_True; break;
+		case TREX_NS_SET: takes = (set->_charsets[st->arg * TREX_CHARSET_WORDS + c / 32] >> (c % 32)) & 1; break;
+		default: takes = TRex_False;
+		}
+		if(takes)
+			trex_set_addstate(set, set->_nlist, &n, st->out, TRex_False, TRex_False);
+	}
+
+	/* if the cache got flushed to make room, d isn't d any more */
+	flushes = set->_dflushes;
+	next = trex_dfa_state(set, set->_nlist, n);
+	if(flushes == set->_dflushes)
+		set->_dnext[d * set->_nclasses + cls] = next;
+	return next;
+}
+
+/* the patterns a DFA state has matched if the text ends there, into _ids */
+static int trex_dfa_ends(TRexSet *set, int d, TRexBool atbol)
+{
+	TRexDState *ds = &set->_dstates[d];
+	int i, n = 0, m = 0;
+	trex_set_nextgen(set);
+	for(i = 0; i < ds->count; i++)
+		set->_marks[set->_dpool[ds->first + i]] = set->_gen;
+	for(i = 0; i < ds->count; i++) {
+		TRexState *st = &set->_states[set->_dpool[ds->first + i]];
+		if(st->type == TREX_NS_EOL) trex_set_addstate(set, set->_clist, &n, st->out, atbol, TRex_True);
+		else if(st->type == TREX_NS_MATCH) set->_ids[m++] = st->arg;
+	}
+	for(i = 0; i < n; i++) {
+		if(set->_states[set->_clist[i]].type == TREX_NS_MATCH) set->_ids[m++] = set->_states[set->_clist[i]].arg;
+	}
+	return m;
+}
+
+/* runs the DFA over the whole text. returns how many patterns in the automaton matched, and which */
+static int trex_dfa_run(TRexSet *set, const TRexChar *text, const int **ids)
+{
+	const unsigned char *t = (const unsigned char *)text;
+	TRexDState *ds;
+	int d;
+
+	trex_dfa_prepare(set);
+	d = trex_dfa_start(set);
+	*ids = set->_ids;
+	if(!*t) return trex_dfa_ends(set, d, TRex_True); /* the start of the text too, so not worth keeping */
+
+	for(; *t && set->_dstates[d].count > 0; t++)
+		d = trex_dfa_step(set, d, *t);
+	if(*t) return 0;
+
+	ds = &set->_dstates[d];
+	if(ds->ends < 0) {
+		int m = trex_dfa_ends(set, d, TRex_False);
+		int *ends = trex_dfa_poolalloc(set, m);
+		ds = &set->_dstates[d];
+		if(m) memcpy(ends, set->_ids, m * sizeof(int));
+		ds->ends = (int)(ends - set->_dpool);
+		ds->nends = m;
+		set->_dmemory += m * sizeof(int);
+	}
+	*ids = &set->_dpool[ds->ends];
+	return ds->nends;
+}
+
+int trex_set_match(TRexSet *set, const TRexChar *text, int *ids, int maxids)
+{
+	int i, n, count = 0;
+	const int *matched;
+
+	/* the ones that couldn't go in the automaton */
+	for(i = 0; i < set->_npatterns; i++) {
+		TRexSetPattern *p = &set->_patterns[i];
+		if(p->start < 0 && trex_backtrack(p->exp, text)) {
+			if(count < maxids) ids[count] = p->id;
+			count++;
+		}
+	}
+
+	n = trex_dfa_run(set, text, &matched);
+	for(i = 0; i < n; i++) {
+		if(count < maxids) ids[count] = matched[i];
+		count++;
+	}
+	return count;
+}
+
+TRexBool trex_set_matchone(TRexSet *set, int id, const TRexChar *text)
+{
+	int i, n;
+	const int *matched;
+	for(i = 0; i < set->_npatterns; i++) {
+		if(set->_patterns[i].id == id) break;
+	}
+	if(i == set->_npatterns) return TRex_False;
+	if(set->_patterns[i].start < 0) return trex_backtrack(set->_patterns[i].exp, text);
+
+	/* the DFA has all of them in it, so it's no quicker to ask about just the one */
+	n = trex_dfa_run(set, text, &matched);
+	for(i = 0; i < n; i++) {
+		if(matched[i] == id) return TRex_True;
+	}
+	return TRex_False;
+}
+
+/* trex_match with a set of one. returns false if the pattern can't be done that way */
+static TRexBool trex_dfa_match(TRex *exp, const TRexChar *text, TRexBool *matched)
+{
+	const int *ids;
+	if(exp->_dfastate == 0) {
+		TRexSet *set = trex_set_new();
+		set->_borrowed = TRex_True;
+		set->_dbudget = TREX_DFA_EXPBUDGET;
+		if(trex_set_addexp(set, 0, exp)->start < 0) {
+			trex_set_free(set);
+			exp->_dfastate = -1;
+		}
+		else {
+			exp->_dfa = set;
+			exp->_dfastate = 1;
+		}
+	}
+	if(exp->_dfastate < 0) return TRex_False;
+	*matched = trex_dfa_run(exp->_dfa, text, &ids) > 0;
+	return TRex_True;
+}
@@ -58,10 +58,23 @@ typedef struct {
 
 TREX_API TRex *trex_compile(const TRexChar *pattern,const TRexChar **error);
 TREX_API void trex_free(TRex *exp);
+/* trex_match runs a DFA when the pattern allows it (no capture groups, \b or \B), so it's linear in the
+   length of the text. anything else backtracks, as it always did. */
 TREX_API TRexBool trex_match(TRex* exp,const TRexChar* text);
 TREX_API TRexBool trex_search(TRex* exp,const TRexChar* text, const TRexChar** out_begin, const TRexChar** out_end);
 TREX_API TRexBool trex_searchrange(TRex* exp,const TRexChar* text_begin,const TRexChar* text_end,const TRexChar** out_begin, const TRexChar** out_end);
 TREX_API int trex_getsubexpcount(TRex* exp);
 TREX_API TRexBool trex_getsubexp(TRex* exp, int n, TRexMatch *subexp);
 
+/* pattern sets: many patterns matched against the same text in one go. a match is always of the whole text,
+   as with trex_match. */
+typedef struct TRexSet TRexSet;
+
+TREX_API TRexSet *trex_set_new();
+TREX_API void trex_set_free(TRexSet *set);
+TREX_API TRexBool trex_set_add(TRexSet *set, int id, const TRexChar *pattern, const TRexChar **error);
+TREX_API void trex_set_remove(TRexSet *set, int id);
+TREX_API int trex_set_match(TRexSet *set, const TRexChar *text, int *ids, int maxids);
+TREX_API TRexBool trex_set_matchone(TRexSet *set, int id, const TRexChar *text);
+
 #endif
@@ -0,0 +1,782 @@
+/*
+ * win32_backend.cpp
+ * This file is a part of Kaptivate
+ * https://github.com/FunkyTownEnterprises/Kaptivate
+ *
+ * Copyright (c) 2011 Ben Cable, Chris Eberle
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Quick overview:
+ * - Raw input API - tells us which device sent us a keyboard / mouse event
+ * - Keyboard hook API - lets us decide whether or not other apps see a key / mouse event
+ * - Goal - decide which events we want to let through while KNOWING where they came from
+ * 
+ * Problems to overcome:
+ *    1. Neither API can be easily used with the other
+ *    2. There is NO GUARANTEED ORDER for which API will generate an event first
+ */
+
+#include "stdafx.hpp"
+#include "win32_backend.hpp"
+#include "kaptivate_exceptions.hpp"
+#include "hooks.hpp"
+
+#include <string.h>
+
+using namespace std;
+using namespace Kaptivate;
+
+////////////////////////////////////////////////////////////////////////////////
+// defines
+
+#define MOUSE_MESSAGE    (WM_USER + 1011)
+#define KEYBOARD_MESSAGE (WM_USER + 1012)
+#define PING_MESSAGE     (WM_USER + 1013)
+#define QUIT_MESSAGE     (WM_USER + 1014)
+
+// How much raw input we try to read per GetRawInputBuffer call
+#define RAW_BUFFER_SIZE 16384
+
+// Pass the batch along once it gets this big, even if there's more waiting
+#define RAW_BATCH_FLUSH 256
+
+// Horizontal wheel support arrived with Vista, the XP headers don't know about it
+#ifndef RI_MOUSE_HWHEEL
+#define RI_MOUSE_HWHEEL 0x0800
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+// Static and extern data
+
+extern HMODULE kaptivateDllModule;
+
+// The window procedures are plain functions, this is how they find their way back
+static Win32Backend* volatile _activeBackend = NULL;
+
+////////////////////////////////////////////////////////////////////////////////
+// Data passed from start to the message loops
+
+typedef struct _kapMsgLoopParams
+{
+    HWND callbackWindow;
+    HANDLE msgEvent;
+    bool success;
+} kapMsgLoopParams;
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Creation / destruction
+
+Win32Backend::Win32Backend()
+{
+    sink = NULL;
+    suspended = false;
+    hookMsgLoopThread = 0;
+    rawMsgLoopThread = 0;
+    hookCallbackWindow = 0;
+    rawCallbackWindow = 0;
+    rawKeyboardRunning = false;
+    rawMouseRunning = false;
+    wantMouse = false;
+    wantKeyboard = false;
+
+    rawBufferSize = RAW_BUFFER_SIZE;
+    rawBuffer = (RAWINPUT*)malloc(rawBufferSize);
+    if(rawBuffer == NULL)
+        throw KaptivateException("Unable to allocate the raw input buffer");
+    batch.reserve(RAW_BATCH_FLUSH * 2);
+
+    // A 32 bit process on 64 bit Windows gets 64 bit headers from GetRawInputBuffer (but not from
+    // GetRawInputData), so the data starts 8 bytes later than RAWINPUT says
+    rawHeaderSize = sizeof(RAWINPUTHEADER);
+    rawBlockAlign = sizeof(DWORD_PTR);
+#ifndef _WIN64
+    BOOL wow64 = FALSE;
+    if(IsWow64Process(GetCurrentProcess(), &wow64) && wow64)
+    {
+        rawHeaderSize += 8;
+        rawBlockAlign = 8;
+    }
+#endif
+}
+
+Win32Backend::~Win32Backend()
+{
+    free(rawBuffer);
+    rawBuffer = NULL;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Event processing
+
+// Translate a raw keyboard event and add it to the batch
+void Win32Backend::decodeKeyboard(HANDLE device, const RAWKEYBOARD& keyboard, LONGLONG timestamp)
+{
+    bool keyUp = false;
+    if((keyboard.Flags & RI_KEY_BREAK) == RI_KEY_BREAK)
+        keyUp = true;
+    else if((keyboard.Flags & RI_KEY_MAKE) != RI_KEY_MAKE)
+        return;
+
+    EventRecord rec;
+    memset(&rec, 0, sizeof(EventRecord));
+    rec.timestamp = timestamp;
+    rec.device = device;
+    rec.type = KEYBOARD_EVENT;
+    rec.decision = UNDECIDED;
+    rec.samples = 1;
+    rec.data.keyboard.vkey = keyboard.VKey;
+    rec.data.keyboard.scanCode = keyboard.MakeCode;
+    rec.data.keyboard.wmMessage = keyboard.Message;
+    rec.data.keyboard.keyUp = keyUp;
+    batch.push_back(rec);
+}
+
+// We're being asked to interpret a keyboard hook event. Work out which key it's about, and let the sink decide
+// (it'll find the raw event that goes with it). Returning 1 stops other apps from recieving the event.
+LRESULT Win32Backend::ProcessKeyboardHook(HWND hWnd, WPARAM wParam, LPARAM lParam)
+{
+    unsigned int vkey = (unsigned int)wParam & 255;
+    unsigned int scanCode = (((unsigned int)lParam) >> 16) & 255;
+    bool keyUp = (((unsigned int)lParam) & 0x80000000) != 0;
+
+    return (sink->decideKeyboard(vkey, scanCode, keyUp) == CONSUME) ? 1 : 0;
+}
+
+// Same for the mouse hook. Mouse hook calls are simply paired with raw events in order.
+// wParam is the mouse message. lParam points into the hooked process, so it's no use to us.
+LRESULT Win32Backend::ProcessMouseHook(HWND hWnd, WPARAM wParam, LPARAM lParam)
+{
+    return (sink->decideMouse((unsigned int)wParam) == CONSUME) ? 1 : 0;
+}
+
+// Translate a raw mouse event and add it to the batch. A single raw event can report button changes,
+// a wheel turn and movement all at once; each becomes a record of its own, in the order the hook will see
+// the corresponding messages. So does each button that changed, since each gets a hook call of its own.
+void Win32Backend::decodeMouse(HANDLE device, const RAWMOUSE& mouse, LONGLONG timestamp)
+{
+    EventRecord rec;
+    memset(&rec, 0, sizeof(EventRecord));
+    rec.timestamp = timestamp;
+    rec.device = device;
+    rec.decision = UNDECIDED;
+    rec.samples = 1;
+
+    // Movement
+    bool absolute = (mouse.usFlags & MOUSE_MOVE_ABSOLUTE) == MOUSE_MOVE_ABSOLUTE;
+    if(absolute || mouse.lLastX != 0 || mouse.lLastY != 0)
+    {
+        rec.type = MOUSE_MOVE_EVENT;
+        rec.data.move.dx = mouse.lLastX;
+        rec.data.move.dy = mouse.lLastY;
+        rec.data.move.absolute = absolute;
+        batch.push_back(rec);
+    }
+
+    // Buttons
+    unsigned short buttons = mouse.usButtonFlags & ~(RI_MOUSE_WHEEL | RI_MOUSE_HWHEEL);
+    for(unsigned short bit = 1; buttons != 0; bit <<= 1)
+    {
+        if((buttons & bit) == 0)
+            continue;
+        buttons &= ~bit;
+
+        memset(&rec.data, 0, sizeof(rec.data));
+        rec.type = MOUSE_BUTTON_EVENT;
+        rec.data.button.buttonFlags = bit;
+        batch.push_back(rec);
+    }
+
+    // Wheel
+    if((mouse.usButtonFlags & (RI_MOUSE_WHEEL | RI_MOUSE_HWHEEL)) != 0)
+    {
+        memset(&rec.data, 0, sizeof(rec.data));
+        rec.type = MOUSE_WHEEL_EVENT;
+        rec.data.wheel.delta = (short)mouse.usButtonData;
+        rec.data.wheel.horizontal = (mouse.usButtonFlags & RI_MOUSE_HWHEEL) == RI_MOUSE_HWHEEL;
+        batch.push_back(rec);
+    }
+}
+
+// Decode one block of raw input, wherever it came from
+void Win32Backend::decode(const RAWINPUTHEADER& header, const BYTE* data, LONGLONG timestamp)
+{
+    if(header.dwType == RIM_TYPEMOUSE)
+        decodeMouse(header.hDevice, *(const RAWMOUSE*)data, timestamp);
+    else if(header.dwType == RIM_TYPEKEYBOARD)
+        decodeKeyboard(header.hDevice, *(const RAWKEYBOARD*)data, timestamp);
+}
+
+// Pick up everything else that's already waiting in the raw input buffer, as many blocks per call as will
+// fit. If GetRawInputBuffer isn't having it, they simply show up as WM_INPUT messages of their own later.
+void Win32Backend::drainRawBuffer(LONGLONG timestamp)
+{
+    while(true)
+    {
+        UINT size = rawBufferSize;
+        UINT count = GetRawInputBuffer(rawBuffer, &size, sizeof(RAWINPUTHEADER));
+        if(count == 0 || count == (UINT)-1)
+            break;
+
+        const BYTE* block = (const BYTE*)rawBuffer;
+        for(UINT i = 0; i < count; i++)
+        {
+            const RAWINPUTHEADER* header = (const RAWINPUTHEADER*)block;
+            decode(*header, block + rawHeaderSize, timestamp);
+
+            // Blocks are QWORD aligned under WOW64, which NEXTRAWINPUTBLOCK doesn't know about
+            UINT_PTR next = (UINT_PTR)(block + header->dwSize);
+            block = (const BYTE*)((next + rawBlockAlign - 1) & ~(UINT_PTR)(rawBlockAlign - 1));
+        }
+
+        // Don't sit on a huge backlog, the hook is waiting for these
+        if(batch.size() >= RAW_BATCH_FLUSH)
+            flushBatch();
+    }
+}
+
+// Hand whatever we've decoded to the sink in one go
+void Win32Backend::flushBatch()
+{
+    if(batch.empty())
+        return;
+    sink->pushRawBatch(&batch[0], (unsigned int)batch.size());
+    batch.clear();
+}
+
+// Our window has recieved an event from the raw api. Decode it, along with anything else that's piled up
+// behind it, and pass the lot along.
+void Win32Backend::ProcessRawInput(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
+{
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+
+    // The buffer doesn't hand out the input that came with this message, so that one is read on its own
+    UINT size = rawBufferSize;
+    if((UINT)-1 != GetRawInputData((HRAWINPUT)lParam, RID_INPUT, rawBuffer, &size, sizeof(RAWINPUTHEADER)))
+        decode(rawBuffer->header, (const BYTE*)&rawBuffer->data, now.QuadPart);
+
+    drainRawBuffer(now.QuadPart);
+    flushBatch();
+}
+
+// The keyboard or mouse hook has been called. This method gets called through some very special magic.
+// Decide what kind of event we're responding to, and call the appropriate handler.
+LRESULT Win32Backend::_ProcessHookWndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
+{
+    if(MOUSE_MESSAGE == message)
+    {
+        if(suspended)
+            return 0;
+        return ProcessMouseHook(hWnd, wParam, lParam);
+    }
+    else if(KEYBOARD_MESSAGE == message)
+    {
+        if(suspended)
+            return 0;
+        return ProcessKeyboardHook(hWnd, wParam, lParam);
+    }
+    else if(PING_MESSAGE == message)
+    {
+        // Ping / Pong
+        return 1;
+    }
+    else if(QUIT_MESSAGE == message)
+    {
+        PostQuitMessage(0);
+    }
+
+    return DefWindowProc(hWnd, message, wParam, lParam);
+}
+
+LRESULT Win32Backend::_ProcessRawWndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
+{
+    if(WM_INPUT == message)
+    {
+        if(!suspended)
+            ProcessRawInput(hWnd, message, wParam, lParam);
+        return 0;
+    }
+    else if(WM_INPUT_DEVICE_CHANGE == message)
+    {
+        // Plugged in or pulled out. The sink will take another look at the device list in its own time.
+        sink->devicesChanged();
+        return 0;
+    }
+    else if(PING_MESSAGE == message)
+    {
+        // Ping / Pong
+        return 1;
+    }
+    else if(QUIT_MESSAGE == message)
+    {
+        PostQuitMessage(0);
+    }
+
+    return DefWindowProc(hWnd, message, wParam, lParam);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Main event loop (seperate thread)
+
+// The one, the only, WndProc handler for Kaptivate. All messages from the hooks eventually wind up here.
+static LRESULT CALLBACK HookWndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
+{
+    if(_activeBackend)
+    {
+        return _activeBackend->_ProcessHookWndProc(hWnd, message, wParam, lParam);
+    }
+    else
+    {
+        return DefWindowProc(hWnd, message, wParam, lParam);
+    }
+}
+
+static LRESULT CALLBACK RawWndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
+{
+    if(_activeBackend)
+    {
+        return _activeBackend->_ProcessRawWndProc(hWnd, message, wParam, lParam);
+    }
+    else
+    {
+        return DefWindowProc(hWnd, message, wParam, lParam);
+    }
+}
+
+// Runs in a separate thread. Create an invisible window and process all events for that window until the window
+// is told to die.
+static DWORD WINAPI HookMessageLoop(LPVOID iValue)
+{
+    kapMsgLoopParams* params = (kapMsgLoopParams*)iValue;
+    params->success = false;
+
+    {
+        // Register a window class
+
+        WNDCLASSEX wce;
+
+        wce.cbSize = sizeof(WNDCLASSEX);
+        wce.style = CS_HREDRAW | CS_VREDRAW;
+        wce.lpfnWndProc = (WNDPROC)HookWndProc;
+        wce.cbClsExtra = 0;
+        wce.cbWndExtra = 0;
+        wce.hInstance = (HINSTANCE)kaptivateDllModule;
+        wce.hIcon = NULL;
+        wce.hIconSm = NULL;
+        wce.hCursor = NULL;
+        wce.hbrBackground = (HBRUSH)GetStockObject(NULL_BRUSH);
+        wce.lpszMenuName = NULL;
+        wce.lpszClassName = L"KaptivateHookMsgWnd";
+
+        if (!RegisterClassEx(&wce))
+        {
+            SetEvent(params->msgEvent);
+            return -1;
+        }
+
+        // Set up the win32 message-only window which recieves messages
+        if(NULL == (params->callbackWindow = CreateWindowEx(NULL, L"KaptivateHookMsgWnd", NULL, NULL, CW_USEDEFAULT,
+            CW_USEDEFAULT, 0, 0, HWND_MESSAGE, NULL, (HINSTANCE)kaptivateDllModule, NULL)))
+        {
+            SetEvent(params->msgEvent);
+            return -1;
+        }
+
+        // Signal the main thread that we're ready
+        params->success = true;
+        SetEvent(params->msgEvent);
+    }
+
+    // Finally we get to the main event loop
+    MSG msg;
+    BOOL bRet;
+    while ((bRet = GetMessage(&msg, NULL, 0, 0)) != 0)
+    {
+        if(bRet == -1)
+        {
+            break;
+        }
+        else
+        {
+            TranslateMessage(&msg);
+            DispatchMessage(&msg);
+        }
+    }
+
+    DestroyWindow(params->callbackWindow);
+
+    return 0;
+}
+
+
+static DWORD WINAPI RawMessageLoop(LPVOID iValue)
+{
+    kapMsgLoopParams* params = (kapMsgLoopParams*)iValue;
+    params->success = false;
+
+    {
+        // Register a window class
+
+        WNDCLASSEX wce;
+
+        wce.cbSize = sizeof(WNDCLASSEX);
+        wce.style = CS_HREDRAW | CS_VREDRAW;
+        wce.lpfnWndProc = (WNDPROC)RawWndProc;
+        wce.cbClsExtra = 0;
+        wce.cbWndExtra = 0;
+        wce.hInstance = (HINSTANCE)kaptivateDllModule;
+        wce.hIcon = NULL;
+        wce.hIconSm = NULL;
+        wce.hCursor = NULL;
+        wce.hbrBackground = (HBRUSH)GetStockObject(NULL_BRUSH);
+        wce.lpszMenuName = NULL;
+        wce.lpszClassName = L"KaptivateRawMsgWnd";
+
+        if (!RegisterClassEx(&wce))
+        {
+            SetEvent(params->msgEvent);
+            return -1;
+        }
+
+        // Set up the win32 message-only window which recieves messages
+        if(NULL == (params->callbackWindow = CreateWindowEx(NULL, L"KaptivateRawMsgWnd", NULL, NULL, CW_USEDEFAULT,
+            CW_USEDEFAULT, 0, 0, HWND_MESSAGE, NULL, (HINSTANCE)kaptivateDllModule, NULL)))
+        {
+            SetEvent(params->msgEvent);
+            return -1;
+        }
+
+        // Signal the main thread that we're ready
+        params->success = true;
+        SetEvent(params->msgEvent);
+    }
+
+    // Finally we get to the main event loop
+    MSG msg;
+    BOOL bRet;
+    while ((bRet = GetMessage(&msg, NULL, 0, 0)) != 0)
+    {
+        if(bRet == -1)
+        {
+            break;
+        }
+        else
+        {
+            TranslateMessage(&msg);
+            DispatchMessage(&msg);
+        }
+    }
+
+    DestroyWindow(params->callbackWindow);
+
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Start / Stop
+
+// Spin up a message loop thread, and wait for its window to answer
+bool Win32Backend::startMsgLoop(LPTHREAD_START_ROUTINE loop, HANDLE& thread, HWND& window)
+{
+    kapMsgLoopParams params;
+    params.callbackWindow = 0;
+    params.msgEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    params.success = false;
+
+    DWORD threadId = 0;
+    if(NULL == (thread = CreateThread(NULL, 0, loop, &params, 0, &threadId)))
+    {
+        CloseHandle(params.msgEvent);
+        return false;
+    }
+
+    // Wait for the thread to decide whether or not everything is good
+    WaitForSingleObject(params.msgEvent, INFINITE);
+    CloseHandle(params.msgEvent);
+    if(!params.success)
+        return false;
+
+    window = params.callbackWindow;
+    return pingMessageWindow(window);
+}
+
+// Set up both message windows, the raw input registration and the hooks
+void Win32Backend::start(InputSink* sink, bool wantMouse, bool wantKeyboard, bool startSuspended, UINT msgTimeoutMs)
+{
+    if(_activeBackend != NULL)
+        throw KaptivateException("The Windows hooks are already in use");
+
+    this->sink = sink;
+    this->suspended = startSuspended;
+    this->wantMouse = wantMouse;
+    this->wantKeyboard = wantKeyboard;
+    _activeBackend = this;
+
+    if(!startMsgLoop(HookMessageLoop, hookMsgLoopThread, hookCallbackWindow))
+    {
+        _activeBackend = NULL;
+        throw KaptivateException("Failed to initialize the hook message window");
+    }
+
+    if(!startMsgLoop(RawMessageLoop, rawMsgLoopThread, rawCallbackWindow))
+    {
+        tryStopMsgLoop();
+        _activeBackend = NULL;
+        throw KaptivateException("Failed to initialize the raw message window");
+    }
+
+    // Finally set up the hooks
+    try
+    {
+        if(!startSuspended)
+        {
+            if(!startRawCapture(wantMouse, wantKeyboard))
+                throw KaptivateException("Failed to start raw capture");
+        }
+
+        short ss = (startSuspended) ? 1 : 0;
+        if(0 != kaptivateHookInit(this->hookCallbackWindow, KEYBOARD_MESSAGE,
+                                  MOUSE_MESSAGE, msgTimeoutMs, ss))
+            throw KaptivateException("Failed to initialize the hooks");
+    }
+    catch(...)
+    {
+        kaptivateHookUninit();
+        stopRawCapture();
+        tryStopMsgLoop();
+        _activeBackend = NULL;
+        throw;
+    }
+}
+
+// Take the hooks down, then the raw input registration, then the windows
+void Win32Backend::stop()
+{
+    // Stop any further messages from being generated
+    if(0 != kaptivateHookUninit())
+        throw KaptivateException("Failed to uninitialize the hooks");
+
+    // Stop the raw events from coming in
+    if(!stopRawCapture())
+        throw KaptivateException("Failed to stop raw capture");
+
+    // Attempt to shut down the message windows
+    if(!tryStopMsgLoop())
+        throw KaptivateException("Failed to stop the Kaptivate message loop");
+
+    _activeBackend = NULL;
+}
+
+// Attempt to stop the message loop thread
+bool Win32Backend::tryStopMsgLoop()
+{
+    // Tell the hook window we're done
+    DWORD res = 0;
+    if(0 == SendMessageTimeout(this->hookCallbackWindow, QUIT_MESSAGE, 0, 0, SMTO_ABORTIFHUNG, 5000, &res))
+        return false;
+
+    // Wait for the hook thread to return
+    if(WAIT_OBJECT_0 != WaitForSingleObject(this->hookMsgLoopThread, 5000))
+        return false;
+
+    // Tell the raw window we're done
+    res = 0;
+    if(0 == SendMessageTimeout(this->rawCallbackWindow, QUIT_MESSAGE, 0, 0, SMTO_ABORTIFHUNG, 5000, &res))
+        return false;
+
+    // Wait for the raw thread to return
+    if(WAIT_OBJECT_0 != WaitForSingleObject(this->rawMsgLoopThread, 5000))
+        return false;
+
+    CloseHandle(this->hookMsgLoopThread);
+    CloseHandle(this->rawMsgLoopThread);
+    hookMsgLoopThread = 0;
+    rawMsgLoopThread = 0;
+    hookCallbackWindow = 0;
+    rawCallbackWindow = 0;
+
+    return true;
+}
+
+// Register for raw input events
+bool Win32Backend::startRawCapture(bool wantMouse, bool wantKeyboard)
+{
+    if(rawKeyboardRunning || rawMouseRunning)
+        throw KaptivateException("The raw capture events are still running");
+
+    unsigned int ct = 0;
+    if(wantKeyboard) ++ct;
+    if(wantMouse) ++ct;
+
+    // Should never happen
+    if(ct == 0)
+        return false;
+
+    RAWINPUTDEVICE* rid = new RAWINPUTDEVICE[ct];
+    ct = 0;
+
+    // Register for keyboard events in the background
+    if(wantKeyboard)
+    {
+        rid[ct].usUsagePage = 0x01; // It's a keyboard
+        rid[ct].usUsage = 0x06;
+        rid[ct].dwFlags = RIDEV_INPUTSINK | RIDEV_NOLEGACY | RIDEV_NOHOTKEYS | RIDEV_DEVNOTIFY;
+        rid[ct].hwndTarget = this->rawCallbackWindow;
+        ++ct;
+    }
+
+    // Register for mouse events in the background
+    if(wantMouse)
+    {
+        rid[ct].usUsagePage = 0x01; // It's a mouse
+        rid[ct].usUsage = 0x02;
+        rid[ct].dwFlags = RIDEV_INPUTSINK | RIDEV_NOLEGACY | RIDEV_CAPTUREMOUSE | RIDEV_DEVNOTIFY;
+        rid[ct].hwndTarget = this->rawCallbackWindow;
+        ++ct;
+    }
+
+    BOOL ret = RegisterRawInputDevices(rid, ct, sizeof(RAWINPUTDEVICE));
+    delete[] rid;
+
+    if(!ret)
+        return false;
+
+    rawKeyboardRunning = wantKeyboard;
+    rawMouseRunning = wantMouse;
+
+    return true;
+}
+
+// Unregister all raw input events
+bool Win32Backend::stopRawCapture()
+{
+    if(!rawKeyboardRunning && !rawMouseRunning)
+        return true;
+
+    unsigned int ct = 0;
+    if(rawKeyboardRunning) ++ct;
+    if(rawMouseRunning) ++ct;
+
+    // Should never happen
+    if(ct == 0)
+        return false;
+
+    RAWINPUTDEVICE* rid = new RAWINPUTDEVICE[ct];
+    ct = 0;
+
+    // Register for keyboard events in the background
+    if(rawKeyboardRunning)
+    {
+        rid[ct].usUsagePage = 0x01;
+        rid[ct].usUsage = 0x06; // It's a keyboard
+        rid[ct].dwFlags = RIDEV_REMOVE;
+        rid[ct].hwndTarget = 0x0;
+        ++ct;
+    }
+
+    // Register for mouse events in the background
+    if(rawMouseRunning)
+    {
+        rid[ct].usUsagePage = 0x01;
+        rid[ct].usUsage = 0x02; // It's a mouse
+        rid[ct].dwFlags = RIDEV_REMOVE;
+        rid[ct].hwndTarget = 0x0;
+        ++ct;
+    }
+
+    // Actually we're unregistering them.
+    BOOL ret = RegisterRawInputDevices(rid, ct, sizeof(RAWINPUTDEVICE));
+    delete[] rid;
+
+    if(!ret)
+        return false;
+
+    rawKeyboardRunning = false;
+    rawMouseRunning = false;
+
+    return true;
+}
+
+// Ensure that the message window is alive and kicking
+bool Win32Backend::pingMessageWindow(HWND wnd) const
+{
+    LRESULT res;
+    DWORD dwres = 0;
+
+    while(true)
+    {
+        res = SendMessageTimeout(wnd, PING_MESSAGE, 0, 0, SMTO_ABORTIFHUNG, 5000, &dwres);
+        if(0 == res)
+        {
+            if(ERROR_TIMEOUT == GetLastError())
+                return false;
+        }
+        else if(1 == res)
+        {
+            return true;
+        }
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Suspend / Resume
+
+// Keep our hooks alive, but have them let everything through untouched
+void Win32Backend::suspend()
+{
+    if(0 != kaptivateHookPause())
+        throw KaptivateException("Unable to suspend hook processing");
+    suspended = true;
+}
+
+// Pick up where we left off. If we started out suspended, the raw input was never registered.
+void Win32Backend::resume()
+{
+    if(!rawKeyboardRunning && !rawMouseRunning)
+    {
+        if(!startRawCapture(wantMouse, wantKeyboard))
+            throw KaptivateException("Failed to start raw capture");
+    }
+
+    suspended = false;
+    if(0 != kaptivateHookUnpause())
+        throw KaptivateException("Unable to resume hook processing");
+}
+
+// Are both message windows still answering?
+bool Win32Backend::isAlive() const
+{
+    if(!pingMessageWindow(this->hookCallbackWindow))
+        return false;
+    if(!pingMessageWindow(this->rawCallbackWindow))
+        return false;
+    if(this->hookCallbackWindow != 0 && !kaptivateHookAlive())
+        return false;
+    return true;
+}
@@ -0,0 +1,105 @@
+/*
+ * win32_backend.hpp
+ * This file is a part of Kaptivate
+ * https://github.com/FunkyTownEnterprises/Kaptivate
+ *
+ * Copyright (c) 2011 Ben Cable, Chris Eberle
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include "kaptivate.hpp"
+#include <vector>
+
+namespace Kaptivate
+{
+    // The Windows backend: the raw input API tells us which device an event came from, and the WH_KEYBOARD /
+    // WH_MOUSE hooks (not the _LL ones; our DLL gets loaded into each app) let us decide whether other apps
+    // get to see it. Each one gets a thread with a message-only window of its own.
+    //
+    // The hooks are global, so only one of these can be running at a time.
+    class Win32Backend : public InputBackend
+    {
+    private:
+        InputSink* sink;
+        volatile bool suspended;
+
+        // Stuff for the message loop threads
+        HANDLE hookMsgLoopThread;
+        HANDLE rawMsgLoopThread;
+        HWND hookCallbackWindow;
+        HWND rawCallbackWindow;
+
+        // To keep track of what type of devices we want from the raw API
+        bool rawKeyboardRunning;
+        bool rawMouseRunning;
+        bool wantMouse;
+        bool wantKeyboard;
+
+        // Raw input is read in bulk and handed to the sink in batches. Only touched by the raw thread.
+        RAWINPUT* rawBuffer;
+        UINT rawBufferSize;
+        UINT rawHeaderSize;
+        UINT rawBlockAlign;
+        std::vector<EventRecord> batch;
+
+        // Internal utility methods
+        bool startMsgLoop(LPTHREAD_START_ROUTINE loop, HANDLE& thread, HWND& window);
+        bool tryStopMsgLoop();
+        bool pingMessageWindow(HWND wnd) const;
+        bool startRawCapture(bool wantMouse, bool wantKeyboard);
+        bool stopRawCapture();
+
+        // Message processing methods
+        void ProcessRawInput(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam);
+        void drainRawBuffer(LONGLONG timestamp);
+        void decode(const RAWINPUTHEADER& header, const BYTE* data, LONGLONG timestamp);
+        void decodeMouse(HANDLE device, const RAWMOUSE& mouse, LONGLONG timestamp);
+        void decodeKeyboard(HANDLE device, const RAWKEYBOARD& keyboard, LONGLONG timestamp);
+        void flushBatch();
+        LRESULT ProcessMouseHook(HWND hWnd, WPARAM wParam, LPARAM lParam);
+        LRESULT ProcessKeyboardHook(HWND hWnd, WPARAM wParam, LPARAM lParam);
+
+        // Not copyable
+        Win32Backend(const Win32Backend&);
+        Win32Backend& operator=(const Win32Backend&);
+
+    public:
+        Win32Backend();
+        ~Win32Backend();
+
+        // InputBackend
+        void start(InputSink* sink, bool wantMouse, bool wantKeyboard, bool startSuspended, UINT msgTimeoutMs);
+        void stop();
+        void suspend();
+        void resume();
+        bool isAlive() const;
+
+        // Window message processing
+        LRESULT _ProcessHookWndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam);
+        LRESULT _ProcessRawWndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam);
+    };
+}
@@ -0,0 +1,855 @@
+/*
+ * kaptivate_bench.cpp
+ * This file is a part of Kaptivate
+ * https://github.com/FunkyTownEnterprises/Kaptivate
+ *
+ * Copyright (c) 2011 Ben Cable, Chris Eberle
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Micro-benchmarks for the hot path between the raw input thread and the hook thread: the queue, a handler
+ * chain, the dispatcher's lookups, TRex against real looking device names, and the whole thing end to end.
+ * Run the Release build from a console; numbers from a Debug build are meaningless.
+ *
+ * With -csv every result is one line of
+ *   stage,variant,params,events,ns_per_event,p50_ns,p99_ns,p999_ns
+ * so runs from two releases can be diffed or loaded into a spreadsheet. Latency columns are 0 where a
+ * benchmark only measures throughput, and ns_per_event is 0 for the end to end runs, which are paced.
+ */
+
+#include "stdafx.hpp"
+
+#include <algorithm>
+#include <exception>
+#include <queue>
+#include <string>
+#include <vector>
+
+#include "kaptivate.hpp"
+#include "event_queue.hpp"
+#include "event_chain.hpp"
+#include "event_dispatcher.hpp"
+#include "synthetic_backend.hpp"
+#include "trex/trex.hpp"
+#include "trex/TRexpp.hpp"
+
+using namespace std;
+using namespace Kaptivate;
+
+////////////////////////////////////////////////////////////////////////////////
+// Timing
+
+static double ticksPerNs = 0.0;
+
+static LONGLONG now()
+{
+    LARGE_INTEGER li;
+    QueryPerformanceCounter(&li);
+    return li.QuadPart;
+}
+
+static double toNs(LONGLONG ticks)
+{
+    return (double)ticks / ticksPerNs;
+}
+
+static double percentile(vector<LONGLONG>& samples, double pct)
+{
+    if(samples.empty())
+        return 0.0;
+    size_t idx = (size_t)((samples.size() - 1) * pct);
+    nth_element(samples.begin(), samples.begin() + idx, samples.end());
+    return toNs(samples[idx]);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Results
+
+static bool csv = false;
+
+static void section(const char* title)
+{
+    if(!csv)
+        printf("\n%s\n", title);
+}
+
+// One line per result, for people or for scripts. Latencies are in nanoseconds, 0 when not measured.
+static void result(const char* stage, const char* variant, const string& params, unsigned int events,
+                   double nsPerEvent, double p50 = 0.0, double p99 = 0.0, double p999 = 0.0)
+{
+    if(csv)
+    {
+        printf("%s,%s,%s,%u,%.1f,%.1f,%.1f,%.1f\n", stage, variant, params.c_str(), events, nsPerEvent, p50,
+            p99, p999);
+        return;
+    }
+
+    printf("  %-10s %-40s %-22s %8u events  %9.1f ns/event", stage, variant, params.c_str(), events,
+        nsPerEvent);
+    if(p50 > 0.0 || p99 > 0.0)
+        printf("  p50 %8.1f  p99 %8.1f  p99.9 %8.1f", p50, p99, p999);
+    printf("\n");
+}
+
+static string describe(const char* name, unsigned int value)
+{
+    char buf[64];
+    sprintf_s(buf, sizeof(buf), "%s=%u", name, value);
+    return buf;
+}
+
+static string describe(const char* name1, unsigned int value1, const char* name2, unsigned int value2)
+{
+    char buf[96];
+    sprintf_s(buf, sizeof(buf), "%s=%u %s=%u", name1, value1, name2, value2);
+    return buf;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// The keyboard queue as it was before the lock-free rings: a std::queue of heap allocated events behind
+// a critical section, and a SetEvent for every single event. The only change is that the wait result is
+// compared against WAIT_OBJECT_0, so that it actually waits instead of returning NULL.
+
+class LegacyKeyboardQueue
+{
+private:
+    bool stopped;
+    std::queue<EventRecord*> kbEventQueue;
+    HANDLE kbdStopSignal;
+    HANDLE kbdEventSignal;
+    HANDLE kbdHandles[2];
+    CRITICAL_SECTION kbdQueueLock;
+
+public:
+    LegacyKeyboardQueue()
+    {
+        kbdEventSignal = CreateEvent(NULL, TRUE, FALSE, NULL);
+        kbdStopSignal = CreateEvent(NULL, TRUE, FALSE, NULL);
+        kbdHandles[0] = kbdEventSignal;
+        kbdHandles[1] = kbdStopSignal;
+        stopped = false;
+        InitializeCriticalSection(&kbdQueueLock);
+    }
+
+    ~LegacyKeyboardQueue()
+    {
+        CloseHandle(kbdEventSignal);
+        CloseHandle(kbdStopSignal);
+        DeleteCriticalSection(&kbdQueueLock);
+    }
+
+    void stop()
+    {
+        EnterCriticalSection(&kbdQueueLock);
+        stopped = true;
+        SetEvent(kbdStopSignal);
+        LeaveCriticalSection(&kbdQueueLock);
+    }
+
+    void EnqueueKeyboardEvent(EventRecord* kbdEvent)
+    {
+        EnterCriticalSection(&kbdQueueLock);
+        if(!stopped)
+        {
+            kbEventQueue.push(kbdEvent);
+            SetEvent(kbdEventSignal);
+        }
+        LeaveCriticalSection(&kbdQueueLock);
+    }
+
+    EventRecord* DequeueKeyboardEvent()
+    {
+        EventRecord* evt = NULL;
+
+        EnterCriticalSection(&kbdQueueLock);
+        while(kbEventQueue.empty() && !stopped)
+        {
+            LeaveCriticalSection(&kbdQueueLock);
+            DWORD res = WaitForMultipleObjects(2, kbdHandles, FALSE, INFINITE);
+            EnterCriticalSection(&kbdQueueLock);
+            if(WAIT_OBJECT_0 != res)
+                break;
+        }
+
+        if(!kbEventQueue.empty())
+        {
+            evt = kbEventQueue.front();
+            kbEventQueue.pop();
+        }
+        LeaveCriticalSection(&kbdQueueLock);
+
+        return evt;
+    }
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// Give both queues the same face. Each push builds a fresh event and each pop gets rid of it, the way
+// the raw and hook threads do.
+
+static void fillRecord(EventRecord& rec)
+{
+    memset(&rec, 0, sizeof(EventRecord));
+    rec.type = KEYBOARD_EVENT;
+    rec.decision = UNDECIDED;
+    rec.data.keyboard.vkey = 'A';
+    rec.data.keyboard.scanCode = 0x1e;
+    rec.data.keyboard.wmMessage = WM_KEYDOWN;
+}
+
+struct LegacyAdapter
+{
+    static const char* name() { return "legacy std::queue + CRITICAL_SECTION"; }
+    LegacyKeyboardQueue queue;
+    void start() { }
+    void stop() { queue.stop(); }
+
+    bool push()
+    {
+        EventRecord* rec = new EventRecord();
+        fillRecord(*rec);
+        queue.EnqueueKeyboardEvent(rec);
+        return true;
+    }
+
+    bool pop()
+    {
+        EventRecord* evt = queue.DequeueKeyboardEvent();
+        if(NULL == evt)
+            return false;
+        delete evt;
+        return true;
+    }
+};
+
+struct RingAdapter
+{
+    static const char* name() { return "spsc ring of records"; }
+    EventQueue queue;
+    void start() { queue.start(); }
+    void stop() { queue.stop(); }
+
+    bool push()
+    {
+        EventRecord rec;
+        fillRecord(rec);
+        return queue.EnqueueKeyboardEvent(rec);
+    }
+
+    bool pop()
+    {
+        EventRecord rec;
+        return queue.DequeueKeyboardEvent(rec);
+    }
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// Benchmarks
+
+template <typename Q>
+struct ConsumerParams
+{
+    Q* queue;
+    unsigned int count;
+    volatile LONG consumed;
+    LONGLONG* sentAt;
+    vector<LONGLONG>* latencies;
+};
+
+template <typename Q>
+static DWORD WINAPI consumerThread(LPVOID param)
+{
+    ConsumerParams<Q>* p = (ConsumerParams<Q>*)param;
+
+    for(unsigned int i = 0; i < p->count; i++)
+    {
+        if(!p->queue->pop())
+            break;
+
+        if(p->latencies)
+            p->latencies->push_back(now() - p->sentAt[i]);
+        InterlockedIncrement(&p->consumed);
+    }
+
+    return 0;
+}
+
+// Producer pushes as fast as it can. Measures sustained throughput, which is what a barcode scanner
+// burst or a macro keyboard looks like.
+template <typename Q>
+static void benchBurst(unsigned int count)
+{
+    Q q;
+    q.start();
+
+    ConsumerParams<Q> params;
+    params.queue = &q;
+    params.count = count;
+    params.consumed = 0;
+    params.sentAt = NULL;
+    params.latencies = NULL;
+
+    HANDLE consumer = CreateThread(NULL, 0, consumerThread<Q>, &params, 0, NULL);
+
+    LONGLONG start = now();
+    for(unsigned int i = 0; i < count; i++)
+    {
+        while(!q.push())
+            YieldProcessor();
+    }
+    WaitForSingleObject(consumer, INFINITE);
+    LONGLONG elapsed = now() - start;
+
+    CloseHandle(consumer);
+    q.stop();
+
+    result("queue", Q::name(), "burst", count, toNs(elapsed) / count);
+}
+
+// Producer pushes one event at a time and waits for the consumer to go back to sleep before the next
+// one. This is what a human typing looks like: every event has to wake the hook thread.
+template <typename Q>
+static void benchPaced(unsigned int count)
+{
+    Q q;
+    q.start();
+
+    vector<LONGLONG> sentAt(count);
+    vector<LONGLONG> latencies;
+    latencies.reserve(count);
+
+    ConsumerParams<Q> params;
+    params.queue = &q;
+    params.count = count;
+    params.consumed = 0;
+    params.sentAt = &sentAt[0];
+    params.latencies = &latencies;
+
+    HANDLE consumer = CreateThread(NULL, 0, consumerThread<Q>, &params, 0, NULL);
+
+    for(unsigned int i = 0; i < count; i++)
+    {
+        sentAt[i] = now();
+        while(!q.push())
+            YieldProcessor();
+
+        // Wait for it to be consumed, then give the consumer time to park again
+        while(params.consumed <= (LONG)i)
+            YieldProcessor();
+        Sleep(0);
+    }
+    WaitForSingleObject(consumer, INFINITE);
+
+    CloseHandle(consumer);
+    q.stop();
+
+    double mean = 0.0;
+    for(size_t i = 0; i < latencies.size(); i++)
+        mean += toNs(latencies[i]);
+    if(!latencies.empty())
+        mean /= latencies.size();
+
+    result("queue", Q::name(), "paced", count, mean, percentile(latencies, 0.50), percentile(latencies, 0.99),
+        percentile(latencies, 0.999));
+}
+
+// Many devices reporting at once, the way a raw input read that drains the whole buffer sees them: one
+// event per device per round. Either each event is queued on its own, or the whole round is queued at
+// once and the consumer is woken once. The consumer takes whatever is waiting in one go.
+struct FanInParams
+{
+    EventQueue* queue;
+    unsigned int count;
+};
+
+static DWORD WINAPI fanInConsumer(LPVOID param)
+{
+    FanInParams* p = (FanInParams*)param;
+    vector<EventRecord> out(1024);
+
+    unsigned int seen = 0;
+    while(seen < p->count)
+    {
+        unsigned int n = p->queue->DequeueKeyboardBatch(&out[0], (unsigned int)out.size(), INFINITE);
+        if(n == 0)
+            break;
+        seen += n;
+    }
+
+    return 0;
+}
+
+static void benchFanIn(unsigned int devices, unsigned int rounds, bool batched)
+{
+    EventQueue q;
+    q.setKeyboardLimit(4096, OVERFLOW_BLOCK);
+    q.start();
+
+    vector<EventRecord> round(devices);
+    for(unsigned int d = 0; d < devices; d++)
+    {
+        fillRecord(round[d]);
+        round[d].device = (HANDLE)(UINT_PTR)(d + 1);
+    }
+
+    FanInParams params;
+    params.queue = &q;
+    params.count = devices * rounds;
+
+    HANDLE consumer = CreateThread(NULL, 0, fanInConsumer, &params, 0, NULL);
+
+    LONGLONG start = now();
+    for(unsigned int r = 0; r < rounds; r++)
+    {
+        if(batched)
+        {
+            q.EnqueueKeyboardBatch(&round[0], devices);
+        }
+        else
+        {
+            for(unsigned int d = 0; d < devices; d++)
+                q.EnqueueKeyboardEvent(round[d]);
+        }
+    }
+    WaitForSingleObject(consumer, INFINITE);
+    LONGLONG elapsed = now() - start;
+
+    CloseHandle(consumer);
+    q.stop();
+
+    result("fan-in", batched ? "batched enqueue" : "one at a time", describe("devices", devices), devices * rounds,
+        toNs(elapsed) / (devices * rounds));
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Handlers and devices for the dispatch benchmarks
+
+// Looks, passes it on
+class PassingHandler : public KeyboardHandler
+{
+public:
+    unsigned int seen;
+    PassingHandler() : seen(0) { }
+
+    virtual void HandleKeyEvent(KeyboardEvent& evt)
+    {
+        seen++;
+        evt.setDecision(PASS);
+    }
+};
+
+// The end of the line
+class DecidingHandler : public KeyboardHandler
+{
+public:
+    virtual void HandleKeyEvent(KeyboardEvent& evt)
+    {
+        evt.setDecision(evt.getKeyUp() ? PERMIT : CONSUME);
+    }
+};
+
+// What Windows calls a keyboard, more or less. A handful of vendors, a different product for each.
+static string deviceName(unsigned int i)
+{
+    static const unsigned int vendors[] = { 0x046D, 0x045E, 0x1532, 0x04D9 };
+    char buf[160];
+    sprintf_s(buf, sizeof(buf), "\\\\?\\HID#VID_%04X&PID_%04X&MI_00#7&%08x&0&0000#{884b96c3-56ef-11d1-bc8c-00a0c91e6bf6}",
+        vendors[i % 4], 0xC300 + i, 0x1a2b3c4d + i * 7919);
+    return buf;
+}
+
+// The sort of thing people register with: anything from one product
+static string devicePattern(unsigned int i)
+{
+    char buf[64];
+    sprintf_s(buf, sizeof(buf), ".*PID_%04X.*", 0xC300 + i);
+    return buf;
+}
+
+static const unsigned int handlerCounts[] = { 1, 4, 16, 64 };
+static const unsigned int deviceCounts[] = { 1, 4, 16, 64, 256 };
+static const unsigned int regexCounts[] = { 1, 8, 64, 256 };
+
+#define COUNT_OF(a) (sizeof(a) / sizeof((a)[0]))
+
+////////////////////////////////////////////////////////////////////////////////
+// Chain, dispatcher, TRex
+
+// A chain of handlers that all pass, and one at the end that decides
+static void benchChain(unsigned int handlers, unsigned int count)
+{
+    vector<PassingHandler> passing(handlers - 1);
+    DecidingHandler deciding;
+
+    KeyboardEventChain chain;
+    for(unsigned int i = 0; i + 1 < handlers; i++)
+        chain.addHandler(&passing[i]);
+    chain.addHandler(&deciding);
+
+    EventRecord rec;
+    fillRecord(rec);
+
+    LONGLONG start = now();
+    for(unsigned int i = 0; i < count; i++)
+    {
+        rec.decision = UNDECIDED;
+        KeyboardEvent evt(rec);
+        chain.runKeyboardEventChain(evt);
+    }
+    LONGLONG elapsed = now() - start;
+
+    result("chain", "runKeyboardEventChain", describe("handlers", handlers), count, toNs(elapsed) / count);
+}
+
+// Events spread over many devices, each with the same handlers, through handleKeyboard. This is the routing
+// table lookups, the reader count and the chain itself. The events are numbered the way KaptivateAPI
+// numbers them on the raw thread.
+static void benchDispatch(unsigned int devices, unsigned int handlers, unsigned int count)
+{
+    EventDispatcher dispatcher;
+    vector<PassingHandler> passing(handlers - 1);
+    DecidingHandler deciding;
+
+    for(unsigned int i = 0; i + 1 < handlers; i++)
+        dispatcher.registerKeyboardHandler(".*HID#VID_.*", &passing[i]);
+    dispatcher.registerKeyboardHandler(".*HID#VID_.*", &deciding);
+
+    vector<EventRecord> records(devices);
+    for(unsigned int d = 0; d < devices; d++)
+    {
+        HANDLE device = (HANDLE)(UINT_PTR)(0x1000 + d);
+        dispatcher.addKeyboardDevice(device, deviceName(d));
+        fillRecord(records[d]);
+        records[d].device = device;
+        records[d].deviceIndex = (unsigned short)dispatcher.deviceIndex(device);
+    }
+
+    LONGLONG start = now();
+    for(unsigned int i = 0; i < count; i++)
+    {
+        EventRecord& rec = records[i % devices];
+        rec.decision = UNDECIDED;
+        KeyboardEvent evt(rec);
+        dispatcher.handleKeyboard(evt);
+    }
+    LONGLONG elapsed = now() - start;
+
+    for(unsigned int i = 0; i + 1 < handlers; i++)
+        dispatcher.unregisterKeyboardHandler(&passing[i]);
+    dispatcher.unregisterKeyboardHandler(&deciding);
+
+    result("dispatch", "handleKeyboard", describe("devices", devices, "handlers", handlers), count,
+        toNs(elapsed) / count);
+}
+
+// Every pattern against every device name, which is what a device arriving or a handler being registered
+// costs: one at a time with TRexpp, then all at once with TRexSetpp (per name, not per pattern). Compiling
+// is measured separately.
+static void benchTRex(unsigned int regexes, unsigned int devices, unsigned int rounds)
+{
+    vector<string> names;
+    for(unsigned int d = 0; d < devices; d++)
+        names.push_back(deviceName(d));
+
+    vector<string> patterns;
+    for(unsigned int r = 0; r < regexes; r++)
+        patterns.push_back(devicePattern(r));
+
+    LONGLONG start = now();
+    vector<TRexpp*> compiled;
+    for(unsigned int r = 0; r < regexes; r++)
+    {
+        compiled.push_back(new TRexpp());
+        compiled.back()->Compile(patterns[r].c_str());
+    }
+    LONGLONG compileElapsed = now() - start;
+
+    // Counted so the loop can't be thrown away
+    volatile unsigned int matched = 0;
+    start = now();
+    for(unsigned int i = 0; i < rounds; i++)
+    {
+        for(unsigned int r = 0; r < regexes; r++)
+        {
+            for(unsigned int d = 0; d < devices; d++)
+            {
+                if(compiled[r]->Match(names[d].c_str()))
+                    matched++;
+            }
+        }
+    }
+    LONGLONG elapsed = now() - start;
+
+    for(size_t r = 0; r < compiled.size(); r++)
+        delete compiled[r];
+
+    // The same again with every pattern in one automaton, the way the dispatcher does it
+    start = now();
+    TRexSetpp set;
+    for(unsigned int r = 0; r < regexes; r++)
+        set.Add(r, patterns[r].c_str());
+    LONGLONG setCompileElapsed = now() - start;
+
+    vector<int> ids(regexes);
+    start = now();
+    for(unsigned int i = 0; i < rounds; i++)
+    {
+        for(unsigned int d = 0; d < devices; d++)
+            matched += set.Match(names[d].c_str(), &ids[0], regexes);
+    }
+    LONGLONG setElapsed = now() - start;
+
+    unsigned int matches = rounds * regexes * devices;
+    unsigned int lookups = rounds * devices;
+    result("trex", "Compile", describe("regexes", regexes), regexes, toNs(compileElapsed) / regexes);
+    result("trex", "Match", describe("regexes", regexes, "devices", devices), matches, toNs(elapsed) / matches);
+    result("trex", "TRexSetpp::Add", describe("regexes", regexes), regexes, toNs(setCompileElapsed) / regexes);
+    result("trex", "TRexSetpp::Match", describe("regexes", regexes, "devices", devices), lookups,
+        toNs(setElapsed) / lookups);
+}
+
+// A pattern that's exponential for the backtracking matcher. Without a capture group trex_match runs it as
+// a DFA, so it should cost about the same per character as any other.
+static void benchTRexWorstCase(unsigned int devices, unsigned int rounds)
+{
+    vector<string> names;
+    for(unsigned int d = 0; d < devices; d++)
+        names.push_back(deviceName(d));
+
+    TRexpp rex;
+    rex.Compile("(?:.*)*HID.*");
+
+    volatile unsigned int matched = 0;
+    LONGLONG start = now();
+    for(unsigned int i = 0; i < rounds; i++)
+    {
+        for(unsigned int d = 0; d < devices; d++)
+        {
+            if(rex.Match(names[d].c_str()))
+                matched++;
+        }
+    }
+    LONGLONG elapsed = now() - start;
+
+    unsigned int matches = rounds * devices;
+    result("trex", "Match (?:.*)*HID.*", describe("devices", devices), matches, toNs(elapsed) / matches);
+}
+
+// Devices turning up while handlers with different patterns are registered: each new device is matched
+// against every pattern and added to the chains that want it.
+static void benchHotplug(unsigned int regexes, unsigned int devices)
+{
+    EventDispatcher dispatcher;
+    vector<DecidingHandler> handlers(regexes);
+    for(unsigned int r = 0; r < regexes; r++)
+        dispatcher.registerKeyboardHandler(devicePattern(r), &handlers[r]);
+
+    vector<string> names;
+    for(unsigned int d = 0; d < devices; d++)
+        names.push_back(deviceName(d));
+
+    LONGLONG start = now();
+    for(unsigned int d = 0; d < devices; d++)
+        dispatcher.addKeyboardDevice((HANDLE)(UINT_PTR)(0x1000 + d), names[d]);
+    LONGLONG elapsed = now() - start;
+
+    for(unsigned int r = 0; r < regexes; r++)
+        dispatcher.unregisterKeyboardHandler(&handlers[r]);
+
+    result("hotplug", "addKeyboardDevice", describe("regexes", regexes, "devices", devices), devices,
+        toNs(elapsed) / devices);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// End to end
+
+// The whole pipeline, raw thread to decision, with synthetic keyboards. Latency is from when the hook
+// would have asked to when it got its answer.
+static void benchEndToEnd(unsigned int keyboards, unsigned int handlers, unsigned int durationMs)
+{
+    SyntheticConfig config;
+    config.keyboards = keyboards;
+    config.eventsPerSecond = 1000;
+    config.durationMs = durationMs;
+
+    vector<PassingHandler> passing(handlers - 1);
+    DecidingHandler deciding;
+
+    SyntheticBackend backend(config);
+    KaptivateAPI* kaptivate = KaptivateAPI::getInstance();
+    kaptivate->setBackend(&backend);
+    for(unsigned int i = 0; i + 1 < handlers; i++)
+        kaptivate->registerKeyboardHandler(".*SYNTHETIC.*", &passing[i]);
+    kaptivate->registerKeyboardHandler(".*SYNTHETIC.*", &deciding);
+
+    kaptivate->startCapture(false, true);
+    backend.waitUntilDone(durationMs + 60000);
+    kaptivate->stopCapture();
+
+    for(unsigned int i = 0; i + 1 < handlers; i++)
+        kaptivate->unregisterKeyboardHandler(&passing[i]);
+    kaptivate->unregisterKeyboardHandler(&deciding);
+    kaptivate->setBackend(NULL);
+    KaptivateAPI::destroyInstance();
+
+    SyntheticReport report = backend.getReport();
+    result("e2e", "synthetic backend", describe("devices", keyboards, "handlers", handlers), report.decided, 0.0,
+        report.p50Us * 1000.0, report.p99Us * 1000.0, report.p999Us * 1000.0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Main
+
+static void usage()
+{
+    printf("Usage: kaptivate_bench [options]\n");
+    printf("  -csv            machine readable output\n");
+    printf("  -only STAGE     queue, fan-in, chain, dispatch, trex, hotplug or e2e\n");
+    printf("  -count N        events per throughput run (1000000)\n");
+    printf("  -paced N        events per latency run (20000)\n");
+    printf("  -e2e-ms N       how long each end to end run lasts (1000)\n");
+}
+
+int main(int argc, char* argv[])
+{
+    LARGE_INTEGER freq;
+    QueryPerformanceFrequency(&freq);
+    ticksPerNs = (double)freq.QuadPart / 1000000000.0;
+
+    unsigned int burstCount = 1000000;
+    unsigned int pacedCount = 20000;
+    unsigned int e2eMs = 1000;
+    string only;
+
+    for(int i = 1; i < argc; i++)
+    {
+        string arg(argv[i]);
+        if(arg == "-csv")
+        {
+            csv = true;
+            continue;
+        }
+        if(i + 1 >= argc)
+        {
+            usage();
+            return 1;
+        }
+
+        if(arg == "-only")
+            only = argv[++i];
+        else if(arg == "-count")
+            burstCount = (unsigned int)atoi(argv[++i]);
+        else if(arg == "-paced")
+            pacedCount = (unsigned int)atoi(argv[++i]);
+        else if(arg == "-e2e-ms")
+            e2eMs = (unsigned int)atoi(argv[++i]);
+        else
+        {
+            usage();
+            return 1;
+        }
+    }
+
+    if(csv)
+        printf("stage,variant,params,events,ns_per_event,p50_ns,p99_ns,p999_ns\n");
+
+    try
+    {
+        if(only.empty() || only == "queue")
+        {
+            section("Keyboard event queue, one producer, one consumer");
+            benchBurst<LegacyAdapter>(burstCount);
+            benchBurst<RingAdapter>(burstCount);
+            benchPaced<LegacyAdapter>(pacedCount);
+            benchPaced<RingAdapter>(pacedCount);
+        }
+
+        if(only.empty() || only == "fan-in")
+        {
+            section("Many devices into one queue");
+            for(size_t i = 0; i < COUNT_OF(deviceCounts); i++)
+            {
+                unsigned int rounds = burstCount / deviceCounts[i];
+                benchFanIn(deviceCounts[i], rounds, false);
+                benchFanIn(deviceCounts[i], rounds, true);
+            }
+        }
+
+        if(only.empty() || only == "chain")
+        {
+            section("One handler chain");
+            for(size_t i = 0; i < COUNT_OF(handlerCounts); i++)
+                benchChain(handlerCounts[i], burstCount);
+        }
+
+        if(only.empty() || only == "dispatch")
+        {
+            section("Dispatcher, device and chain lookups included");
+            for(size_t d = 0; d < COUNT_OF(deviceCounts); d++)
+            {
+                for(size_t h = 0; h < COUNT_OF(handlerCounts); h++)
+                    benchDispatch(deviceCounts[d], handlerCounts[h], burstCount);
+            }
+        }
+
+        if(only.empty() || only == "trex")
+        {
+            section("TRex against device names");
+            for(size_t r = 0; r < COUNT_OF(regexCounts); r++)
+            {
+                unsigned int rounds = max(1u, burstCount / (regexCounts[r] * 64));
+                benchTRex(regexCounts[r], 64, rounds);
+            }
+            benchTRexWorstCase(64, max(1u, burstCount / 64));
+        }
+
+        if(only.empty() || only == "hotplug")
+        {
+            section("New devices against registered patterns");
+            for(size_t r = 0; r < COUNT_OF(regexCounts); r++)
+                benchHotplug(regexCounts[r], 256);
+        }
+
+        if(only.empty() || only == "e2e")
+        {
+            section("End to end, synthetic keyboards at 1000 events/s each");
+            static const unsigned int e2eDevices[] = { 1, 16 };
+            static const unsigned int e2eHandlers[] = { 1, 16 };
+            for(size_t d = 0; d < COUNT_OF(e2eDevices); d++)
+            {
+                for(size_t h = 0; h < COUNT_OF(e2eHandlers); h++)
+                    benchEndToEnd(e2eDevices[d], e2eHandlers[h], e2eMs);
+            }
+        }
+    }
+    catch(exception& e)
+    {
+        printf("Failed: %s\n", e.what());
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,225 @@
+/*
+ * spsc_ring_bench.cpp
+ * This file is a part of Kaptivate
+ * https://github.com/FunkyTownEnterprises/Kaptivate
+ *
+ * Copyright (c) 2011 Ben Cable, Chris Eberle
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * A stand alone throughput test for SpscRing. Unlike kaptivate_bench it only needs spsc_ring.hpp (and the
+ * atomic_ops.hpp it pulls in) plus POSIX threads, so it builds with GCC or Clang on Linux:
+ *
+ *   g++ -std=c++03 -O2 -I ../kaptivate spsc_ring_bench.cpp -lpthread -o spsc_ring_bench
+ *
+ * and, to have ThreadSanitizer check the acquire / release pairs while it runs:
+ *
+ *   g++ -std=c++03 -O1 -g -fsanitize=thread -I ../kaptivate spsc_ring_bench.cpp -lpthread -o spsc_ring_tsan
+ *
+ * One producer pushes a counting sequence as fast as it can; the consumer drains it with pop(), popBatch()
+ * or peek() / dropFront() and checks every value arrives exactly once and in order. Exits non-zero if one
+ * doesn't.
+ *
+ *   spsc_ring_bench [-n items] [-cap capacity] [-batch maxCount]
+ */
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "spsc_ring.hpp"
+
+using namespace Kaptivate;
+
+typedef unsigned long long Item;
+
+enum ConsumeMode
+{
+    CONSUME_POP,
+    CONSUME_BATCH,
+    CONSUME_PEEK
+};
+
+struct BenchRun
+{
+    SpscRing<Item>* ring;
+    Item count;
+    unsigned int fullSpins;
+};
+
+static double nowSeconds()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void* producerMain(void* arg)
+{
+    BenchRun* run = (BenchRun*)arg;
+    for(Item i = 0; i < run->count; )
+    {
+        if(run->ring->push(i))
+            i++;
+        else
+        {
+            run->fullSpins++;
+            sched_yield();
+        }
+    }
+
+    return NULL;
+}
+
+// Returns false if anything arrived out of order
+static bool runOnce(const char* name, ConsumeMode mode, Item count, unsigned int capacity, unsigned int batch)
+{
+    SpscRing<Item> ring(capacity);
+    BenchRun run;
+    run.ring = &ring;
+    run.count = count;
+    run.fullSpins = 0;
+
+    Item* items = new Item[batch];
+    Item expected = 0;
+    unsigned int emptySpins = 0;
+    bool ok = true;
+
+    double start = nowSeconds();
+
+    pthread_t producer;
+    if(pthread_create(&producer, NULL, producerMain, &run) != 0)
+    {
+        fprintf(stderr, "pthread_create failed\n");
+        delete[] items;
+        return false;
+    }
+
+    while(ok && expected < count)
+    {
+        unsigned int got = 0;
+        if(mode == CONSUME_POP)
+        {
+            if(ring.pop(items[0]))
+                got = 1;
+        }
+        else if(mode == CONSUME_BATCH)
+            got = ring.popBatch(items, batch);
+        else
+        {
+            Item* front = ring.peek(0);
+            if(front != NULL)
+            {
+                items[0] = *front;
+                ring.dropFront();
+                got = 1;
+            }
+        }
+
+        if(got == 0)
+        {
+            emptySpins++;
+            sched_yield();
+            continue;
+        }
+
+        for(unsigned int i = 0; i < got; i++, expected++)
+        {
+            if(items[i] != expected)
+            {
+                fprintf(stderr, "%s: expected %llu, got %llu\n", name, expected, items[i]);
+                ok = false;
+                break;
+            }
+        }
+    }
+
+    // A failed check leaves the producer stuck on a full ring; drain it so the join returns
+    if(!ok)
+    {
+        while(expected < count)
+            expected += ring.popBatch(items, batch);
+    }
+
+    pthread_join(producer, NULL);
+    double elapsed = nowSeconds() - start;
+
+    if(ok && !ring.empty())
+    {
+        fprintf(stderr, "%s: %u items left over\n", name, ring.size());
+        ok = false;
+    }
+
+    printf("%-6s %10llu items  %8.2f Mitems/s  %6.2f ns/item  full %u  empty %u%s\n", name, count,
+        (double)count / elapsed / 1e6, elapsed * 1e9 / (double)count, run.fullSpins, emptySpins,
+        ok ? "" : "  FAILED");
+
+    delete[] items;
+    return ok;
+}
+
+int main(int argc, char* argv[])
+{
+    Item count = 10000000ULL;
+    unsigned int capacity = 1024;
+    unsigned int batch = 64;
+
+    for(int i = 1; i < argc; i++)
+    {
+        if(i + 1 >= argc)
+        {
+            fprintf(stderr, "usage: %s [-n items] [-cap capacity] [-batch maxCount]\n", argv[0]);
+            return 2;
+        }
+
+        if(!strcmp(argv[i], "-n"))
+            count = strtoull(argv[++i], NULL, 10);
+        else if(!strcmp(argv[i], "-cap"))
+            capacity = (unsigned int)atoi(argv[++i]);
+        else if(!strcmp(argv[i], "-batch"))
+            batch = (unsigned int)atoi(argv[++i]);
+        else
+        {
+            fprintf(stderr, "unknown option %s\n", argv[i]);
+            return 2;
+        }
+    }
+
+    if(batch == 0)
+        batch = 1;
+
+    printf("SpscRing<unsigned long long>, capacity %u, batch %u\n", SpscRing<Item>(capacity).capacity(), batch);
+
+    bool ok = true;
+    ok = runOnce("pop", CONSUME_POP, count, capacity, batch) && ok;
+    ok = runOnce("batch", CONSUME_BATCH, count, capacity, batch) && ok;
+    ok = runOnce("peek", CONSUME_PEEK, count, capacity, batch) && ok;
+
+    return ok ? 0 : 1;
+}
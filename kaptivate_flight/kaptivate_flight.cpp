@@ -0,0 +1,322 @@
+/*
+ * kaptivate_flight.cpp
+ * This file is a part of Kaptivate
+ * https://github.com/FunkyTownEnterprises/Kaptivate
+ *
+ * Copyright (c) 2011 Ben Cable, Chris Eberle
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Turns a flight recorder dump (see KaptivateAPI::setFlightRecorder) into a Chrome trace, which chrome://tracing
+ * or ui.perfetto.dev can show. Each ring gets a track of its own; every hook call is a slice from when it was
+ * asked to when it was answered, and arrows join each raw event to the decision that used it.
+ *
+ *   kaptivate_flight kaptivate-001.kfr kaptivate-001.json
+ */
+
+#include "stdafx.hpp"
+
+#include <string.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "flight_log.hpp"
+
+using namespace std;
+using namespace Kaptivate;
+
+struct Ring
+{
+    unsigned int id;
+    vector<FlightEntry> entries;
+};
+
+static const char* ringName(unsigned int ring)
+{
+    switch(ring)
+    {
+    case FLIGHT_RING_RAW:       return "raw input";
+    case FLIGHT_RING_HOOK:      return "hook";
+    case FLIGHT_RING_CONTROL:   return "control";
+    }
+    return "unknown";
+}
+
+static const char* typeName(unsigned char type)
+{
+    switch(type)
+    {
+    case KEYBOARD_EVENT:        return "key";
+    case MOUSE_BUTTON_EVENT:    return "button";
+    case MOUSE_WHEEL_EVENT:     return "wheel";
+    case MOUSE_MOVE_EVENT:      return "move";
+    }
+    return "mouse";
+}
+
+static const char* decisionName(unsigned char decision)
+{
+    switch(decision)
+    {
+    case PERMIT:                return "permit";
+    case CONSUME:               return "consume";
+    }
+    return "undecided";
+}
+
+static const char* reasonName(unsigned int reason)
+{
+    switch(reason)
+    {
+    case FLIGHT_DUMP_REQUESTED: return "requested";
+    case FLIGHT_DUMP_TIMEOUT:   return "hook timeout";
+    case FLIGHT_DUMP_SLOW:      return "slow decision";
+    case FLIGHT_DUMP_HOOK_DEAD: return "hooks stopped answering";
+    }
+    return "unknown";
+}
+
+static bool readAll(FILE* in, void* data, size_t size)
+{
+    return size == 0 || fread(data, size, 1, in) == 1;
+}
+
+static bool load(const char* path, FlightDumpHeader& header, vector<Ring>& rings)
+{
+    FILE* in = NULL;
+    if(fopen_s(&in, path, "rb") != 0 || in == NULL)
+    {
+        fprintf(stderr, "Can't open %s\n", path);
+        return false;
+    }
+
+    bool ok = readAll(in, &header, sizeof(header)) &&
+              memcmp(header.magic, FLIGHT_DUMP_MAGIC, sizeof(header.magic)) == 0 &&
+              header.version == FLIGHT_DUMP_VERSION && header.ticksPerSecond > 0;
+
+    for(unsigned int i = 0; ok && i < header.rings; i++)
+    {
+        FlightRingHeader ringHeader;
+        if(!readAll(in, &ringHeader, sizeof(ringHeader)))
+        {
+            ok = false;
+            break;
+        }
+
+        Ring ring;
+        ring.id = ringHeader.ring;
+        ring.entries.resize(ringHeader.count);
+        if(ringHeader.count > 0)
+            ok = readAll(in, &ring.entries[0], ringHeader.count * sizeof(FlightEntry));
+        rings.push_back(ring);
+    }
+
+    fclose(in);
+    if(!ok)
+        fprintf(stderr, "%s isn't a flight recorder dump, or is cut short\n", path);
+    return ok;
+}
+
+// Writes one trace event at a time, and keeps the commas straight
+class TraceWriter
+{
+private:
+    FILE* out;
+    bool first;
+    LONGLONG origin;
+    double ticksPerUs;
+
+public:
+    TraceWriter(FILE* out, LONGLONG origin, LONGLONG ticksPerSecond)
+        : out(out), first(true), origin(origin), ticksPerUs((double)ticksPerSecond / 1000000.0) { }
+
+    double us(LONGLONG ticks) const { return (double)(ticks - origin) / ticksPerUs; }
+
+    // Everything up to the args
+    void begin(const char* name, const char* phase, unsigned int tid, LONGLONG ticks)
+    {
+        fprintf(out, "%s\n{\"name\":\"%s\",\"ph\":\"%s\",\"pid\":1,\"tid\":%u,\"ts\":%.3f",
+                first ? "" : ",", name, phase, tid, us(ticks));
+        first = false;
+    }
+
+    void end()
+    {
+        fprintf(out, "}");
+    }
+
+    void threadName(unsigned int tid, const char* name)
+    {
+        fprintf(out, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"%s\"}}",
+                first ? "" : ",", tid, name);
+        first = false;
+    }
+};
+
+static void convert(FILE* out, const FlightDumpHeader& header, const vector<Ring>& rings)
+{
+    // Start the clock at the oldest entry anywhere
+    LONGLONG origin = header.dumpTicks;
+    for(size_t r = 0; r < rings.size(); r++)
+    {
+        if(!rings[r].entries.empty() && rings[r].entries[0].timestamp < origin)
+            origin = rings[r].entries[0].timestamp;
+    }
+
+    TraceWriter trace(out, origin, header.ticksPerSecond);
+    fprintf(out, "{\"displayTimeUnit\":\"ms\",\"otherData\":{\"reason\":\"%s\"},\"traceEvents\":[", reasonName(header.reason));
+
+    // Raw events that a decision can point back to
+    map<unsigned int, bool> rawSeen;
+    for(size_t r = 0; r < rings.size(); r++)
+    {
+        if(rings[r].id != FLIGHT_RING_RAW)
+            continue;
+        for(size_t i = 0; i < rings[r].entries.size(); i++)
+            rawSeen[rings[r].entries[i].sequence] = true;
+    }
+
+    for(size_t r = 0; r < rings.size(); r++)
+    {
+        const Ring& ring = rings[r];
+        unsigned int tid = ring.id + 1;
+        trace.threadName(tid, ringName(ring.id));
+
+        // The hook call still waiting for its answer, if any
+        const FlightEntry* asked = NULL;
+
+        for(size_t i = 0; i < ring.entries.size(); i++)
+        {
+            const FlightEntry& e = ring.entries[i];
+            switch(e.kind)
+            {
+            case FLIGHT_RAW:
+                trace.begin(typeName(e.type), "i", tid, e.timestamp);
+                fprintf(out, ",\"s\":\"t\",\"args\":{\"sequence\":%u,\"device\":\"0x%llx\",\"value\":\"0x%x\",\"up\":%d}",
+                        e.sequence, e.device, e.value, e.flags & 1);
+                trace.end();
+
+                trace.begin("event", "s", tid, e.timestamp);
+                fprintf(out, ",\"cat\":\"event\",\"id\":%u", e.sequence);
+                trace.end();
+                break;
+
+            case FLIGHT_ASKED:
+                asked = &e;
+                break;
+
+            case FLIGHT_DECIDED:
+            case FLIGHT_TIMEOUT:
+            {
+                bool timedOut = (e.kind == FLIGHT_TIMEOUT);
+                LONGLONG start = (asked != NULL) ? asked->timestamp :
+                    e.timestamp - (LONGLONG)(e.value * ((double)header.ticksPerSecond / 1000000.0));
+
+                trace.begin(timedOut ? "timeout" : typeName(e.type), "X", tid, start);
+                fprintf(out, ",\"dur\":%.3f,\"args\":{\"decision\":\"%s\"", trace.us(e.timestamp) - trace.us(start),
+                        decisionName(e.decision));
+                if(asked != NULL && asked->type == KEYBOARD_EVENT)
+                    fprintf(out, ",\"vkey\":%u,\"scanCode\":%u,\"up\":%d", asked->value & 0xffff, asked->value >> 16, asked->flags & 1);
+                if(!timedOut)
+                    fprintf(out, ",\"sequence\":%u,\"device\":\"0x%llx\"", e.sequence, e.device);
+                fprintf(out, "}");
+                trace.end();
+
+                // Point back at the raw event, if it's still in the dump
+                if(!timedOut && rawSeen.count(e.sequence))
+                {
+                    trace.begin("event", "f", tid, start);
+                    fprintf(out, ",\"cat\":\"event\",\"id\":%u,\"bp\":\"e\"", e.sequence);
+                    trace.end();
+                }
+
+                asked = NULL;
+                break;
+            }
+
+            case FLIGHT_SLOW:
+                trace.begin("slow decision", "i", tid, e.timestamp);
+                fprintf(out, ",\"s\":\"p\",\"args\":{\"us\":%u}", e.value);
+                trace.end();
+                break;
+
+            case FLIGHT_HOOK_DEAD:
+                trace.begin("hooks stopped answering", "i", tid, e.timestamp);
+                fprintf(out, ",\"s\":\"g\"");
+                trace.end();
+                break;
+
+            case FLIGHT_DUMP:
+                trace.begin("dump", "i", tid, e.timestamp);
+                fprintf(out, ",\"s\":\"g\",\"args\":{\"reason\":\"%s\"}", reasonName(e.value));
+                trace.end();
+                break;
+            }
+        }
+
+        // Asked, but the dump was taken before it was answered
+        if(asked != NULL)
+        {
+            trace.begin("unanswered", "X", tid, asked->timestamp);
+            fprintf(out, ",\"dur\":%.3f", trace.us(header.dumpTicks) - trace.us(asked->timestamp));
+            trace.end();
+        }
+    }
+
+    fprintf(out, "\n]}\n");
+}
+
+int main(int argc, char* argv[])
+{
+    if(argc != 3)
+    {
+        printf("Usage: kaptivate_flight <dump.kfr> <trace.json>\n");
+        return 1;
+    }
+
+    FlightDumpHeader header;
+    vector<Ring> rings;
+    if(!load(argv[1], header, rings))
+        return 1;
+
+    FILE* out = NULL;
+    if(fopen_s(&out, argv[2], "w") != 0 || out == NULL)
+    {
+        fprintf(stderr, "Can't create %s\n", argv[2]);
+        return 1;
+    }
+
+    convert(out, header, rings);
+    fclose(out);
+
+    size_t total = 0;
+    for(size_t r = 0; r < rings.size(); r++)
+        total += rings[r].entries.size();
+    printf("%u entries, dumped because: %s\n", (unsigned int)total, reasonName(header.reason));
+    return 0;
+}
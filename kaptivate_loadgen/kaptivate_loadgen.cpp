@@ -0,0 +1,286 @@
+/*
+ * kaptivate_loadgen.cpp
+ * This file is a part of Kaptivate
+ * https://github.com/FunkyTownEnterprises/Kaptivate
+ *
+ * Copyright (c) 2011 Ben Cable, Chris Eberle
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Pushes a synthetic load through the whole pipeline (raw side, queue, correlator, handlers, observers)
+ * without installing any hooks, and reports how fast decisions come back. Run the Release build from a
+ * console; numbers from a Debug build are meaningless.
+ *
+ *   kaptivate_loadgen -keyboards 16 -rate 200 -burst 8 -gap-us 500 -skew-us -200 -seconds 10
+ */
+
+#include "stdafx.hpp"
+
+#include <exception>
+#include <string>
+#include <vector>
+
+#include "kaptivate.hpp"
+#include "synthetic_backend.hpp"
+
+using namespace std;
+using namespace Kaptivate;
+
+////////////////////////////////////////////////////////////////////////////////
+// Handlers
+
+// Pretend to do some work, without sleeping
+static void busyWait(unsigned int us)
+{
+    if(us == 0)
+        return;
+
+    LARGE_INTEGER freq, start, cur;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&start);
+    LONGLONG until = start.QuadPart + freq.QuadPart * us / 1000000;
+    do
+    {
+        YieldProcessor();
+        QueryPerformanceCounter(&cur);
+    } while(cur.QuadPart < until);
+}
+
+// Eats every other key, so both kinds of decision get exercised
+class LoadKeyboardHandler : public KeyboardHandler
+{
+public:
+    unsigned int workUs;
+
+    virtual void HandleKeyEvent(KeyboardEvent& evt)
+    {
+        busyWait(workUs);
+        evt.setDecision(evt.getKeyUp() ? PERMIT : CONSUME);
+    }
+};
+
+class LoadMouseHandler : public MouseHandler
+{
+public:
+    unsigned int workUs;
+
+    virtual void HandleButtonEvent(MouseButtonEvent& evt)
+    {
+        busyWait(workUs);
+        evt.setDecision(PERMIT);
+    }
+
+    virtual void HandleWheelEvent(MouseWheelEvent& evt) { }
+    virtual void HandleMoveEvent(MouseMoveEvent& evt) { }
+};
+
+// Counts what it sees, from the observer threads
+class CountingObserver : public KeyboardHandler
+{
+public:
+    volatile LONG seen;
+
+    virtual void HandleKeyEvent(KeyboardEvent& evt)
+    {
+        InterlockedIncrement(&seen);
+    }
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// Main
+
+static void usage()
+{
+    printf("Usage: kaptivate_loadgen [options]\n");
+    printf("  -keyboards N    fake keyboards (4)\n");
+    printf("  -mice N         fake mice (0)\n");
+    printf("  -rate N         events per second per device (100)\n");
+    printf("  -burst N        events per burst (1)\n");
+    printf("  -gap-us N       time between events in a burst (0)\n");
+    printf("  -skew-us N      hook arrival relative to the raw event, negative is earlier (0)\n");
+    printf("  -seconds N      how long to run (5)\n");
+    printf("  -seed N         schedule seed (1)\n");
+    printf("  -work-us N      time each handler spends per event (0)\n");
+    printf("  -observers N    observer threads, 0 for no observer (0)\n");
+    printf("  -speculative    decide keys on the raw thread\n");
+    printf("  -trace          time each stage of each event\n");
+    printf("  -profile        profile each handler on each device\n");
+}
+
+int main(int argc, char* argv[])
+{
+    SyntheticConfig config;
+    unsigned int workUs = 0;
+    unsigned int observerThreads = 0;
+    bool speculative = false;
+    bool trace = false;
+    bool profile = false;
+
+    for(int i = 1; i < argc; i++)
+    {
+        string arg(argv[i]);
+        if(arg == "-speculative")
+        {
+            speculative = true;
+            continue;
+        }
+        if(arg == "-trace")
+        {
+            trace = true;
+            continue;
+        }
+        if(arg == "-profile")
+        {
+            profile = true;
+            continue;
+        }
+        if(i + 1 >= argc)
+        {
+            usage();
+            return 1;
+        }
+
+        int value = atoi(argv[++i]);
+        if(arg == "-keyboards")
+            config.keyboards = (unsigned int)value;
+        else if(arg == "-mice")
+            config.mice = (unsigned int)value;
+        else if(arg == "-rate")
+            config.eventsPerSecond = (unsigned int)value;
+        else if(arg == "-burst")
+            config.burstLength = (unsigned int)value;
+        else if(arg == "-gap-us")
+            config.burstGapUs = (unsigned int)value;
+        else if(arg == "-skew-us")
+            config.hookSkewUs = value;
+        else if(arg == "-seconds")
+            config.durationMs = (unsigned int)value * 1000;
+        else if(arg == "-seed")
+            config.seed = (unsigned int)value;
+        else if(arg == "-work-us")
+            workUs = (unsigned int)value;
+        else if(arg == "-observers")
+            observerThreads = (unsigned int)value;
+        else
+        {
+            usage();
+            return 1;
+        }
+    }
+
+    LoadKeyboardHandler kbdHandler;
+    kbdHandler.workUs = workUs;
+    LoadMouseHandler mouseHandler;
+    mouseHandler.workUs = workUs;
+    CountingObserver observer;
+    observer.seen = 0;
+
+    try
+    {
+        SyntheticBackend backend(config);
+        KaptivateAPI* kaptivate = KaptivateAPI::getInstance();
+
+        kaptivate->setBackend(&backend);
+        kaptivate->setSpeculativeDispatch(speculative);
+        kaptivate->setLatencyTracing(trace);
+        kaptivate->setHandlerProfiling(profile);
+        kaptivate->registerKeyboardHandler(".*SYNTHETIC.*", &kbdHandler);
+        kaptivate->resgisterMouseHandler(".*SYNTHETIC.*", &mouseHandler);
+        if(observerThreads > 0)
+        {
+            kaptivate->setObserverThreads(observerThreads);
+            kaptivate->registerKeyboardHandler(".*SYNTHETIC.*", &observer, true);
+        }
+
+        printf("%u keyboards, %u mice, %u events/s each, bursts of %u, %d us skew, %u s\n", config.keyboards,
+            config.mice, config.eventsPerSecond, config.burstLength, config.hookSkewUs, config.durationMs / 1000);
+
+        kaptivate->startCapture(config.mice > 0, config.keyboards > 0);
+        if(!backend.waitUntilDone(config.durationMs + 60000))
+            printf("The schedule didn't finish in time, stopping early\n");
+        kaptivate->stopCapture();
+
+        SyntheticReport report = backend.getReport();
+        QueueStats kq = kaptivate->getKeyboardQueueStats();
+        QueueStats mq = kaptivate->getMouseQueueStats();
+        CorrelationStats kc = kaptivate->getKeyboardCorrelationStats();
+        CorrelationStats mc = kaptivate->getMouseCorrelationStats();
+
+        printf("\n");
+        printf("  decided     %u of %u (%u consumed)\n", report.decided, report.scheduled, report.consumed);
+        printf("  throughput  %.0f events/s over %.1f ms\n", report.eventsPerSecond, report.elapsedMs);
+        printf("  latency     p50 %.1f us  p99 %.1f us  p99.9 %.1f us  max %.1f us\n",
+            report.p50Us, report.p99Us, report.p999Us, report.maxUs);
+        printf("  keyboard q  high water %u  dropped %u\n", kq.highWater, kq.dropped);
+        printf("  mouse q     high water %u  dropped %u  coalesced %u\n", mq.highWater, mq.dropped, mq.coalesced);
+        printf("  keyboard c  matched %u  missed %u  late %u  expired %u\n", kc.matched, kc.missed, kc.late,
+            kc.expired);
+        printf("  mouse c     matched %u  missed %u  late %u  expired %u\n", mc.matched, mc.missed, mc.late,
+            mc.expired);
+        if(observerThreads > 0)
+            printf("  observed    %ld\n", observer.seen);
+
+        if(trace)
+        {
+            static const char* stageNames[LATENCY_STAGES] = { "decode", "queued", "hook wait", "handler", "hook",
+                                                              "total" };
+            LatencyStats ls = kaptivate->getLatencyStats();
+            printf("\n");
+            for(int i = 0; i < LATENCY_STAGES; i++)
+            {
+                const StageLatency& st = ls.stages[i];
+                printf("  %-10s  %8u  mean %8.1f us  p50 %8.1f  p99 %8.1f  p99.9 %8.1f  max %8.1f\n", stageNames[i],
+                    st.count, st.meanUs, st.p50Us, st.p99Us, st.p999Us, st.maxUs);
+            }
+        }
+
+        if(profile)
+        {
+            vector<HandlerStats> hs = kaptivate->getHandlerStats();
+            printf("\n");
+            for(size_t i = 0; i < hs.size(); i++)
+            {
+                printf("  %s %p on %p  %8u calls  mean %8.1f us  p99 %8.1f  max %8.1f  %I64u cycles\n",
+                    hs[i].keyboard ? "keyboard" : "mouse   ", hs[i].handler, hs[i].device, hs[i].calls, hs[i].meanUs,
+                    hs[i].p99Us, hs[i].maxUs, hs[i].cpuCycles);
+            }
+        }
+
+        kaptivate->unregisterKeyboardHandler(&kbdHandler);
+        kaptivate->unregisterMouseHandler(&mouseHandler);
+        if(observerThreads > 0)
+            kaptivate->unregisterKeyboardHandler(&observer);
+        kaptivate->setBackend(NULL);
+        KaptivateAPI::destroyInstance();
+    }
+    catch(exception& e)
+    {
+        printf("Failed: %s\n", e.what());
+        return 1;
+    }
+
+    return 0;
+}